@@ -0,0 +1,261 @@
+/*
+ *  Copyright (C) 2004-2006 Alo Sarv <madcat_@users.sourceforge.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef __BUFFERCHAIN_H__
+#define __BUFFERCHAIN_H__
+
+/**
+ * \file bufferchain.h Interface for BufferChain class
+ */
+
+#include <hnbase/osdep.h>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <deque>
+#include <stdexcept>
+#include <string>
+#ifndef WIN32
+	#include <unistd.h>
+#endif
+
+/**
+ * Describes one contiguous chunk of memory in a scatter/gather I/O operation.
+ */
+struct IOVec {
+	const char *m_data;     //!< Start of the chunk
+	uint32_t    m_len;      //!< Length of the chunk
+};
+
+//! Maximum number of IOVecs passed to a single scatter/gather write
+const uint32_t MAX_IOVEC = 64;
+
+/**
+ * Owns an open file descriptor, closing it when the last reference goes away.
+ * Used for keeping the file open while regions of it are queued for sending.
+ */
+class FileHandle : public boost::noncopyable {
+public:
+	explicit FileHandle(int fd) : m_fd(fd) {}
+	~FileHandle() {
+		if (m_fd != -1) {
+			close(m_fd);
+		}
+	}
+	int getFd() const { return m_fd; }
+private:
+	int m_fd;
+};
+typedef boost::shared_ptr<FileHandle> FileHandlePtr;
+
+/**
+ * BufferChain is an outgoing data queue made up of reference-counted buffer
+ * segments. Unlike a single std::string, appending never moves data that is
+ * already queued, and consuming sent data only advances an offset (or drops
+ * a segment) instead of erase()'ing the string prefix. The queued data can be
+ * handed to the OS as an IOVec array for a single scatter/gather write.
+ *
+ * Large buffers handed over as Buffer are queued by reference without copying
+ * the data. Small writes are coalesced into the tail segment (when it's not
+ * shared), so lots of small packets don't produce lots of tiny segments.
+ *
+ * A region of an open file may be queued as well, so file data is sent by the
+ * kernel directly from the page cache (sendfile()) without ever being copied
+ * into userspace. getIOVecs() stops at such a segment; when it reaches the
+ * front of the queue, getFileRegion() describes it instead.
+ */
+class BufferChain {
+public:
+	//! Reference-counted data segment
+	typedef boost::shared_ptr<std::string> Buffer;
+
+	enum Constants {
+		//! Writes up to this size are coalesced into the tail segment
+		COALESCE_SIZE = 4096,
+		//! Tail segment isn't grown past this size when coalescing
+		SEGMENT_SIZE  = 16384
+	};
+
+	BufferChain() : m_offset(), m_size() {}
+
+	/**
+	 * Queue a copy of data.
+	 *
+	 * @param data      Data to be queued
+	 */
+	void append(const std::string &data) {
+		if (data.empty()) {
+			return;
+		} else if (canCoalesce(data.size())) {
+			m_chain.back().m_buf->append(data);
+		} else {
+			Buffer buf(new std::string(data));
+			m_chain.push_back(Segment(buf));
+		}
+		m_size += data.size();
+	}
+
+	/**
+	 * Queue a buffer by reference. The buffer must not be modified by the
+	 * caller afterwards.
+	 *
+	 * @param buf       Buffer to be queued
+	 */
+	void append(Buffer buf) {
+		if (!buf || buf->empty()) {
+			return;
+		} else if (canCoalesce(buf->size())) {
+			m_chain.back().m_buf->append(*buf);
+		} else {
+			m_chain.push_back(Segment(buf));
+		}
+		m_size += buf->size();
+	}
+
+	/**
+	 * Queue a region of an open file. The file is kept open until the
+	 * region has been consumed.
+	 *
+	 * @param file      File to send data from
+	 * @param offset    Begin offset of the region in the file
+	 * @param len       Length of the region
+	 */
+	void appendFile(FileHandlePtr file, uint64_t offset, uint32_t len) {
+		CHECK_THROW(file && file->getFd() != -1);
+		if (len) {
+			m_chain.push_back(Segment(file, offset, len));
+			m_size += len;
+		}
+	}
+
+	/**
+	 * Describe the front of the queue as an IOVec array, up to the first
+	 * file region.
+	 *
+	 * @param vec       Array to be filled
+	 * @param maxCnt    Size of the array
+	 * @param maxLen    Maximum number of bytes to be described
+	 * @return          Number of entries filled
+	 */
+	uint32_t getIOVecs(IOVec *vec, uint32_t maxCnt, uint32_t maxLen) const {
+		uint32_t cnt = 0;
+		uint32_t offset = m_offset;
+		CIter it = m_chain.begin();
+		while (it != m_chain.end() && cnt < maxCnt && maxLen) {
+			if ((*it).m_file) {
+				break;
+			}
+			uint32_t len = (*it).size() - offset;
+			if (len > maxLen) {
+				len = maxLen;
+			}
+			vec[cnt].m_data = (*it).m_buf->data() + offset;
+			vec[cnt].m_len = len;
+			maxLen -= len;
+			offset = 0;
+			++cnt;
+			++it;
+		}
+		return cnt;
+	}
+
+	/**
+	 * Describe the file region at the front of the queue.
+	 *
+	 * @param fd        Receives the file descriptor
+	 * @param offset    Receives the file offset of the unsent data
+	 * @param len       Receives the length of the unsent data
+	 * @return          False if the front segment isn't a file region
+	 */
+	bool getFileRegion(int *fd, uint64_t *offset, uint32_t *len) const {
+		if (m_chain.empty() || !m_chain.front().m_file) {
+			return false;
+		}
+		const Segment &s = m_chain.front();
+		*fd = s.m_file->getFd();
+		*offset = s.m_offset + m_offset;
+		*len = s.m_len - m_offset;
+		return true;
+	}
+
+	/**
+	 * Remove data from the front of the queue (e.g. after it was sent).
+	 *
+	 * @param len       Number of bytes to remove
+	 */
+	void consume(uint32_t len) {
+		CHECK_THROW(len <= m_size);
+		m_size -= len;
+		while (len) {
+			uint32_t avail = m_chain.front().size() - m_offset;
+			if (len < avail) {
+				m_offset += len;
+				break;
+			}
+			len -= avail;
+			m_chain.pop_front();
+			m_offset = 0;
+		}
+	}
+
+	//! Drop all queued data
+	void clear() {
+		m_chain.clear();
+		m_offset = 0;
+		m_size = 0;
+	}
+
+	//! \returns Number of bytes queued
+	uint32_t size() const { return m_size; }
+
+	//! \returns True if there's no queued data
+	bool empty() const { return !m_size; }
+
+	//! \returns Number of segments in the queue
+	size_t getSegmentCount() const { return m_chain.size(); }
+private:
+	//! Queued segment; either a memory buffer or a file region
+	struct Segment {
+		explicit Segment(Buffer buf)
+		: m_buf(buf), m_offset(), m_len() {}
+		Segment(FileHandlePtr file, uint64_t offset, uint32_t len)
+		: m_file(file), m_offset(offset), m_len(len) {}
+		uint32_t size() const {
+			return m_buf ? m_buf->size() : m_len;
+		}
+		Buffer        m_buf;     //!< Data, if memory segment
+		FileHandlePtr m_file;    //!< File, if file region
+		uint64_t      m_offset;  //!< Begin offset in file
+		uint32_t      m_len;     //!< Length of file region
+	};
+
+	//! Whether data of length len can be appended to the tail segment
+	bool canCoalesce(uint32_t len) const {
+		return len <= COALESCE_SIZE && m_chain.size()
+			&& m_chain.back().m_buf
+			&& m_chain.back().m_buf.unique()
+			&& m_chain.back().m_buf->size() + len <= SEGMENT_SIZE;
+	}
+
+	std::deque<Segment> m_chain; //!< Queued segments
+	uint32_t m_offset;           //!< Already consumed part of front segment
+	uint32_t m_size;             //!< Total bytes queued
+
+	typedef std::deque<Segment>::const_iterator CIter;
+};
+
+#endif
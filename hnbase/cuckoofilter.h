@@ -0,0 +1,171 @@
+/*
+ *  Copyright (C) 2004-2006 Alo Sarv <madcat_@users.sourceforge.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef __CUCKOOFILTER_H__
+#define __CUCKOOFILTER_H__
+
+/**
+ * \file cuckoofilter.h Interface for CuckooFilter class
+ */
+
+#include <hnbase/osdep.h>
+#include <algorithm>
+#include <vector>
+
+/**
+ * CuckooFilter is a compact set of 64-bit keys, which only stores a 16-bit
+ * fingerprint of each key. Lookups may thus give false positives (about one
+ * in 8000 lookups when the filter is full), but never false negatives, unless
+ * the filter has overflowed.
+ *
+ * Each key has two candidate buckets of four fingerprints each; when both
+ * are full, an existing fingerprint is moved to its alternate bucket to make
+ * room. If no room is found after MAX_KICKS moves, one fingerprint is lost
+ * and insert() returns false; this only happens when the filter is close to
+ * its capacity.
+ */
+class CuckooFilter {
+public:
+	/**
+	 * @param capacity Number of keys to size the filter for; rounded up
+	 *                 so that the filter is at most ~95% full then
+	 */
+	CuckooFilter(uint32_t capacity) : m_size() {
+		uint32_t buckets = 1;
+		while (buckets * SLOTS * 95 < capacity * 100) {
+			buckets *= 2;
+		}
+		m_table.resize(buckets * SLOTS);
+		m_mask = buckets - 1;
+	}
+
+	/**
+	 * Add a key. Adding a key which already is in the filter is a no-op.
+	 *
+	 * @param key      Key to add
+	 * @return         False if the filter overflowed, and some (other)
+	 *                 key was lost
+	 */
+	bool insert(uint64_t key) {
+		uint16_t fp;
+		uint32_t i1, i2;
+		locate(key, &fp, &i1, &i2);
+		if (find(i1, fp) || find(i2, fp)) {
+			return true;
+		}
+		if (add(i1, fp) || add(i2, fp)) {
+			++m_size;
+			return true;
+		}
+		uint32_t i = fp & 1 ? i1 : i2;
+		for (uint32_t n = 0; n < MAX_KICKS; ++n) {
+			uint16_t &victim = m_table[i * SLOTS + n % SLOTS];
+			std::swap(fp, victim);
+			i = alternate(i, fp);
+			if (add(i, fp)) {
+				++m_size;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	//! \returns Whether the key (or one with same fingerprint) was added
+	bool contains(uint64_t key) const {
+		uint16_t fp;
+		uint32_t i1, i2;
+		locate(key, &fp, &i1, &i2);
+		return find(i1, fp) || find(i2, fp);
+	}
+
+	//! Remove all keys
+	void clear() {
+		std::fill(m_table.begin(), m_table.end(), 0);
+		m_size = 0;
+	}
+
+	//! Exchange contents with another filter
+	void swap(CuckooFilter &o) {
+		m_table.swap(o.m_table);
+		std::swap(m_mask, o.m_mask);
+		std::swap(m_size, o.m_size);
+	}
+
+	//! \returns Number of fingerprints stored
+	uint32_t size() const { return m_size; }
+
+	//! \returns Memory used by the table, in bytes
+	uint32_t memory() const { return m_table.size() * sizeof(uint16_t); }
+private:
+	enum {
+		SLOTS = 4,          //!< Fingerprints per bucket
+		MAX_KICKS = 500     //!< Moves to try before giving up
+	};
+
+	//! 64-bit mixing function (splitmix64 finalizer)
+	static uint64_t mix(uint64_t k) {
+		k ^= k >> 30;
+		k *= 0xbf58476d1ce4e5b9ull;
+		k ^= k >> 27;
+		k *= 0x94d049bb133111ebull;
+		k ^= k >> 31;
+		return k;
+	}
+
+	//! Fingerprint and the two buckets of a key; 0 marks empty slots
+	void locate(uint64_t key, uint16_t *fp, uint32_t *i1, uint32_t *i2)
+	const {
+		uint64_t h = mix(key);
+		*fp = static_cast<uint16_t>(h >> 48);
+		if (!*fp) {
+			*fp = 1;
+		}
+		*i1 = static_cast<uint32_t>(h) & m_mask;
+		*i2 = alternate(*i1, *fp);
+	}
+
+	//! The other bucket of a fingerprint; alternate(alternate(i)) == i
+	uint32_t alternate(uint32_t i, uint16_t fp) const {
+		return (i ^ (fp * 0x5bd1e995u)) & m_mask;
+	}
+
+	bool find(uint32_t i, uint16_t fp) const {
+		for (uint32_t j = 0; j < SLOTS; ++j) {
+			if (m_table[i * SLOTS + j] == fp) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	bool add(uint32_t i, uint16_t fp) {
+		for (uint32_t j = 0; j < SLOTS; ++j) {
+			if (!m_table[i * SLOTS + j]) {
+				m_table[i * SLOTS + j] = fp;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	std::vector<uint16_t> m_table;  //!< Buckets of SLOTS fingerprints
+	uint32_t m_mask;                //!< Number of buckets - 1
+	uint32_t m_size;                //!< Fingerprints stored
+};
+
+#endif
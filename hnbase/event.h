@@ -75,6 +75,8 @@
 #include <hnbase/log.h>
 #include <hnbase/utils.h>
 #include <hnbase/tsptrs.h>
+#include <hnbase/mpscqueue.h>
+#include <hnbase/timingwheel.h>
 
 // event tables backend - Boost.Signal, Boost.Function and Boost.Bind libraries
 #include <boost/signal.hpp>
@@ -83,6 +85,7 @@
 #include <boost/function.hpp>
 #include <boost/bind.hpp>
 #include <boost/intrusive_ptr.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <boost/type_traits.hpp>
 
 // multi-thread safety - Boost.Thread (mutexes)
@@ -91,6 +94,7 @@
 // std includes
 #include <map>
 #include <set>
+#include <vector>
 
 /**
  * Trackable object allows tracking the object's lifetime by Event subsystem,
@@ -128,27 +132,26 @@ private:
 template<typename Source, typename Event>
 class EventTable : public EventTableBase {
 	class InternalEvent;
-	class DelayedEvent;
-	//! Internal event shared pointer
-	typedef boost::intrusive_ptr<InternalEvent> EventPtr;
-	//! Delayed event shared pointer
-	typedef boost::intrusive_ptr<DelayedEvent> DelayedPtr;
+	struct DelayedEvent;
+	struct PendingEvent;
 	//! Type of handler function
 	typedef typename boost::function<void (Source, Event)> Handler;
 	//! Type of signal used in this event table
 	typedef typename boost::signal<void (Source, Event)> SigType;
 	//! Helper typedef, for iterating on sigMap
 	typedef typename std::map<Source, SigType*>::iterator Iter;
-	//! Helper typedef, for iterating on pending events vector
-	typedef typename std::vector<EventPtr>::iterator PIter;
 	//! Helper typedef, for iterator in m_toDelete vector
 	typedef typename std::set<Source>::iterator DeleteIter;
 public:
 	//! Dummy default constructor
-	EventTable() {}
+	EventTable() : m_pool(sizeof(PendingEvent), POOL_SIZE),
+	m_deferred(), m_notified(),
+	m_delayedPool(sizeof(DelayedEvent), POOL_SIZE) {}
 
 	EventTable(std::string source, std::string event)
-	: m_source(source), m_event(event) {
+	: m_pool(sizeof(PendingEvent), POOL_SIZE), m_deferred(),
+	m_notified(), m_delayedPool(sizeof(DelayedEvent), POOL_SIZE),
+	m_source(source), m_event(event) {
 #ifdef DEBUG_EVTT // for init/cleanup debugging; don't use log calls here!
 		std::cerr << "Debug: " <<
 			(boost::format("Initializing EventTable(%s, %s)")
@@ -165,6 +168,20 @@ public:
 			% m_source % m_event) << std::endl;
 		;
 #endif
+		freeEvents(m_deferred);
+		while (PendingEvent *e = popPending()) {
+			e->m_next = 0;
+			freeEvents(e);
+		}
+		if (m_delayed) {
+			DelayedEvent *e = DelayedEvent::cast(m_delayed->clear());
+			while (e) {
+				DelayedEvent *next = e->next();
+				freeDelayed(e);
+				e = next;
+			}
+		}
+
 		typename std::map<Source, SigType*>::iterator it;
 		it = m_sigMap.begin();
 		while (it != m_sigMap.end()) {
@@ -343,15 +360,27 @@ public:
 
 	/**
 	 * Post an event to the event queue, which shall be passed to all
-	 * handlers during next event loop.
+	 * handlers during next event loop. This is lock-free, and may be
+	 * called from any thread.
 	 *
 	 * @param src     Event source
 	 * @param evt     The event itself
 	 */
 	void postEvent(Source src, Event evt) {
-		boost::recursive_mutex::scoped_lock l(m_pendingMutex);
-		m_pending.push_back(EventPtr(new InternalEvent(src, evt)));
-		notify();
+		void *mem = m_pool.alloc();
+		PendingEvent *e = 0;
+		try {
+			e = new (mem) PendingEvent(src, evt);
+		} catch (...) {
+			m_pool.free(mem);
+			throw;
+		}
+		m_pending.push(e);
+
+		// only wake up the main loop once per process() call
+		if (!Detail::atomicExchange(&m_notified, 1L)) {
+			notify();
+		}
 	}
 
 	/**
@@ -370,8 +399,19 @@ public:
 	 */
 	void postEvent(Source src, Event evt, uint32_t delay) {
 		boost::recursive_mutex::scoped_lock l(m_delayedMutex);
-		DelayedPtr devt(new DelayedEvent(src, evt, delay));
-		m_delayed.insert(devt);
+		uint64_t tick = EventMain::instance().getTick();
+		if (!m_delayed) {
+			m_delayed.reset(new Detail::TimingWheel(tick));
+		}
+		void *mem = m_delayedPool.alloc();
+		DelayedEvent *e = 0;
+		try {
+			e = new (mem) DelayedEvent(src, evt);
+		} catch (...) {
+			m_delayedPool.free(mem);
+			throw;
+		}
+		m_delayed->add(e, tick + delay);
 	}
 
 	/**
@@ -400,30 +440,24 @@ public:
 
 	/**
 	 * Call all handlers for all pending events. This method is called from
-	 * main event loop.
+	 * main event loop, and must not be called from several threads
+	 * concurrently.
+	 *
+	 * Pending events are taken from the queue in batches, and handlers
+	 * are called without blocking the threads posting new events. Events
+	 * posted by the handlers themselves are handled before returning.
 	 */
 	virtual void process() {
-		checkForDelayed();
-
-		boost::recursive_mutex::scoped_lock l1(m_pendingMutex);
-		boost::recursive_mutex::scoped_lock l2(m_sigMapMutex);
+		Detail::atomicExchange(&m_notified, 0L);
 
-		while (m_pending.size()) {
-			EventPtr evt = m_pending.front();
-			if (!evt->isValid()) {
-				m_pending.pop_front();
-				continue;
-			}
+		DelayedEvent *delayed = checkForDelayed();
 
-			Iter j = m_sigMap.find(evt->getSource());
-			if (j != m_sigMap.end()) {
-				(*(*j).second)(
-					evt->getSource(), evt->getEvent()
-				);
-			}
-			m_allSig(evt->getSource(), evt->getEvent());
+		boost::recursive_mutex::scoped_lock l(m_sigMapMutex);
 
-			m_pending.pop_front();
+		processPending();
+		if (delayed) {
+			processDelayed(delayed);
+			processPending();
 		}
 
 		checkDelete();
@@ -469,18 +503,36 @@ private:
 	 */
 	SigType m_allSig;
 
+	//! Maximum number of free event nodes kept in m_pool
+	enum { POOL_SIZE = 256 };
+
 	/**
-	 * Pending events queue, filled by postEvent() method and cleared in
+	 * Pending events queue, filled by postEvent() method and drained in
 	 * process().
 	 */
-	std::deque<EventPtr> m_pending;
+	Detail::MPSCQueue m_pending;
+
+	//! Memory for PendingEvent objects
+	Detail::NodePool m_pool;
+
+	/**
+	 * Events taken from m_pending, but not handled since a handler threw
+	 * an exception; these are handled first during next process() call.
+	 */
+	PendingEvent *m_deferred;
+
+	//! Set when the main loop has been notified about pending events
+	volatile long m_notified;
 
 	/**
 	 * Delayed events, which will be posted when the timeout is over.
-	 * The key to this map is the actual tick when the event should be
-	 * emitted.
+	 * The wheel is keyed by the actual tick when the event should be
+	 * emitted; it is created when the first delayed event is posted.
 	 */
-	std::multiset<DelayedPtr, Utils::PtrLess<DelayedPtr> > m_delayed;
+	boost::scoped_ptr<Detail::TimingWheel> m_delayed;
+
+	//! Memory for DelayedEvent objects
+	Detail::NodePool m_delayedPool;
 
 	/**
 	 * Deletion queue, filled by safeDelete method; objects here are
@@ -490,14 +542,14 @@ private:
 	std::set<Source> m_toDelete;
 
 	/**
-	 * Recursive mutexes which protect the above four containers in multi-
+	 * Recursive mutexes which protect the above containers in multi-
 	 * threaded environment. They are recursive since we are most likely
 	 * to be called from an event handler from same thread, in which case we
-	 * want to be able to access the containers.
+	 * want to be able to access the containers. The pending events queue
+	 * needs no locking.
 	 */
 	//@{
 	boost::recursive_mutex m_sigMapMutex;
-	boost::recursive_mutex m_pendingMutex;
 	boost::recursive_mutex m_delayedMutex;
 	boost::recursive_mutex m_deleteMutex;
 	//@}
@@ -562,48 +614,190 @@ private:
 
 	/**
 	 * DelayedEvent is an event that is to be emitted after specified time
-	 * has passed. DelayedEvents can be invalidated at any time before
-	 * their emitting via setting the shared pointer m_valid to false.
-	 * Trackable-derived objects automatically set this pointer to false
-	 * upon destruction.
+	 * has passed, kept in m_delayed wheel. DelayedEvents can be
+	 * invalidated at any time before their emitting via setting the
+	 * shared pointer m_valid to false. Trackable-derived objects
+	 * automatically set this pointer to false upon destruction. The
+	 * objects are constructed in memory allocated from m_delayedPool.
 	 */
-	class DelayedEvent : public InternalEvent {
-	public:
-		/**
-		 * Constructor
-		 *
-		 * @param src         Source object
-		 * @param evt         Event object
-		 * @param delay       Delay, in milliseconds
-		 */
-		DelayedEvent(Source src, Event evt, uint32_t delay)
-		: InternalEvent(src, evt),
-		m_postTime(EventMain::instance().getTick() + delay) {}
-
-		//! Comparison operator, ordered by m_postTime member
-		friend bool operator<(
-			const DelayedEvent &x, const DelayedEvent &y
-		) {
-			return x.m_postTime < y.m_postTime;
-		}
-		//! Implicit conversion to uint64_t returns m_postTime
-		operator uint64_t() const { return m_postTime; }
-	private:
-		uint64_t m_postTime;               //!< Posting time
+	struct DelayedEvent : public Detail::TimingWheel::Timer {
+		DelayedEvent(Source src, Event evt) : m_evt(src, evt) {}
+		InternalEvent m_evt;
+
+		static DelayedEvent* cast(Detail::TimingWheel::Timer *t) {
+			return static_cast<DelayedEvent*>(t);
+		}
+		//! \returns Next event in list of expired events
+		DelayedEvent* next() const { return cast(getNext()); }
+	};
+
+	/**
+	 * Event in the pending events queue. The objects are constructed in
+	 * memory allocated from m_pool.
+	 */
+	struct PendingEvent : public Detail::MPSCQueue::Node {
+		PendingEvent(Source src, Event evt) : m_evt(src, evt) {}
+		InternalEvent m_evt;
+
+		//! \returns Next event in a batch taken from the queue
+		PendingEvent* next() const {
+			return static_cast<PendingEvent*>(m_next);
+		}
 	};
 
+	//! \returns Next event from m_pending queue, or 0 if none
+	PendingEvent* popPending() {
+		return static_cast<PendingEvent*>(m_pending.pop());
+	}
+
 	/**
-	 * Transfer all delayed events for which the delay is over to pending
-	 * list.
+	 * Take all currently available events from the pending queue. The
+	 * events are chained through their m_next members, in posting order.
+	 *
+	 * @return       First event of the batch, or 0 if there are none
 	 */
-	void checkForDelayed() {
-		boost::recursive_mutex::scoped_lock l1(m_delayedMutex);
-		boost::recursive_mutex::scoped_lock l2(m_pendingMutex);
+	PendingEvent* takeBatch() {
+		PendingEvent *first = m_deferred;
+		PendingEvent *last = first;
+		m_deferred = 0;
+		while (last && last->next()) {
+			last = last->next();
+		}
+		while (PendingEvent *e = popPending()) {
+			e->m_next = 0;
+			if (last) {
+				last->m_next = e;
+			} else {
+				first = e;
+			}
+			last = e;
+		}
+		return first;
+	}
+
+	//! Destroy a chain of events and return the memory to the pool
+	void freeEvents(PendingEvent *e) {
+		while (e) {
+			PendingEvent *next = e->next();
+			e->~PendingEvent();
+			m_pool.free(e);
+			e = next;
+		}
+	}
+
+	/**
+	 * Keeps track of the unhandled part of a batch in process(); if a
+	 * handler throws, the remaining events are deferred to next call.
+	 */
+	struct BatchGuard {
+		BatchGuard(EventTable *t, PendingEvent *e) : m_t(t), m_e(e) {}
+		~BatchGuard() {
+			if (m_e) {
+				PendingEvent *last = m_e;
+				while (last->next()) {
+					last = last->next();
+				}
+				last->m_next = m_t->m_deferred;
+				m_t->m_deferred = m_e;
+			}
+		}
+		EventTable   *m_t;
+		PendingEvent *m_e;   //!< Next unhandled event
+	};
+
+	/**
+	 * Handle pending events until the queue is empty. Caller must hold
+	 * m_sigMapMutex.
+	 */
+	void processPending() {
+		while (PendingEvent *batch = takeBatch()) {
+			BatchGuard guard(this, batch);
+			while (guard.m_e) {
+				PendingEvent *e = guard.m_e;
+				guard.m_e = e->next();
+				e->m_next = 0;
+				try {
+					emit(e->m_evt);
+				} catch (...) {
+					freeEvents(e);
+					throw;
+				}
+				freeEvents(e);
+			}
+		}
+	}
+
+	/**
+	 * Pass an event to all handlers. Caller must hold m_sigMapMutex.
+	 */
+	void emit(const InternalEvent &evt) {
+		if (!evt.isValid()) {
+			return;
+		}
+		Iter j = m_sigMap.find(evt.getSource());
+		if (j != m_sigMap.end()) {
+			(*(*j).second)(evt.getSource(), evt.getEvent());
+		}
+		m_allSig(evt.getSource(), evt.getEvent());
+	}
+
+	/**
+	 * Remove all delayed events for which the delay is over.
+	 *
+	 * @return        The events, chained in emitting order, or 0
+	 */
+	DelayedEvent* checkForDelayed() {
+		boost::recursive_mutex::scoped_lock l(m_delayedMutex);
+		if (!m_delayed) {
+			return 0;
+		}
 		uint64_t tick = EventMain::instance().getTick();
+		return DelayedEvent::cast(m_delayed->advance(tick));
+	}
 
-		while (m_delayed.size() && (*(*m_delayed.begin()) <= tick)) {
-			m_pending.push_back(*m_delayed.begin());
-			m_delayed.erase(m_delayed.begin());
+	//! Destroy a delayed event and return the memory to the pool
+	void freeDelayed(DelayedEvent *e) {
+		e->~DelayedEvent();
+		m_delayedPool.free(e);
+	}
+
+	/**
+	 * Keeps track of the unhandled part of expired events list in
+	 * processDelayed(); if a handler throws, the remaining events are
+	 * put back, to be emitted during next call.
+	 */
+	struct DelayedGuard {
+		DelayedGuard(EventTable *t, DelayedEvent *e) : m_t(t), m_e(e) {}
+		~DelayedGuard() {
+			boost::recursive_mutex::scoped_lock l(
+				m_t->m_delayedMutex
+			);
+			while (m_e) {
+				DelayedEvent *next = m_e->next();
+				m_t->m_delayed->add(m_e, m_e->getExpire());
+				m_e = next;
+			}
+		}
+		EventTable   *m_t;
+		DelayedEvent *m_e;   //!< Next unhandled event
+	};
+
+	/**
+	 * Emit a list of expired delayed events. Caller must hold
+	 * m_sigMapMutex.
+	 */
+	void processDelayed(DelayedEvent *list) {
+		DelayedGuard guard(this, list);
+		while (guard.m_e) {
+			DelayedEvent *e = guard.m_e;
+			guard.m_e = e->next();
+			try {
+				emit(e->m_evt);
+			} catch (...) {
+				freeDelayed(e);
+				throw;
+			}
+			freeDelayed(e);
 		}
 	}
 
@@ -26,6 +26,7 @@
 #include <boost/function.hpp>
 #include <boost/shared_ptr.hpp>
 #include <hnbase/osdep.h>
+#include <set>
 
 class HashBase;
 class HashSetBase;
@@ -37,7 +38,7 @@ class IPV4Address;
 class Object;
 template<typename Impl, typename _ImplPtr> class Scheduler;
 template<typename T> class Range;
-template<typename T> class RangeList;
+template<typename T, typename Container = std::multiset<T> > class RangeList;
 
 //! Socket types and protocols for easier SSocket class usage
 namespace Socket {
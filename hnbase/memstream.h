@@ -0,0 +1,119 @@
+/*
+ *  Copyright (C) 2004-2006 Alo Sarv <madcat_@users.sourceforge.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef __MEMSTREAM_H__
+#define __MEMSTREAM_H__
+
+/**
+ * \file memstream.h Interface for MemStream class
+ */
+
+#include <hnbase/osdep.h>
+#include <istream>
+#include <streambuf>
+
+/**
+ * MemStreamBuf is a read-only stream buffer over a memory region owned by
+ * someone else. The memory is read in place, and must stay valid for as long
+ * as the buffer is used. Seeking is supported within the region.
+ */
+class MemStreamBuf : public std::streambuf {
+public:
+	MemStreamBuf() {}
+	MemStreamBuf(const char *data, uint32_t len) { reset(data, len); }
+
+	//! Start reading another memory region
+	void reset(const char *data, uint32_t len) {
+		char *p = const_cast<char*>(data);
+		setg(p, p, p + len);
+	}
+
+	//! \returns Start of the region
+	const char* data() const { return eback(); }
+
+	//! \returns Length of the region
+	uint32_t size() const { return egptr() - eback(); }
+
+	//! \returns Number of bytes not read yet
+	uint32_t remaining() const { return egptr() - gptr(); }
+protected:
+	virtual pos_type seekoff(
+		off_type off, std::ios::seekdir dir,
+		std::ios::openmode which = std::ios::in
+	) {
+		char *pos = 0;
+		if (!(which & std::ios::in)) {
+			return pos_type(off_type(-1));
+		} else if (dir == std::ios::beg) {
+			pos = eback();
+		} else if (dir == std::ios::cur) {
+			pos = gptr();
+		} else {
+			pos = egptr();
+		}
+		if (off < eback() - pos || off > egptr() - pos) {
+			return pos_type(off_type(-1));
+		}
+		setg(eback(), pos + off, egptr());
+		return pos_type(gptr() - eback());
+	}
+
+	virtual pos_type seekpos(
+		pos_type pos, std::ios::openmode which = std::ios::in
+	) {
+		return seekoff(off_type(pos), std::ios::beg, which);
+	}
+};
+
+/**
+ * MemStream is an input stream reading directly from memory, without copying
+ * it, bounded to the given region; reading past the end fails just like
+ * reading past the end of a std::istringstream. A single object may be
+ * reused for reading many regions through reset(), so the stream is only
+ * constructed once.
+ */
+class MemStream : public std::istream {
+public:
+	MemStream() : std::istream(0) {
+		rdbuf(&m_buf);
+	}
+
+	MemStream(const char *data, uint32_t len)
+	: std::istream(0), m_buf(data, len) {
+		rdbuf(&m_buf);
+	}
+
+	//! Start reading another memory region; also clears error state
+	void reset(const char *data, uint32_t len) {
+		m_buf.reset(data, len);
+		clear();
+	}
+
+	//! \returns Start of the region
+	const char* data() const { return m_buf.data(); }
+
+	//! \returns Length of the region
+	uint32_t size() const { return m_buf.size(); }
+
+	//! \returns Number of bytes not read yet
+	uint32_t remaining() const { return m_buf.remaining(); }
+private:
+	MemStreamBuf m_buf;
+};
+
+#endif
@@ -0,0 +1,216 @@
+/*
+ *  Copyright (C) 2004-2006 Alo Sarv <madcat_@users.sourceforge.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef __MPSCQUEUE_H__
+#define __MPSCQUEUE_H__
+
+/**
+ * \file mpscqueue.h
+ * Interface for lock-free multi-producer, single-consumer queue and related
+ * helpers, used by the Event subsystem.
+ */
+
+#include <hnbase/osdep.h>
+#include <boost/noncopyable.hpp>
+#include <boost/thread.hpp>
+#include <new>
+
+#ifdef _MSC_VER
+	#include <windows.h>
+#endif
+
+namespace Detail {
+
+/**
+ * @name Atomic operations
+ *
+ * Both exchange operations imply a full memory barrier.
+ */
+//@{
+template<typename T>
+inline T* atomicExchange(T* volatile *p, T *v) {
+#ifdef _MSC_VER
+	return static_cast<T*>(InterlockedExchangePointer(
+		reinterpret_cast<void* volatile*>(p), v
+	));
+#else
+	// __sync_lock_test_and_set() is only an acquire barrier
+	__sync_synchronize();
+	return __sync_lock_test_and_set(p, v);
+#endif
+}
+
+inline long atomicExchange(volatile long *p, long v) {
+#ifdef _MSC_VER
+	return InterlockedExchange(p, v);
+#else
+	__sync_synchronize();
+	return __sync_lock_test_and_set(p, v);
+#endif
+}
+
+//! Orders loads of data published by another thread through exchange
+inline void readBarrier() {
+#if defined(_MSC_VER)
+	MemoryBarrier();
+#elif defined(__i386__) || defined(__x86_64__)
+	// loads are not reordered with other loads on x86
+	__asm__ __volatile__("" ::: "memory");
+#else
+	__sync_synchronize();
+#endif
+}
+//@}
+
+/**
+ * Intrusive multi-producer, single-consumer FIFO queue. push() may be called
+ * from any number of threads concurrently, and costs a single atomic exchange;
+ * pop() may only be called by one thread at a time (the consumer). The queue
+ * doesn't own the nodes.
+ *
+ * If a producer is preempted in the middle of push(), pop() may report the
+ * queue as empty even though nodes pushed later are complete; those become
+ * available as soon as the producer finishes the push.
+ *
+ * The algorithm is by Dmitriy V'jukov.
+ */
+class MPSCQueue : public boost::noncopyable {
+public:
+	//! Base class for queued objects
+	struct Node {
+		Node* volatile m_next;
+	};
+
+	MPSCQueue() : m_head(&m_stub), m_tail(&m_stub) {
+		m_stub.m_next = 0;
+	}
+
+	//! Add a node to the end of the queue
+	void push(Node *n) {
+		n->m_next = 0;
+		Node *prev = atomicExchange(&m_head, n);
+		prev->m_next = n;
+	}
+
+	/**
+	 * Remove a node from the front of the queue. Once returned, the node's
+	 * m_next member is no longer used by the queue.
+	 *
+	 * @return     The node, or 0 if no node is available
+	 */
+	Node* pop() {
+		Node *tail = m_tail;
+		Node *next = tail->m_next;
+		if (tail == &m_stub) {
+			if (!next) {
+				return 0;
+			}
+			m_tail = next;
+			tail = next;
+			next = next->m_next;
+		}
+		if (next) {
+			readBarrier();
+			m_tail = next;
+			return tail;
+		}
+		if (tail != m_head) {
+			return 0; // push in progress
+		}
+		push(&m_stub);
+		next = tail->m_next;
+		if (next) {
+			readBarrier();
+			m_tail = next;
+			return tail;
+		}
+		return 0;
+	}
+private:
+	Node* volatile m_head;    //!< Last pushed node; written by producers
+	Node*          m_tail;    //!< Next node to pop; used by consumer only
+	Node           m_stub;    //!< Placeholder keeping the list non-empty
+};
+
+/**
+ * NodePool recycles equally-sized memory blocks, to avoid a heap allocation
+ * for each short-lived queue node. Up to a fixed number of free blocks are
+ * kept around; the rest are returned to the heap. The pool lock is only held
+ * for unlinking or linking a single block.
+ */
+class NodePool : public boost::noncopyable {
+public:
+	/**
+	 * @param size      Size of each block
+	 * @param maxFree   Maximum number of free blocks kept in the pool
+	 */
+	NodePool(size_t size, uint32_t maxFree)
+	: m_size(size < sizeof(Block) ? sizeof(Block) : size),
+	m_maxFree(maxFree), m_free(), m_freeCount() {}
+
+	~NodePool() {
+		while (m_free) {
+			Block *b = m_free;
+			m_free = b->m_next;
+			::operator delete(b);
+		}
+	}
+
+	//! \returns Uninitialized block of memory
+	void* alloc() {
+		{
+			boost::mutex::scoped_lock l(m_lock);
+			if (m_free) {
+				Block *b = m_free;
+				m_free = b->m_next;
+				--m_freeCount;
+				return b;
+			}
+		}
+		return ::operator new(m_size);
+	}
+
+	//! Return a block previously allocated with alloc()
+	void free(void *p) {
+		{
+			boost::mutex::scoped_lock l(m_lock);
+			if (m_freeCount < m_maxFree) {
+				Block *b = static_cast<Block*>(p);
+				b->m_next = m_free;
+				m_free = b;
+				++m_freeCount;
+				return;
+			}
+		}
+		::operator delete(p);
+	}
+private:
+	struct Block {
+		Block *m_next;
+	};
+
+	size_t       m_size;        //!< Size of blocks
+	uint32_t     m_maxFree;     //!< Max blocks in m_free
+	Block       *m_free;        //!< Free blocks
+	uint32_t     m_freeCount;   //!< Number of blocks in m_free
+	boost::mutex m_lock;        //!< Protects m_free and m_freeCount
+};
+
+} // end namespace Detail
+
+#endif
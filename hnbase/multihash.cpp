@@ -0,0 +1,331 @@
+/*
+ *  Copyright (C) 2004-2006 Alo Sarv <madcat_@users.sourceforge.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/**
+ * \file multihash.cpp Implementation of MultiHash class and portable kernel
+ */
+
+#include <hnbase/pch.h>
+#include <hnbase/multihash.h>
+#include <hnbase/multihash_kernel.h>
+#include <hnbase/utils.h>
+#include <cstring>
+
+#ifdef MULTIHASH_X86
+	#ifdef _MSC_VER
+		#include <intrin.h>
+	#else
+		#include <cpuid.h>
+	#endif
+#endif
+
+namespace MultiHashDetail {
+
+//! Portable single-lane operations
+struct ScalarOps {
+	typedef uint32_t V;
+	enum { LANES = 1 };
+
+	static V set1(uint32_t x) { return x; }
+	static V add(V a, V b)  { return a + b; }
+	static V xor_(V a, V b) { return a ^ b; }
+	static V and_(V a, V b) { return a & b; }
+	static V or_(V a, V b)  { return a | b; }
+	template<int N>
+	static V rotl(V x) { return (x << N) | (x >> (32 - N)); }
+	static V bswap(V x) {
+		return (x << 24) | ((x << 8) & 0xff0000)
+			| ((x >> 8) & 0xff00) | (x >> 24);
+	}
+	static V load(uint32_t *const *state, uint32_t i) {
+		return state[0][i];
+	}
+	static void store(uint32_t *const *state, uint32_t i, V v) {
+		state[0][i] = v;
+	}
+	static void loadBlock(V *w, const uint8_t *const *data, uint32_t off) {
+		const uint8_t *p = data[0] + off;
+		for (uint32_t i = 0; i < 16; ++i, p += 4) {
+			w[i] = p[0] | (p[1] << 8) | (p[2] << 16)
+				| (static_cast<uint32_t>(p[3]) << 24);
+		}
+	}
+};
+
+typedef Kernels<ScalarOps> Scalar;
+
+#ifdef MULTIHASH_X86
+
+static void cpuid(uint32_t leaf, uint32_t *regs) {
+#ifdef _MSC_VER
+	int tmp[4];
+	__cpuidex(tmp, leaf, 0);
+	for (uint32_t i = 0; i < 4; ++i) {
+		regs[i] = tmp[i];
+	}
+#else
+	__cpuid_count(leaf, 0, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+//! Whether the OS saves the SSE and AVX registers on context switches
+static bool haveYmmState() {
+#ifdef _MSC_VER
+	return (_xgetbv(0) & 6) == 6;
+#else
+	uint32_t lo, hi;
+	__asm__ __volatile__ ("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+	return (lo & 6) == 6;
+#endif
+}
+
+#endif
+
+static MultiHash::Kernel detectKernel() {
+	MultiHash::Kernel k = MultiHash::SCALAR;
+	if (MultiHash::isSupported(MultiHash::AVX2)) {
+		k = MultiHash::AVX2;
+	} else if (MultiHash::isSupported(MultiHash::SSE2)) {
+		k = MultiHash::SSE2;
+	}
+	return k;
+}
+
+} // end namespace MultiHashDetail
+
+using namespace MultiHashDetail;
+
+static MultiHash::Kernel s_kernel = detectKernel();
+
+bool MultiHash::isSupported(Kernel k) {
+	if (k == SCALAR) {
+		return true;
+	}
+#ifdef MULTIHASH_X86
+	uint32_t regs[4];
+	cpuid(0, regs);
+	uint32_t maxLeaf = regs[0];
+	cpuid(1, regs);
+	if (k == SSE2) {
+		return regs[3] & (1 << 26);
+	}
+	// AVX2 needs AVX and OSXSAVE bits, and YMM state enabled by the OS
+	if (k == AVX2 && maxLeaf >= 7) {
+		if ((regs[2] & (3 << 27)) != (3 << 27) || !haveYmmState()) {
+			return false;
+		}
+		cpuid(7, regs);
+		return regs[1] & (1 << 5);
+	}
+#endif
+	return false;
+}
+
+MultiHash::Kernel MultiHash::getKernel() {
+	return s_kernel;
+}
+
+bool MultiHash::setKernel(Kernel k) {
+	if (!isSupported(k)) {
+		return false;
+	}
+	s_kernel = k;
+	return true;
+}
+
+const char* MultiHash::getKernelName(Kernel k) {
+	switch (k) {
+		case SCALAR: return "scalar";
+		case SSE2:   return "SSE2";
+		case AVX2:   return "AVX2";
+		default:     return "unknown";
+	}
+}
+
+MultiHash::MultiHash(Algorithm algo, uint32_t streams)
+: m_algo(algo), m_streams(streams), m_words(algo == SHA1 ? 5 : 4),
+m_lanes(getLanes()), m_scalar(), m_vector() {
+	CHECK_THROW(streams);
+
+	switch (algo) {
+		case MD4:  m_scalar = &Scalar::md4;  break;
+		case MD5:  m_scalar = &Scalar::md5;  break;
+		case SHA1: m_scalar = &Scalar::sha1; break;
+		default:   CHECK_THROW(false);
+	}
+#ifdef MULTIHASH_X86
+	if (m_lanes == SSE2) {
+		m_vector = algo == MD4 ? &sse2Md4 : algo == MD5 ? &sse2Md5
+			: &sse2Sha1;
+	} else if (m_lanes == AVX2) {
+		m_vector = algo == MD4 ? &avx2Md4 : algo == MD5 ? &avx2Md5
+			: &avx2Sha1;
+	}
+#endif
+	if (!m_vector) {
+		m_lanes = 1;
+	}
+
+	static const uint32_t init[5] = {
+		0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0
+	};
+	m_state.reset(new uint32_t[streams * m_words]);
+	m_buffer.reset(new uint8_t[streams * 64]);
+	m_bufLen.reset(new uint32_t[streams]);
+	m_count.reset(new uint64_t[streams]);
+	m_done.reset(new bool[streams]);
+	for (uint32_t i = 0; i < streams; ++i) {
+		memcpy(&m_state[i * m_words], init, m_words * 4);
+		m_bufLen[i] = 0;
+		m_count[i] = 0;
+		m_done[i] = false;
+	}
+}
+
+MultiHash::~MultiHash() {}
+
+void MultiHash::sumUp(const char *const *data, const uint32_t *len) {
+	std::vector<const uint8_t*> ptr(m_streams);
+	std::vector<uint32_t> left(len, len + m_streams);
+	std::vector<uint32_t> active;
+
+	for (uint32_t i = 0; i < m_streams; ++i) {
+		CHECK_THROW(!m_done[i]);
+		CHECK_THROW(data[i] || !len[i]);
+		ptr[i] = reinterpret_cast<const uint8_t*>(data[i]);
+		m_count[i] += len[i];
+
+		// complete the partial block left over from last call first
+		uint8_t *buf = &m_buffer[i * 64];
+		if (m_bufLen[i] && left[i]) {
+			uint32_t cnt = std::min(64 - m_bufLen[i], left[i]);
+			memcpy(buf + m_bufLen[i], ptr[i], cnt);
+			m_bufLen[i] += cnt;
+			ptr[i] += cnt;
+			left[i] -= cnt;
+			if (m_bufLen[i] == 64) {
+				uint32_t *state = &m_state[i * m_words];
+				const uint8_t *block = buf;
+				m_scalar(&state, &block, 1);
+				m_bufLen[i] = 0;
+			}
+		}
+		if (left[i] >= 64) {
+			active.push_back(i);
+		}
+	}
+
+	if (active.size()) {
+		compress(&ptr[0], &left[0], &active[0], active.size());
+	}
+
+	for (uint32_t i = 0; i < m_streams; ++i) {
+		if (left[i]) {
+			uint8_t *buf = &m_buffer[i * 64] + m_bufLen[i];
+			memcpy(buf, ptr[i], left[i]);
+			m_bufLen[i] += left[i];
+		}
+	}
+}
+
+// Streams are processed in groups of m_lanes, as many blocks at once as the
+// shortest of the group has; unused lanes compute garbage into scratch state.
+// A single stream goes through the scalar kernel, which is faster for that.
+void MultiHash::compress(
+	const uint8_t **data, uint32_t *len, const uint32_t *streams,
+	uint32_t count
+) {
+	std::vector<uint32_t> todo(streams, streams + count);
+	uint32_t scratch[AVX2][5];
+	uint32_t *state[AVX2];
+	const uint8_t *block[AVX2];
+	memset(scratch, 0, sizeof(scratch));
+
+	while (todo.size()) {
+		uint32_t n = std::min<uint32_t>(todo.size(), m_lanes);
+		if (n == 1) {
+			uint32_t s = todo[0];
+			state[0] = &m_state[s * m_words];
+			block[0] = data[s];
+			m_scalar(state, block, len[s] / 64);
+			data[s] += len[s] / 64 * 64;
+			len[s] %= 64;
+		} else {
+			uint32_t blocks = len[todo[0]] / 64;
+			for (uint32_t i = 0; i < n; ++i) {
+				blocks = std::min(blocks, len[todo[i]] / 64);
+			}
+			for (uint32_t i = 0; i < m_lanes; ++i) {
+				if (i < n) {
+					state[i] = &m_state[todo[i] * m_words];
+					block[i] = data[todo[i]];
+				} else {
+					state[i] = scratch[i];
+					block[i] = data[todo[0]];
+				}
+			}
+			m_vector(state, block, blocks);
+			for (uint32_t i = 0; i < n; ++i) {
+				data[todo[i]] += blocks * 64;
+				len[todo[i]] -= blocks * 64;
+			}
+		}
+
+		std::vector<uint32_t> rest;
+		for (uint32_t i = 0; i < todo.size(); ++i) {
+			if (len[todo[i]] >= 64) {
+				rest.push_back(todo[i]);
+			}
+		}
+		todo.swap(rest);
+	}
+}
+
+std::string MultiHash::getHash(uint32_t stream) {
+	CHECK_THROW(stream < m_streams);
+	CHECK_THROW(!m_done[stream]);
+
+	// padding: 0x80, zeroes, and data length in bits in the last 8 bytes
+	uint8_t pad[128];
+	uint32_t cnt = m_bufLen[stream];
+	uint32_t total = cnt + 9 > 64 ? 128 : 64;
+	memset(pad, 0, sizeof(pad));
+	memcpy(pad, &m_buffer[stream * 64], cnt);
+	pad[cnt] = 0x80;
+	uint64_t bits = m_count[stream] * 8;
+	for (uint32_t i = 0; i < 8; ++i) {
+		uint8_t b = static_cast<uint8_t>(bits >> (i * 8));
+		if (m_algo == SHA1) {
+			pad[total - 1 - i] = b;
+		} else {
+			pad[total - 8 + i] = b;
+		}
+	}
+	uint32_t *state = &m_state[stream * m_words];
+	const uint8_t *block = pad;
+	m_scalar(&state, &block, total / 64);
+	m_done[stream] = true;
+
+	// MD4 and MD5 output is little-endian, SHA1 big-endian
+	std::string ret(m_words * 4, '\0');
+	for (uint32_t i = 0; i < m_words * 4; ++i) {
+		uint32_t shift = m_algo == SHA1 ? (3 - i % 4) * 8 : i % 4 * 8;
+		ret[i] = static_cast<char>(state[i / 4] >> shift);
+	}
+	return ret;
+}
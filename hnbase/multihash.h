@@ -0,0 +1,148 @@
+/*
+ *  Copyright (C) 2004-2006 Alo Sarv <madcat_@users.sourceforge.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/**
+ * \file multihash.h Interface for MultiHash class
+ */
+
+#ifndef __MULTIHASH_H__
+#define __MULTIHASH_H__
+
+#include <hnbase/osdep.h>
+#include <boost/noncopyable.hpp>
+#include <boost/scoped_array.hpp>
+#include <string>
+
+/**
+ * MultiHash computes MD4, MD5 or SHA-1 checksums of several independent data
+ * streams at once. Md4Transform and friends process one 64-byte block at a
+ * time, using a single 32-bit value per register; MultiHash instead keeps the
+ * state of 4 (SSE2) or 8 (AVX2) streams in one vector register, so the blocks
+ * of that many streams are processed with the same instructions. The kernel
+ * is selected at runtime based on what the CPU supports; on other CPUs, the
+ * portable code is used, which processes one stream at a time.
+ *
+ * Usage is similar to Md4Transform - pass data to sumUp() as many times as
+ * needed, then call getHash() ONCE for each stream. Each sumUp() call passes
+ * the next piece of data for all streams; the streams gain the most when the
+ * pieces are of equal size.
+ */
+class HNBASE_EXPORT MultiHash : public boost::noncopyable {
+public:
+	//! Supported checksums
+	enum Algorithm {
+		MD4,
+		MD5,
+		SHA1
+	};
+
+	//! Available implementations; the value is the number of lanes
+	enum Kernel {
+		SCALAR = 1,
+		SSE2   = 4,
+		AVX2   = 8
+	};
+
+	/**
+	 * Construct new checksumming context
+	 *
+	 * @param algo       Checksum to compute
+	 * @param streams    Number of data streams
+	 */
+	MultiHash(Algorithm algo, uint32_t streams);
+
+	//! Destructor
+	~MultiHash();
+
+	/**
+	 * Add data to the streams.
+	 *
+	 * @param data       Array of getStreams() pointers to data
+	 * @param len        Array of getStreams() lengths; may contain zeroes
+	 */
+	void sumUp(const char *const *data, const uint32_t *len);
+
+	/**
+	 * Finalize checksumming of a stream and retrieve the checksum. Call
+	 * this function only ONCE for each stream.
+	 *
+	 * @param stream     Stream index
+	 * @return           Checksum, 16 (MD4, MD5) or 20 (SHA1) bytes long
+	 */
+	std::string getHash(uint32_t stream);
+
+	//! \returns Number of streams in this context
+	uint32_t getStreams() const { return m_streams; }
+
+	//! \returns Currently used kernel
+	static Kernel getKernel();
+
+	//! \returns Number of streams the current kernel processes at once
+	static uint32_t getLanes() { return getKernel(); }
+
+	//! \returns Human-readable name of a kernel
+	static const char* getKernelName(Kernel k);
+
+	/**
+	 * Select the kernel to be used by subsequently created contexts;
+	 * mainly for testing and benchmarks.
+	 *
+	 * @param k         Kernel to use
+	 * @return          False if the CPU doesn't support the kernel
+	 */
+	static bool setKernel(Kernel k);
+
+	//! \returns Whether the CPU supports the kernel
+	static bool isSupported(Kernel k);
+private:
+	/**
+	 * Block compression function; processes the same number of blocks
+	 * from each lane, data and state of lane i given by data[i] and
+	 * state[i].
+	 */
+	typedef void (*Compress)(
+		uint32_t *const *state, const uint8_t *const *data,
+		uint32_t blocks
+	);
+
+	//! Process whole blocks of streams; advances data pointers
+	void compress(
+		const uint8_t **data, uint32_t *len, const uint32_t *streams,
+		uint32_t count
+	);
+
+	Algorithm m_algo;         //!< Computed checksum
+	uint32_t  m_streams;      //!< Number of streams
+	uint32_t  m_words;        //!< State size in 32-bit words
+	uint32_t  m_lanes;        //!< Lanes in m_vector
+	Compress  m_scalar;       //!< Single-lane compression function
+	Compress  m_vector;       //!< Multi-lane compression function
+
+	//! Per-stream state, m_words words each
+	boost::scoped_array<uint32_t> m_state;
+	//! Per-stream 64-byte buffer of partial block
+	boost::scoped_array<uint8_t>  m_buffer;
+	//! Per-stream number of bytes in buffer
+	boost::scoped_array<uint32_t> m_bufLen;
+	//! Per-stream total number of bytes
+	boost::scoped_array<uint64_t> m_count;
+	//! Per-stream flag, set after getHash()
+	boost::scoped_array<bool>     m_done;
+};
+
+#endif
@@ -0,0 +1,141 @@
+/*
+ *  Copyright (C) 2004-2006 Alo Sarv <madcat_@users.sourceforge.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/**
+ * \file multihash_avx2.cpp 8-lane AVX2 kernel for MultiHash
+ *
+ * This file is compiled for AVX2 regardless of the compiler flags used for the
+ * rest of the code; MultiHash only calls it after checking the CPU.
+ */
+
+#include <hnbase/osdep.h>
+
+#if defined(__i386__) || defined(__x86_64__) \
+	|| defined(_M_IX86) || defined(_M_X64)
+
+#include <immintrin.h>
+
+#if defined(__clang__)
+	#pragma clang attribute push \
+		(__attribute__((target("avx2"))), apply_to = function)
+#elif defined(__GNUC__)
+	#pragma GCC target("avx2")
+#endif
+
+#include <hnbase/multihash_kernel.h>
+
+namespace MultiHashDetail {
+
+struct Avx2Ops {
+	typedef __m256i V;
+	enum { LANES = 8 };
+
+	static V set1(uint32_t x) { return _mm256_set1_epi32(x); }
+	static V add(V a, V b)  { return _mm256_add_epi32(a, b); }
+	static V xor_(V a, V b) { return _mm256_xor_si256(a, b); }
+	static V and_(V a, V b) { return _mm256_and_si256(a, b); }
+	static V or_(V a, V b)  { return _mm256_or_si256(a, b); }
+	template<int N>
+	static V rotl(V x) {
+		return _mm256_or_si256(
+			_mm256_slli_epi32(x, N), _mm256_srli_epi32(x, 32 - N)
+		);
+	}
+	static V bswap(V x) {
+		const V mask = _mm256_setr_epi8(
+			3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+			3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12
+		);
+		return _mm256_shuffle_epi8(x, mask);
+	}
+	static V load(uint32_t *const *s, uint32_t i) {
+		return _mm256_set_epi32(
+			s[7][i], s[6][i], s[5][i], s[4][i],
+			s[3][i], s[2][i], s[1][i], s[0][i]
+		);
+	}
+	static void store(uint32_t *const *s, uint32_t i, V v) {
+		uint32_t tmp[LANES];
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(tmp), v);
+		for (uint32_t j = 0; j < LANES; ++j) {
+			s[j][i] = tmp[j];
+		}
+	}
+	// eight words of each lane in, word of eight lanes out; the unpacks
+	// work within 128-bit halves, so the halves are put together last
+	static void loadBlock(V *w, const uint8_t *const *data, uint32_t off) {
+		for (uint32_t i = 0; i < 16; i += 8) {
+			V r[LANES], t[LANES], u[LANES];
+			for (uint32_t j = 0; j < LANES; ++j) {
+				r[j] = _mm256_loadu_si256(
+					reinterpret_cast<const __m256i*>(
+						data[j] + off + i * 4
+					)
+				);
+			}
+			for (uint32_t j = 0; j < LANES; j += 2) {
+				V *p = r + j;
+				t[j]     = _mm256_unpacklo_epi32(p[0], p[1]);
+				t[j + 1] = _mm256_unpackhi_epi32(p[0], p[1]);
+			}
+			for (uint32_t j = 0; j < LANES; j += 4) {
+				V *p = t + j;
+				u[j]     = _mm256_unpacklo_epi64(p[0], p[2]);
+				u[j + 1] = _mm256_unpackhi_epi64(p[0], p[2]);
+				u[j + 2] = _mm256_unpacklo_epi64(p[1], p[3]);
+				u[j + 3] = _mm256_unpackhi_epi64(p[1], p[3]);
+			}
+			for (uint32_t j = 0; j < 4; ++j) {
+				w[i + j] = _mm256_permute2x128_si256(
+					u[j], u[j + 4], 0x20
+				);
+				w[i + j + 4] = _mm256_permute2x128_si256(
+					u[j], u[j + 4], 0x31
+				);
+			}
+		}
+	}
+};
+
+typedef Kernels<Avx2Ops> Avx2;
+
+void avx2Md4(
+	uint32_t *const *state, const uint8_t *const *data, uint32_t blocks
+) {
+	Avx2::md4(state, data, blocks);
+}
+
+void avx2Md5(
+	uint32_t *const *state, const uint8_t *const *data, uint32_t blocks
+) {
+	Avx2::md5(state, data, blocks);
+}
+
+void avx2Sha1(
+	uint32_t *const *state, const uint8_t *const *data, uint32_t blocks
+) {
+	Avx2::sha1(state, data, blocks);
+}
+
+} // end namespace MultiHashDetail
+
+#if defined(__clang__)
+	#pragma clang attribute pop
+#endif
+
+#endif
@@ -0,0 +1,264 @@
+/*
+ *  Copyright (C) 2004-2006 Alo Sarv <madcat_@users.sourceforge.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/**
+ * \file multihash_kernel.h MultiHash block compression functions
+ *
+ * For MultiHash implementation use only. The functions are written once in
+ * terms of an Ops class, which defines the vector type and operations on it;
+ * each kernel (multihash.cpp, multihash_sse2.cpp, multihash_avx2.cpp)
+ * instantiates them with its own Ops, compiled for its instruction set.
+ *
+ * Ops must provide:
+ * - V        Vector type, one 32-bit value per lane
+ * - LANES    Number of lanes in V
+ * - set1(), add(), xor_(), and_(), or_(), rotl<N>() and bswap() (swaps
+ *   the bytes of each 32-bit value)
+ * - load(state, i), store(state, i, v) - gather/scatter word i of the lane
+ *   states
+ * - loadBlock(w, data, offset) - load the 16 little-endian words of a
+ *   block at offset from each lane's data
+ */
+
+#ifndef __MULTIHASH_KERNEL_H__
+#define __MULTIHASH_KERNEL_H__
+
+#include <hnbase/osdep.h>
+
+#if defined(__i386__) || defined(__x86_64__) \
+	|| defined(_M_IX86) || defined(_M_X64)
+	#define MULTIHASH_X86
+#endif
+
+namespace MultiHashDetail {
+
+template<typename Ops>
+struct Kernels {
+	typedef typename Ops::V V;
+
+	static inline V k(uint32_t x) { return Ops::set1(x); }
+	static inline V add(V a, V b) { return Ops::add(a, b); }
+	static inline V add(V a, V b, V c) { return add(add(a, b), c); }
+
+	// z ^ (x & (y ^ z)) == (x & y) | (~x & z)
+	static inline V sel(V x, V y, V z) {
+		return Ops::xor_(z, Ops::and_(x, Ops::xor_(y, z)));
+	}
+	static inline V maj(V x, V y, V z) {
+		return Ops::or_(Ops::and_(x, y), Ops::and_(z, Ops::or_(x, y)));
+	}
+	static inline V par(V x, V y, V z) {
+		return Ops::xor_(x, Ops::xor_(y, z));
+	}
+	// y ^ (x | ~z)
+	static inline V md5i(V x, V y, V z) {
+		return Ops::xor_(y, Ops::or_(x, Ops::xor_(z, k(0xffffffff))));
+	}
+
+	static void md4(
+		uint32_t *const *state, const uint8_t *const *data,
+		uint32_t blocks
+	) {
+		V a = Ops::load(state, 0), b = Ops::load(state, 1);
+		V c = Ops::load(state, 2), d = Ops::load(state, 3);
+		V w[16];
+		for (uint32_t i = 0; i < blocks; ++i) {
+			Ops::loadBlock(w, data, i * 64);
+			V aa = a, bb = b, cc = c, dd = d;
+
+#define MD4_STEP(f, a, b, c, d, x, s, t) \
+	a = Ops::template rotl<s>(add(a, f(b, c, d), add(w[x], k(t))))
+#define MD4_ROUND(f, x0, x1, x2, x3, s0, s1, s2, s3, t) \
+	MD4_STEP(f, a, b, c, d, x0, s0, t); \
+	MD4_STEP(f, d, a, b, c, x1, s1, t); \
+	MD4_STEP(f, c, d, a, b, x2, s2, t); \
+	MD4_STEP(f, b, c, d, a, x3, s3, t)
+
+			MD4_ROUND(sel,  0,  1,  2,  3, 3, 7, 11, 19, 0);
+			MD4_ROUND(sel,  4,  5,  6,  7, 3, 7, 11, 19, 0);
+			MD4_ROUND(sel,  8,  9, 10, 11, 3, 7, 11, 19, 0);
+			MD4_ROUND(sel, 12, 13, 14, 15, 3, 7, 11, 19, 0);
+
+			MD4_ROUND(maj,  0,  4,  8, 12, 3, 5, 9, 13,
+				0x5a827999);
+			MD4_ROUND(maj,  1,  5,  9, 13, 3, 5, 9, 13,
+				0x5a827999);
+			MD4_ROUND(maj,  2,  6, 10, 14, 3, 5, 9, 13,
+				0x5a827999);
+			MD4_ROUND(maj,  3,  7, 11, 15, 3, 5, 9, 13,
+				0x5a827999);
+
+			MD4_ROUND(par,  0,  8,  4, 12, 3, 9, 11, 15,
+				0x6ed9eba1);
+			MD4_ROUND(par,  2, 10,  6, 14, 3, 9, 11, 15,
+				0x6ed9eba1);
+			MD4_ROUND(par,  1,  9,  5, 13, 3, 9, 11, 15,
+				0x6ed9eba1);
+			MD4_ROUND(par,  3, 11,  7, 15, 3, 9, 11, 15,
+				0x6ed9eba1);
+
+#undef MD4_ROUND
+#undef MD4_STEP
+
+			a = add(a, aa); b = add(b, bb);
+			c = add(c, cc); d = add(d, dd);
+		}
+		Ops::store(state, 0, a); Ops::store(state, 1, b);
+		Ops::store(state, 2, c); Ops::store(state, 3, d);
+	}
+
+	static void md5(
+		uint32_t *const *state, const uint8_t *const *data,
+		uint32_t blocks
+	) {
+		V a = Ops::load(state, 0), b = Ops::load(state, 1);
+		V c = Ops::load(state, 2), d = Ops::load(state, 3);
+		V w[16];
+		for (uint32_t i = 0; i < blocks; ++i) {
+			Ops::loadBlock(w, data, i * 64);
+			V aa = a, bb = b, cc = c, dd = d;
+
+#define MD5_STEP(f, a, b, c, d, x, s, t) \
+	a = add(b, Ops::template rotl<s>(add(a, f(b, c, d), add(w[x], k(t)))))
+#define MD5_ROUND(f, x0, x1, x2, x3, s0, s1, s2, s3, t0, t1, t2, t3) \
+	MD5_STEP(f, a, b, c, d, x0, s0, t0); \
+	MD5_STEP(f, d, a, b, c, x1, s1, t1); \
+	MD5_STEP(f, c, d, a, b, x2, s2, t2); \
+	MD5_STEP(f, b, c, d, a, x3, s3, t3)
+
+			MD5_ROUND(sel,  0,  1,  2,  3, 7, 12, 17, 22,
+				0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee);
+			MD5_ROUND(sel,  4,  5,  6,  7, 7, 12, 17, 22,
+				0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501);
+			MD5_ROUND(sel,  8,  9, 10, 11, 7, 12, 17, 22,
+				0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be);
+			MD5_ROUND(sel, 12, 13, 14, 15, 7, 12, 17, 22,
+				0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821);
+
+			// G(x, y, z) == F(z, x, y)
+#define MD5G(x, y, z) sel(z, x, y)
+			MD5_ROUND(MD5G,  1,  6, 11,  0, 5, 9, 14, 20,
+				0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa);
+			MD5_ROUND(MD5G,  5, 10, 15,  4, 5, 9, 14, 20,
+				0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8);
+			MD5_ROUND(MD5G,  9, 14,  3,  8, 5, 9, 14, 20,
+				0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed);
+			MD5_ROUND(MD5G, 13,  2,  7, 12, 5, 9, 14, 20,
+				0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a);
+#undef MD5G
+
+			MD5_ROUND(par,  5,  8, 11, 14, 4, 11, 16, 23,
+				0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c);
+			MD5_ROUND(par,  1,  4,  7, 10, 4, 11, 16, 23,
+				0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70);
+			MD5_ROUND(par, 13,  0,  3,  6, 4, 11, 16, 23,
+				0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05);
+			MD5_ROUND(par,  9, 12, 15,  2, 4, 11, 16, 23,
+				0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665);
+
+			MD5_ROUND(md5i,  0,  7, 14,  5, 6, 10, 15, 21,
+				0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039);
+			MD5_ROUND(md5i, 12,  3, 10,  1, 6, 10, 15, 21,
+				0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1);
+			MD5_ROUND(md5i,  8, 15,  6, 13, 6, 10, 15, 21,
+				0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1);
+			MD5_ROUND(md5i,  4, 11,  2,  9, 6, 10, 15, 21,
+				0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391);
+
+#undef MD5_ROUND
+#undef MD5_STEP
+
+			a = add(a, aa); b = add(b, bb);
+			c = add(c, cc); d = add(d, dd);
+		}
+		Ops::store(state, 0, a); Ops::store(state, 1, b);
+		Ops::store(state, 2, c); Ops::store(state, 3, d);
+	}
+
+	static void sha1(
+		uint32_t *const *state, const uint8_t *const *data,
+		uint32_t blocks
+	) {
+		V a = Ops::load(state, 0), b = Ops::load(state, 1);
+		V c = Ops::load(state, 2), d = Ops::load(state, 3);
+		V e = Ops::load(state, 4);
+		V w[16];
+		for (uint32_t i = 0; i < blocks; ++i) {
+			Ops::loadBlock(w, data, i * 64);
+			for (uint32_t j = 0; j < 16; ++j) {
+				w[j] = Ops::bswap(w[j]);
+			}
+			V aa = a, bb = b, cc = c, dd = d, ee = e;
+
+#define SHA1_EXPAND(t) \
+	(w[(t) & 15] = Ops::template rotl<1>(Ops::xor_( \
+		Ops::xor_(w[((t) - 3) & 15], w[((t) - 8) & 15]), \
+		Ops::xor_(w[((t) - 14) & 15], w[(t) & 15]) \
+	)))
+#define SHA1_STEP(f, x, kt) { \
+	V tmp = add(Ops::template rotl<5>(a), f(b, c, d), add(e, x, k(kt))); \
+	e = d; d = c; c = Ops::template rotl<30>(b); b = a; a = tmp; \
+}
+			uint32_t t = 0;
+			for (; t < 16; ++t) {
+				SHA1_STEP(sel, w[t], 0x5a827999);
+			}
+			for (; t < 20; ++t) {
+				SHA1_STEP(sel, SHA1_EXPAND(t), 0x5a827999);
+			}
+			for (; t < 40; ++t) {
+				SHA1_STEP(par, SHA1_EXPAND(t), 0x6ed9eba1);
+			}
+			for (; t < 60; ++t) {
+				SHA1_STEP(maj, SHA1_EXPAND(t), 0x8f1bbcdc);
+			}
+			for (; t < 80; ++t) {
+				SHA1_STEP(par, SHA1_EXPAND(t), 0xca62c1d6);
+			}
+
+#undef SHA1_STEP
+#undef SHA1_EXPAND
+
+			a = add(a, aa); b = add(b, bb); c = add(c, cc);
+			d = add(d, dd); e = add(e, ee);
+		}
+		Ops::store(state, 0, a); Ops::store(state, 1, b);
+		Ops::store(state, 2, c); Ops::store(state, 3, d);
+		Ops::store(state, 4, e);
+	}
+};
+
+#ifdef MULTIHASH_X86
+
+//! Kernels defined in multihash_sse2.cpp and multihash_avx2.cpp
+#define MULTIHASH_DECLARE(name) \
+	void name(uint32_t *const *state, const uint8_t *const *data, \
+		uint32_t blocks)
+MULTIHASH_DECLARE(sse2Md4);
+MULTIHASH_DECLARE(sse2Md5);
+MULTIHASH_DECLARE(sse2Sha1);
+MULTIHASH_DECLARE(avx2Md4);
+MULTIHASH_DECLARE(avx2Md5);
+MULTIHASH_DECLARE(avx2Sha1);
+#undef MULTIHASH_DECLARE
+
+#endif
+
+} // end namespace MultiHashDetail
+
+#endif
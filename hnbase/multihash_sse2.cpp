@@ -0,0 +1,123 @@
+/*
+ *  Copyright (C) 2004-2006 Alo Sarv <madcat_@users.sourceforge.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/**
+ * \file multihash_sse2.cpp 4-lane SSE2 kernel for MultiHash
+ *
+ * This file is compiled for SSE2 even when the rest of the code isn't (e.g.
+ * 32-bit x86 builds); MultiHash only calls it after checking the CPU.
+ */
+
+#include <hnbase/osdep.h>
+
+#if defined(__i386__) || defined(__x86_64__) \
+	|| defined(_M_IX86) || defined(_M_X64)
+
+#include <emmintrin.h>
+
+#if defined(__clang__)
+	#pragma clang attribute push \
+		(__attribute__((target("sse2"))), apply_to = function)
+#elif defined(__GNUC__)
+	#pragma GCC target("sse2")
+#endif
+
+#include <hnbase/multihash_kernel.h>
+
+namespace MultiHashDetail {
+
+struct Sse2Ops {
+	typedef __m128i V;
+	enum { LANES = 4 };
+
+	static V set1(uint32_t x) { return _mm_set1_epi32(x); }
+	static V add(V a, V b)  { return _mm_add_epi32(a, b); }
+	static V xor_(V a, V b) { return _mm_xor_si128(a, b); }
+	static V and_(V a, V b) { return _mm_and_si128(a, b); }
+	static V or_(V a, V b)  { return _mm_or_si128(a, b); }
+	template<int N>
+	static V rotl(V x) {
+		return _mm_or_si128(
+			_mm_slli_epi32(x, N), _mm_srli_epi32(x, 32 - N)
+		);
+	}
+	// swap bytes in 16-bit words, then the words
+	static V bswap(V x) {
+		x = _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+		return _mm_shufflehi_epi16(_mm_shufflelo_epi16(x, 0xb1), 0xb1);
+	}
+	static V load(uint32_t *const *s, uint32_t i) {
+		return _mm_set_epi32(s[3][i], s[2][i], s[1][i], s[0][i]);
+	}
+	static void store(uint32_t *const *s, uint32_t i, V v) {
+		uint32_t tmp[LANES];
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(tmp), v);
+		for (uint32_t j = 0; j < LANES; ++j) {
+			s[j][i] = tmp[j];
+		}
+	}
+	// four words of each lane in, word of four lanes out
+	static void loadBlock(V *w, const uint8_t *const *data, uint32_t off) {
+		for (uint32_t i = 0; i < 16; i += 4) {
+			V r[LANES];
+			for (uint32_t j = 0; j < LANES; ++j) {
+				r[j] = _mm_loadu_si128(
+					reinterpret_cast<const __m128i*>(
+						data[j] + off + i * 4
+					)
+				);
+			}
+			V t0 = _mm_unpacklo_epi32(r[0], r[1]);
+			V t1 = _mm_unpacklo_epi32(r[2], r[3]);
+			V t2 = _mm_unpackhi_epi32(r[0], r[1]);
+			V t3 = _mm_unpackhi_epi32(r[2], r[3]);
+			w[i]     = _mm_unpacklo_epi64(t0, t1);
+			w[i + 1] = _mm_unpackhi_epi64(t0, t1);
+			w[i + 2] = _mm_unpacklo_epi64(t2, t3);
+			w[i + 3] = _mm_unpackhi_epi64(t2, t3);
+		}
+	}
+};
+
+typedef Kernels<Sse2Ops> Sse2;
+
+void sse2Md4(
+	uint32_t *const *state, const uint8_t *const *data, uint32_t blocks
+) {
+	Sse2::md4(state, data, blocks);
+}
+
+void sse2Md5(
+	uint32_t *const *state, const uint8_t *const *data, uint32_t blocks
+) {
+	Sse2::md5(state, data, blocks);
+}
+
+void sse2Sha1(
+	uint32_t *const *state, const uint8_t *const *data, uint32_t blocks
+) {
+	Sse2::sha1(state, data, blocks);
+}
+
+} // end namespace MultiHashDetail
+
+#if defined(__clang__)
+	#pragma clang attribute pop
+#endif
+
+#endif
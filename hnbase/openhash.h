@@ -0,0 +1,247 @@
+/*
+ *  Copyright (C) 2004-2006 Alo Sarv <madcat_@users.sourceforge.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef __OPENHASH_H__
+#define __OPENHASH_H__
+
+/**
+ * \file openhash.h Interface for OpenHashMap class
+ */
+
+#include <hnbase/osdep.h>
+#include <algorithm>
+#include <functional>
+#include <string>
+#include <vector>
+
+/**
+ * OpenHashMap is a hash table with open addressing and linear probing. All
+ * entries are stored in a single array, so a lookup usually touches a single
+ * cache line and performs one key comparison, instead of walking a tree of
+ * separately allocated nodes like std::map does.
+ *
+ * Removed entries leave a marker behind, which is dropped when the table is
+ * rebuilt; the table is rebuilt when three quarters of the slots are in use.
+ * Pointers returned by find() are invalidated by insert().
+ *
+ * Both Key and Value must be default-constructible; they are swapped, not
+ * copied, when the table is rebuilt.
+ *
+ * @param Key      Key type
+ * @param Value    Value type
+ * @param HashFn   Functor returning size_t hash of a key
+ * @param KeyEqual Functor comparing two keys for equality
+ */
+template<
+	typename Key, typename Value, typename HashFn,
+	typename KeyEqual = std::equal_to<Key>
+>
+class OpenHashMap {
+public:
+	OpenHashMap(const HashFn &h = HashFn(), const KeyEqual &e = KeyEqual())
+	: m_hash(h), m_equal(e), m_size(), m_used() {}
+
+	/**
+	 * Look up an entry.
+	 *
+	 * @param k        Key to search for
+	 * @return         Pointer to the value, or 0 if not found
+	 */
+	Value* find(const Key &k) {
+		size_t i = lookup(k);
+		return i == NPOS ? 0 : &m_slots[i].m_value;
+	}
+	const Value* find(const Key &k) const {
+		size_t i = lookup(k);
+		return i == NPOS ? 0 : &m_slots[i].m_value;
+	}
+
+	/**
+	 * Add an entry, unless the key already exists.
+	 *
+	 * @param k        Key to insert
+	 * @param v        Value to insert
+	 * @return         True if inserted, false if the key already existed
+	 */
+	bool insert(const Key &k, const Value &v) {
+		return insertKey(k, v).second;
+	}
+
+	/**
+	 * Access the value for a key, default-constructing it if the key
+	 * doesn't exist yet.
+	 */
+	Value& operator[](const Key &k) {
+		return m_slots[insertKey(k, Value()).first].m_value;
+	}
+
+	/**
+	 * Remove an entry.
+	 *
+	 * @param k        Key to remove
+	 * @return         True if the entry was found and removed
+	 */
+	bool erase(const Key &k) {
+		size_t i = lookup(k);
+		if (i == NPOS) {
+			return false;
+		}
+		Slot tmp;
+		std::swap(m_slots[i].m_key, tmp.m_key);
+		std::swap(m_slots[i].m_value, tmp.m_value);
+		m_slots[i].m_state = DELETED;
+		--m_size;
+		return true;
+	}
+
+	//! Remove all entries and release memory
+	void clear() {
+		std::vector<Slot>().swap(m_slots);
+		m_size = m_used = 0;
+	}
+
+	//! \returns Number of entries
+	size_t size() const { return m_size; }
+	//! \returns Whether there are no entries
+	bool empty() const { return !m_size; }
+	//! \returns Number of slots allocated
+	size_t capacity() const { return m_slots.size(); }
+
+	/**
+	 * Call a function for each entry, in unspecified order. The function
+	 * receives the key and a reference to the value, and may not modify
+	 * the table.
+	 */
+	template<typename Fun>
+	void forEach(Fun f) {
+		for (size_t i = 0; i < m_slots.size(); ++i) {
+			if (m_slots[i].m_state == USED) {
+				f(m_slots[i].m_key, m_slots[i].m_value);
+			}
+		}
+	}
+private:
+	enum SlotState { EMPTY = 0, USED, DELETED };
+
+	struct Slot {
+		Slot() : m_key(), m_value(), m_state(EMPTY) {}
+		Key     m_key;
+		Value   m_value;
+		uint8_t m_state;
+	};
+
+	static const size_t NPOS = ~size_t(0);
+	static const size_t MIN_CAPACITY = 16;
+
+	/**
+	 * Spread the hash over all bits, since only the lowest bits select
+	 * the slot.
+	 */
+	size_t bucket(const Key &k) const {
+		size_t h = m_hash(k);
+		h ^= h >> 16;
+		h *= 0x45d9f3b;
+		h ^= h >> 16;
+		return h & (m_slots.size() - 1);
+	}
+
+	//! \returns Slot number of key, or NPOS
+	size_t lookup(const Key &k) const {
+		if (m_slots.empty()) {
+			return NPOS;
+		}
+		size_t mask = m_slots.size() - 1;
+		for (size_t i = bucket(k); ; i = (i + 1) & mask) {
+			const Slot &s = m_slots[i];
+			if (s.m_state == EMPTY) {
+				return NPOS;
+			} else if (s.m_state == USED && m_equal(s.m_key, k)) {
+				return i;
+			}
+		}
+	}
+
+	//! \returns Slot number of key, and whether it was inserted
+	std::pair<size_t, bool> insertKey(const Key &k, const Value &v) {
+		size_t i = lookup(k);
+		if (i != NPOS) {
+			return std::make_pair(i, false);
+		}
+		if ((m_used + 1) * 4 > m_slots.size() * 3) {
+			rehash();
+		}
+		size_t mask = m_slots.size() - 1;
+		i = bucket(k);
+		while (m_slots[i].m_state == USED) {
+			i = (i + 1) & mask;
+		}
+		if (m_slots[i].m_state == EMPTY) {
+			++m_used;
+		}
+		m_slots[i].m_key = k;
+		m_slots[i].m_value = v;
+		m_slots[i].m_state = USED;
+		++m_size;
+		return std::make_pair(i, true);
+	}
+
+	//! Rebuild the table, sized for twice the current number of entries
+	void rehash() {
+		size_t cap = MIN_CAPACITY;
+		while (cap * 3 < (m_size + 1) * 8) {
+			cap *= 2;
+		}
+		std::vector<Slot> old(cap);
+		old.swap(m_slots);
+		m_used = m_size;
+		for (size_t j = 0; j < old.size(); ++j) {
+			if (old[j].m_state != USED) {
+				continue;
+			}
+			size_t i = bucket(old[j].m_key);
+			while (m_slots[i].m_state == USED) {
+				i = (i + 1) & (cap - 1);
+			}
+			std::swap(m_slots[i].m_key, old[j].m_key);
+			std::swap(m_slots[i].m_value, old[j].m_value);
+			m_slots[i].m_state = USED;
+		}
+	}
+
+	std::vector<Slot> m_slots;  //!< Table of 2^n slots
+	HashFn   m_hash;            //!< Hash function
+	KeyEqual m_equal;           //!< Key comparison
+	size_t   m_size;            //!< Number of entries
+	size_t   m_used;            //!< Number of entries and removed markers
+};
+
+/**
+ * FNV-1a hash of a string, for use with OpenHashMap
+ */
+struct StringHash {
+	size_t operator()(const std::string &s) const {
+		uint32_t h = 2166136261u;
+		for (size_t i = 0; i < s.size(); ++i) {
+			h ^= static_cast<uint8_t>(s[i]);
+			h *= 16777619u;
+		}
+		return h;
+	}
+};
+
+#endif
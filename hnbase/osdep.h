@@ -118,8 +118,10 @@ enum VersionInfo {
 	#endif
 #elif defined(__MACH__) || defined(__FreeBSD__) || \
 defined(__NetBSD__) || defined( __OpenBSD__ )
-	// Mac and BSD lack lseek64, and O_LARGEFILE
+	// Mac and BSD lack lseek64, pread64, pwrite64 and O_LARGEFILE
 	#define lseek64(fd, pos, dir) lseek(fd, pos, dir)
+	#define pread64(fd, buf, len, pos) pread(fd, buf, len, pos)
+	#define pwrite64(fd, buf, len, pos) pwrite(fd, buf, len, pos)
 	#define O_LARGEFILE 0
 #endif
 
@@ -23,10 +23,14 @@
 #ifndef __RANGELIST_H__
 #define __RANGELIST_H__
 
+#include <hnbase/fwd.h>
 #include <hnbase/range.h>
 #include <hnbase/lambda_placeholders.h>
 #include <hnbase/utils.h>              // for IntegerConcept
 #include <boost/concept_check.hpp>     // for concept checks
+#include <algorithm>
+#include <set>
+#include <vector>
 
 namespace CGComm {
 	enum {
@@ -57,7 +61,12 @@ namespace CGComm {
  * All operations on RangeLists have logarithmic complexity, so it is possible
  * to store vast amounts of ranges here with little performance penalty.
  *
+ * The ranges are stored in a std::multiset by default. Passing std::vector as
+ * Container selects the flat implementation (see below), which is faster for
+ * lists that are only modified with merge() and erase().
+ *
  * @param T         Type of ranges to be contained.
+ * @param Container Underlying container type
  *
  * The specified type must implement the following:
  *
@@ -92,10 +101,10 @@ namespace CGComm {
  * boost::logic::tribool erase(X *x);
  * \endcode
  */
-template<typename RangeType>
+template<typename RangeType, typename Container>
 class RangeList {
 public:
-	typedef std::multiset<RangeType>      Impl;
+	typedef Container                     Impl;
 	typedef typename Impl::iterator       Iter;
 	typedef typename Impl::const_iterator CIter;
 	typedef typename RangeType::size_type size_type;
@@ -187,6 +196,19 @@ public:
 		m_ranges.insert(r);
 	}
 
+	/**
+	 * Merge a sequence of ranges into the rangelist.
+	 *
+	 * @param first   Iterator to the first range to be merged
+	 * @param last    Iterator to one-past-end of the ranges
+	 */
+	template<typename InputIter>
+	void mergeMany(InputIter first, InputIter last) {
+		for (; first != last; ++first) {
+			merge(*first);
+		}
+	}
+
 	/**
 	 * Erase a range from the rangelist.
 	 *
@@ -448,12 +470,280 @@ private:
 	}
 };
 
+/**
+ * Flat RangeList implementation, stores the ranges in a sorted vector. The
+ * ranges are always kept coalesced - overlapping and bordering ranges are
+ * merged together - so lookups are a single binary search over contiguous
+ * memory, and merging a range next to an existing one doesn't allocate
+ * memory at all. This suits lists that are updated for every received block,
+ * such as the completed ranges of a download.
+ *
+ * Since the ranges never overlap, push() and remove() are not supported, and
+ * only constant iterators are provided. Iterators are invalidated by all
+ * modifying operations.
+ */
+template<typename RangeType>
+class RangeList<RangeType, std::vector<RangeType> > {
+public:
+	typedef std::vector<RangeType>        Impl;
+	typedef typename Impl::const_iterator CIter;
+	typedef CIter                         Iter;
+	typedef typename RangeType::size_type size_type;
+
+	BOOST_CLASS_REQUIRE(size_type, Utils, IntegerConcept);
+
+	//! Default constructor
+	RangeList() {}
+
+	//! Construct and load from stream
+	RangeList(std::istream &i) {
+		using namespace Utils;
+		uint32_t cnt = getVal<uint32_t>(i);
+		Impl tmp;
+		tmp.reserve(cnt);
+		for (uint32_t j = 0; j < cnt; ++j) {
+			CHECK_THROW(getVal<uint8_t>(i) == CGComm::OP_RANGE);
+			CHECK_THROW(getVal<uint16_t>(i) == sizeof(size_type)*2);
+			tmp.push_back(RangeType(i));
+		}
+		mergeMany(tmp.begin(), tmp.end());
+	}
+
+	//! Output operator for streams
+	friend std::ostream& operator<<(std::ostream &o, const RangeList &rl) {
+		Utils::putVal<uint8_t>(o, CGComm::OP_RANGELIST);
+		Utils::putVal<uint16_t>(o, rl.size()*(sizeof(size_type)*2+3));
+		Utils::putVal<uint32_t>(o, rl.size());
+		for_each(rl.begin(), rl.end(), o << __1);
+		return o;
+	}
+
+	/**
+	 * Merge a range into the rangelist; the ranges overlapping or
+	 * bordering with it are replaced by a single range.
+	 *
+	 * @param r       Range to be merged into the rangelist.
+	 */
+	void merge(RangeType r) {
+		typename Impl::iterator i = std::lower_bound(
+			m_ranges.begin(), m_ranges.end(), r, Before()
+		);
+		typename Impl::iterator j = i;
+		while (j != m_ranges.end() && !Before()(r, *j)) {
+			r.merge(*j++);
+		}
+		if (i == j) {
+			m_ranges.insert(i, r);
+		} else {
+			*i = r;
+			m_ranges.erase(++i, j);
+		}
+	}
+
+	/**
+	 * Merge a sequence of ranges into the rangelist. The ranges are sorted
+	 * and merged with the existing ones in a single pass, so this is
+	 * considerably faster than merging them one by one.
+	 *
+	 * @param first   Iterator to the first range to be merged
+	 * @param last    Iterator to one-past-end of the ranges
+	 */
+	template<typename InputIter>
+	void mergeMany(InputIter first, InputIter last) {
+		Impl in(first, last);
+		std::sort(in.begin(), in.end(), BeginLess());
+		Impl out;
+		out.reserve(m_ranges.size() + in.size());
+		CIter a = m_ranges.begin(), b = in.begin();
+		while (a != m_ranges.end() || b != in.end()) {
+			bool fromA = b == in.end() || (a != m_ranges.end()
+				&& (*a).begin() <= (*b).begin());
+			const RangeType &r = fromA ? *a++ : *b++;
+			if (out.empty() || Before()(out.back(), r)) {
+				out.push_back(r);
+			} else {
+				out.back().merge(r);
+			}
+		}
+		m_ranges.swap(out);
+	}
+
+	/**
+	 * Erase a range from the rangelist, truncating or splitting the ranges
+	 * overlapping with it.
+	 *
+	 * @param r        Range to be erased
+	 */
+	void erase(const RangeType &r) {
+		typename Impl::iterator i = std::lower_bound(
+			m_ranges.begin(), m_ranges.end(), r.begin(), EndLess()
+		);
+		typename Impl::iterator j = i;
+		while (j != m_ranges.end() && (*j).begin() <= r.end()) {
+			++j;
+		}
+		if (i == j) {
+			return;
+		}
+		bool head = (*i).begin() < r.begin();
+		bool tail = (*(j - 1)).end() > r.end();
+		RangeType last(*(j - 1));
+		if (head) {
+			(*i++).end(r.begin() - 1);
+		}
+		if (tail) {
+			last.begin(r.end() + 1);
+			if (i != j) {
+				*i++ = last;
+			} else {
+				i = m_ranges.insert(i, last) + 1;
+				j = i;
+			}
+		}
+		m_ranges.erase(i, j);
+	}
+
+	/**
+	 * Erases a specific iterator
+	 *
+	 * @param it       Iterator to be erased
+	 */
+	void erase(CIter it) {
+		assert(it != m_ranges.end());
+		m_ranges.erase(m_ranges.begin() + (it - m_ranges.begin()));
+	}
+
+	/**
+	 * Locate the first free (unused) range in the rangelist, optionally
+	 * indicating the upper bound until which to search.
+	 *
+	 * @param limit        Optional upper bound for searching
+	 * @return             An unused range
+	 */
+	RangeType getFirstFree(
+		const size_type &limit = std::numeric_limits<size_type>::max()
+	) const {
+		size_type curPos = std::numeric_limits<size_type>::min();
+		size_type endPos = std::numeric_limits<size_type>::max();
+		if (size()) {
+			if ((*begin()).begin() > curPos) {
+				endPos = (*begin()).begin() - 1;
+				if (endPos - curPos + 1 > limit) {
+					endPos = curPos + limit - 1;
+				}
+			} else {
+				curPos = (*begin()).end() + 1;
+				if (size() == 1) {
+					endPos = curPos + limit - 1;
+				} else {
+					endPos = m_ranges[1].begin() - 1;
+				}
+			}
+		} else {
+			endPos = curPos + limit - 1;
+		}
+		return RangeType(curPos, endPos);
+	}
+
+	//! \returns True if the range is even partially contained here
+	bool contains(const RangeType &r) const {
+		return getContains(r) != end();
+	}
+
+	//! \returns True if the range is fully contained here
+	bool containsFull(const RangeType &r) const {
+		CIter i = getContains(r);
+		return i != end() && (*i).containsFull(r);
+	}
+
+	/**
+	 * Locate the first range which overlaps with the passed range.
+	 *
+	 * @param r       Range to be searched for
+	 * @return        Iterator to the found range, or end() if not found.
+	 */
+	CIter getContains(const RangeType &r) const {
+		CIter i = std::lower_bound(
+			begin(), end(), r.begin(), EndLess()
+		);
+		if (i != end() && (*i).begin() <= r.end()) {
+			return i;
+		}
+		return end();
+	}
+
+	/**
+	 * @name More convenient versions for the above functions
+	 */
+	//! @{
+	void merge(const size_type &x, const size_type &y) {
+		merge(RangeType(x, y));
+	}
+	void erase(const size_type &x, const size_type &y) {
+		erase(RangeType(x, y));
+	}
+	bool contains(const size_type &x, const size_type &y) const {
+		return contains(RangeType(x, y));
+	}
+	bool containsFull(const size_type &x, const size_type &y) const {
+		return containsFull(RangeType(x, y));
+	}
+	CIter getContains(const size_type &x, const size_type &y) const {
+		return getContains(RangeType(x, y));
+	}
+	//! @}
+
+	//! @name Generic accessors
+	//! @{
+	size_t size() const { return m_ranges.size(); }
+	void clear() { m_ranges.clear(); }
+	bool empty() const { return m_ranges.empty(); }
+	CIter begin() const { return m_ranges.begin(); }
+	CIter end()   const { return m_ranges.end(); }
+	const RangeType& front() const {
+		CHECK_THROW(size());
+		return m_ranges.front();
+	}
+	const RangeType& back() const {
+		CHECK_THROW(size());
+		return m_ranges.back();
+	}
+	//! @}
+private:
+	/**
+	 * Whether x lies before y, without overlapping or bordering it; the
+	 * end + 1 can't overflow, since end is less than another value.
+	 */
+	struct Before {
+		bool operator()(const RangeType &x, const RangeType &y) const {
+			return x.end() < y.begin() && x.end() + 1 != y.begin();
+		}
+	};
+	//! Orders ranges by their end, for searching by offset
+	struct EndLess {
+		bool operator()(const RangeType &x, const size_type &y) const {
+			return x.end() < y;
+		}
+	};
+	//! Orders ranges by their begin, for sorting overlapping ranges
+	struct BeginLess {
+		bool operator()(const RangeType &x, const RangeType &y) const {
+			return x.begin() < y.begin();
+		}
+	};
+
+	Impl m_ranges;
+};
+
 //! \name Commonly used RangeList types
 //! @{
 typedef RangeList<Range64> RangeList64;
 typedef RangeList<Range32> RangeList32;
 typedef RangeList<Range16> RangeList16;
 typedef RangeList<Range8 > RangeList8;
+typedef RangeList<Range64, std::vector<Range64> > FlatRangeList64;
+typedef RangeList<Range32, std::vector<Range32> > FlatRangeList32;
+typedef RangeList<Range16, std::vector<Range16> > FlatRangeList16;
 //! @}
 
 #endif
@@ -0,0 +1,232 @@
+/*
+ *  Copyright (C) 2004-2006 Alo Sarv <madcat_@users.sourceforge.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef __RANKEDSET_H__
+#define __RANKEDSET_H__
+
+/**
+ * \file rankedset.h Interface for RankedSet class
+ */
+
+#include <hnbase/osdep.h>
+#include <boost/noncopyable.hpp>
+#include <functional>
+
+/**
+ * RankedSet is an ordered set which, in addition to insertion, removal and
+ * lookup, can tell the position of a value in the set (the number of smaller
+ * elements), and find the element at a given position, all in O(log n) time.
+ * std::set would need a linear walk for the latter two.
+ *
+ * It is implemented as a treap: a binary search tree where each node also
+ * has a random priority, and parents have higher priorities than their
+ * children, which keeps the tree balanced with high probability. Each node
+ * stores the size of its subtree, which is what the position queries use.
+ *
+ * @param T        Value type
+ * @param Compare  Strict weak ordering of values
+ */
+template<typename T, typename Compare = std::less<T> >
+class RankedSet : public boost::noncopyable {
+public:
+	RankedSet(const Compare &comp = Compare())
+	: m_root(), m_comp(comp), m_seed(2463534242u) {}
+
+	~RankedSet() { clear(); }
+
+	/**
+	 * Add a value, unless it's already in the set.
+	 *
+	 * @param v        Value to insert
+	 * @return         True if inserted, false if it already existed
+	 */
+	bool insert(const T &v) {
+		if (contains(v)) {
+			return false;
+		}
+		Node *l, *r;
+		split(m_root, v, false, l, r);
+		m_root = merge(merge(l, new Node(v, random())), r);
+		return true;
+	}
+
+	/**
+	 * Remove a value.
+	 *
+	 * @param v        Value to remove
+	 * @return         True if removed, false if it wasn't in the set
+	 */
+	bool erase(const T &v) {
+		Node *l, *m, *r;
+		split(m_root, v, false, l, m);
+		split(m, v, true, m, r);
+		m_root = merge(l, r);
+		bool found = m;
+		delete m;
+		return found;
+	}
+
+	//! \returns Whether the value is in the set
+	bool contains(const T &v) const {
+		Node *n = m_root;
+		while (n) {
+			if (m_comp(v, n->m_value)) {
+				n = n->m_left;
+			} else if (m_comp(n->m_value, v)) {
+				n = n->m_right;
+			} else {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	/**
+	 * @param v        Value to compare against; needn't be in the set
+	 * @return         Number of elements smaller than v
+	 */
+	uint32_t countLess(const T &v) const {
+		uint32_t cnt = 0;
+		Node *n = m_root;
+		while (n) {
+			if (m_comp(n->m_value, v)) {
+				cnt += size(n->m_left) + 1;
+				n = n->m_right;
+			} else {
+				n = n->m_left;
+			}
+		}
+		return cnt;
+	}
+
+	/**
+	 * @param pos      Position, must be less than size()
+	 * @return         Element with exactly pos smaller elements
+	 */
+	const T& at(uint32_t pos) const {
+		CHECK_THROW(pos < size());
+		Node *n = m_root;
+		while (pos != size(n->m_left)) {
+			if (pos < size(n->m_left)) {
+				n = n->m_left;
+			} else {
+				pos -= size(n->m_left) + 1;
+				n = n->m_right;
+			}
+		}
+		return n->m_value;
+	}
+
+	//! \returns The smallest element; the set must not be empty
+	const T& front() const {
+		CHECK_THROW(m_root);
+		Node *n = m_root;
+		while (n->m_left) {
+			n = n->m_left;
+		}
+		return n->m_value;
+	}
+
+	uint32_t size()  const { return size(m_root); }
+	bool     empty() const { return !m_root;      }
+
+	//! Remove all elements
+	void clear() {
+		destroy(m_root);
+		m_root = 0;
+	}
+private:
+	struct Node {
+		Node(const T &v, uint32_t prio)
+		: m_value(v), m_prio(prio), m_size(1), m_left(), m_right() {}
+
+		T m_value;
+		uint32_t m_prio;       //!< Heap priority
+		uint32_t m_size;       //!< Number of nodes in this subtree
+		Node *m_left;
+		Node *m_right;
+	};
+
+	static uint32_t size(const Node *n) { return n ? n->m_size : 0; }
+
+	static void update(Node *n) {
+		n->m_size = size(n->m_left) + size(n->m_right) + 1;
+	}
+
+	/**
+	 * Split a subtree into two by value.
+	 *
+	 * @param n        Subtree to split
+	 * @param v        Value to split at
+	 * @param incl     Whether elements equal to v go to the left tree
+	 * @param l        Receives the elements less than (or equal to) v
+	 * @param r        Receives the rest of the elements
+	 */
+	void split(Node *n, const T &v, bool incl, Node *&l, Node *&r) const {
+		if (!n) {
+			l = r = 0;
+			return;
+		}
+		bool left = incl ? !m_comp(v, n->m_value) : m_comp(n->m_value, v);
+		if (left) {
+			split(n->m_right, v, incl, n->m_right, r);
+			l = n;
+		} else {
+			split(n->m_left, v, incl, l, n->m_left);
+			r = n;
+		}
+		update(n);
+	}
+
+	//! Join two subtrees, where all elements of l are smaller than r's
+	static Node* merge(Node *l, Node *r) {
+		if (!l || !r) {
+			return l ? l : r;
+		} else if (l->m_prio > r->m_prio) {
+			l->m_right = merge(l->m_right, r);
+			update(l);
+			return l;
+		} else {
+			r->m_left = merge(l, r->m_left);
+			update(r);
+			return r;
+		}
+	}
+
+	static void destroy(Node *n) {
+		if (n) {
+			destroy(n->m_left);
+			destroy(n->m_right);
+			delete n;
+		}
+	}
+
+	//! xorshift generator for node priorities
+	uint32_t random() {
+		m_seed ^= m_seed << 13;
+		m_seed ^= m_seed >> 17;
+		m_seed ^= m_seed << 5;
+		return m_seed;
+	}
+
+	Node *m_root;
+	Compare m_comp;
+	uint32_t m_seed;
+};
+
+#endif
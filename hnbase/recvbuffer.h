@@ -0,0 +1,159 @@
+/*
+ *  Copyright (C) 2004-2006 Alo Sarv <madcat_@users.sourceforge.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef __RECVBUFFER_H__
+#define __RECVBUFFER_H__
+
+/**
+ * \file recvbuffer.h Interface for RecvBuffer class
+ */
+
+#include <hnbase/osdep.h>
+#include <boost/noncopyable.hpp>
+#include <boost/scoped_array.hpp>
+#include <cstring>
+#include <stdexcept>
+
+/**
+ * RecvBuffer is a per-socket incoming data buffer. The socket reads directly
+ * into the free space at the end of the buffer (reserve() + commit()), and the
+ * consumer parses the received data in place through data() / size(), and
+ * releases only the bytes it actually used through consume(). An incomplete
+ * message thus stays where it is until the rest of it arrives, and nothing is
+ * copied between the socket, the scheduler and the parser.
+ *
+ * The unconsumed data is moved to the front of the buffer only when there
+ * isn't enough room at the end for the next read. Sockets read at most
+ * BLOCK_SIZE bytes at a time, and buffers of up to KEEP_SIZE (a block, plus
+ * room for an incomplete message left from the previous one) are reused once
+ * drained. Buffers which grew larger than that, to hold a large message, are
+ * released as soon as they become empty, so idle sockets don't hold on to
+ * memory. The storage is not zero-filled when allocated.
+ */
+class RecvBuffer : public boost::noncopyable {
+public:
+	enum Constants {
+		//! Maximum amount of data to read from socket at once
+		BLOCK_SIZE = 16384,
+		//! Buffers larger than this are released once they become empty
+		KEEP_SIZE  = 2 * BLOCK_SIZE,
+		//! Buffer capacity is always a multiple of this
+		GRANULARITY = 4096
+	};
+
+	RecvBuffer() : m_cap(), m_begin(), m_end() {}
+
+	/**
+	 * Get space for writing at least len bytes at the end of the buffer.
+	 * The returned pointer stays valid until the next non-const call.
+	 *
+	 * @param len      Number of bytes needed
+	 * @return         Pointer to the start of the free space
+	 */
+	char* reserve(uint32_t len) {
+		if (m_cap - m_end >= len) {
+			return m_buf.get() + m_end;
+		}
+		uint32_t used = size();
+		if (m_cap >= used + len) {
+			memmove(m_buf.get(), m_buf.get() + m_begin, used);
+		} else {
+			uint32_t cap = m_cap * 2;
+			if (cap < used + len) {
+				cap = used + len;
+			}
+			cap = (cap + GRANULARITY - 1) / GRANULARITY * GRANULARITY;
+			boost::scoped_array<char> tmp(new char[cap]);
+			if (used) {
+				memcpy(tmp.get(), m_buf.get() + m_begin, used);
+			}
+			m_buf.swap(tmp);
+			m_cap = cap;
+		}
+		m_begin = 0;
+		m_end = used;
+		return m_buf.get() + m_end;
+	}
+
+	/**
+	 * Mark bytes written into the space returned by reserve() as received.
+	 *
+	 * @param len      Number of bytes actually written
+	 */
+	void commit(uint32_t len) {
+		CHECK_THROW(m_end + len <= m_cap);
+		m_end += len;
+		if (empty()) {
+			clear();
+		}
+	}
+
+	/**
+	 * Copy data to the end of the buffer.
+	 *
+	 * @param data     Data to be copied
+	 * @param len      Length of data
+	 */
+	void append(const char *data, uint32_t len) {
+		if (len) {
+			memcpy(reserve(len), data, len);
+			commit(len);
+		}
+	}
+
+	/**
+	 * Release bytes from the front of the buffer.
+	 *
+	 * @param len      Number of bytes consumed
+	 */
+	void consume(uint32_t len) {
+		CHECK_THROW(len <= size());
+		m_begin += len;
+		if (empty()) {
+			clear();
+		}
+	}
+
+	//! Drop all data; large buffers are released
+	void clear() {
+		m_begin = m_end = 0;
+		if (m_cap > KEEP_SIZE) {
+			m_buf.reset();
+			m_cap = 0;
+		}
+	}
+
+	//! \returns Pointer to the unconsumed data; valid until next modification
+	const char* data() const { return m_cap ? m_buf.get() + m_begin : 0; }
+
+	//! \returns Number of unconsumed bytes
+	uint32_t size() const { return m_end - m_begin; }
+
+	//! \returns True if there's no unconsumed data
+	bool empty() const { return m_begin == m_end; }
+
+	//! \returns Number of bytes allocated
+	uint32_t capacity() const { return m_cap; }
+private:
+	boost::scoped_array<char> m_buf; //!< Storage
+	uint32_t m_cap;                  //!< Size of m_buf
+	uint32_t m_begin;                //!< Start of unconsumed data
+	uint32_t m_end;                  //!< End of received data
+};
+
+#endif
@@ -88,6 +88,8 @@
 
 #include <hnbase/schedbase.h>          // scheduler base
 #include <hnbase/sockets.h>            // xplatform socket api
+#include <hnbase/bufferchain.h>        // outgoing data buffers
+#include <hnbase/recvbuffer.h>         // incoming data buffers
 #include <hnbase/log.h>                // for logging functions
 #include <hnbase/rangelist.h>          // for ranges
 #include <boost/function.hpp>          // function objects
@@ -333,10 +335,8 @@ public:
 	 * @param ptr   Implementation pointer where to send this data
 	 * @param data  Data buffer to be sent out
 	 *
-	 * If there is existing outgoing data scheduled for this socket, the
-	 * newly passed data must be appeneded to existing data buffer.
-	 * Otherwise, a new data buffer is allocated for this socket, and the
-	 * data copied into there. In the latter case, a new upload request
+	 * The data is queued at the end of the socket's outgoing buffer chain.
+	 * If there's no upload request pending for this socket yet, a new one
 	 * is generated and submitted to SchedBase for processing.
 	 *
 	 * \note The pointed socket is not required to be in connected state
@@ -350,13 +350,41 @@ public:
 		assert(s_sockets.find(ptr->getSocket()) != s_sockets.end());
 
 		ptr->m_outBuffer->append(data);
+		scheduleUpload(ptr);
+	}
 
-		RIter i = s_upReqs.find(ptr->getSocket());
-		if (i != s_upReqs.end()) {
-			(*i).second->setValid(true);
-		} else if (ptr->getSocket()->isConnected()) {
-			SchedBase::instance().addUploadReq(new UploadReq(ptr));
-		}
+	/**
+	 * Schedule outgoing data without copying it; the buffer is queued by
+	 * reference and released once it has been sent out.
+	 *
+	 * @param ptr   Implementation pointer where to send this data
+	 * @param data  Buffer to be sent out; may not be modified afterwards
+	 */
+	static void write(SSocketWrapperPtr ptr, BufferChain::Buffer data) {
+		assert(s_sockets.find(ptr->getSocket()) != s_sockets.end());
+
+		ptr->m_outBuffer->append(data);
+		scheduleUpload(ptr);
+	}
+
+	/**
+	 * Schedule a region of an open file to be sent out. The data is sent
+	 * directly from the file (see SocketClient::sendFile()), in order with
+	 * the rest of the outgoing data, and is subject to the same limits.
+	 *
+	 * @param ptr     Implementation pointer where to send this data
+	 * @param file    File to send the data from
+	 * @param offset  Begin offset of the data in the file
+	 * @param len     Length of the data
+	 */
+	static void writeFile(
+		SSocketWrapperPtr ptr, FileHandlePtr file, uint64_t offset,
+		uint32_t len
+	) {
+		assert(s_sockets.find(ptr->getSocket()) != s_sockets.end());
+
+		ptr->m_outBuffer->appendFile(file, offset, len);
+		scheduleUpload(ptr);
 	}
 
 	/**
@@ -377,14 +405,16 @@ public:
 	 */
 	static void read(SSocketWrapperPtr ptr, std::string *buf) {
 		assert(s_sockets.find(ptr->getSocket()) != s_sockets.end());
-		buf->append(*ptr->m_inBuffer);
-		ptr->m_inBuffer->clear();
+		RecvBuffer &in = *ptr->m_inBuffer;
+		if (in.size()) {
+			buf->append(in.data(), in.size());
+		}
+		in.clear();
 	}
 
 	/**
-	 * Faster version of read(), this returns the input buffer directly,
-	 * performing two std::string copy operations (cheap on most impls),
-	 * avoiding (possibly costly) std::string::append() call.
+	 * Variant of read(), this returns the input buffer contents as a new
+	 * string.
 	 *
 	 * @param ptr     Pointer to socket to read data from
 	 * @return        The current input buffer
@@ -394,11 +424,25 @@ public:
 	 */
 	static std::string getData(SSocketWrapperPtr ptr) {
 		assert(s_sockets.find(ptr->getSocket()) != s_sockets.end());
-		std::string tmp = *ptr->m_inBuffer;
-		ptr->m_inBuffer->clear();
+		RecvBuffer &in = *ptr->m_inBuffer;
+		std::string tmp(in.size() ? in.data() : "", in.size());
+		in.clear();
 		return tmp;
 	}
 
+	/**
+	 * Access the input buffer directly, without copying the data. The
+	 * caller parses the data in place and consume()'s what it used; any
+	 * remaining data stays buffered until more arrives.
+	 *
+	 * @param ptr     Pointer to socket to read data from
+	 * @return        The socket's input buffer
+	 */
+	static boost::shared_ptr<RecvBuffer> getInput(SSocketWrapperPtr ptr) {
+		assert(s_sockets.find(ptr->getSocket()) != s_sockets.end());
+		return ptr->m_inBuffer;
+	}
+
 	/**
 	 * Accept a pending connection
 	 *
@@ -592,7 +636,7 @@ public:
 			ImplPtr s, HandlerFunc h = 0, ScoreFunc f = 0
 		) : m_socket(s), m_handler(h), m_scoreFunc(f), 
 		m_connecting(new bool(false)),
-		m_outBuffer(new std::string), m_inBuffer(new std::string),
+		m_outBuffer(new BufferChain), m_inBuffer(new RecvBuffer),
 		m_accepted(new std::deque<AcceptType*>),
 		m_downSpeed(
 			new SpeedMeter(
@@ -616,9 +660,9 @@ public:
 		//@}
 
 		bool isWritable() const {
-			return !m_outBuffer->size() && m_socket->isWritable();
+			return m_outBuffer->empty() && m_socket->isWritable();
 		}
-		bool isReadable() const { return m_inBuffer->size(); }
+		bool isReadable() const { return !m_inBuffer->empty(); }
 
 		/**
 		 * Pass event to frontend
@@ -650,10 +694,10 @@ public:
 		//! if socket is connecting
 		boost::shared_ptr<bool> m_connecting; 
 
-		//! Outgoing data buffer
-		boost::shared_ptr<std::string> m_outBuffer;
+		//! Outgoing data buffers
+		boost::shared_ptr<BufferChain> m_outBuffer;
 		//! Incoming data buffer
-		boost::shared_ptr<std::string> m_inBuffer;
+		boost::shared_ptr<RecvBuffer> m_inBuffer;
 		//! Accepted connections
 		boost::shared_ptr<std::deque<AcceptType*> > m_accepted;
 
@@ -706,15 +750,39 @@ public:
 				num = m_obj->m_outBuffer->size();
 			}
 
+			// memory segments and file regions are sent with
+			// separate calls; go on until the socket is full
+			BufferChain &buf = *m_obj->m_outBuffer;
 			uint32_t ret = 0;
-			ret = m_obj->getSocket()->write(
-				m_obj->m_outBuffer->data(), num
-			);
+			while (ret < num) {
+				int fd = -1;
+				uint64_t offset = 0;
+				uint32_t len = 0, cnt = 0;
+				if (buf.getFileRegion(&fd, &offset, &len)) {
+					len = std::min(len, num - ret);
+					cnt = m_obj->getSocket()->sendFile(
+						fd, offset, len
+					);
+				} else {
+					IOVec vec[MAX_IOVEC];
+					uint32_t vecCnt = buf.getIOVecs(
+						vec, MAX_IOVEC, num - ret
+					);
+					for (uint32_t i = 0; i < vecCnt; ++i) {
+						len += vec[i].m_len;
+					}
+					cnt = m_obj->getSocket()->write(
+						vec, vecCnt
+					);
+				}
+				buf.consume(cnt);
+				ret += cnt;
+				if (cnt < len) {
+					break;
+				}
+			}
 
-			if (ret < m_obj->m_outBuffer->size()) {
-				m_obj->m_outBuffer->erase(0, ret);
-			} else {
-				m_obj->m_outBuffer->clear();
+			if (m_obj->m_outBuffer->empty()) {
 				invalidate();
 			}
 
@@ -773,20 +841,26 @@ public:
 		 * @return            Amount of data actually received
 		 *
 		 * If the remote peer is marked as no_limit in SchedBase, we
-		 * ignore the limit here, and recevive max 100k with each block.
+		 * ignore the limit here. The data is read directly into the
+		 * socket's input buffer, at most RecvBuffer::BLOCK_SIZE bytes
+		 * at a time, and no more than the socket has available, so the
+		 * buffer only grows as much as the received data needs.
 		 */
 		virtual uint32_t doRecv(uint32_t amount) {
-		 	// static input buffer
-			static char buf[SchedBase::INPUT_BUFSIZE];
-
 			uint32_t peer = m_obj->getSocket()->getPeer().getIp();
 			bool isLimited = SchedBase::instance().isLimited(peer);
 
-			if (!isLimited || amount > SchedBase::INPUT_BUFSIZE) {
-				amount = SchedBase::INPUT_BUFSIZE;
+			if (!isLimited || amount > RecvBuffer::BLOCK_SIZE) {
+				amount = RecvBuffer::BLOCK_SIZE;
+			}
+			uint32_t avail = m_obj->getSocket()->available();
+			if (avail && avail < amount) {
+				amount = avail;
 			}
 
-			int ret = m_obj->getSocket()->read(buf, amount);
+			RecvBuffer &in = *m_obj->m_inBuffer;
+			int ret = m_obj->getSocket()->read(in.reserve(amount), amount);
+			in.commit(ret);
 
 			if (ret == 0) {  // Got no data - mh ?
 				return 0;
@@ -794,7 +868,6 @@ public:
 
 			*m_obj->m_downSpeed += ret;
 			m_obj->addDownloaded(ret);
-			m_obj->m_inBuffer->append(buf, ret);
 
 			// if no limit is applied, don't return count either
 			return isLimited ? ret : 0;
@@ -954,6 +1027,21 @@ public:
 		ImplPtr, SchedBase::ReqBase*
 	>::iterator RIter;
 
+	/**
+	 * Make sure there's a valid upload request for a socket that has
+	 * outgoing data queued.
+	 *
+	 * @param ptr     Socket that has outgoing data
+	 */
+	static void scheduleUpload(SSocketWrapperPtr ptr) {
+		RIter i = s_upReqs.find(ptr->getSocket());
+		if (i != s_upReqs.end()) {
+			(*i).second->setValid(true);
+		} else if (ptr->getSocket()->isConnected()) {
+			SchedBase::instance().addUploadReq(new UploadReq(ptr));
+		}
+	}
+
 	/**
 	 * Invalidate all requests related to a specific socket
 	 *
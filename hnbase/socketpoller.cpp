@@ -0,0 +1,284 @@
+/*
+ *  Copyright (C) 2004-2006 Alo Sarv <madcat_@users.sourceforge.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/**
+ * \file socketpoller.cpp Implementation of SocketWatcher polling backends
+ */
+
+#include <hnbase/pch.h>
+#include <hnbase/socketpoller.h>
+#include <hnbase/log.h>
+
+#ifdef WIN32
+	#include <winsock2.h>
+#else
+	#include <sys/time.h>
+	#include <sys/types.h>
+	#include <unistd.h>
+	#include <errno.h>
+#endif
+
+namespace Detail {
+
+// SocketPoller class
+// ------------------
+SocketPoller::SocketPoller() {}
+SocketPoller::~SocketPoller() {}
+
+SocketPoller* SocketPoller::create(const std::string &name) {
+#ifdef HAVE_EPOLL
+	if (name.empty() || name == "epoll") {
+		try {
+			return new EpollPoller;
+		} catch (SocketError &e) {
+			logDebug(
+				boost::format("Unable to use epoll: %s")
+				% e.what()
+			);
+			if (!name.empty()) {
+				return 0;
+			}
+		}
+	}
+#endif
+	if (name.empty() || name == "select") {
+		return new SelectPoller;
+	}
+	return 0;
+}
+
+// SelectPoller class
+// ------------------
+SelectPoller::SelectPoller() {}
+
+void SelectPoller::set(SOCKET s, uint8_t events) {
+#ifndef WIN32
+	// FD_SET() on a descriptor beyond FD_SETSIZE corrupts the stack
+	if (s >= FD_SETSIZE) {
+		logWarning(boost::format(
+			"select(): Socket %d exceeds FD_SETSIZE (%d), "
+			"it will not be polled."
+		) % s % FD_SETSIZE);
+		return;
+	}
+#endif
+	m_interest[s] = events;
+}
+
+void SelectPoller::remove(SOCKET s) {
+	m_interest.erase(s);
+}
+
+int SelectPoller::poll(uint32_t timeout, ReadyList *ready) {
+	fd_set rfds;
+	fd_set wfds;
+	fd_set efds;
+	FD_ZERO(&rfds);
+	FD_ZERO(&wfds);
+	FD_ZERO(&efds);
+
+	// Temporary variable to keep track of highest-numbered socket,
+	// needed later for passing to select().
+	SOCKET highest = 0;
+	for (Iter i = m_interest.begin(); i != m_interest.end(); ++i) {
+		if ((*i).second & PE_READ) {
+			FD_SET((*i).first, &rfds);
+		}
+		if ((*i).second & PE_WRITE) {
+			FD_SET((*i).first, &wfds);
+		}
+		if ((*i).second & PE_EXCEPT) {
+			FD_SET((*i).first, &efds);
+		}
+		if ((*i).first > highest) {
+			highest = (*i).first;
+		}
+	}
+
+	timeval tv;
+	tv.tv_sec = timeout / 1000;
+	tv.tv_usec = (timeout % 1000) * 1000;
+
+	int ret = select(highest + 1, &rfds, &wfds, &efds, &tv);
+	if (ret <= 0) {
+		return ret < 0 ? -1 : 0;
+	}
+
+#ifdef WIN32
+	std::map<SOCKET, uint8_t> tmp;
+	for (unsigned int i = 0; i < rfds.fd_count; i++) {
+		tmp[rfds.fd_array[i]] |= PE_READ;
+	}
+	for (unsigned int i = 0; i < wfds.fd_count; i++) {
+		tmp[wfds.fd_array[i]] |= PE_WRITE;
+	}
+	for (unsigned int i = 0; i < efds.fd_count; i++) {
+		tmp[efds.fd_array[i]] |= PE_EXCEPT;
+	}
+	ready->insert(ready->end(), tmp.begin(), tmp.end());
+#else
+	for (Iter i = m_interest.begin(); i != m_interest.end(); ++i) {
+		uint8_t events = 0;
+		if (FD_ISSET((*i).first, &rfds)) {
+			events |= PE_READ;
+		}
+		if (FD_ISSET((*i).first, &wfds)) {
+			events |= PE_WRITE;
+		}
+		if (FD_ISSET((*i).first, &efds)) {
+			events |= PE_EXCEPT;
+		}
+		if (events) {
+			ready->push_back(std::make_pair((*i).first, events));
+		}
+	}
+#endif
+	return ready->size();
+}
+
+#ifdef HAVE_EPOLL
+
+// EpollPoller class
+// -----------------
+static uint32_t toEpoll(uint8_t events) {
+	uint32_t ret = 0;
+	if (events & SocketPoller::PE_READ) {
+		ret |= EPOLLIN;
+	}
+	if (events & SocketPoller::PE_WRITE) {
+		ret |= EPOLLOUT;
+	}
+	if (events & SocketPoller::PE_EXCEPT) {
+		ret |= EPOLLPRI;
+	}
+	return ret;
+}
+
+EpollPoller::EpollPoller() : m_epfd(epoll_create(1024)), m_events(256) {
+	if (m_epfd == -1) {
+		throw SocketError(
+			(boost::format("epoll_create(): %s") % strerror(errno)).str()
+		);
+	}
+}
+
+EpollPoller::~EpollPoller() {
+	::close(m_epfd);
+}
+
+void EpollPoller::set(SOCKET s, uint8_t events) {
+	CHECK_RET(s >= 0);
+	if (static_cast<size_t>(s) >= m_interest.size()) {
+		m_interest.resize(s + 1, -1);
+	}
+	if (m_interest[s] == events) {
+		return;
+	}
+
+	epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = toEpoll(events);
+	ev.data.fd = s;
+
+	// epoll always reports EPOLLERR/EPOLLHUP, even with empty interest,
+	// so a socket we're not interested in would wake up every wait.
+	// Take it out of the kernel set instead, and re-add when needed.
+	if (!events) {
+		if (m_interest[s] > 0) {
+			epoll_ctl(m_epfd, EPOLL_CTL_DEL, s, &ev);
+		}
+		m_interest[s] = 0;
+		return;
+	}
+
+	int op = m_interest[s] > 0 ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+	int ret = epoll_ctl(m_epfd, op, s, &ev);
+
+	// The descriptor may have been closed and re-used by the OS before
+	// we got to remove it, which makes our cached state stale.
+	if (ret == -1 && op == EPOLL_CTL_ADD && errno == EEXIST) {
+		ret = epoll_ctl(m_epfd, EPOLL_CTL_MOD, s, &ev);
+	} else if (ret == -1 && op == EPOLL_CTL_MOD && errno == ENOENT) {
+		ret = epoll_ctl(m_epfd, EPOLL_CTL_ADD, s, &ev);
+	}
+	if (ret == -1) {
+		logDebug(
+			boost::format("epoll_ctl(%d): %s") % s % strerror(errno)
+		);
+		m_interest[s] = -1;
+	} else {
+		m_interest[s] = events;
+	}
+}
+
+void EpollPoller::remove(SOCKET s) {
+	if (s < 0 || static_cast<size_t>(s) >= m_interest.size()) {
+		return;
+	}
+	if (m_interest[s] > 0) {
+		// Fails with EBADF if the socket was already closed (which
+		// implicitly removes it from the set); that's fine.
+		epoll_event ev;
+		epoll_ctl(m_epfd, EPOLL_CTL_DEL, s, &ev);
+	}
+	m_interest[s] = -1;
+}
+
+int EpollPoller::poll(uint32_t timeout, ReadyList *ready) {
+	int ret = epoll_wait(m_epfd, &m_events[0], m_events.size(), timeout);
+	if (ret == -1) {
+		return errno == EINTR ? 0 : -1;
+	}
+	for (int i = 0; i < ret; ++i) {
+		SOCKET s = m_events[i].data.fd;
+		uint32_t ev = m_events[i].events;
+		int16_t interest = m_interest[s];
+		if (interest <= 0) {
+			continue;
+		}
+		uint8_t events = 0;
+		if (ev & EPOLLIN) {
+			events |= PE_READ;
+		}
+		if (ev & EPOLLOUT) {
+			events |= PE_WRITE;
+		}
+		if (ev & EPOLLPRI) {
+			events |= PE_EXCEPT;
+		}
+		// select() reports errors and hangups as readability and
+		// writability; SocketWatcher relies on that to detect lost
+		// connections and failed connect()s.
+		if (ev & (EPOLLERR | EPOLLHUP)) {
+			events |= PE_READ | PE_WRITE;
+		}
+		events &= interest;
+		if (events) {
+			ready->push_back(std::make_pair(s, events));
+		}
+	}
+	// All slots used - grow the buffer so next time we get more at once
+	if (static_cast<size_t>(ret) == m_events.size()) {
+		m_events.resize(m_events.size() * 2);
+	}
+	return ready->size();
+}
+
+#endif // HAVE_EPOLL
+
+} // end namespace Detail
@@ -0,0 +1,145 @@
+/*
+ *  Copyright (C) 2004-2006 Alo Sarv <madcat_@users.sourceforge.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef __SOCKETPOLLER_H__
+#define __SOCKETPOLLER_H__
+
+/**
+ * \file socketpoller.h Interface for SocketWatcher polling backends
+ */
+
+#include <hnbase/osdep.h>
+#include <hnbase/sockets.h>
+#include <boost/noncopyable.hpp>
+#include <map>
+#include <vector>
+
+#ifdef __linux__
+	#define HAVE_EPOLL
+	#include <sys/epoll.h>
+#endif
+
+namespace Detail {
+
+/**
+ * SocketPoller is the abstract interface between SocketWatcher and the
+ * operating system's readiness notification facility. SocketWatcher tells the
+ * poller which events it is currently interested in for each socket, and only
+ * when that interest changes; the poller reports back sockets which became
+ * ready. This keeps the cost of a single poll proportional to the number of
+ * sockets that actually have events, as long as the backend supports it.
+ *
+ * All backends are level-triggered - a socket stays ready until the condition
+ * is cleared or the interest for the event is removed.
+ */
+class HNBASE_EXPORT SocketPoller : public boost::noncopyable {
+public:
+	//! Events a socket can be polled for
+	enum PollEvent {
+		PE_READ   = 0x01,    //!< Readable / incoming connection
+		PE_WRITE  = 0x02,    //!< Writable / connect() completed
+		PE_EXCEPT = 0x04     //!< Exceptional condition (OOB data)
+	};
+
+	//! Sockets that became ready, along with the PollEvent flags
+	typedef std::vector<std::pair<SOCKET, uint8_t> > ReadyList;
+
+	/**
+	 * Construct a poller by name.
+	 *
+	 * @param name     Backend name, "select" or "epoll"; if empty, the
+	 *                 best backend available on this platform is used.
+	 * @return         New poller, or 0 if the backend is not available.
+	 */
+	static SocketPoller* create(const std::string &name = "");
+
+	virtual ~SocketPoller();
+
+	/**
+	 * Register a socket or change the events it's polled for. Passing
+	 * zero events stops polling the socket until events are set again.
+	 *
+	 * @param s        Socket to be polled
+	 * @param events   Bitfield of PollEvent values
+	 */
+	virtual void set(SOCKET s, uint8_t events) = 0;
+
+	/**
+	 * Stop polling a socket. Safe to call on sockets which were already
+	 * closed by the OS.
+	 */
+	virtual void remove(SOCKET s) = 0;
+
+	/**
+	 * Wait for events.
+	 *
+	 * @param timeout   Maximum time to wait, in milliseconds
+	 * @param ready     Receives sockets with pending events
+	 * @return          Number of ready sockets, or -1 on error
+	 */
+	virtual int poll(uint32_t timeout, ReadyList *ready) = 0;
+
+	//! \returns Name of the backend
+	virtual const char* getName() const = 0;
+protected:
+	SocketPoller();
+};
+
+/**
+ * Portable select()-based backend. Since select() has no persistent state in
+ * the kernel, the interest sets are rebuilt on each poll, and the number of
+ * sockets is limited by FD_SETSIZE.
+ */
+class HNBASE_EXPORT SelectPoller : public SocketPoller {
+public:
+	SelectPoller();
+	virtual void set(SOCKET s, uint8_t events);
+	virtual void remove(SOCKET s);
+	virtual int poll(uint32_t timeout, ReadyList *ready);
+	virtual const char* getName() const { return "select"; }
+private:
+	std::map<SOCKET, uint8_t> m_interest;      //!< socket -> events
+	typedef std::map<SOCKET, uint8_t>::iterator Iter;
+};
+
+#ifdef HAVE_EPOLL
+/**
+ * Linux epoll()-based backend. The interest set lives in kernel and is only
+ * updated through set()/remove(), so a poll costs O(ready sockets) instead of
+ * O(all sockets), and there is no upper limit on the number of sockets.
+ */
+class HNBASE_EXPORT EpollPoller : public SocketPoller {
+public:
+	//! \throws SocketError if epoll_create() fails
+	EpollPoller();
+	~EpollPoller();
+	virtual void set(SOCKET s, uint8_t events);
+	virtual void remove(SOCKET s);
+	virtual int poll(uint32_t timeout, ReadyList *ready);
+	virtual const char* getName() const { return "epoll"; }
+private:
+	int m_epfd;                       //!< epoll file descriptor
+	//! Indexed by fd; -1 if unused, 0 if known but not in kernel set
+	std::vector<int16_t> m_interest;
+	std::vector<epoll_event> m_events;//!< Buffer for epoll_wait() output
+};
+#endif
+
+} // end namespace Detail
+
+#endif
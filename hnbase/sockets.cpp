@@ -23,6 +23,7 @@
 #include <hnbase/pch.h>
 #include <hnbase/osdep.h>
 #include <hnbase/sockets.h>
+#include <hnbase/socketpoller.h>
 #include <hnbase/log.h>
 #include <stdexcept>
 
@@ -32,6 +33,11 @@
 	typedef int socklen_t;
 #else
 	#include <sys/socket.h>
+	#include <sys/uio.h>
+	#include <sys/ioctl.h>
+	#ifdef __linux__
+		#include <sys/sendfile.h>
+	#endif
 	#include <sys/un.h>
 	#include <fcntl.h>
 	#include <netinet/in.h>
@@ -43,6 +49,9 @@
 	#define MSG_NOSIGNAL 0
 #endif
 
+//! Bounce buffer size for sendFile() on platforms lacking sendfile()
+static const uint32_t MAX_FILE_BUF = 64 * 1024;
+
 /**
  * Socket error codes
  * Define our internal socket error codes from platform-specific codes for
@@ -355,6 +364,11 @@ void SocketClient::disconnect() {
 	m_peer = IPV4Address();     //!< Reset peer
 }
 
+void SocketClient::setTimeout(uint32_t t) {
+	m_timeout = EventMain::instance().getTick() + t;
+	SocketWatcher::instance().addTimeout(this);
+}
+
 // Read data from socket
 uint32_t SocketClient::read(void *buffer, uint32_t length) {
 	if (!m_connected) {
@@ -370,6 +384,7 @@ uint32_t SocketClient::read(void *buffer, uint32_t length) {
 		m_socket, reinterpret_cast<char*>(buffer), length, MSG_NOSIGNAL
 	);
 	m_hasData = false;
+	SocketWatcher::instance().setDirty(m_socket);
 	if (ret == SOCKET_ERROR) {
 		ret = 0;
 		if (getLastError() != SOCK_EAGAIN) {
@@ -383,6 +398,21 @@ uint32_t SocketClient::read(void *buffer, uint32_t length) {
 	return ret;
 }
 
+uint32_t SocketClient::available() const {
+#ifdef WIN32
+	u_long ret = 0;
+	if (ioctlsocket(m_socket, FIONREAD, &ret) == SOCKET_ERROR) {
+		return 0;
+	}
+#else
+	int ret = 0;
+	if (ioctl(m_socket, FIONREAD, &ret) == -1 || ret < 0) {
+		return 0;
+	}
+#endif
+	return ret;
+}
+
 // Write data to socket
 uint32_t SocketClient::write(const char *buffer, uint32_t length) {
 	if (!m_connected) {
@@ -394,6 +424,58 @@ uint32_t SocketClient::write(const char *buffer, uint32_t length) {
 	}
 	int ret = ::send(m_socket, buffer, length, MSG_NOSIGNAL);
 	m_writable = false;
+	SocketWatcher::instance().setDirty(m_socket);
+	if (ret == SOCKET_ERROR) {
+		ret = 0;
+		if (getLastError() != SOCK_EAGAIN) {
+			close();
+			m_erronous = true;
+			m_connected = false;
+			m_connecting = false;
+			SocketWatcher::instance().postEvent(this, SOCK_LOST);
+		}
+	}
+	return ret;
+}
+
+// Write data from several buffers to socket
+uint32_t SocketClient::write(const IOVec *vec, uint32_t count) {
+	if (!m_connected) {
+		throw SocketError("Attempt to write to a disconnected socket.");
+	} else if (m_connecting) {
+		throw SocketError("Attempt to write to a connecting socket.");
+	} else if (m_erronous) {
+		throw SocketError("Attempt to write to an erronous socket.");
+	}
+	if (count > MAX_IOVEC) {
+		count = MAX_IOVEC;
+	}
+#ifdef WIN32
+	WSABUF bufs[MAX_IOVEC];
+	for (uint32_t i = 0; i < count; ++i) {
+		bufs[i].buf = const_cast<char*>(vec[i].m_data);
+		bufs[i].len = vec[i].m_len;
+	}
+	DWORD sent = 0;
+	int ret = WSASend(m_socket, bufs, count, &sent, 0, 0, 0);
+	if (ret != SOCKET_ERROR) {
+		ret = sent;
+	}
+#else
+	iovec bufs[MAX_IOVEC];
+	for (uint32_t i = 0; i < count; ++i) {
+		bufs[i].iov_base = const_cast<char*>(vec[i].m_data);
+		bufs[i].iov_len = vec[i].m_len;
+	}
+	msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = bufs;
+	msg.msg_iovlen = count;
+	// writev() has no way of suppressing SIGPIPE, hence sendmsg()
+	int ret = ::sendmsg(m_socket, &msg, MSG_NOSIGNAL);
+#endif
+	m_writable = false;
+	SocketWatcher::instance().setDirty(m_socket);
 	if (ret == SOCKET_ERROR) {
 		ret = 0;
 		if (getLastError() != SOCK_EAGAIN) {
@@ -407,6 +489,51 @@ uint32_t SocketClient::write(const char *buffer, uint32_t length) {
 	return ret;
 }
 
+// Write data from file to socket. Without sendfile(), the data goes through
+// a bounce buffer; whatever the socket doesn't take is simply read again by
+// the next call.
+uint32_t SocketClient::sendFile(int fd, uint64_t offset, uint32_t len) {
+	if (!m_connected) {
+		throw SocketError("Attempt to write to a disconnected socket.");
+	} else if (m_connecting) {
+		throw SocketError("Attempt to write to a connecting socket.");
+	} else if (m_erronous) {
+		throw SocketError("Attempt to write to an erronous socket.");
+	}
+#ifdef __linux__
+	off64_t pos = offset;
+	int ret = ::sendfile64(m_socket, fd, &pos, len);
+#else
+	char buf[MAX_FILE_BUF];
+	if (len > MAX_FILE_BUF) {
+		len = MAX_FILE_BUF;
+	}
+	#ifdef WIN32
+	int ret = SOCKET_ERROR;
+	if (static_cast<uint64_t>(lseek64(fd, offset, SEEK_SET)) == offset) {
+		ret = ::read(fd, buf, len);
+	}
+	#else
+	int ret = ::pread64(fd, buf, len, offset);
+	#endif
+	if (ret > 0) {
+		ret = ::send(m_socket, buf, ret, MSG_NOSIGNAL);
+	}
+#endif
+	m_writable = false;
+	SocketWatcher::instance().setDirty(m_socket);
+	// nothing sent without an error means the file was truncated, so the
+	// queued region can never be sent - treat it as a failure too
+	if (!ret || (ret == SOCKET_ERROR && getLastError() != SOCK_EAGAIN)) {
+		close();
+		m_erronous = true;
+		m_connected = false;
+		m_connecting = false;
+		SocketWatcher::instance().postEvent(this, SOCK_LOST);
+	}
+	return ret > 0 ? ret : 0;
+}
+
 IPV4Address SocketClient::getAddr() const {
 	sockaddr_in name;
 	socklen_t sz = sizeof(name);
@@ -585,6 +712,7 @@ SocketClient* SocketServer::accept(SCEventHandler ehandler) {
 
 	client->setHandler(ehandler);
 	m_incoming = false;
+	SocketWatcher::instance().setDirty(m_socket);
 
 	return client;
 }
@@ -695,6 +823,7 @@ uint32_t UDPSocket::recv(char *buf, uint32_t len, IPV4Address *from) {
 
 	if (ret == SOCKET_ERROR) {
 		m_hasData = false;
+		SocketWatcher::instance().setDirty(m_socket);
 		if (getLastError() != SOCK_EAGAIN) {
 			throw SocketError(socketError("recvfrom(): "));
 		} else {
@@ -713,6 +842,7 @@ uint32_t UDPSocket::recv(char *buf, uint32_t len, IPV4Address *from) {
 	);
 	if (ret2 <= 0) {
 		m_hasData = false;
+		SocketWatcher::instance().setDirty(m_socket);
 	}
 
 	return ret;
@@ -762,7 +892,7 @@ uint32_t UDPSocket::send(const std::string &data, IPV4Address to) {
 // SocketWatcher class - Performs sockets polling and events dispatching.
 // -------------------
 // constructors/destructors
-SocketWatcher::SocketWatcher() {
+SocketWatcher::SocketWatcher() : m_poller(Detail::SocketPoller::create()) {
 //	Log::instance().enableTraceMask(TRACE_SOCKET, "socket");
 }
 SocketWatcher::~SocketWatcher() {}
@@ -791,6 +921,34 @@ SocketWatcher& SocketWatcher::instance() {
 	return s;
 }
 
+bool SocketWatcher::setPoller(const std::string &name) {
+	Detail::SocketPoller *poller = Detail::SocketPoller::create(name);
+	if (!poller) {
+		return false;
+	}
+	m_poller.reset(poller);
+
+	// new backend knows nothing about existing sockets
+	for (SCIter i = m_clients.begin(); i != m_clients.end(); ++i) {
+		setDirty((*i).first);
+	}
+	for (SSIter i = m_servers.begin(); i != m_servers.end(); ++i) {
+		setDirty((*i).first);
+	}
+	for (SUIter i = m_udpSockets.begin(); i != m_udpSockets.end(); ++i) {
+		setDirty((*i).first);
+	}
+	logDebug(
+		boost::format("SocketWatcher: Using %s() for polling.")
+		% m_poller->getName()
+	);
+	return true;
+}
+
+std::string SocketWatcher::getPoller() const {
+	return m_poller->getName();
+}
+
 // Add a socket for polling
 void SocketWatcher::doAddSocket(SocketServer *socket) {
 	CHECK_THROW(socket != 0);
@@ -799,7 +957,8 @@ void SocketWatcher::doAddSocket(SocketServer *socket) {
 		% socket->getSocket()
 	);
 	m_servers[socket->getSocket()] = socket;
-	m_sockets.insert(socket->getSocket());
+	m_poller->remove(socket->getSocket());
+	setDirty(socket->getSocket());
 }
 
 // Add a socket for polling
@@ -810,7 +969,8 @@ void SocketWatcher::doAddSocket(SocketClient *socket) {
 		% socket->getSocket()
 	);
 	m_clients[socket->getSocket()] = socket;
-	m_sockets.insert(socket->getSocket());
+	m_poller->remove(socket->getSocket());
+	setDirty(socket->getSocket());
 }
 
 void SocketWatcher::doAddSocket(UDPSocket *socket) {
@@ -821,7 +981,8 @@ void SocketWatcher::doAddSocket(UDPSocket *socket) {
 		% socket->getSocket()
 	);
 	m_udpSockets[socket->getSocket()] = socket;
-	m_sockets.insert(socket->getSocket());
+	m_poller->remove(socket->getSocket());
+	setDirty(socket->getSocket());
 }
 
 // Remove a socket from polled sockets list
@@ -847,7 +1008,7 @@ void SocketWatcher::cleanupSockets() {
 		SSIter i = m_servers.find(toRemove->getSocket());
 		if (i != m_servers.end() && (*i).second == toRemove) {
 			m_servers.erase(i);
-			m_sockets.erase(toRemove->getSocket());
+			m_poller->remove(toRemove->getSocket());
 		}
 		if (toRemove->toDelete()) {
 			delete toRemove;
@@ -861,9 +1022,10 @@ void SocketWatcher::cleanupSockets() {
 		SCIter i = m_clients.find(toRemove->getSocket());
 		if (i != m_clients.end() && (*i).second == toRemove) {
 			m_clients.erase(i);
-			m_sockets.erase(toRemove->getSocket());
+			m_poller->remove(toRemove->getSocket());
 		}
 		if (toRemove->toDelete()) {
+			m_timed.erase(toRemove);
 			delete toRemove;
 		}
 		++it2;
@@ -875,7 +1037,7 @@ void SocketWatcher::cleanupSockets() {
 		SUIter i = m_udpSockets.find(toRemove->getSocket());
 		if (i != m_udpSockets.end() && (*i).second == toRemove) {
 			m_udpSockets.erase(i);
-			m_sockets.erase(toRemove->getSocket());
+			m_poller->remove(toRemove->getSocket());
 		}
 		if (toRemove->toDelete()) {
 			delete toRemove;
@@ -894,94 +1056,101 @@ void SocketWatcher::cleanupSockets() {
 	m_udpToRemove.clear();
 }
 
-// Poll listed sockets
-//
-// We only add sockets to the sets for which we are certain that the select()
-// operation wouldn't return immediately, e.g. if a socket already has incoming
-// data, we don't add it to the sets, since that would cause select() to return
-// instantly. The main reason for this is safety - if client doesn't read the
-// data out of a readable socket, or accept an incoming connection, we would
-// detect the socket readable again in next select(), re-post the event etc.
-// Uff. Better safe than sorry - once the data has been read out, the
-// SocketClient/SocketServer re-enable the flags so we'll start polling it
-// again.
-void SocketWatcher::process() {
-	fd_set rfds;
-	fd_set wfds;
-	fd_set efds;
-	FD_ZERO(&rfds);
-	FD_ZERO(&wfds);
-	FD_ZERO(&efds);
+// Expire timeouts. Only clients which have had a timeout set are checked, and
+// they are dropped from the set once the timeout is cleared or fired.
+void SocketWatcher::checkTimeouts() {
 	uint64_t curTick = EventMain::instance().getTick();
-
-	cleanupSockets();
-
-	// Temporary variable to keep track of highest-numbered socket,
-	// needed later for passing to select().
-	SOCKET highest = 0;
-
-	// Add all servers. Note: Servers can't become writable.
-	for (SSIter i = m_servers.begin(); i != m_servers.end(); ++i) {
-		// Only add the ones which don't have any incoming pending
-		if (!(*i).second->m_incoming) {
-			FD_SET((*i).first, &rfds);
-		}
-		// Only add those which are not erronous
-		if (!(*i).second->m_erronous) {
-			FD_SET((*i).first, &efds);
-		}
-		if ((*i).first > highest) {
-			highest = (*i).first;
+	std::set<SocketClient*>::iterator it(m_timed.begin());
+	while (it != m_timed.end()) {
+		SocketClient *c = *it;
+		if (!c->m_timeout) {
+			m_timed.erase(it++);
+			continue;
+		} else if (c->m_timeout >= curTick) {
+			++it;
+			continue;
 		}
-	}
-	// Add all clients
-	for (SCIter i = m_clients.begin(); i != m_clients.end(); ++i) {
-		SocketClient *c = (*i).second;
-		if (c->m_timeout && c->m_timeout < curTick) {
+		m_timed.erase(it++);
+		SCIter i = m_clients.find(c->getSocket());
+		if (i != m_clients.end() && (*i).second == c) {
 			// Timeout is over
 			postEvent(c, SOCK_TIMEOUT);
 			c->close();
 			c->m_timeout = 0;
-			continue;
 		}
+	}
+}
+
+// We only poll sockets for events for which we are certain that the poll
+// operation wouldn't return immediately, e.g. if a socket already has incoming
+// data, we don't poll it for readability, since that would cause poll to return
+// instantly. The main reason for this is safety - if client doesn't read the
+// data out of a readable socket, or accept an incoming connection, we would
+// detect the socket readable again in next poll, re-post the event etc.
+// Uff. Better safe than sorry - once the data has been read out, the
+// SocketClient/SocketServer re-enable the flags so we'll start polling it
+// again.
+void SocketWatcher::updateInterest(SOCKET sock) {
+	using Detail::SocketPoller;
+	uint8_t events = 0;
 
-		// Only add the ones which don't have incoming data and are
+	SCIter i = m_clients.find(sock);
+	if (i != m_clients.end()) {
+		SocketClient *c = (*i).second;
+		// Only the ones which don't have incoming data and are
 		// connected
 		if (!c->m_hasData && c->m_connected) {
-			FD_SET((*i).first, &rfds);
+			events |= SocketPoller::PE_READ;
 		}
-		// Only add the ones which are in connecting/connected
-		// state
+		// Only the ones which are in connecting/connected state
 		if ((c->m_connecting || c->m_connected) && !c->m_writable) {
-			FD_SET((*i).first, &wfds);
+			events |= SocketPoller::PE_WRITE;
 		}
-		// Only add the ones that aren't erronous already
+		// Only the ones that aren't erronous already
 		if (!c->m_erronous && c->m_connected) {
-			FD_SET((*i).first, &efds);
-		}
-		if ((*i).first > highest) {
-			highest = (*i).first;
+			events |= SocketPoller::PE_EXCEPT;
 		}
+		m_poller->set(sock, events);
+		return;
 	}
 
-	// Add all UDP sockets
-	for (SUIter i = m_udpSockets.begin(); i != m_udpSockets.end(); ++i) {
-		if (!(*i).second->m_hasData) {
-			FD_SET((*i).first, &rfds);
+	// Note: Servers can't become writable.
+	SSIter j = m_servers.find(sock);
+	if (j != m_servers.end()) {
+		if (!(*j).second->m_incoming) {
+			events |= SocketPoller::PE_READ;
 		}
-		if (!(*i).second->m_erronous) {
-			FD_SET((*i).first, &efds);
+		if (!(*j).second->m_erronous) {
+			events |= SocketPoller::PE_EXCEPT;
 		}
-		if ((*i).first > highest) {
-			highest = (*i).first;
+		m_poller->set(sock, events);
+		return;
+	}
+
+	SUIter k = m_udpSockets.find(sock);
+	if (k != m_udpSockets.end()) {
+		if (!(*k).second->m_hasData) {
+			events |= SocketPoller::PE_READ;
 		}
+		if (!(*k).second->m_erronous) {
+			events |= SocketPoller::PE_EXCEPT;
+		}
+		m_poller->set(sock, events);
 	}
+}
 
+// Poll listed sockets
+void SocketWatcher::process() {
+	using Detail::SocketPoller;
+
+	cleanupSockets();
+	checkTimeouts();
 	cleanupSockets();
 
-	timeval tv;
-	tv.tv_sec = 0;
-	tv.tv_usec = 50000;
+	for (SIter i = m_dirty.begin(); i != m_dirty.end(); ++i) {
+		updateInterest(*i);
+	}
+	m_dirty.clear();
 
 #ifdef WIN32
 	Sleep(50);
@@ -989,31 +1158,21 @@ void SocketWatcher::process() {
 	usleep(50000);
 #endif
 
-	int ret = select(highest + 1, &rfds, &wfds, &efds, &tv);
+	SocketPoller::ReadyList ready;
+	int ret = m_poller->poll(50, &ready);
 	if (ret > 0) {
-#ifdef WIN32
-		for (unsigned int i = 0; i < rfds.fd_count; i++) {
-			handleReadableSocket(rfds.fd_array[i]);
-		}
-		for (unsigned int i = 0; i < wfds.fd_count; i++) {
-			handleWritableSocket(wfds.fd_array[i]);
-		}
-		for (unsigned int i = 0; i < efds.fd_count; i++) {
-			handleErronousSocket(efds.fd_array[i]);
-		}
-#else
-		for (SIter i = m_sockets.begin(); i != m_sockets.end(); i++) {
-			if (FD_ISSET(*i, &rfds)) {
-				handleReadableSocket(*i);
-			} else if (FD_ISSET(*i, &wfds)) {
-				handleWritableSocket(*i);
-			} else if (FD_ISSET(*i, &efds)) {
-				handleErronousSocket(*i);
+		SocketPoller::ReadyList::iterator i = ready.begin();
+		for (; i != ready.end(); ++i) {
+			if ((*i).second & SocketPoller::PE_READ) {
+				handleReadableSocket((*i).first);
+			} else if ((*i).second & SocketPoller::PE_WRITE) {
+				handleWritableSocket((*i).first);
+			} else if ((*i).second & SocketPoller::PE_EXCEPT) {
+				handleErronousSocket((*i).first);
 			}
 		}
-#endif
 	} else if (ret == SOCKET_ERROR) {
-		socketError("select(): ");
+		socketError(std::string(m_poller->getName()) + "(): ");
 	}
 
 	// emit events
@@ -1031,6 +1190,7 @@ void SocketWatcher::process() {
 // * If its a connected stream socket, the connection may have been closed
 void SocketWatcher::handleReadableSocket(SOCKET sock) {
 	logTrace(TRACE_SOCKET, boost::format("Socket %d is readable.") % sock);
+	setDirty(sock);
 
 	// First determine who governs the socket. Need two map lookups here.
 	SCIter i = m_clients.find(sock);
@@ -1103,6 +1263,7 @@ void SocketWatcher::handleReadableSocket(SOCKET sock) {
 // with queued data became (again) writable
 void SocketWatcher::handleWritableSocket(SOCKET sock) {
 	logTrace(TRACE_SOCKET, boost::format("Socket %d is writable.") % sock);
+	setDirty(sock);
 
 	SCIter i = m_clients.find(sock);
 	if (i == m_clients.end()) {
@@ -1155,6 +1316,7 @@ void SocketWatcher::handleWritableSocket(SOCKET sock) {
 // information.
 void SocketWatcher::handleErronousSocket(SOCKET sock) {
 	logTrace(TRACE_SOCKET, boost::format("Socket %d is erronous.") % sock);
+	setDirty(sock);
 
 	SCIter i = m_clients.find(sock);
 	if (i == m_clients.end()) {
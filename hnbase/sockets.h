@@ -55,8 +55,10 @@
 #include <hnbase/event.h>
 #include <hnbase/ipv4addr.h>
 #include <hnbase/fwd.h>
+#include <hnbase/bufferchain.h>
 #include <boost/function.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <list>
 #include <map>
 #include <set>
@@ -68,6 +70,10 @@
 	typedef int SOCKET;
 #endif
 
+namespace Detail {
+	class SocketPoller;
+}
+
 /**
  * Exception class
  */
@@ -198,6 +204,32 @@ public:
 	 */
 	uint32_t  write(const char *buffer, uint32_t length);
 
+	/**
+	 * Scatter/gather version of write(), sends the contents of several
+	 * buffers with a single system call.
+	 *
+	 * @param vec       Array of buffers to be written, in order
+	 * @param count     Number of elements in vec
+	 * @return          Number of bytes written to socket.
+	 *
+	 * \throws SocketError if something goes wrong.
+	 */
+	uint32_t  write(const IOVec *vec, uint32_t count);
+
+	/**
+	 * Send a region of an open file. Where the platform supports it, the
+	 * data is passed from the file to the socket inside the kernel
+	 * (sendfile()), without being copied through userspace.
+	 *
+	 * @param fd        Descriptor of the file to send data from
+	 * @param offset    File offset where to start sending
+	 * @param len       Amount of data to send
+	 * @return          Number of bytes written to socket.
+	 *
+	 * \throws SocketError if something goes wrong.
+	 */
+	uint32_t  sendFile(int fd, uint64_t offset, uint32_t len);
+
 	/**
 	 * Read data from socket
 	 *
@@ -209,6 +241,12 @@ public:
 	 */
 	uint32_t read(void *buffer, uint32_t length);
 
+	/**
+	 * @returns Number of bytes that can be read from the socket without
+	 *          blocking, or 0 if unknown
+	 */
+	uint32_t available() const;
+
 	/**
 	 * Make an outgoing connection.
 	 *
@@ -246,9 +284,7 @@ public:
 	 *
 	 * @param t      Timeout, in milliseconds
 	 */
-	void setTimeout(uint32_t t) {
-		m_timeout = EventMain::instance().getTick() + t;
-	}
+	void setTimeout(uint32_t t);
 
 	/**
 	 * \returns The address this socket is connected to.
@@ -520,8 +556,14 @@ private:
 
 /**
  * SocketWatcher class keeps a list of active sockets, performs checking
- * them for events (in DoPoll() member function), as well as events posting
+ * them for events (in process() member function), as well as events posting
  * to Event Subsystem when there are events in sockets.
+ *
+ * The actual polling is delegated to a Detail::SocketPoller backend (epoll
+ * on Linux, select() elsewhere). The backend is kept informed about which
+ * events each socket is interested in; since that only changes when a socket's
+ * state flags change, sockets mark themselves dirty via setDirty(), and only
+ * dirty sockets are re-evaluated on each pass.
  */
 class HNBASE_EXPORT SocketWatcher : public EventTableBase {
 public:
@@ -560,6 +602,35 @@ public:
 	template<typename T>
 	void postEvent(T *obj, SocketEvent evt);
 
+	/**
+	 * Indicates that the state of a socket has changed, and the events
+	 * it is being polled for need to be re-evaluated on next pass.
+	 *
+	 * @param sock     Socket which state changed
+	 */
+	void setDirty(SOCKET sock) { m_dirty.insert(sock); }
+
+	/**
+	 * Start tracking timeout of a client socket.
+	 *
+	 * @param client   Socket which timeout was set
+	 */
+	void addTimeout(SocketClient *client) { m_timed.insert(client); }
+
+	/**
+	 * Change the polling backend. Currently watched sockets are
+	 * re-registered with the new backend.
+	 *
+	 * @param name     Backend name ("epoll" or "select"); empty string
+	 *                 selects the best backend available.
+	 * @return         True if the backend was changed, false if it is not
+	 *                 available on this platform.
+	 */
+	bool setPoller(const std::string &name);
+
+	//! \returns Name of the polling backend in use
+	std::string getPoller() const;
+
 	//! Access to the Singleton object of this class
 	static SocketWatcher& instance();
 private:
@@ -580,7 +651,6 @@ private:
 	void doRemoveSocket(UDPSocket *socket);
 	//@}
 
-	std::set<SOCKET> m_sockets;                    //!< Set of sockets
 	std::map<SOCKET, SocketClient*> m_clients;     //!< Map of clients
 	std::map<SOCKET, SocketServer*> m_servers;     //!< Map of servers
 	std::map<SOCKET, UDPSocket*   > m_udpSockets;  //!< Map of UDP sockets
@@ -599,6 +669,24 @@ private:
 	void handleErronousSocket(SOCKET sock);
 	//@}
 
+	/**
+	 * Push the events the socket is interested in to the polling backend,
+	 * based on the current state flags of the governing object.
+	 */
+	void updateInterest(SOCKET sock);
+
+	//! Emit SOCK_TIMEOUT for sockets which timeouts have passed
+	void checkTimeouts();
+
+	//! Polling backend
+	boost::scoped_ptr<Detail::SocketPoller> m_poller;
+
+	//! Sockets which state changed since last pass
+	std::set<SOCKET> m_dirty;
+
+	//! Clients that have a timeout set
+	std::set<SocketClient*> m_timed;
+
 	/**
 	 * Temporary containers for sockets pending removal. These are cleared,
 	 * and removed from real containers in cleanupSockets() method.
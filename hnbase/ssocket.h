@@ -112,6 +112,28 @@ public:
 		_Scheduler::write(m_ptr, buf);
 	}
 
+	/**
+	 * Write data into socket without copying it
+	 *
+	 * @param buf   Buffer to be written; it's kept by reference until the
+	 *              data has been sent, so it may not be modified afterwards
+	 */
+	void write(BufferChain::Buffer buf) {
+		_Scheduler::write(m_ptr, buf);
+	}
+
+	/**
+	 * Write a region of an open file into socket, without reading the data
+	 * into memory first.
+	 *
+	 * @param file    File to send the data from
+	 * @param offset  Begin offset of the data in the file
+	 * @param len     Length of the data
+	 */
+	void writeFile(FileHandlePtr file, uint64_t offset, uint32_t len) {
+		_Scheduler::writeFile(m_ptr, file, offset, len);
+	}
+
 	/**
 	 * Read data from socket
 	 *
@@ -123,13 +145,9 @@ public:
 	}
 
 	/**
-	 * A more optimized version of read() method, this returns the incoming
-	 * data buffer directly. The different between getData() and read()
-	 * methods is that in case of read(), the data is appended to the
-	 * buffer, which means memcpy operation, however, with this method, only
-	 * std::string copy-constructor is called, and majority of
-	 * implementations have that optimized to avoid data copying. So this
-	 * method should be prefered over read() method.
+	 * Returns the incoming data as a new string. The different between
+	 * getData() and read() methods is that in case of read(), the data is
+	 * appended to an existing buffer.
 	 *
 	 * @return     All data that has been received thus far.
 	 *
@@ -140,6 +158,22 @@ public:
 		return _Scheduler::getData(m_ptr);
 	}
 
+	/**
+	 * Zero-copy access to the incoming data. The returned buffer is the
+	 * one the socket reads into; parse the data in place and consume()
+	 * only the bytes that were used - incomplete messages stay in the
+	 * buffer and are completed by subsequent reads. This should be
+	 * preferred over read() and getData() by stream parsers.
+	 *
+	 * The buffer is reference-counted, so keep the returned pointer while
+	 * parsing if the socket might be destroyed in the process.
+	 *
+	 * @return     The socket's input buffer
+	 */
+	boost::shared_ptr<RecvBuffer> getInput() {
+		return _Scheduler::getInput(m_ptr);
+	}
+
 	/**
 	 * Perform an outgoing connection
 	 *
@@ -375,8 +409,14 @@ private:
 		}
 	}
 
-	friend SSocket& operator<<(SSocket &s, const std::string &data) {
-		s.write(data);
+	/**
+	 * Packets are usually built into a temporary string, which is handed
+	 * over to the outgoing chain by reference instead of being copied.
+	 */
+	friend SSocket& operator<<(SSocket &s, std::string data) {
+		BufferChain::Buffer buf(new std::string);
+		buf->swap(data);
+		s.write(buf);
 		return s;
 	}
 	friend SSocket& operator>>(SSocket &s, std::string &data) {
@@ -0,0 +1,144 @@
+/*
+ *  Copyright (C) 2004-2006 Alo Sarv <madcat_@users.sourceforge.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/** \file test-bufferchain.cpp Regress-test for BufferChain class */
+
+#ifndef DOXYGEN_SHOULD_SKIP_THIS
+
+#include <hnbase/bufferchain.h>
+#include <boost/test/unit_test.hpp>
+#include <fstream>
+#include <iostream>
+#include <fcntl.h>
+
+// Reassemble the data described by the iovecs
+std::string collect(const IOVec *vec, uint32_t cnt) {
+	std::string ret;
+	for (uint32_t i = 0; i < cnt; ++i) {
+		ret.append(vec[i].m_data, vec[i].m_len);
+	}
+	return ret;
+}
+
+void test_append() {
+	BufferChain bc;
+	BOOST_CHECK(bc.empty());
+
+	bc.append(std::string("hello "));
+	bc.append(std::string("world"));
+	BOOST_CHECK(bc.size() == 11);
+	// small writes end up in the same segment
+	BOOST_CHECK(bc.getSegmentCount() == 1);
+
+	IOVec vec[8];
+	uint32_t cnt = bc.getIOVecs(vec, 8, bc.size());
+	BOOST_CHECK(collect(vec, cnt) == "hello world");
+
+	// shared buffers are queued by reference
+	BufferChain::Buffer buf(new std::string(10000, 'x'));
+	bc.append(buf);
+	BOOST_CHECK(bc.getSegmentCount() == 2);
+	cnt = bc.getIOVecs(vec, 8, bc.size());
+	BOOST_CHECK(cnt == 2);
+	BOOST_CHECK(vec[1].m_data == buf->data());
+
+	// the shared buffer is not modified by coalescing
+	bc.append(std::string("!"));
+	BOOST_CHECK(bc.getSegmentCount() == 3);
+	BOOST_CHECK(buf->size() == 10000);
+	BOOST_CHECK(bc.size() == 10012);
+}
+
+void test_consume() {
+	BufferChain bc;
+	bc.append(BufferChain::Buffer(new std::string(5000, 'a')));
+	bc.append(BufferChain::Buffer(new std::string(5000, 'b')));
+	bc.append(BufferChain::Buffer(new std::string(5000, 'c')));
+
+	IOVec vec[8];
+	uint32_t cnt = bc.getIOVecs(vec, 8, 7000);
+	BOOST_CHECK(cnt == 2);
+	BOOST_CHECK(vec[0].m_len == 5000);
+	BOOST_CHECK(vec[1].m_len == 2000);
+
+	bc.consume(7000);
+	BOOST_CHECK(bc.size() == 8000);
+	BOOST_CHECK(bc.getSegmentCount() == 2);
+	cnt = bc.getIOVecs(vec, 1, bc.size());
+	BOOST_CHECK(cnt == 1);
+	BOOST_CHECK(vec[0].m_len == 3000);
+	BOOST_CHECK(vec[0].m_data[0] == 'b');
+
+	bc.consume(3000);
+	BOOST_CHECK(bc.getSegmentCount() == 1);
+	BOOST_CHECK_THROW(bc.consume(5001), std::exception);
+	bc.consume(5000);
+	BOOST_CHECK(bc.empty());
+	BOOST_CHECK(bc.getSegmentCount() == 0);
+	BOOST_CHECK(bc.getIOVecs(vec, 8, 100) == 0);
+}
+
+void test_file() {
+	std::ofstream("bufferchain.tmp") << "0123456789";
+	int fd = open("bufferchain.tmp", O_RDONLY|O_BINARY);
+	BOOST_REQUIRE(fd != -1);
+	FileHandlePtr file(new FileHandle(fd));
+
+	BufferChain bc;
+	bc.append(std::string("head"));
+	bc.appendFile(file, 2, 6);
+	bc.append(std::string("tail"));
+	BOOST_CHECK(bc.size() == 14);
+	BOOST_CHECK(bc.getSegmentCount() == 3);
+
+	// iovecs stop at the file region
+	IOVec vec[8];
+	uint32_t cnt = bc.getIOVecs(vec, 8, bc.size());
+	BOOST_CHECK(collect(vec, cnt) == "head");
+	uint64_t offset = 0;
+	uint32_t len = 0;
+	BOOST_CHECK(!bc.getFileRegion(&fd, &offset, &len));
+
+	bc.consume(4);
+	BOOST_CHECK(bc.getIOVecs(vec, 8, bc.size()) == 0);
+	BOOST_CHECK(bc.getFileRegion(&fd, &offset, &len));
+	BOOST_CHECK(fd == file->getFd() && offset == 2 && len == 6);
+	bc.consume(4);
+	BOOST_CHECK(bc.getFileRegion(&fd, &offset, &len));
+	BOOST_CHECK(offset == 6 && len == 2);
+
+	// the file stays open while queued
+	file.reset();
+	bc.consume(2);
+	BOOST_CHECK(!bc.getFileRegion(&fd, &offset, &len));
+	cnt = bc.getIOVecs(vec, 8, bc.size());
+	BOOST_CHECK(collect(vec, cnt) == "tail");
+	remove("bufferchain.tmp");
+}
+
+boost::unit_test::test_suite* init_unit_test_suite(int, char*[]) {
+	std::cerr << "BufferChain: ";
+	boost::unit_test::test_suite *test = 0;
+	test = BOOST_TEST_SUITE("BufferChain");
+	test->add(BOOST_TEST_CASE(&test_append));
+	test->add(BOOST_TEST_CASE(&test_consume));
+	test->add(BOOST_TEST_CASE(&test_file));
+	return test;
+}
+
+#endif
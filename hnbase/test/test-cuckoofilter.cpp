@@ -0,0 +1,89 @@
+/*
+ *  Copyright (C) 2004-2006 Alo Sarv <madcat_@users.sourceforge.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/** \file test-cuckoofilter.cpp Regress-test for CuckooFilter class */
+
+#ifndef DOXYGEN_SHOULD_SKIP_THIS
+
+#include <hnbase/cuckoofilter.h>
+#include <boost/test/unit_test.hpp>
+#include <iostream>
+
+void test_basic() {
+	CuckooFilter f(100);
+	BOOST_CHECK(f.size() == 0);
+	BOOST_CHECK(!f.contains(1));
+	BOOST_CHECK(f.insert(1));
+	BOOST_CHECK(f.insert(1));
+	BOOST_CHECK(f.size() == 1);
+	BOOST_CHECK(f.contains(1));
+	BOOST_CHECK(!f.contains(2));
+	f.clear();
+	BOOST_CHECK(f.size() == 0);
+	BOOST_CHECK(!f.contains(1));
+}
+
+// no false negatives up to capacity, and few false positives
+void test_full() {
+	const uint32_t cnt = 100000;
+	CuckooFilter f(cnt);
+	for (uint64_t i = 0; i < cnt; ++i) {
+		BOOST_CHECK(f.insert(i * 7919));
+	}
+	uint32_t missing = 0;
+	for (uint64_t i = 0; i < cnt; ++i) {
+		missing += !f.contains(i * 7919);
+	}
+	BOOST_CHECK(missing == 0);
+
+	uint32_t falsePos = 0;
+	for (uint64_t i = 0; i < cnt; ++i) {
+		falsePos += f.contains(i * 7919 + 1);
+	}
+	BOOST_CHECK(falsePos < cnt / 1000);
+	std::cerr << "(" << falsePos << " false positives in " << cnt;
+	std::cerr << " lookups, " << f.memory() << " bytes) ";
+}
+
+// overflowing loses keys, but doesn't break the filter
+void test_overflow() {
+	CuckooFilter f(1000);
+	uint32_t failed = 0;
+	for (uint64_t i = 0; i < 10000; ++i) {
+		failed += !f.insert(i);
+	}
+	BOOST_CHECK(failed > 0);
+	uint32_t missing = 0;
+	for (uint64_t i = 0; i < 10000; ++i) {
+		missing += !f.contains(i);
+	}
+	BOOST_CHECK(missing <= failed);
+	BOOST_CHECK(f.size() <= f.memory() / 2);
+}
+
+boost::unit_test::test_suite* init_unit_test_suite(int, char*[]) {
+	std::cerr << "CuckooFilter: ";
+	boost::unit_test::test_suite *test = 0;
+	test = BOOST_TEST_SUITE("CuckooFilter");
+	test->add(BOOST_TEST_CASE(&test_basic));
+	test->add(BOOST_TEST_CASE(&test_full));
+	test->add(BOOST_TEST_CASE(&test_overflow));
+	return test;
+}
+
+#endif
@@ -0,0 +1,82 @@
+/*
+ *  Copyright (C) 2004-2006 Alo Sarv <madcat_@users.sourceforge.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/**
+ * \file test-eventqueue.cpp Benchmark for EventTable event posting
+ *
+ * One or more producer threads post events into an EventTable, while the main
+ * thread handles them through process(), as the main event loop does. Reports
+ * the number of events passed through the table per second.
+ */
+
+#include <hnbase/event.h>
+#include <hnbase/utils.h>
+#include <boost/thread.hpp>
+#include <iostream>
+
+static const uint32_t EVENTS = 1000000;   // per producer thread
+
+struct Source {
+	DECLARE_EVENT_TABLE(Source*, int);
+};
+IMPLEMENT_EVENT_TABLE(Source, Source*, int);
+
+struct Counter {
+	Counter() : m_count() {}
+	void onEvent(Source*, int) { ++m_count; }
+	uint64_t m_count;
+};
+
+void produce(Source *src, uint32_t count) {
+	for (uint32_t i = 0; i < count; ++i) {
+		Source::getEventTable().postEvent(src, i);
+	}
+}
+
+void bench(uint32_t producers) {
+	Source src;
+	Counter cnt;
+	boost::signals::connection c = Source::getEventTable().addHandler(
+		&src, &cnt, &Counter::onEvent
+	);
+	uint64_t total = static_cast<uint64_t>(producers) * EVENTS;
+
+	Utils::StopWatch elapsed;
+	boost::thread_group threads;
+	for (uint32_t i = 0; i < producers; ++i) {
+		threads.create_thread(boost::bind(&produce, &src, EVENTS));
+	}
+	while (cnt.m_count < total) {
+		Source::getEventTable().process();
+	}
+	threads.join_all();
+	uint64_t ms = elapsed.elapsed();
+
+	std::cerr << boost::format("%d producer(s): %d events in %dms, ")
+		% producers % total % ms;
+	std::cerr << boost::format("%.0f events/sec")
+		% (total * 1000.0 / (ms ? ms : 1)) << std::endl;
+
+	Source::getEventTable().delHandler(&src, c);
+}
+
+int main() {
+	bench(1);
+	bench(4);
+	return 0;
+}
@@ -0,0 +1,94 @@
+/*
+ *  Copyright (C) 2004-2006 Alo Sarv <madcat_@users.sourceforge.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/** \file test-memstream.cpp Regress-test for MemStream class */
+
+#ifndef DOXYGEN_SHOULD_SKIP_THIS
+
+#include <hnbase/memstream.h>
+#include <hnbase/utils.h>
+#include <boost/test/unit_test.hpp>
+#include <iostream>
+#include <sstream>
+
+// reads the same values as std::istringstream, from the same memory
+void test_read() {
+	std::ostringstream o;
+	Utils::putVal<uint8_t>(o, 0xe3);
+	Utils::putVal<uint32_t>(o, 12345678);
+	Utils::putVal<std::string>(o, "hello");
+	Utils::putVal<uint16_t>(o, 42);
+	std::string data(o.str());
+
+	MemStream m(data.data(), data.size());
+	BOOST_CHECK(m.data() == data.data());
+	BOOST_CHECK(m.size() == data.size());
+	BOOST_CHECK(Utils::getVal<uint8_t>(m) == 0xe3);
+	BOOST_CHECK(Utils::getVal<uint32_t>(m) == 12345678);
+	BOOST_CHECK(Utils::getVal<std::string>(m).value() == "hello");
+	BOOST_CHECK(m.remaining() == 2);
+	BOOST_CHECK(Utils::getVal<uint16_t>(m) == 42);
+	BOOST_CHECK(m.good());
+	BOOST_CHECK(m.remaining() == 0);
+
+	// bounded: nothing is read past the end
+	BOOST_CHECK_THROW(Utils::getVal<uint8_t>(m).value(), Utils::ReadError);
+	BOOST_CHECK(m.eof());
+}
+
+void test_seek() {
+	std::string data("0123456789");
+	MemStream m(data.data(), 5);
+	m.seekg(0, std::ios::end);
+	BOOST_CHECK(m.tellg() == std::streampos(5));
+	m.seekg(2);
+	BOOST_CHECK(m.peek() == '2');
+	m.seekg(-1, std::ios::cur);
+	BOOST_CHECK(m.get() == '1');
+
+	// seeking outside the region fails and keeps the position
+	m.seekg(6);
+	BOOST_CHECK(m.fail());
+	m.clear();
+	BOOST_CHECK(m.tellg() == std::streampos(2));
+	m.seekg(-3, std::ios::cur);
+	BOOST_CHECK(m.fail());
+
+	// reuse for another region clears the error state
+	m.reset(data.data() + 5, 5);
+	BOOST_CHECK(m.good());
+	BOOST_CHECK(m.size() == 5);
+	BOOST_CHECK(Utils::getVal<std::string>(m, 5).value() == "56789");
+	BOOST_CHECK_THROW(Utils::getVal<std::string>(m, 1), Utils::ReadError);
+
+	// empty region
+	m.reset(0, 0);
+	BOOST_CHECK(m.size() == 0);
+	BOOST_CHECK(m.peek() == EOF);
+}
+
+boost::unit_test::test_suite* init_unit_test_suite(int, char*[]) {
+	std::cerr << "MemStream: ";
+	boost::unit_test::test_suite *test = 0;
+	test = BOOST_TEST_SUITE("MemStream");
+	test->add(BOOST_TEST_CASE(&test_read));
+	test->add(BOOST_TEST_CASE(&test_seek));
+	return test;
+}
+
+#endif
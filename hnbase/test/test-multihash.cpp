@@ -0,0 +1,195 @@
+/*
+ *  Copyright (C) 2004-2006 Alo Sarv <madcat_@users.sourceforge.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/**
+ * \file test-multihash.cpp Test and benchmark for MultiHash kernels
+ *
+ * First checks that each kernel the CPU supports gives the same checksums as
+ * Md4Transform, Md5Transform and Sha1Transform, for streams of various
+ * lengths fed in pieces of various sizes. Then hashes a number of ed2k-part
+ * sized chunks, first one by one with the old transforms, then all at once
+ * with each kernel, and reports the throughput of each.
+ */
+
+#ifndef DOXYGEN_SHOULD_SKIP_THIS
+
+#include <hnbase/multihash.h>
+#include <hnbase/md4transform.h>
+#include <hnbase/md5transform.h>
+#include <hnbase/sha1transform.h>
+#include <hnbase/utils.h>
+#include <iostream>
+#include <stdexcept>
+
+static const uint32_t CHUNK_SIZE = 9728000;    // ed2k part size
+static const uint32_t CHUNKS     = 8;
+static const uint32_t BLOCK      = 256 * 1024; // HashWork buffer size
+
+static const MultiHash::Algorithm s_algos[] = {
+	MultiHash::MD4, MultiHash::MD5, MultiHash::SHA1
+};
+static const char *s_algoNames[] = { "MD4", "MD5", "SHA1" };
+static const MultiHash::Kernel s_kernels[] = {
+	MultiHash::SCALAR, MultiHash::SSE2, MultiHash::AVX2
+};
+
+// checksum using the old transforms
+std::string reference(
+	MultiHash::Algorithm algo, const char *data, uint32_t len
+) {
+	if (algo == MultiHash::MD4) {
+		Md4Transform t;
+		t.sumUp(data, len);
+		return t.getHash().toString();
+	} else if (algo == MultiHash::MD5) {
+		Md5Transform t;
+		t.sumUp(data, len);
+		return t.getHash().toString();
+	} else {
+		Sha1Transform t;
+		t.sumUp(data, len);
+		return t.getHash().toString();
+	}
+}
+
+std::string makeData(uint32_t len, uint32_t seed) {
+	std::string ret(len, '\0');
+	for (uint32_t i = 0; i < len; ++i) {
+		ret[i] = static_cast<char>(i * 7 + i / 251 + seed);
+	}
+	return ret;
+}
+
+// 1 to 11 streams of 0 to ~1000 bytes, fed in pieces of 1 to 199 bytes
+void checkKernel(MultiHash::Kernel kernel) {
+	for (uint32_t a = 0; a < 3; ++a)
+	for (uint32_t streams = 1; streams < 12; ++streams) {
+		std::vector<std::string> data;
+		for (uint32_t i = 0; i < streams; ++i) {
+			uint32_t len = (i * 263 + streams * 71) % 1031;
+			data.push_back(makeData(len, i));
+		}
+		MultiHash mh(s_algos[a], streams);
+		std::vector<uint32_t> pos(streams);
+		bool done = false;
+		for (uint32_t round = 0; !done; ++round) {
+			std::vector<const char*> ptr(streams);
+			std::vector<uint32_t> len(streams);
+			done = true;
+			for (uint32_t i = 0; i < streams; ++i) {
+				uint32_t piece = (round * 37 + i * 53) % 199;
+				len[i] = std::min<uint32_t>(
+					piece + 1, data[i].size() - pos[i]
+				);
+				ptr[i] = data[i].data() + pos[i];
+				pos[i] += len[i];
+				done &= pos[i] == data[i].size();
+			}
+			mh.sumUp(&ptr[0], &len[0]);
+		}
+		for (uint32_t i = 0; i < streams; ++i) {
+			std::string ref = reference(
+				s_algos[a], data[i].data(), data[i].size()
+			);
+			if (mh.getHash(i) != ref) {
+				throw std::runtime_error((boost::format(
+					"%s kernel: %s of stream %d/%d wrong"
+				) % MultiHash::getKernelName(kernel)
+				% s_algoNames[a] % i % streams).str());
+			}
+		}
+	}
+}
+
+void report(const std::string &name, uint64_t ms) {
+	double mb = CHUNK_SIZE / 1024.0 / 1024.0 * CHUNKS;
+	std::cerr << boost::format("%-16s %5dms, %7.1f MB/s")
+		% name % ms % (mb * 1000.0 / (ms ? ms : 1))
+		<< std::endl;
+}
+
+// all chunks at once, one HashWork buffer of each at a time
+void hashChunks(
+	MultiHash::Algorithm algo, const std::vector<std::string> &chunks,
+	const std::vector<std::string> &results
+) {
+	MultiHash mh(algo, CHUNKS);
+	for (uint32_t pos = 0; pos < CHUNK_SIZE; pos += BLOCK) {
+		uint32_t cnt = std::min(BLOCK, CHUNK_SIZE - pos);
+		std::vector<const char*> ptr(CHUNKS);
+		std::vector<uint32_t> len(CHUNKS, cnt);
+		for (uint32_t i = 0; i < CHUNKS; ++i) {
+			ptr[i] = chunks[i].data() + pos;
+		}
+		mh.sumUp(&ptr[0], &len[0]);
+	}
+	for (uint32_t i = 0; i < CHUNKS; ++i) {
+		CHECK_THROW_MSG(mh.getHash(i) == results[i], "Wrong checksum");
+	}
+}
+
+void benchmark(const std::vector<std::string> &chunks) {
+	for (uint32_t a = 0; a < 3; ++a) {
+		std::string name(s_algoNames[a]);
+		std::vector<std::string> results;
+		Utils::StopWatch elapsed;
+		for (uint32_t i = 0; i < CHUNKS; ++i) {
+			results.push_back(reference(
+				s_algos[a], chunks[i].data(), chunks[i].size()
+			));
+		}
+		report(name + " transform", elapsed.elapsed());
+
+		for (uint32_t k = 0; k < 3; ++k) {
+			if (MultiHash::setKernel(s_kernels[k])) {
+				elapsed.reset();
+				hashChunks(s_algos[a], chunks, results);
+				report(
+					name + " " + MultiHash::getKernelName(
+						s_kernels[k]
+					), elapsed.elapsed()
+				);
+			}
+		}
+	}
+}
+
+int main() try {
+	MultiHash::Kernel def = MultiHash::getKernel();
+	std::cerr << "Default kernel: " << MultiHash::getKernelName(def)
+		<< std::endl;
+	for (uint32_t k = 0; k < 3; ++k) {
+		if (MultiHash::setKernel(s_kernels[k])) {
+			checkKernel(s_kernels[k]);
+			std::cerr << MultiHash::getKernelName(s_kernels[k])
+				<< " kernel ok" << std::endl;
+		}
+	}
+
+	std::vector<std::string> chunks;
+	for (uint32_t i = 0; i < CHUNKS; ++i) {
+		chunks.push_back(makeData(CHUNK_SIZE, i));
+	}
+	benchmark(chunks);
+	return 0;
+} catch (std::exception &e) {
+	std::cerr << "Error: " << e.what() << std::endl;
+	return 1;
+}
+
+#endif
@@ -0,0 +1,137 @@
+/*
+ *  Copyright (C) 2004-2006 Alo Sarv <madcat_@users.sourceforge.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/** \file test-openhash.cpp Regress-test for OpenHashMap class */
+
+#ifndef DOXYGEN_SHOULD_SKIP_THIS
+
+#include <hnbase/openhash.h>
+#include <boost/test/unit_test.hpp>
+#include <boost/lexical_cast.hpp>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <set>
+
+struct IntHash {
+	size_t operator()(uint32_t x) const { return x; }
+};
+
+// all keys in the same slot, so everything is found by probing
+struct BadHash {
+	size_t operator()(uint32_t) const { return 0; }
+};
+
+typedef OpenHashMap<uint32_t, uint32_t, IntHash> IntMap;
+
+void test_basic() {
+	IntMap m;
+	BOOST_CHECK(m.empty());
+	BOOST_CHECK(!m.find(1));
+	BOOST_CHECK(!m.erase(1));
+
+	BOOST_CHECK(m.insert(1, 10));
+	BOOST_CHECK(!m.insert(1, 20));
+	BOOST_CHECK(m.size() == 1);
+	BOOST_CHECK(m.find(1) && *m.find(1) == 10);
+
+	m[2] = 20;
+	BOOST_CHECK(m.size() == 2);
+	BOOST_CHECK(*m.find(2) == 20);
+	BOOST_CHECK(m[3] == 0);
+	BOOST_CHECK(m.size() == 3);
+
+	BOOST_CHECK(m.erase(1));
+	BOOST_CHECK(!m.find(1));
+	BOOST_CHECK(*m.find(2) == 20);
+	BOOST_CHECK(m.size() == 2);
+
+	m.clear();
+	BOOST_CHECK(m.empty());
+	BOOST_CHECK(m.capacity() == 0);
+	BOOST_CHECK(!m.find(2));
+}
+
+void test_collisions() {
+	OpenHashMap<uint32_t, uint32_t, BadHash> m;
+	for (uint32_t i = 0; i < 100; ++i) {
+		BOOST_CHECK(m.insert(i, i * 2));
+	}
+	// removed entries in the middle of the probe sequence
+	for (uint32_t i = 0; i < 100; i += 2) {
+		BOOST_CHECK(m.erase(i));
+	}
+	for (uint32_t i = 0; i < 100; ++i) {
+		BOOST_CHECK((m.find(i) != 0) == (i % 2 == 1));
+	}
+	BOOST_CHECK(m.insert(50, 1));
+	BOOST_CHECK(*m.find(51) == 102);
+	BOOST_CHECK(m.size() == 51);
+}
+
+// compare against std::map, with removals forcing rebuilds
+void test_random() {
+	IntMap m;
+	std::map<uint32_t, uint32_t> ref;
+	srand(1);
+	for (uint32_t i = 0; i < 100000; ++i) {
+		uint32_t k = rand() % 5000;
+		switch (rand() % 3) {
+			case 0:
+				BOOST_CHECK(m.insert(k, i) == ref.insert(
+					std::make_pair(k, i)
+				).second);
+				break;
+			case 1:
+				BOOST_CHECK(m.erase(k) == (ref.erase(k) == 1));
+				break;
+			default: {
+				uint32_t *v = m.find(k);
+				BOOST_CHECK((v != 0) == (ref.count(k) == 1));
+				BOOST_CHECK(!v || *v == ref[k]);
+				break;
+			}
+		}
+	}
+	BOOST_CHECK(m.size() == ref.size());
+	BOOST_CHECK(m.capacity() <= 16384);
+}
+
+void test_values() {
+	OpenHashMap<std::string, std::set<int>, StringHash> m;
+	for (int i = 0; i < 1000; ++i) {
+		m[boost::lexical_cast<std::string>(i % 100)].insert(i);
+	}
+	BOOST_CHECK(m.size() == 100);
+	BOOST_CHECK(m.find("42")->size() == 10);
+	BOOST_CHECK(m.find("42")->count(942));
+	BOOST_CHECK(!m.find("100"));
+}
+
+boost::unit_test::test_suite* init_unit_test_suite(int, char*[]) {
+	std::cerr << "OpenHashMap: ";
+	boost::unit_test::test_suite *test = 0;
+	test = BOOST_TEST_SUITE("OpenHashMap");
+	test->add(BOOST_TEST_CASE(&test_basic));
+	test->add(BOOST_TEST_CASE(&test_collisions));
+	test->add(BOOST_TEST_CASE(&test_random));
+	test->add(BOOST_TEST_CASE(&test_values));
+	return test;
+}
+
+#endif
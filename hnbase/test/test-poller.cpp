@@ -0,0 +1,184 @@
+/*
+ *  Copyright (C) 2004-2006 Alo Sarv <madcat_@users.sourceforge.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/**
+ * \file test-poller.cpp Benchmark for SocketWatcher polling backends
+ *
+ * Registers 1k, 10k and 50k idle UDP sockets with each available polling
+ * backend and measures the cost of a single zero-timeout poll, which is what
+ * SocketWatcher pays on every main loop iteration. A single socket with
+ * pending data is included to verify the backends actually report events.
+ * Also checks that a hung-up socket with no events set doesn't wake the poll.
+ */
+
+#include <hnbase/socketpoller.h>
+#include <hnbase/utils.h>
+#include <iostream>
+
+#ifndef WIN32
+	#include <sys/resource.h>
+	#include <sys/socket.h>
+	#include <netinet/in.h>
+	#include <unistd.h>
+#endif
+
+using Detail::SocketPoller;
+
+static const int ITERATIONS = 1000;
+
+// Raise the open files limit as far as we are allowed
+static void raiseFdLimit() {
+#ifndef WIN32
+	rlimit rl;
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+#endif
+}
+
+void bench(const std::string &name, uint32_t count) {
+	boost::scoped_ptr<SocketPoller> poller(SocketPoller::create(name));
+	if (!poller) {
+		std::cerr << name << ": not available." << std::endl;
+		return;
+	}
+
+	std::vector<SOCKET> sockets;
+	for (uint32_t i = 0; i < count; ++i) {
+		SOCKET s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+		if (s < 0) {
+			break;
+		}
+		sockets.push_back(s);
+	}
+	if (sockets.size() < count) {
+		std::cerr << boost::format("%6s %6d: only %d sockets available")
+			% name % count % sockets.size() << std::endl;
+		for (uint32_t i = 0; i < sockets.size(); ++i) {
+			close(sockets[i]);
+		}
+		return;
+	}
+#ifndef WIN32
+	if (name == "select" && sockets.back() >= FD_SETSIZE) {
+		std::cerr << boost::format("%6s %6d: exceeds FD_SETSIZE")
+			% name % count << std::endl;
+		for (uint32_t i = 0; i < sockets.size(); ++i) {
+			close(sockets[i]);
+		}
+		return;
+	}
+#endif
+
+	// one active socket, bound to loopback and sent data to itself
+	sockaddr_in sin;
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t len = sizeof(sin);
+	bind(sockets[0], reinterpret_cast<sockaddr*>(&sin), sizeof(sin));
+	getsockname(sockets[0], reinterpret_cast<sockaddr*>(&sin), &len);
+	sendto(sockets[0], "x", 1, 0, reinterpret_cast<sockaddr*>(&sin), len);
+
+	Utils::StopWatch regTime;
+	for (uint32_t i = 0; i < sockets.size(); ++i) {
+		poller->set(sockets[i], SocketPoller::PE_READ);
+	}
+	uint64_t reg = regTime.elapsed();
+
+	SocketPoller::ReadyList ready;
+	Utils::StopWatch pollTime;
+	for (int i = 0; i < ITERATIONS; ++i) {
+		ready.clear();
+		poller->poll(0, &ready);
+	}
+	uint64_t elapsed = pollTime.elapsed();
+
+	std::cerr << boost::format(
+		"%6s %6d sockets: %8.2fus per poll, %4dms to register, "
+		"%d ready"
+	) % name % count % (elapsed * 1000.0 / ITERATIONS) % reg % ready.size();
+	std::cerr << std::endl;
+
+	for (uint32_t i = 0; i < sockets.size(); ++i) {
+		poller->remove(sockets[i]);
+		close(sockets[i]);
+	}
+}
+
+/**
+ * A socket whose peer has hung up must not wake up the poll while no events
+ * are set for it (epoll reports hangups regardless of the interest set), and
+ * must be reported again once events are set.
+ *
+ * @return       True if the backend behaved correctly
+ */
+bool checkHangup(const std::string &name) {
+#ifndef WIN32
+	boost::scoped_ptr<SocketPoller> poller(SocketPoller::create(name));
+	if (!poller) {
+		return true;
+	}
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+		return true;
+	}
+	close(fds[1]);
+
+	SocketPoller::ReadyList ready;
+	poller->set(fds[0], SocketPoller::PE_READ);
+	poller->set(fds[0], 0);
+	Utils::StopWatch waitTime;
+	poller->poll(100, &ready);
+	bool ok = ready.empty() && waitTime.elapsed() >= 50;
+
+	ready.clear();
+	poller->set(fds[0], SocketPoller::PE_READ);
+	poller->poll(0, &ready);
+	ok = ok && ready.size() == 1;
+
+	poller->remove(fds[0]);
+	close(fds[0]);
+	if (!ok) {
+		std::cerr << name << ": hangup check failed." << std::endl;
+	}
+	return ok;
+#else
+	return true;
+#endif
+}
+
+int main() {
+	raiseFdLimit();
+
+	bool ok = checkHangup("select");
+	ok = checkHangup("epoll") && ok;
+	if (!ok) {
+		return 1;
+	}
+
+	uint32_t counts[] = { 1000, 10000, 50000 };
+	const char *backends[] = { "select", "epoll" };
+	for (uint32_t i = 0; i < sizeof(backends) / sizeof(char*); ++i) {
+		for (uint32_t j = 0; j < sizeof(counts) / sizeof(uint32_t); ++j) {
+			bench(backends[i], counts[j]);
+		}
+	}
+	return 0;
+}
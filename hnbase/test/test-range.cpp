@@ -23,7 +23,10 @@
 #include <hnbase/range.h>
 #include <hnbase/rangelist.h>
 #include <boost/test/unit_test.hpp>
+#include <cstdlib>
 #include <iostream>
+#include <sstream>
+#include <vector>
 
 void test_base() {
 	Range16 r(0, 5);
@@ -428,6 +431,103 @@ void test_even_more() {
 	BOOST_CHECK(!rl2.contains(Range32(1044496386ul)));
 }
 
+// sets [b, b + len) in the bitmap, returning the range
+Range16 mark(std::vector<bool> *ref, uint16_t b, uint16_t len, bool val) {
+	for (uint16_t j = b; j < b + len; ++j) {
+		(*ref)[j] = val;
+	}
+	return Range16(b, b + len - 1);
+}
+
+// compares flat implementation against a bitmap, merging and erasing random
+// ranges, one at a time and in batches
+void test_flat() {
+	FlatRangeList16 rl;
+	std::vector<bool> ref(2000);
+	srand(1);
+	for (uint32_t n = 0; n < 20000; ++n) {
+		uint16_t b = rand() % 1990, len = 1 + rand() % 10;
+		switch (rand() % 5) {
+			case 0:
+				rl.erase(mark(&ref, b, len, false));
+				break;
+			case 1: {
+				std::vector<Range16> batch;
+				for (uint32_t i = 0; i < 20; ++i) {
+					b = rand() % 1990;
+					len = 1 + rand() % 10;
+					batch.push_back(
+						mark(&ref, b, len, true)
+					);
+				}
+				rl.mergeMany(batch.begin(), batch.end());
+				break;
+			}
+			default:
+				rl.merge(mark(&ref, b, len, true));
+				break;
+		}
+		if (n % 100) {
+			continue;
+		}
+		// ranges must be sorted, disjoint, and match the bitmap
+		std::vector<bool> tmp(2000);
+		FlatRangeList16::CIter i = rl.begin();
+		for (; i != rl.end(); ++i) {
+			if (i != rl.begin()) {
+				uint16_t prevEnd = (*(i - 1)).end();
+				BOOST_REQUIRE(prevEnd + 1 < (*i).begin());
+			}
+			mark(&tmp, (*i).begin(), (*i).length(), 1);
+		}
+		BOOST_REQUIRE(tmp == ref);
+		uint16_t x = rand() % 1990, y = x + rand() % 10;
+		bool any = false, all = true;
+		for (uint16_t j = x; j <= y; ++j) {
+			any |= ref[j];
+			all &= ref[j];
+		}
+		BOOST_CHECK(rl.contains(x, y) == any);
+		BOOST_CHECK(rl.containsFull(x, y) == all);
+	}
+}
+
+void test_flat_more() {
+	FlatRangeList16 rl;
+	rl.merge(0, 5);
+	rl.merge(7, 10);
+	rl.merge(6, 6);
+	BOOST_CHECK(rl.size() == 1);
+	rl.erase(3, 4);
+	BOOST_CHECK(rl.size() == 2);
+	BOOST_CHECK(rl.front().end() == 2);
+	BOOST_CHECK(rl.back().begin() == 5);
+	BOOST_CHECK(rl.getContains(3, 4) == rl.end());
+	BOOST_CHECK(rl.getContains(0, 20)->begin() == 0);
+	BOOST_CHECK(rl.getContains(4, 20)->begin() == 5);
+	BOOST_CHECK(rl.getFirstFree().begin() == 3);
+	BOOST_CHECK(rl.getFirstFree().end() == 4);
+	rl.erase(rl.getContains(6, 6));
+	BOOST_CHECK(rl.size() == 1);
+	rl.merge(65530, 65535);
+	BOOST_CHECK(rl.contains(65535, 65535));
+	rl.merge(100, 65529);
+	BOOST_CHECK(rl.size() == 2);
+	rl.erase(0, 65535);
+	BOOST_CHECK(rl.empty());
+
+	// serialization is compatible with the default implementation
+	RangeList16 r2;
+	r2.merge(1, 2);
+	r2.merge(10, 20);
+	std::stringstream tmp;
+	tmp << r2;
+	tmp.seekg(3);
+	FlatRangeList16 r3(tmp);
+	BOOST_CHECK(r3.size() == 2);
+	BOOST_CHECK(r3.containsFull(10, 20));
+}
+
 boost::unit_test::test_suite* init_unit_test_suite(int, char*[]) {
 	std::cerr << "Range Management Subsystem: ";
 	boost::unit_test::test_suite *test = 0;
@@ -438,6 +538,8 @@ boost::unit_test::test_suite* init_unit_test_suite(int, char*[]) {
 	test->add(BOOST_TEST_CASE(&test_getfree));
 	test->add(BOOST_TEST_CASE(&test_contains));
 	test->add(BOOST_TEST_CASE(&test_even_more));
+	test->add(BOOST_TEST_CASE(&test_flat));
+	test->add(BOOST_TEST_CASE(&test_flat_more));
 	return test;
 }
 
@@ -0,0 +1,129 @@
+/*
+ *  Copyright (C) 2004-2006 Alo Sarv <madcat_@users.sourceforge.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/**
+ * \file test-rangelist.cpp Benchmark for RangeList implementations
+ *
+ * Simulates the range bookkeeping of a 700MB download: 150k blocks of 10KB
+ * arrive from 30 sources, each downloading a different 180KB region, which is
+ * checked against and added to the locked list. For every block, the
+ * completed list is queried, and the block is merged into it. The completed
+ * list starts out fragmented with a few thousand holes, like a download
+ * resumed after receiving data from many sources.
+ *
+ * Reports the time taken with the default (std::multiset) and flat
+ * (std::vector) RangeList implementations, and the time to load the
+ * fragmented list with merge() and with mergeMany().
+ */
+
+#ifndef DOXYGEN_SHOULD_SKIP_THIS
+
+#include <hnbase/rangelist.h>
+#include <hnbase/utils.h>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+static const uint64_t FILE_SIZE  = 700ull * 1024 * 1024;
+static const uint32_t BLOCK_SIZE = 10240;
+static const uint32_t REGION     = 18 * BLOCK_SIZE;
+static const uint32_t SOURCES    = 30;
+static const uint32_t HOLES      = 5000;
+static const uint32_t ROUNDS     = 5000;
+
+// completed ranges of a download, with HOLES missing regions
+std::vector<Range64> fragmented() {
+	std::vector<Range64> ret;
+	srand(1);
+	uint64_t pos = 0;
+	uint64_t step = FILE_SIZE / HOLES;
+	while (pos + step < FILE_SIZE) {
+		uint64_t hole = BLOCK_SIZE * (1 + rand() % 8);
+		ret.push_back(Range64(pos, pos + step - hole - 1));
+		pos += step;
+	}
+	// received in random order
+	for (uint32_t i = ret.size() - 1; i > 0; --i) {
+		std::swap(ret[i], ret[rand() % (i + 1)]);
+	}
+	return ret;
+}
+
+template<typename List>
+void benchmark(const std::string &name, const std::vector<Range64> &start) {
+	Utils::StopWatch t;
+	List complete;
+	for (uint32_t i = 0; i < start.size(); ++i) {
+		complete.merge(start[i]);
+	}
+	uint64_t loadTime = t.elapsed();
+
+	t.reset();
+	List bulk;
+	bulk.mergeMany(start.begin(), start.end());
+	uint64_t bulkTime = t.elapsed();
+
+	// each source downloads a region, starting at random offset
+	List locked;
+	std::vector<uint64_t> next(SOURCES), regionEnd(SOURCES);
+	uint32_t blocks = 0;
+	srand(2);
+	t.reset();
+	for (uint32_t round = 0; round < ROUNDS; ++round) {
+		for (uint32_t s = 0; s < SOURCES; ++s) {
+			if (next[s] >= regionEnd[s]) {
+				if (regionEnd[s]) {
+					locked.erase(
+						regionEnd[s] - REGION,
+						regionEnd[s] - 1
+					);
+				}
+				uint64_t r = rand() % (FILE_SIZE / REGION - 1);
+				next[s] = r * REGION;
+				regionEnd[s] = next[s] + REGION;
+				if (locked.contains(next[s], regionEnd[s] - 1)) {
+					next[s] = regionEnd[s] = 0;
+					continue;
+				}
+				locked.merge(next[s], regionEnd[s] - 1);
+			}
+			uint64_t b = next[s], e = b + BLOCK_SIZE - 1;
+			next[s] += BLOCK_SIZE;
+			if (!complete.containsFull(b, e)) {
+				complete.merge(b, e);
+			}
+			complete.getContains(b, e);
+			++blocks;
+		}
+	}
+	uint64_t blockTime = t.elapsed();
+	std::cerr << boost::format(
+		"%-8s load %5dms, mergeMany %5dms; %d blocks %5dms, "
+		"%d ranges"
+	) % name % loadTime % bulkTime % blocks % blockTime % complete.size()
+	<< std::endl;
+}
+
+int main() {
+	std::vector<Range64> start(fragmented());
+	benchmark<RangeList64>("multiset", start);
+	benchmark<FlatRangeList64>("flat", start);
+	return 0;
+}
+
+#endif
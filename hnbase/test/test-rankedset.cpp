@@ -0,0 +1,126 @@
+/*
+ *  Copyright (C) 2004-2006 Alo Sarv <madcat_@users.sourceforge.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/** \file test-rankedset.cpp Regress-test for RankedSet class */
+
+#ifndef DOXYGEN_SHOULD_SKIP_THIS
+
+#include <hnbase/rankedset.h>
+#include <boost/test/unit_test.hpp>
+#include <cstdlib>
+#include <iostream>
+#include <iterator>
+#include <set>
+
+void test_basic() {
+	RankedSet<int> s;
+	BOOST_CHECK(s.empty());
+	BOOST_CHECK(s.countLess(5) == 0);
+	BOOST_CHECK(!s.erase(5));
+
+	BOOST_CHECK(s.insert(5));
+	BOOST_CHECK(s.insert(1));
+	BOOST_CHECK(s.insert(9));
+	BOOST_CHECK(!s.insert(5));
+	BOOST_CHECK(s.size() == 3);
+	BOOST_CHECK(s.front() == 1);
+	BOOST_CHECK(s.at(1) == 5);
+	BOOST_CHECK(s.at(2) == 9);
+	BOOST_CHECK(s.countLess(5) == 1);
+	BOOST_CHECK(s.countLess(6) == 2);
+	BOOST_CHECK(s.countLess(100) == 3);
+
+	BOOST_CHECK(s.erase(1));
+	BOOST_CHECK(!s.contains(1));
+	BOOST_CHECK(s.front() == 5);
+	s.clear();
+	BOOST_CHECK(s.empty());
+}
+
+// descending order, as used for scores
+void test_compare() {
+	RankedSet<int, std::greater<int> > s;
+	for (int i = 0; i < 100; ++i) {
+		s.insert(i);
+	}
+	BOOST_CHECK(s.front() == 99);
+	BOOST_CHECK(s.countLess(90) == 9);
+	BOOST_CHECK(s.at(10) == 89);
+}
+
+// compare against std::set
+void test_random() {
+	RankedSet<uint32_t> s;
+	std::set<uint32_t> ref;
+	srand(1);
+	for (uint32_t i = 0; i < 100000; ++i) {
+		uint32_t k = rand() % 5000;
+		switch (rand() % 4) {
+			case 0:
+				BOOST_CHECK(s.insert(k) == ref.insert(k).second);
+				break;
+			case 1:
+				BOOST_CHECK(s.erase(k) == (ref.erase(k) == 1));
+				break;
+			case 2:
+				BOOST_CHECK(s.countLess(k) == static_cast<uint32_t>(
+					std::distance(ref.begin(), ref.lower_bound(k))
+				));
+				break;
+			default:
+				BOOST_CHECK(s.contains(k) == (ref.count(k) == 1));
+				if (ref.size()) {
+					uint32_t pos = k % ref.size();
+					std::set<uint32_t>::iterator j = ref.begin();
+					std::advance(j, pos);
+					BOOST_CHECK(s.at(pos) == *j);
+				}
+				break;
+		}
+	}
+	BOOST_CHECK(s.size() == ref.size());
+	BOOST_CHECK(s.empty() || s.front() == *ref.begin());
+}
+
+// sorted insertion must not degrade the tree
+void test_sorted() {
+	RankedSet<uint32_t> s;
+	for (uint32_t i = 0; i < 1000000; ++i) {
+		s.insert(i);
+	}
+	BOOST_CHECK(s.countLess(500000) == 500000);
+	for (uint32_t i = 0; i < 1000000; i += 2) {
+		s.erase(i);
+	}
+	BOOST_CHECK(s.size() == 500000);
+	BOOST_CHECK(s.front() == 1);
+	BOOST_CHECK(s.at(1000) == 2001);
+}
+
+boost::unit_test::test_suite* init_unit_test_suite(int, char*[]) {
+	std::cerr << "RankedSet: ";
+	boost::unit_test::test_suite *test = 0;
+	test = BOOST_TEST_SUITE("RankedSet");
+	test->add(BOOST_TEST_CASE(&test_basic));
+	test->add(BOOST_TEST_CASE(&test_compare));
+	test->add(BOOST_TEST_CASE(&test_random));
+	test->add(BOOST_TEST_CASE(&test_sorted));
+	return test;
+}
+
+#endif
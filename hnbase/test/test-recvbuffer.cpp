@@ -0,0 +1,104 @@
+/*
+ *  Copyright (C) 2004-2006 Alo Sarv <madcat_@users.sourceforge.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/** \file test-recvbuffer.cpp Regress-test for RecvBuffer class */
+
+#ifndef DOXYGEN_SHOULD_SKIP_THIS
+
+#include <hnbase/recvbuffer.h>
+#include <boost/test/unit_test.hpp>
+#include <iostream>
+
+void test_readwrite() {
+	RecvBuffer rb;
+	BOOST_CHECK(rb.empty());
+	BOOST_CHECK(rb.capacity() == 0);
+
+	char *p = rb.reserve(100);
+	memcpy(p, "hello world", 11);
+	rb.commit(11);
+	BOOST_CHECK(rb.size() == 11);
+	BOOST_CHECK(std::string(rb.data(), rb.size()) == "hello world");
+	BOOST_CHECK(rb.capacity() == RecvBuffer::GRANULARITY);
+
+	// partial consume leaves the rest in place
+	rb.consume(6);
+	BOOST_CHECK(std::string(rb.data(), rb.size()) == "world");
+	BOOST_CHECK_THROW(rb.consume(6), std::exception);
+	BOOST_CHECK_THROW(rb.commit(RecvBuffer::GRANULARITY), std::exception);
+
+	rb.consume(5);
+	BOOST_CHECK(rb.empty());
+}
+
+void test_compact() {
+	RecvBuffer rb;
+	rb.append(std::string(4000, 'a').data(), 4000);
+	rb.consume(3990);
+
+	// fits after moving the remaining data to front
+	const char *old = rb.data();
+	rb.append(std::string(4000, 'b').data(), 4000);
+	BOOST_CHECK(rb.capacity() == RecvBuffer::GRANULARITY);
+	BOOST_CHECK(rb.data() != old);
+	BOOST_CHECK(rb.size() == 4010);
+	BOOST_CHECK(rb.data()[9] == 'a');
+	BOOST_CHECK(rb.data()[10] == 'b');
+
+	// grows when needed, keeping the data
+	rb.reserve(100000);
+	BOOST_CHECK(rb.capacity() >= 104010);
+	BOOST_CHECK(rb.size() == 4010);
+	BOOST_CHECK(rb.data()[9] == 'a');
+
+	// large buffers are released once empty
+	rb.consume(rb.size());
+	BOOST_CHECK(rb.capacity() == 0);
+
+	// small ones are kept
+	rb.append("x", 1);
+	rb.consume(1);
+	BOOST_CHECK(rb.capacity() == RecvBuffer::GRANULARITY);
+}
+
+// buffers used for block-sized reads are reused once drained
+void test_reuse() {
+	RecvBuffer rb;
+	rb.append("abc", 3);
+	rb.reserve(RecvBuffer::BLOCK_SIZE);
+	rb.commit(RecvBuffer::BLOCK_SIZE);
+	uint32_t cap = rb.capacity();
+	BOOST_CHECK(cap > RecvBuffer::BLOCK_SIZE);
+	BOOST_CHECK(cap <= RecvBuffer::KEEP_SIZE);
+	rb.consume(rb.size());
+	BOOST_CHECK(rb.capacity() == cap);
+	rb.reserve(RecvBuffer::BLOCK_SIZE);
+	BOOST_CHECK(rb.capacity() == cap);
+}
+
+boost::unit_test::test_suite* init_unit_test_suite(int, char*[]) {
+	std::cerr << "RecvBuffer: ";
+	boost::unit_test::test_suite *test = 0;
+	test = BOOST_TEST_SUITE("RecvBuffer");
+	test->add(BOOST_TEST_CASE(&test_readwrite));
+	test->add(BOOST_TEST_CASE(&test_compact));
+	test->add(BOOST_TEST_CASE(&test_reuse));
+	return test;
+}
+
+#endif
@@ -0,0 +1,203 @@
+/*
+ *  Copyright (C) 2004-2006 Alo Sarv <madcat_@users.sourceforge.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/**
+ * \file test-sendfile.cpp Benchmark for uploading file data over loopback
+ *
+ * Sends a file over a loopback connection in 10kb packets, as ed2k uploads
+ * do, first the old way - reading the data into memory and building complete
+ * packets - and then by sending only the packet headers from memory and the
+ * data directly from the file with sendfile(). A thread on the other end
+ * receives and counts the data. Reports the throughput of both.
+ *
+ * \note Without sendfile() (non-Linux systems), the second pass reads the
+ *       data through a bounce buffer, as SocketClient::sendFile() does.
+ */
+
+#ifndef DOXYGEN_SHOULD_SKIP_THIS
+
+#include <hnbase/osdep.h>
+#include <hnbase/utils.h>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#ifdef __linux__
+	#include <sys/sendfile.h>
+#endif
+#ifndef MSG_NOSIGNAL
+	#define MSG_NOSIGNAL 0
+#endif
+
+static const uint32_t FILE_SIZE = 64 * 1024 * 1024;
+static const uint32_t PASSES    = 8;            // file sent this many times
+static const uint32_t CHUNK     = 180 * 1024;   // bufferData() size
+static const uint32_t PACKET    = 10240;        // sendNextChunk() size
+static const uint32_t HEADER    = 30;           // DataChunk header size
+static const char *FILE_NAME    = "sendfile.tmp";
+
+void check(bool cond, const char *msg) {
+	if (!cond) {
+		throw std::runtime_error(std::string(msg) + strerror(errno));
+	}
+}
+
+void sendAll(int sock, const char *data, uint32_t len) {
+	while (len) {
+		int ret = ::send(sock, data, len, MSG_NOSIGNAL);
+		check(ret > 0, "send: ");
+		data += ret;
+		len -= ret;
+	}
+}
+
+void sendRegion(int sock, int fd, uint64_t offset, uint32_t len) {
+	while (len) {
+#ifdef __linux__
+		off64_t pos = offset;
+		int ret = ::sendfile64(sock, fd, &pos, len);
+#else
+		char buf[64 * 1024];
+		uint32_t cnt = std::min<uint32_t>(len, sizeof(buf));
+		int ret = ::pread64(fd, buf, cnt, offset);
+		if (ret > 0) {
+			ret = ::send(sock, buf, ret, MSG_NOSIGNAL);
+		}
+#endif
+		check(ret > 0, "sendfile: ");
+		offset += ret;
+		len -= ret;
+	}
+}
+
+// old path: chunk is read into memory, each packet built by copying the data
+void sendCopy(int sock, int fd) {
+	for (uint32_t pos = 0; pos < FILE_SIZE; pos += CHUNK) {
+		uint32_t len = std::min(CHUNK, FILE_SIZE - pos);
+		std::string buf(len, '\0');
+		check(::pread64(fd, &buf[0], len, pos) == (int)len, "pread: ");
+		for (uint32_t off = 0; off < len; off += PACKET) {
+			std::string packet(HEADER, '\0');
+			packet += buf.substr(off, PACKET);
+			sendAll(sock, packet.data(), packet.size());
+		}
+	}
+}
+
+// new path: only headers are in memory, data is sent from file
+void sendZeroCopy(int sock, int fd) {
+	std::string header(HEADER, '\0');
+	for (uint32_t pos = 0; pos < FILE_SIZE; pos += PACKET) {
+		sendAll(sock, header.data(), header.size());
+		sendRegion(sock, fd, pos, std::min(PACKET, FILE_SIZE - pos));
+	}
+}
+
+void receive(int sock, uint64_t expected) {
+	std::string buf(256 * 1024, '\0');
+	while (expected) {
+		int ret = ::recv(sock, &buf[0], buf.size(), 0);
+		if (ret <= 0) {
+			break;
+		}
+		expected -= ret;
+	}
+	close(sock);
+}
+
+void bench(int listener, const std::string &name, void (*sender)(int, int)) {
+	sockaddr_in addr;
+	socklen_t sz = sizeof(addr);
+	getsockname(listener, reinterpret_cast<sockaddr*>(&addr), &sz);
+	int sock = socket(AF_INET, SOCK_STREAM, 0);
+	check(sock != -1, "socket: ");
+	int ret = connect(sock, reinterpret_cast<sockaddr*>(&addr), sz);
+	check(ret != -1, "connect: ");
+	int peer = accept(listener, 0, 0);
+	check(peer != -1, "accept: ");
+
+	int fd = open(FILE_NAME, O_RDONLY|O_LARGEFILE|O_BINARY);
+	check(fd != -1, "open: ");
+	uint64_t total = FILE_SIZE + (FILE_SIZE + PACKET - 1) / PACKET * HEADER;
+	boost::thread t(boost::bind(&receive, peer, total * PASSES));
+
+	Utils::StopWatch elapsed;
+	for (uint32_t i = 0; i < PASSES; ++i) {
+		sender(sock, fd);
+	}
+	close(sock);
+	t.join();
+	uint64_t ms = elapsed.elapsed();
+	close(fd);
+
+	double mb = FILE_SIZE / 1024.0 / 1024.0 * PASSES;
+	std::cerr << boost::format("%s: %s in %dms, %.1f MB/s")
+		% name % Utils::bytesToString(FILE_SIZE * PASSES) % ms
+		% (mb * 1000.0 / (ms ? ms : 1))
+		<< std::endl;
+}
+
+int main() try {
+	{
+		std::string data(1024 * 1024, '\0');
+		for (uint32_t i = 0; i < data.size(); ++i) {
+			data[i] = static_cast<char>(i * 7 + i / 251);
+		}
+		int flags = O_WRONLY|O_CREAT|O_TRUNC|O_BINARY;
+		int fd = open(FILE_NAME, flags, 0600);
+		check(fd != -1, "open: ");
+		for (uint32_t i = 0; i < FILE_SIZE / data.size(); ++i) {
+			int ret = ::write(fd, data.data(), data.size());
+			check(ret == (int)data.size(), "write: ");
+		}
+		close(fd);
+	}
+
+	int listener = socket(AF_INET, SOCK_STREAM, 0);
+	check(listener != -1, "socket: ");
+	sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+	int ret = bind(listener, reinterpret_cast<sockaddr*>(&addr),
+		sizeof(addr)
+	);
+	check(ret != -1, "bind: ");
+	check(listen(listener, 1) != -1, "listen: ");
+
+	// first pass only warms up the page cache
+	bench(listener, "warmup   ", &sendCopy);
+	bench(listener, "copy     ", &sendCopy);
+	bench(listener, "zero-copy", &sendZeroCopy);
+
+	close(listener);
+	unlink(FILE_NAME);
+	return 0;
+} catch (std::exception &e) {
+	std::cerr << "Error: " << e.what() << std::endl;
+	unlink(FILE_NAME);
+	return 1;
+}
+
+#endif
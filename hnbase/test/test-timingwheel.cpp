@@ -0,0 +1,138 @@
+/*
+ *  Copyright (C) 2004-2006 Alo Sarv <madcat_@users.sourceforge.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/** \file test-timingwheel.cpp Regress-test for TimingWheel class */
+
+#ifndef DOXYGEN_SHOULD_SKIP_THIS
+
+#include <hnbase/timingwheel.h>
+#include <boost/test/unit_test.hpp>
+#include <cstdlib>
+#include <iostream>
+#include <set>
+#include <vector>
+
+using Detail::TimingWheel;
+
+// Collect the expire times of timers returned by advance()
+std::vector<uint64_t> expired(TimingWheel::Timer *t) {
+	std::vector<uint64_t> ret;
+	for (; t; t = t->getNext()) {
+		BOOST_CHECK(!t->isActive());
+		ret.push_back(t->getExpire());
+	}
+	return ret;
+}
+
+void test_expire() {
+	TimingWheel tw(1000);
+	TimingWheel::Timer t[6];
+	tw.add(&t[0], 1000 + 70000);      // level 2
+	tw.add(&t[1], 1000 + 5);          // level 0
+	tw.add(&t[2], 1000 + 300);        // level 1
+	tw.add(&t[3], 1000 + 5);
+	tw.add(&t[4], 999);               // already expired
+	tw.add(&t[5], 1000 + 20000000);   // level 3
+	BOOST_CHECK(tw.size() == 6);
+
+	std::vector<uint64_t> r = expired(tw.advance(1000));
+	BOOST_CHECK(r.size() == 1 && r[0] == 999);
+
+	BOOST_CHECK(!tw.advance(1004));
+	r = expired(tw.advance(1005));
+	BOOST_CHECK(r.size() == 2);
+	// timers expiring at the same time are returned in order of adding
+	BOOST_CHECK(r.size() == 2 && r[0] == 1005 && r[1] == 1005);
+	BOOST_CHECK(t[1].getNext() == &t[3]);
+
+	BOOST_CHECK(!tw.advance(1299));
+	r = expired(tw.advance(1300));
+	BOOST_CHECK(r.size() == 1 && r[0] == 1300);
+
+	// skipping a large amount of time at once
+	r = expired(tw.advance(1000 + 70000 + 500));
+	BOOST_CHECK(r.size() == 1 && r[0] == 71000);
+
+	BOOST_CHECK(!tw.advance(1000 + 20000000 - 1));
+	r = expired(tw.advance(1000 + 20000000));
+	BOOST_CHECK(r.size() == 1);
+	BOOST_CHECK(tw.size() == 0);
+}
+
+void test_remove() {
+	TimingWheel tw(0);
+	TimingWheel::Timer t[3];
+	tw.add(&t[0], 10);
+	tw.add(&t[1], 10);
+	tw.add(&t[2], 1000);
+	tw.remove(&t[0]);
+	tw.remove(&t[2]);
+	BOOST_CHECK(!t[0].isActive());
+	tw.remove(&t[0]); // no-op
+	BOOST_CHECK(tw.size() == 1);
+
+	std::vector<uint64_t> r = expired(tw.advance(2000));
+	BOOST_CHECK(r.size() == 1);
+	BOOST_CHECK(tw.advance(2000) == 0);
+
+	tw.add(&t[0], 3000);
+	tw.add(&t[1], 1ull << 40); // beyond the range of the wheel
+	r = expired(tw.clear());
+	BOOST_CHECK(r.size() == 2);
+	BOOST_CHECK(tw.size() == 0);
+}
+
+// Compare against a sorted reference, with random timers
+void test_random() {
+	TimingWheel tw(0);
+	std::vector<TimingWheel::Timer> t(5000);
+	std::multiset<uint64_t> ref;
+	srand(0);
+	for (uint32_t i = 0; i < t.size(); ++i) {
+		uint64_t expire = rand() % 100000;
+		if (i % 10 == 0) {
+			expire = rand() * 97ull % 100000000;
+		}
+		tw.add(&t[i], expire);
+		ref.insert(expire);
+	}
+	uint64_t now = 0;
+	while (ref.size()) {
+		now += rand() % 5000;
+		std::vector<uint64_t> r = expired(tw.advance(now));
+		std::vector<uint64_t> e;
+		while (ref.size() && *ref.begin() <= now) {
+			e.push_back(*ref.begin());
+			ref.erase(ref.begin());
+		}
+		BOOST_CHECK(r == e);
+	}
+	BOOST_CHECK(tw.size() == 0);
+}
+
+boost::unit_test::test_suite* init_unit_test_suite(int, char*[]) {
+	std::cerr << "TimingWheel: ";
+	boost::unit_test::test_suite *test = 0;
+	test = BOOST_TEST_SUITE("TimingWheel");
+	test->add(BOOST_TEST_CASE(&test_expire));
+	test->add(BOOST_TEST_CASE(&test_remove));
+	test->add(BOOST_TEST_CASE(&test_random));
+	return test;
+}
+
+#endif
@@ -0,0 +1,155 @@
+/*
+ *  Copyright (C) 2004-2006 Alo Sarv <madcat_@users.sourceforge.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/**
+ * \file timingwheel.cpp Implementation of TimingWheel class
+ */
+
+#include <hnbase/pch.h>
+#include <hnbase/timingwheel.h>
+
+namespace Detail {
+
+TimingWheel::TimingWheel(uint64_t now) : m_now(now), m_count() {
+	for (uint32_t i = 0; i < LEVELS; ++i) {
+		for (uint32_t j = 0; j < SLOTS; ++j) {
+			m_slots[i][j] = 0;
+		}
+		m_levelCount[i] = 0;
+	}
+}
+
+void TimingWheel::add(Timer *t, uint64_t expire) {
+	CHECK_THROW(!t->m_pprev);
+	t->m_expire = expire;
+	insert(t);
+}
+
+void TimingWheel::insert(Timer *t) {
+	uint64_t expire = t->m_expire < m_now ? m_now : t->m_expire;
+	uint64_t delta = expire - m_now;
+	uint32_t level = 0;
+	while (level < LEVELS - 1 && delta >> (SLOT_BITS * (level + 1))) {
+		++level;
+	}
+	// beyond the range of the wheel - park in the furthest slot
+	if (delta >> (SLOT_BITS * LEVELS)) {
+		expire = m_now + (1ull << (SLOT_BITS * LEVELS)) - 1;
+	}
+	Timer *&slot = m_slots[level][(expire >> (SLOT_BITS*level)) & SLOT_MASK];
+
+	t->m_next = slot;
+	if (slot) {
+		slot->m_pprev = &t->m_next;
+	}
+	slot = t;
+	t->m_pprev = &slot;
+	t->m_level = level;
+	++m_levelCount[level];
+	++m_count;
+}
+
+void TimingWheel::remove(Timer *t) {
+	if (!t->m_pprev) {
+		return;
+	}
+	*t->m_pprev = t->m_next;
+	if (t->m_next) {
+		t->m_next->m_pprev = t->m_pprev;
+	}
+	t->m_next = 0;
+	t->m_pprev = 0;
+	--m_levelCount[t->m_level];
+	--m_count;
+}
+
+void TimingWheel::cascade(uint32_t level) {
+	uint32_t idx = (m_now >> (SLOT_BITS * level)) & SLOT_MASK;
+	Timer *t = m_slots[level][idx];
+	m_slots[level][idx] = 0;
+	while (t) {
+		Timer *next = t->m_next;
+		--m_levelCount[level];
+		--m_count;
+		insert(t);
+		t = next;
+	}
+}
+
+void TimingWheel::collect(Timer **&tail, uint32_t level, uint32_t idx) {
+	// slots are LIFO; reverse to get the timers in the order of adding
+	Timer *t = m_slots[level][idx];
+	Timer *rev = 0;
+	m_slots[level][idx] = 0;
+	while (t) {
+		Timer *next = t->m_next;
+		t->m_pprev = 0;
+		t->m_next = rev;
+		rev = t;
+		--m_levelCount[level];
+		--m_count;
+		t = next;
+	}
+	*tail = rev;
+	while (*tail) {
+		tail = &(*tail)->m_next;
+	}
+}
+
+TimingWheel::Timer* TimingWheel::advance(uint64_t now) {
+	Timer *head = 0;
+	Timer **tail = &head;
+
+	while (m_now <= now) {
+		if (!m_count) {
+			m_now = now + 1;
+			break;
+		}
+		uint32_t idx = m_now & SLOT_MASK;
+		if (!idx) {
+			for (uint32_t level = 1; level < LEVELS; ++level) {
+				cascade(level);
+				if ((m_now >> (SLOT_BITS * level)) & SLOT_MASK) {
+					break;
+				}
+			}
+		}
+		// Nothing on level 0 - skip to the end of it's revolution
+		if (!m_levelCount[0]) {
+			uint64_t next = (m_now | SLOT_MASK) + 1;
+			m_now = next < now + 1 ? next : now + 1;
+			continue;
+		}
+		collect(tail, 0, idx);
+		++m_now;
+	}
+	return head;
+}
+
+TimingWheel::Timer* TimingWheel::clear() {
+	Timer *head = 0;
+	Timer **tail = &head;
+	for (uint32_t i = 0; i < LEVELS; ++i) {
+		for (uint32_t j = 0; j < SLOTS; ++j) {
+			collect(tail, i, j);
+		}
+	}
+	return head;
+}
+
+} // end namespace Detail
@@ -0,0 +1,126 @@
+/*
+ *  Copyright (C) 2004-2006 Alo Sarv <madcat_@users.sourceforge.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef __TIMINGWHEEL_H__
+#define __TIMINGWHEEL_H__
+
+/**
+ * \file timingwheel.h Interface for TimingWheel class
+ */
+
+#include <hnbase/osdep.h>
+#include <boost/noncopyable.hpp>
+
+namespace Detail {
+
+/**
+ * TimingWheel is a hierarchical hashed timing wheel, used as the engine for
+ * delayed events. Timers are kept in unsorted slot lists instead of an ordered
+ * container; inserting and removing a timer are O(1) and need no allocation,
+ * since the timers are intrusive.
+ *
+ * The wheel has LEVELS levels of SLOTS slots each. Level 0 slots are one
+ * millisecond wide, and each higher level's slots span a full revolution of
+ * the level below. Timers in higher levels are moved ("cascaded") down as the
+ * wheel turns, so each timer is touched at most LEVELS times before it
+ * expires. The covered range is 2^32 ms (~49 days); timers further in future
+ * are parked in the last slot and re-inserted on cascade.
+ */
+class HNBASE_EXPORT TimingWheel : public boost::noncopyable {
+public:
+	/**
+	 * Base class for objects kept in the wheel.
+	 */
+	struct Timer {
+		Timer() : m_next(), m_pprev(), m_expire(), m_level() {}
+
+		//! \returns Next timer in the list returned by advance()
+		Timer* getNext() const { return m_next; }
+		//! \returns Expiration time
+		uint64_t getExpire() const { return m_expire; }
+		//! \returns Whether the timer is currently in a wheel
+		bool isActive() const { return m_pprev; }
+	private:
+		friend class TimingWheel;
+		Timer    *m_next;     //!< Next timer in slot
+		Timer   **m_pprev;    //!< Pointer to the link pointing to us
+		uint64_t  m_expire;   //!< Expiration time
+		uint8_t   m_level;    //!< Level of the wheel we'r in
+	};
+
+	enum Constants {
+		LEVELS    = 4,
+		SLOT_BITS = 8,
+		SLOTS     = 1 << SLOT_BITS,
+		SLOT_MASK = SLOTS - 1
+	};
+
+	/**
+	 * @param now     Current time, in milliseconds
+	 */
+	explicit TimingWheel(uint64_t now);
+
+	/**
+	 * Schedule a timer. Timers which have already expired are returned by
+	 * next call to advance().
+	 *
+	 * @param t        Timer, which must not be active
+	 * @param expire   Expiration time, in milliseconds
+	 */
+	void add(Timer *t, uint64_t expire);
+
+	//! Cancel an active timer; does nothing if the timer isn't active
+	void remove(Timer *t);
+
+	/**
+	 * Turn the wheel forward, collecting all timers which have expired.
+	 *
+	 * @param now      Current time, in milliseconds
+	 * @return         Expired timers, chained through getNext(), in order
+	 *                 of expiration; 0 if none expired
+	 */
+	Timer* advance(uint64_t now);
+
+	/**
+	 * Remove all timers from the wheel.
+	 *
+	 * @return         The removed timers, chained through getNext()
+	 */
+	Timer* clear();
+
+	//! \returns Number of active timers
+	uint32_t size() const { return m_count; }
+private:
+	//! Link timer into a slot based on it's expiration time
+	void insert(Timer *t);
+
+	//! Re-insert all timers in a slot, moving them to lower levels
+	void cascade(uint32_t level);
+
+	//! Unlink all timers in a slot, appending them to chain ending at tail
+	void collect(Timer **&tail, uint32_t level, uint32_t idx);
+
+	Timer   *m_slots[LEVELS][SLOTS];   //!< Slot lists
+	uint32_t m_levelCount[LEVELS];     //!< Number of timers per level
+	uint64_t m_now;                    //!< Next millisecond to process
+	uint32_t m_count;                  //!< Number of timers
+};
+
+} // end namespace Detail
+
+#endif
@@ -141,7 +141,15 @@ bool BitTorrent::onInit() {
 		);
 	}
 
-	initFiles();
+	// the torrents' data is found in shared directories, which are
+	// scanned in the background
+	if (FilesList::instance().isScanning()) {
+		m_scanDone = FilesList::instance().onScanDone.connect(
+			boost::bind(&BitTorrent::onScanDone, this)
+		);
+	} else {
+		initFiles();
+	}
 	adjustLimits();
 	Prefs::instance().valueChanged.connect(
 		boost::bind(&BitTorrent::configChanged, this, _1, _2)
@@ -152,6 +160,7 @@ bool BitTorrent::onInit() {
 
 int BitTorrent::onExit() {
 	using namespace boost::lambda;
+	m_scanDone.disconnect();
 	m_listener.reset();
 	for_each(
 		m_newClients.begin(), m_newClients.end(),
@@ -165,6 +174,11 @@ int BitTorrent::onExit() {
 	return 0;
 }
 
+void BitTorrent::onScanDone() {
+	m_scanDone.disconnect();
+	initFiles();
+}
+
 void BitTorrent::initFiles() {
 	using namespace boost::filesystem;
 	typedef std::map<
@@ -159,11 +159,16 @@ private:
 	void initTorrentDb(const boost::filesystem::path &path);
 	void initKnownTorrents(const boost::filesystem::path &confDir);
 	void initFiles();
+	//! Calls initFiles() once shared directories have been scanned
+	void onScanDone();
 	void saveKnownTorrents(const boost::filesystem::path &confDir);
 
 	//! Known torrents and their data locations, .torrent -> path
 	std::map<std::string, boost::filesystem::path> m_known;
 
+	//! Connection to FilesList::onScanDone, while waiting for it
+	boost::signals::connection m_scanDone;
+
 	/**
 	 * Workaround for clients who send handshake so fast that we parse it
 	 * right in Client constructor, emitting handshakeReceived signal,
@@ -22,6 +22,7 @@
 
 #include <hncore/bt/files.h>
 #include <hnbase/timed_callback.h>
+#include <hncore/hashpool.h>
 #include <hncore/metadata.h>
 #include <boost/filesystem/operations.hpp>
 #include <boost/algorithm/string/predicate.hpp>
@@ -143,7 +144,8 @@ void TorrentFile::finishDownload() {
 // --------------------
 PartialTorrent::CacheImpl::CacheImpl(
 	uint64_t begin, uint64_t end, const boost::filesystem::path &p
-) : Range64(begin, end), m_loc(p) {
+) : Range64(begin, end), m_loc(p),
+m_buffer(boost::bind(&CacheImpl::save, this)) {
 	if (!boost::filesystem::exists(p)) {
 		std::ofstream o(p.native_file_string().c_str());
 		o.put('\0');
@@ -152,23 +154,27 @@ PartialTorrent::CacheImpl::CacheImpl(
 
 // this expects relative offset, inside this cachefile
 //
-// the buffer bookeeping is similar as is done inside PartData - buffered data
-// is in a map, keyed by begin offset, so disk writes occour in a begin->end
-// fashion, avoiding backwards seeking.
+// the buffer bookeeping is the same as is done inside PartData - buffered data
+// is kept in WriteBuffer, keyed by begin offset, so disk writes occour in a
+// begin->end fashion, avoiding backwards seeking, and counts against the global
+// write cache budget.
 void PartialTorrent::CacheImpl::write(uint64_t begin, const std::string &data) {
-	m_buffer[begin] = data;
+	m_buffer.write(begin, data);
+	WriteCache::instance().evict();
 }
 
 // again, very similar to what is done inside PartData::save method, we flush
 // the data to disk. The usage of fcntl API instead of C++ iostreams is since
 // GCC versions 3.2 through 3.4 lack 64bit IO support.
 void PartialTorrent::CacheImpl::save() {
-	if (!m_buffer.size()) {
+	if (m_buffer.empty()) {
 		return;
 	}
 
-	int fd = open(m_loc.native_file_string().c_str(), O_RDWR|O_BINARY);
-	if (!fd) {
+	int fd = open(
+		m_loc.native_file_string().c_str(), O_RDWR|O_LARGEFILE|O_BINARY
+	);
+	if (fd == -1) {
 		logError(
 			boost::format("Failed to open cache file '%s': %s")
 			% m_loc.native_file_string() % strerror(errno)
@@ -176,20 +182,19 @@ void PartialTorrent::CacheImpl::save() {
 		return;
 	}
 
-	for (BIter i = m_buffer.begin(); i != m_buffer.end(); ++i) try {
-		uint64_t ret = lseek64(fd, (*i).first, SEEK_SET);
-		CHECK_THROW(ret == static_cast<uint64_t>((*i).first));
-		int c = ::write(fd, (*i).second.data(), (*i).second.size());
-		CHECK_THROW(c == static_cast<int>((*i).second.size()));
-	} catch (...) {
-		close(fd);
-		throw std::runtime_error(
-			"no space left on drive (torrent cache failure)"
-		);
+	WriteBuffer::Extents data = m_buffer.take();
+	WriteBuffer::Extents::iterator i = data.begin();
+	for (; i != data.end(); ++i) {
+		if (!(*i).second->writeTo(fd)) {
+			close(fd);
+			m_buffer.restore(data);
+			throw std::runtime_error(
+				"no space left on drive (torrent cache failure)"
+			);
+		}
 	}
 	fsync(fd);
 	close(fd);
-	m_buffer.clear();
 }
 
 PartialTorrent::InternalFile::InternalFile(
@@ -239,13 +244,14 @@ PartialTorrent::PartialTorrent(
 		InternalFile f(offset, (*it).second->getSize(), (*it).second);
 		m_children.push(f);
 		m_childrenReverse[(*it).second] = offset;
-		RangeList64 cr = (*it).second->getCompletedRanges();
-		for (RangeList64::CIter j = cr.begin(); j != cr.end(); ++j) {
+		FlatRangeList64 cr = (*it).second->getCompletedRanges();
+		FlatRangeList64::CIter j;
+		for (j = cr.begin(); j != cr.end(); ++j) {
 			Range64 tmp(offset + (*j).begin(), offset + (*j).end());
 			setComplete(tmp);
 		}
-		RangeList64 vr = (*it).second->getVerifiedRanges();
-		for (RangeList64::CIter j = vr.begin(); j != vr.end(); ++j) {
+		FlatRangeList64 vr = (*it).second->getVerifiedRanges();
+		for (j = vr.begin(); j != vr.end(); ++j) {
 			Range64 tmp(offset + (*j).begin(), offset + (*j).end());
 			setVerified(tmp);
 		}
@@ -602,7 +608,7 @@ HashWorkPtr PartialTorrent::verifyRange(
 	c = new TorrentHasher(range, files, relativeOffsets, ref);
 	c->waitAlloc(waitAlloc);
 	if (c->canRun()) {
-		IOThread::instance().postWork(c);
+		HashPool::instance().postWork(c);
 	} else {
 		m_pendingChecks.push_back(c);
 	}
@@ -623,7 +629,7 @@ HashWorkPtr PartialTorrent::verifyRange(
 	}
 	cc = new TorrentHasher(range, files, relativeOffsets, ref);
 	cc->getEventTable().addHandler(c, this, &PartialTorrent::onCacheVerify);
-	IOThread::instance().postWork(cc);
+	HashPool::instance().postWork(cc);
 	return c;
 }
 
@@ -658,7 +664,7 @@ void PartialTorrent::childAllocDone(PartData *file) {
 	while (i != m_pendingChecks.end()) {
 		(*i)->allocDone(file);
 		if ((*i)->canRun()) {
-			IOThread::instance().postWork(*i);
+			HashPool::instance().postWork(*i);
 			j = i++;
 			m_pendingChecks.erase(j);
 		} else {
@@ -946,12 +952,10 @@ uint64_t TorrentHasher::readNext(uint64_t pos) {
 // offsets to global, since internally we used relative offsets within the
 // first and last files of this hash job (in case the job crossed multiple
 // file boundaries)
-void TorrentHasher::finish() {
-	if (!isFull()) {
-		m_begin = m_globalOffsets.begin();
-		m_end   = m_globalOffsets.end();
-	}
-	HashWork::finish();
+void TorrentHasher::verify(const HashBase &h) {
+	m_begin = m_globalOffsets.begin();
+	m_end   = m_globalOffsets.end();
+	HashWork::verify(h);
 }
 
 } // end Bt namespace
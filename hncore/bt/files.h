@@ -263,9 +263,7 @@ private:
 		//! Physical location on disk
 		boost::filesystem::path m_loc;
 		//! Data buffer for non-flushed data
-		std::map<uint64_t, std::string> m_buffer;
-		//! Makes life simpler
-		typedef std::map<uint64_t, std::string>::iterator BIter;
+		WriteBuffer m_buffer;
 	};
 
 	/**
@@ -416,6 +414,11 @@ public:
 	 * @returns true if this job can be run now (no allocations pending)
 	 */
 	bool canRun() const { return !m_waiting.size(); }
+
+	//! Only jobs within a single file can be batched
+	virtual bool canBatch() {
+		return m_files.size() == 1 && HashWork::canBatch();
+	}
 protected:
 	/**
 	 * Read next data from file
@@ -432,7 +435,7 @@ protected:
 	 * offsets in order to find the chunk that needed this hash job, thus
 	 * the modification must be done prior to the events being posted.
 	 */
-	virtual void finish();
+	virtual void verify(const HashBase &h);
 private:
 	//! Files for this work
 	std::vector<boost::filesystem::path> m_files;
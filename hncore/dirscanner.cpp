@@ -0,0 +1,397 @@
+/*
+ *  Copyright (C) 2004-2006 Alo Sarv <madcat_@users.sourceforge.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/**
+ * \file dirscanner.cpp Implementation of DirScanner class
+ */
+
+#include <hncore/pch.h>
+#include <hncore/dirscanner.h>
+#include <hnbase/prefs.h>
+#include <boost/filesystem/operations.hpp>
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/algorithm/string/case_conv.hpp>
+#include <boost/bind.hpp>
+
+#ifdef __linux__
+	#define HAVE_INOTIFY
+	#include <sys/inotify.h>
+	#include <poll.h>
+	#include <unistd.h>
+#endif
+
+IMPLEMENT_EVENT_TABLE(DirScanner, DirScanner*, DirScanner::DeltaPtr);
+
+DirScanner::DirScanner() : m_exiting(), m_started(), m_inotify(-1) {
+#ifdef HAVE_INOTIFY
+	m_inotify = inotify_init();
+	if (m_inotify == -1) {
+		logDebug(
+			boost::format("Unable to watch shared directories: %s")
+			% strerror(errno)
+		);
+	}
+#endif
+}
+
+DirScanner::~DirScanner() {
+	exit();
+}
+
+DirScanner& DirScanner::instance() {
+	static DirScanner ds;
+	return ds;
+}
+
+bool DirScanner::isIgnored(const std::string &name) {
+	std::string fName(name);
+	boost::algorithm::to_lower(fName);
+	return boost::algorithm::starts_with(fName, "albumart")
+		|| fName == "folder.jpg"
+		|| fName == "thumbs.db"
+		|| fName == "desktop.ini";
+}
+
+bool DirScanner::canWatch() const {
+	return m_inotify != -1;
+}
+
+// threads are started on first scan, so they don't exist when not sharing
+void DirScanner::start() {
+	if (m_started) {
+		return;
+	}
+	m_started = true;
+	uint32_t cnt = Prefs::instance().read<uint32_t>("/ScanThreads", 4);
+	for (uint32_t i = 0; i < std::max<uint32_t>(cnt, 1); ++i) {
+		m_workers.create_thread(
+			boost::bind(&DirScanner::workerLoop, this)
+		);
+	}
+	if (canWatch()) {
+		m_watcher.reset(new boost::thread(
+			boost::bind(&DirScanner::watchLoop, this)
+		));
+	}
+}
+
+void DirScanner::exit() {
+	{
+		boost::mutex::scoped_lock l(m_lock);
+		m_exiting = true;
+		m_tasks.clear();
+		m_notify.notify_all();
+	}
+	m_workers.join_all();
+	if (m_watcher) {
+		m_watcher->join();
+		m_watcher.reset();
+	}
+#ifdef HAVE_INOTIFY
+	if (m_inotify != -1) {
+		close(m_inotify);
+		m_inotify = -1;
+	}
+#endif
+}
+
+void DirScanner::scan(const std::string &root, bool recurse) {
+	boost::mutex::scoped_lock l(m_lock);
+	if (m_exiting) {
+		return;
+	}
+	start();
+	Root &r = m_roots[root];
+	r.m_recurse = recurse;
+	r.m_pending = 1;
+	Task t;
+	t.m_root = root;
+	t.m_dir = boost::filesystem::path(root, boost::filesystem::no_check);
+	t.m_recurse = recurse;
+	t.m_generation = ++r.m_generation;
+	m_tasks.push_back(t);
+	m_notify.notify_all();
+}
+
+void DirScanner::remove(const std::string &root) {
+	boost::mutex::scoped_lock l(m_lock);
+	m_roots.erase(root);
+	typedef std::map<
+		int, std::pair<std::string, boost::filesystem::path>
+	>::iterator WIter;
+	for (WIter i = m_watches.begin(); i != m_watches.end();) {
+		if ((*i).second.first == root) {
+#ifdef HAVE_INOTIFY
+			inotify_rm_watch(m_inotify, (*i).first);
+#endif
+			m_watches.erase(i++);
+		} else {
+			++i;
+		}
+	}
+}
+
+void DirScanner::workerLoop() {
+	while (true) {
+		Task task;
+		{
+			boost::mutex::scoped_lock l(m_lock);
+			while (m_tasks.empty() && !m_exiting) {
+				m_notify.wait(l);
+			}
+			if (m_exiting) {
+				return;
+			}
+			task = m_tasks.front();
+			m_tasks.pop_front();
+			if (!isCurrent(task)) {
+				continue;
+			}
+		}
+		scanDir(task);
+	}
+}
+
+// The directory is watched before enumerating it, so no files created in the
+// meantime are missed. Subdirectories are queued before this task is marked
+// finished, so the scan isn't considered done prematurely.
+void DirScanner::scanDir(const Task &task) {
+	using namespace boost::filesystem;
+
+	watch(task.m_root, task.m_dir);
+
+	DeltaPtr delta(new Delta(task.m_root));
+	std::vector<path> subdirs;
+	try {
+		directory_iterator end;
+		for (directory_iterator i(task.m_dir); i != end; ++i) try {
+			if (is_directory(*i)) {
+				if (task.m_recurse) {
+					subdirs.push_back(*i);
+				}
+				continue;
+			}
+			if (isIgnored((*i).leaf())) {
+				continue;
+			}
+			delta->m_added.push_back(*i);
+			if (delta->m_added.size() == BATCH_SIZE) {
+				post(task, delta, false);
+				delta.reset(new Delta(task.m_root));
+			}
+		} catch (std::exception &e) {
+			logDebug(
+				boost::format("Scanning shared directories: %s")
+				% e.what()
+			);
+		}
+	} catch (std::exception &e) {
+		logError(
+			boost::format("Scanning shared directory %s: %s")
+			% task.m_dir.native_directory_string() % e.what()
+		);
+	}
+
+	if (subdirs.size()) {
+		boost::mutex::scoped_lock l(m_lock);
+		if (isCurrent(task)) {
+			for (uint32_t i = 0; i < subdirs.size(); ++i) {
+				Task t(task);
+				t.m_dir = subdirs[i];
+				m_tasks.push_back(t);
+			}
+			m_roots[task.m_root].m_pending += subdirs.size();
+			m_notify.notify_all();
+		}
+	}
+	post(task, delta, true);
+}
+
+bool DirScanner::isCurrent(const Task &task) const {
+	std::map<std::string, Root>::const_iterator i;
+	i = m_roots.find(task.m_root);
+	return i != m_roots.end()
+		&& (*i).second.m_generation == task.m_generation;
+}
+
+// Posting is done under the lock, so that the delta of the last finished task
+// is always posted after the deltas of other tasks.
+void DirScanner::post(const Task &task, DeltaPtr delta, bool finished) {
+	boost::mutex::scoped_lock l(m_lock);
+	if (!isCurrent(task)) {
+		return;
+	}
+	if (finished && !--m_roots[task.m_root].m_pending) {
+		delta->m_done = true;
+	}
+	if (delta->m_added.size() || delta->m_done) {
+		getEventTable().postEvent(this, delta);
+	}
+}
+
+#ifndef HAVE_INOTIFY
+
+void DirScanner::watch(const std::string &, const boost::filesystem::path &) {}
+void DirScanner::watchLoop() {}
+void DirScanner::onChanges(const char *, uint32_t) {}
+
+#else
+
+void DirScanner::watch(
+	const std::string &root, const boost::filesystem::path &dir
+) {
+	if (!canWatch()) {
+		return;
+	}
+	int wd = inotify_add_watch(
+		m_inotify, dir.native_directory_string().c_str(),
+		IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM
+		| IN_MOVED_TO | IN_ONLYDIR
+	);
+	if (wd == -1) {
+		// usually fs.inotify.max_user_watches has been reached
+		logDebug(
+			boost::format("Unable to watch directory %s: %s")
+			% dir.native_directory_string() % strerror(errno)
+		);
+		return;
+	}
+	boost::mutex::scoped_lock l(m_lock);
+	if (m_roots.find(root) == m_roots.end()) {
+		inotify_rm_watch(m_inotify, wd); // removed meanwhile
+	} else {
+		m_watches[wd] = std::make_pair(root, dir);
+	}
+}
+
+// poll() timeout allows checking for exit
+void DirScanner::watchLoop() {
+	std::vector<char> buf(64 * 1024);
+	while (true) {
+		{
+			boost::mutex::scoped_lock l(m_lock);
+			if (m_exiting) {
+				return;
+			}
+		}
+		pollfd p;
+		p.fd = m_inotify;
+		p.events = POLLIN;
+		p.revents = 0;
+		if (poll(&p, 1, 500) <= 0) {
+			continue;
+		}
+		ssize_t len = read(m_inotify, &buf[0], buf.size());
+		if (len > 0) {
+			onChanges(&buf[0], len);
+		}
+	}
+}
+
+// Files are reported once they have been closed after writing, or moved into
+// the directory; created subdirectories are scanned (which also starts
+// watching them). When the kernel queue overflows, events have been lost, so
+// all directories are scanned again.
+void DirScanner::onChanges(const char *buf, uint32_t len) {
+	using boost::filesystem::path;
+	using boost::filesystem::no_check;
+	typedef std::map<
+		int, std::pair<std::string, boost::filesystem::path>
+	>::iterator WIter;
+
+	bool overflow = false;
+	std::map<std::string, DeltaPtr> deltas;
+	boost::mutex::scoped_lock l(m_lock);
+	uint32_t pos = 0;
+	while (pos + sizeof(inotify_event) <= len) {
+		const inotify_event *e = reinterpret_cast<const inotify_event*>(
+			buf + pos
+		);
+		pos += sizeof(inotify_event) + e->len;
+		if (e->mask & IN_Q_OVERFLOW) {
+			overflow = true;
+			continue;
+		}
+		WIter i = m_watches.find(e->wd);
+		if (i == m_watches.end()) {
+			continue;
+		} else if (e->mask & IN_IGNORED) {
+			m_watches.erase(i); // directory was removed
+			continue;
+		} else if (!e->len) {
+			continue;
+		}
+		std::map<std::string, Root>::iterator r;
+		r = m_roots.find((*i).second.first);
+		if (r == m_roots.end()) {
+			continue;
+		}
+		path p = (*i).second.second / path(e->name, no_check);
+		DeltaPtr &d = deltas[(*r).first];
+		if (!d) {
+			d.reset(new Delta((*r).first));
+		}
+		if (e->mask & IN_ISDIR) {
+			if (e->mask & (IN_CREATE | IN_MOVED_TO)) {
+				Root &root = (*r).second;
+				if (root.m_recurse) {
+					Task t;
+					t.m_root = (*r).first;
+					t.m_dir = p;
+					t.m_recurse = true;
+					t.m_generation = root.m_generation;
+					m_tasks.push_back(t);
+					++root.m_pending;
+					m_notify.notify_all();
+				}
+			} else if (e->mask & (IN_DELETE | IN_MOVED_FROM)) {
+				d->m_removedDirs.push_back(p);
+			}
+		} else if (e->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+			if (!isIgnored(e->name)) {
+				d->m_added.push_back(p);
+			}
+		} else if (e->mask & (IN_DELETE | IN_MOVED_FROM)) {
+			d->m_removed.push_back(p);
+		}
+	}
+	std::map<std::string, DeltaPtr>::iterator i = deltas.begin();
+	for (; i != deltas.end(); ++i) {
+		const Delta &d = *(*i).second;
+		if (d.m_added.size() || d.m_removed.size()
+			|| d.m_removedDirs.size()) {
+			getEventTable().postEvent(this, (*i).second);
+		}
+	}
+	if (!overflow) {
+		return;
+	}
+	logDebug("Directory change notifications lost; rescanning.");
+	std::map<std::string, bool> roots;
+	std::map<std::string, Root>::iterator j = m_roots.begin();
+	for (; j != m_roots.end(); ++j) {
+		roots[(*j).first] = (*j).second.m_recurse;
+	}
+	l.unlock();
+	std::map<std::string, bool>::iterator k = roots.begin();
+	for (; k != roots.end(); ++k) {
+		scan((*k).first, (*k).second);
+	}
+}
+
+#endif
@@ -0,0 +1,160 @@
+/*
+ *  Copyright (C) 2004-2006 Alo Sarv <madcat_@users.sourceforge.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/**
+ * \file dirscanner.h Interface for DirScanner class
+ */
+
+#ifndef __DIRSCANNER_H__
+#define __DIRSCANNER_H__
+
+#include <hnbase/event.h>
+#include <hncore/fwd.h>
+#include <boost/filesystem/path.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread.hpp>
+#include <deque>
+#include <map>
+#include <vector>
+
+/**
+ * DirScanner enumerates shared directories in a pool of worker threads
+ * (/ScanThreads preference, default 4), so large directory trees don't block
+ * the main loop. Subdirectories of a recursive scan are queued as separate
+ * tasks, and are thus enumerated in parallel.
+ *
+ * Where supported (inotify on Linux), scanned directories are also watched
+ * for changes: files written, deleted or renamed, and subdirectories created
+ * in recursively shared directories, are reported as they happen, so the
+ * directories never need to be scanned again.
+ *
+ * The results are delivered in the main thread through the event table, as
+ * Delta objects; files found by scanning are delivered in batches of up to
+ * BATCH_SIZE files.
+ */
+class HNCORE_EXPORT DirScanner : public boost::noncopyable {
+public:
+	//! Changes found in a shared directory
+	struct Delta {
+		Delta(const std::string &root) : m_root(root), m_done() {}
+
+		//! Shared directory, as passed to scan()
+		std::string m_root;
+		//! Files found, or written to
+		std::vector<boost::filesystem::path> m_added;
+		//! Files removed
+		std::vector<boost::filesystem::path> m_removed;
+		//! Directories removed, along with all of their contents
+		std::vector<boost::filesystem::path> m_removedDirs;
+		//! Whether this is the last Delta of a scan
+		bool m_done;
+	};
+	typedef boost::shared_ptr<Delta> DeltaPtr;
+
+	DECLARE_EVENT_TABLE(DirScanner*, DeltaPtr);
+
+	static DirScanner& instance();
+
+	//! Maximum number of changes in a Delta
+	static const uint32_t BATCH_SIZE = 1000;
+
+	/**
+	 * Start scanning a directory, and watching it for changes afterwards.
+	 * If the directory is already being scanned, the scan is restarted.
+	 *
+	 * @param root     Directory to scan
+	 * @param recurse  Whether to scan subdirectories as well
+	 */
+	void scan(const std::string &root, bool recurse);
+
+	/**
+	 * Stop scanning and watching a directory; pending results of the scan
+	 * are discarded.
+	 *
+	 * @param root     Directory passed to scan()
+	 */
+	void remove(const std::string &root);
+
+	//! Whether directories are watched for changes
+	bool canWatch() const;
+
+	//! Stop all threads; called on shutdown
+	void exit();
+
+	//! Whether a file should not be shared, based on its name
+	static bool isIgnored(const std::string &name);
+private:
+	DirScanner();
+	~DirScanner();
+
+	//! Directory to be enumerated
+	struct Task {
+		std::string m_root;               //!< Shared directory
+		boost::filesystem::path m_dir;    //!< Directory to enumerate
+		bool m_recurse;                   //!< Queue subdirectories
+		uint32_t m_generation;            //!< Root generation
+	};
+
+	//! State of shared directory
+	struct Root {
+		Root() : m_recurse(), m_generation(), m_pending() {}
+		bool m_recurse;                   //!< Scanned recursively
+		uint32_t m_generation;            //!< Increased on each scan()
+		uint32_t m_pending;               //!< Tasks not finished
+	};
+
+	//! Start worker threads, unless already started
+	void start();
+	//! Worker thread loop
+	void workerLoop();
+	//! Enumerate directory in worker thread
+	void scanDir(const Task &task);
+	//! Post delta, unless the scan is obsolete; updates pending count
+	void post(const Task &task, DeltaPtr delta, bool finished);
+	//! Whether task belongs to the latest scan of its root; needs m_lock
+	bool isCurrent(const Task &task) const;
+
+	std::map<std::string, Root> m_roots;  //!< Shared directories
+	std::deque<Task> m_tasks;             //!< Pending tasks
+	boost::mutex m_lock;                  //!< Protects all of the above
+	boost::condition m_notify;            //!< Signals new tasks
+	bool m_exiting;                       //!< Threads should exit
+	boost::thread_group m_workers;        //!< Worker threads
+	bool m_started;                       //!< Workers have been started
+
+	/**
+	 * @name Watching for changes
+	 */
+	//!@{
+	//! Start watching directory; called from worker thread
+	void watch(const std::string &root, const boost::filesystem::path &d);
+	//! Change watcher thread loop
+	void watchLoop();
+	//! Handle change notifications read from m_inotify
+	void onChanges(const char *buf, uint32_t len);
+
+	int m_inotify;                        //!< Notification descriptor
+	//! Watched directories, with their roots; protected by m_lock
+	std::map<int, std::pair<std::string, boost::filesystem::path> >
+		m_watches;
+	boost::scoped_ptr<boost::thread> m_watcher; //!< Change watcher thread
+	//!@}
+};
+
+#endif
@@ -28,6 +28,8 @@
 #include <hncore/metadb.h>
 #include <hncore/metadata.h>
 #include <hnbase/ssocket.h>
+#include <hnbase/prefs.h>
+#include <set>
 
 namespace Donkey {
 
@@ -48,14 +50,27 @@ const std::string TRACE_CLIENT = "ed2k.client";
  */
 const uint32_t SEND_TO_ONE_CLIENT = 53 * ED2K_CHUNKSIZE;
 
+/**
+ * Round-trip time (ms) assumed for a download source until it is measured.
+ */
+const uint32_t DEFAULT_RTT = 500;
+
+/**
+ * Max number of chunks requested from a single download source at a time;
+ * three ReqChunks packets worth.
+ */
+const uint32_t MAX_PIPELINE = 9;
+
 //! \name Object counters
 //!@{
 size_t s_queueInfoCnt = 0;
 size_t s_uploadInfoCnt = 0;
-size_t s_downloadInfoCnt = 0;
 size_t s_sourceInfoCnt = 0;
 //!@}
 
+//! DownloadInfo objects alive, for taking over chunks of slower sources
+std::set<DownloadInfo*> s_downloads;
+
 // QueueInfo class
 // ---------------
 QueueInfo::QueueInfo(Client *parent, SharedFile *req, const Hash<ED2KHash> &h)
@@ -125,12 +140,35 @@ void UploadInfo::connectSpeeder() {
 }
 
 // buffer first data chunk into memory
-void UploadInfo::bufferData() {
+void UploadInfo::bufferData(bool compress) {
 	CHECK_THROW(m_reqFile);
 	CHECK_THROW(m_reqChunks.size());
 
 	m_curPos = m_reqChunks.front().begin();
 	m_endPos = m_reqChunks.front().end();
+	m_compressed = false;
+
+	Compressor &comp = Compressor::instance();
+	std::string packed;
+	if (compress && comp.find(m_reqHash, m_reqChunks.front(), &packed)) {
+		if (packed.size()) {
+			setCompressed(packed);
+			return;
+		}
+		compress = false; // known not to compress
+	}
+
+	bool sendFile = Prefs::instance().read<bool>("/ed2k/SendFile", true);
+	if (sendFile && !compress && !m_reqFile->isPartial()) {
+		m_file = m_reqFile->openRegion(m_curPos, m_endPos);
+		m_compressed = false;
+		logTrace(TRACE_CLIENT,
+			boost::format("[%s] Sending upload data from file "
+			"(%d..%d)") % m_parent->getIpPort() % m_curPos
+			% m_endPos
+		);
+		return;
+	}
 	m_buffer = m_reqFile->read(m_curPos, m_endPos);
 
 	logTrace(TRACE_CLIENT,
@@ -138,25 +176,37 @@ void UploadInfo::bufferData() {
 		m_parent->getIpPort() % m_curPos % m_endPos % m_buffer.size()
 	);
 	CHECK_THROW_MSG(m_buffer.size(), "UploadBuffering failed!");
-}
-
-// Compress the upload buffer
-bool UploadInfo::compress() {
-	CHECK_THROW(m_buffer.size());
 
-	Utils::StopWatch s;
-	std::string tmp = Zlib::compress(m_buffer);
-	logTrace(TRACE_CLIENT, boost::format("Data compression took %dms.") %s);
+	if (compress) {
+		m_job = comp.compress(m_reqHash, m_reqChunks.front(), m_buffer);
+	}
+	if (m_job) {
+		m_jobConn = CompressJob::getEventTable().addHandler(
+			m_job, this, &UploadInfo::onCompressed
+		);
+	}
+}
 
-	if (tmp.size() < m_buffer.size()) {
-		m_buffer = tmp;
-		m_compressed = true;
-		m_endPos = m_buffer.size();
-		return true;
-	} else {
-		m_compressed = false;
-		return false;
+void UploadInfo::onCompressed(CompressJobPtr, bool ok) {
+	m_jobConn.disconnect();
+	CompressJobPtr job = m_job;
+	m_job = CompressJobPtr();
+	if (ok) {
+		setCompressed(job->getResult());
 	}
+	m_parent->sendNextChunk();
+}
+
+// m_endPos holds the size of compressed data from now on; see getNext()
+void UploadInfo::setCompressed(const std::string &data) {
+	logTrace(TRACE_CLIENT,
+		boost::format("[%s] Sending compressed data (%d..%d, %d -> %d)")
+		% m_parent->getIpPort() % m_curPos % m_endPos
+		% (m_endPos - m_curPos + 1) % data.size()
+	);
+	m_buffer = data;
+	m_compressed = true;
+	m_endPos = m_buffer.size();
 }
 
 // retrieve next chunks
@@ -166,17 +216,21 @@ UploadInfo::getNext(uint32_t amount) {
 		amount = m_buffer.size();
 	}
 
+	// all parts of compressed data carry the begin offset of the chunk,
+	// and the total size of the compressed data
 	boost::tuple<uint32_t, uint32_t, std::string> ret;
 	ret.get<0>() = m_curPos;
 	if (m_compressed) {
-		ret.get<1>() = m_reqChunks.front().length();
+		ret.get<1>() = m_endPos;
 	} else {
 		ret.get<1>() = m_curPos + amount;
 	}
 	ret.get<2>() = m_buffer.substr(0, amount);
 
 	m_buffer.erase(0, amount);
-	m_curPos += amount;
+	if (!m_compressed) {
+		m_curPos += amount;
+	}
 
 	if (m_buffer.size() == 0 && m_reqChunks.size()) {
 		m_reqChunks.pop_front();
@@ -187,6 +241,31 @@ UploadInfo::getNext(uint32_t amount) {
 	return ret;
 }
 
+// m_endPos is inclusive here, since no compression is done
+FileHandlePtr UploadInfo::getNextRegion(
+	uint32_t amount, uint32_t *begin, uint32_t *end
+) {
+	CHECK_THROW(m_file);
+	if (m_endPos + 1 - m_curPos < amount) {
+		amount = m_endPos + 1 - m_curPos;
+	}
+	*begin = m_curPos;
+	*end = m_curPos + amount;
+	FileHandlePtr ret = m_file;
+
+	m_curPos += amount;
+	if (m_curPos > m_endPos) {
+		m_file.reset();
+		if (m_reqChunks.size()) {
+			m_reqChunks.pop_front();
+		}
+	}
+
+	m_sent += amount; // update sent count
+
+	return ret;
+}
+
 // Add a new requested chunk (but only if we don't have this in our list
 // already).
 //
@@ -415,10 +494,10 @@ void SourceInfo::addFileName(MetaData *md, const std::string &name) {
 // ------------------
 DownloadInfo::DownloadInfo(Client *parent, PartData *pd, PartMapPtr partMap)
 : ClientExtBase(parent), m_reqPD(pd), m_partMap(partMap), m_packedBegin(),
-m_received() {
+m_received(), m_rtt(), m_probe(0, 0), m_probeTime() {
 	CHECK_THROW(pd);
 	CHECK_THROW(partMap);
-	++s_downloadInfoCnt;
+	s_downloads.insert(this);
 	m_speeder = pd->getDownSpeed.connect(
 		boost::bind(
 			&ED2KClientSocket::getDownSpeed, m_parent->getSocket()
@@ -451,20 +530,57 @@ DownloadInfo::~DownloadInfo() {
 			"[%s] DownloadSessionEnd: Total received: %d bytes"
 		) % m_parent->getIpPort() % m_received
 	);
-	--s_downloadInfoCnt;
+	s_downloads.erase(this);
 	m_speeder.disconnect();
 	m_parent->setDownloading(false, m_reqPD);
 }
 
 size_t DownloadInfo::count() {
-	return s_downloadInfoCnt;
+	return s_downloads.size();
 }
 
-std::list<Range32> DownloadInfo::getChunkReqs() try {
+std::list<Range32> DownloadInfo::getChunkReqs(bool onlyNew) {
 	CHECK_THROW(m_reqPD);
 
-	if (!m_curPart) {
-		m_curPart = m_reqPD->getRange(ED2K_PARTSIZE, *m_partMap);
+	bool idle = m_reqChunks.empty();
+	uint32_t depth = getPipeline();
+	std::list<Range32> tmp;
+	while (m_reqChunks.size() < depth) {
+		::Detail::LockedRangePtr lock(getNextLock());
+		if (!lock) {
+			break;
+		}
+		m_reqChunks.push_back(lock);
+		tmp.push_back(*lock);
+	}
+	if (m_reqChunks.empty()) {
+		throw std::runtime_error("No more needed parts");
+	}
+	if (idle && tmp.size()) {
+		m_probe = tmp.front();
+		m_probeTime = Utils::getTick();
+	}
+	if (!onlyNew) {
+		tmp.clear();
+		for (Iter i = m_reqChunks.begin(); i != m_reqChunks.end(); ++i){
+			tmp.push_back(*(*i));
+		}
+	}
+	return tmp;
+}
+
+::Detail::LockedRangePtr DownloadInfo::getNextLock() {
+	while (true) {
+		if (!m_curPart) {
+			m_curPart = m_reqPD->getRange(
+				ED2K_PARTSIZE, *m_partMap
+			);
+		}
+		if (!m_curPart && stealChunk()) {
+			m_curPart = m_reqPD->getRange(
+				ED2K_PARTSIZE, *m_partMap
+			);
+		}
 		if (!m_curPart) {
 			logTrace(TRACE_CLIENT,
 				boost::format(
@@ -473,36 +589,81 @@ std::list<Range32> DownloadInfo::getChunkReqs() try {
 					"already locked."
 				) % m_parent->getIpPort()
 			);
-			throw std::runtime_error("No more needed parts");
+			return ::Detail::LockedRangePtr();
 		}
-	}
-	while (m_reqChunks.size() < 3) {
 		::Detail::LockedRangePtr lock(
 			m_curPart->getLock(ED2K_CHUNKSIZE)
 		);
-		if (!lock) {
-			m_curPart.reset();
-			return getChunkReqs();
+		if (lock) {
+			return lock;
 		}
-		m_reqChunks.push_back(lock);
-	}
-	std::list<Range32> tmp;
-	for (Iter i = m_reqChunks.begin(); i != m_reqChunks.end(); ++i) {
-		tmp.push_back(*(*i));
+		m_curPart.reset();
 	}
-	return tmp;
-} catch (std::exception&) {
-	if (m_reqChunks.size()) {
-		std::list<Range32> tmp;
-		for (Iter i = m_reqChunks.begin(); i != m_reqChunks.end(); ++i){
-			tmp.push_back(*(*i));
+}
+
+uint32_t DownloadInfo::getPipeline() const {
+	ED2KClientSocket *sock = m_parent->getSocket();
+	uint64_t speed = sock ? sock->getDownSpeed() : 0;
+	uint64_t inFlight = speed * (m_rtt ? m_rtt : DEFAULT_RTT) / 1000;
+	uint32_t cnt = 2 + inFlight / ED2K_CHUNKSIZE;
+	return std::min(std::max(cnt, 3u), MAX_PIPELINE);
+}
+
+bool DownloadInfo::stealChunk() {
+	ED2KClientSocket *sock = m_parent->getSocket();
+	uint32_t speed = sock ? sock->getDownSpeed() : 0;
+	DownloadInfo *victim = 0;
+	uint32_t victimSpeed = 0;
+
+	std::set<DownloadInfo*>::iterator i = s_downloads.begin();
+	for (; i != s_downloads.end(); ++i) {
+		DownloadInfo *d = *i;
+		if (d == this || d->m_reqPD != m_reqPD) {
+			continue;
+		} else if (d->m_reqChunks.size() < 2) {
+			continue; // only the chunk being received
 		}
-		return tmp;
-	} else {
-		throw;
+		uint64_t part = d->m_reqChunks.back()->begin() / ED2K_PARTSIZE;
+		if (m_partMap->size() && !m_partMap->at(part)) {
+			continue; // this client doesn't have it
+		}
+		sock = d->m_parent->getSocket();
+		uint32_t s = sock ? sock->getDownSpeed() : 0;
+		if (s * 2 >= speed) {
+			continue;
+		} else if (!victim || s < victimSpeed) {
+			victim = d;
+			victimSpeed = s;
+		}
+	}
+	if (!victim) {
+		return false;
 	}
+
+	logTrace(TRACE_CLIENT,
+		boost::format(
+			"[%s] Taking over chunk %d..%d from slower source "
+			"%s (%d vs %d bytes/s)"
+		) % m_parent->getIpPort() % victim->m_reqChunks.back()->begin()
+		% victim->m_reqChunks.back()->end()
+		% victim->m_parent->getIpPort() % victimSpeed % speed
+	);
+	victim->m_reqChunks.pop_back();
+	return true;
+}
+
+void DownloadInfo::onData(uint64_t offset) {
+	if (!m_probeTime || !m_probe.contains(offset)) {
+		return;
+	}
+	uint32_t sample = Utils::getTick() - m_probeTime;
+	m_rtt = m_rtt ? (m_rtt * 3 + sample) / 4 : sample;
+	m_probeTime = 0;
+	logTrace(TRACE_CLIENT,
+		boost::format("[%s] Round-trip time %dms (estimate %dms)")
+		% m_parent->getIpPort() % sample % m_rtt
+	);
 }
-MSVC_ONLY(;)
 
 bool DownloadInfo::write(Range32 r, const std::string &data) try {
 	CHECK_THROW(m_reqPD);
@@ -513,6 +674,8 @@ bool DownloadInfo::write(Range32 r, const std::string &data) try {
 		return false; // nothing to do
 	}
 
+	onData(r.begin());
+
 	Iter i = m_reqChunks.begin();
 	for (; i != m_reqChunks.end() && !(*i)->contains(r); ++i);
 	CHECK_THROW(i != m_reqChunks.end());
@@ -545,6 +708,7 @@ bool DownloadInfo::writePacked(
 	CHECK_THROW(m_reqPD);
 	CHECK_THROW(m_reqChunks.size());
 
+	onData(begin);
 	m_packedBegin = begin;
 	m_packedBuffer.append(data);
 
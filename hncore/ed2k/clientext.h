@@ -25,6 +25,8 @@
 
 #include <hncore/ed2k/fwd.h>
 #include <hncore/ed2k/downloadlist.h>
+#include <hncore/ed2k/compressor.h>
+#include <hnbase/bufferchain.h>
 #include <hnbase/hash.h>
 #include <hnbase/range.h>
 #include <hncore/fwd.h>
@@ -74,7 +76,9 @@ public:
 	Hash<ED2KHash> getReqHash()   const { return m_reqHash;          }
 	uint32_t       getSent()      const { return m_sent;             }
 	bool           isCompressed() const { return m_compressed;       }
-	bool           hasBuffered()  const { return m_buffer.size();    }
+	bool           hasBuffered()  const { return m_buffer.size() || m_file; }
+	bool           isFromFile()   const { return m_file.get() != 0;  }
+	bool           isCompressing() const { return m_job.get() != 0;  }
 	uint8_t   getReqChunkCount()  const { return m_reqChunks.size(); }
 
 	void setReqFile(SharedFile *sf)          { m_reqFile = sf;     }
@@ -83,16 +87,19 @@ public:
 	//@}
 
 	/**
-	 * Reads first chunk in m_reqChunks into m_buffer from disk
-	 */
-	void bufferData();
-
-	/**
-	 * Attempts to compress the current m_buffer.
+	 * Reads first chunk in m_reqChunks into m_buffer from disk. Complete
+	 * files are instead only opened, and the data is sent directly from
+	 * the file later (see getNextRegion()), unless disabled with
+	 * /ed2k/SendFile preference.
+	 *
+	 * If compression is requested, the compressed chunk is taken from
+	 * Compressor cache if possible; otherwise the data is read into
+	 * m_buffer and passed to Compressor, and isCompressing() returns true
+	 * until it's done, at which point the parent's upload is resumed.
 	 *
-	 * @return true if compression succeeded, false otherwise
+	 * @param compress   Whether to compress the data
 	 */
-	bool compress();
+	void bufferData(bool compress = false);
 
 	/**
 	 * Get next data chunk from m_buffer. The requested data is
@@ -110,6 +117,19 @@ public:
 	 */
 	boost::tuple<uint32_t, uint32_t, std::string> getNext(uint32_t amount);
 
+	/**
+	 * Get next region to be sent directly from file; the counterpart of
+	 * getNext() when isFromFile() is true.
+	 *
+	 * @param amount     Amount of data to retrieve
+	 * @param begin      Receives begin offset of the region
+	 * @param end        Receives end offset of the region (exclusive)
+	 * @return           File to send the region from
+	 */
+	FileHandlePtr getNextRegion(
+		uint32_t amount, uint32_t *begin, uint32_t *end
+	);
+
 	/**
 	 * Connects speedmeter to parent client's socket
 	 */
@@ -118,6 +138,12 @@ public:
 	//! \returns Number of UploadInfo objects alive
 	static size_t count();
 private:
+	//! Event handler for the compression job of current chunk
+	void onCompressed(CompressJobPtr job, bool ok);
+
+	//! Replace m_buffer with compressed data
+	void setCompressed(const std::string &data);
+
 	//! Requested file
 	SharedFile *m_reqFile;
 
@@ -135,6 +161,9 @@ private:
 	 */
 	std::string m_buffer;
 
+	//! Open file, if the current chunk is sent directly from file
+	FileHandlePtr m_file;
+
 	/**
 	 * If the client is uploading, this is the current uploading position.
 	 */
@@ -154,6 +183,12 @@ private:
 	 */
 	bool m_compressed;
 
+	//! Compression job in progress for current buffer
+	CompressJobPtr m_job;
+
+	//! Connected to the event table of m_job
+	boost::signals::scoped_connection m_jobConn;
+
 	/**
 	 * How much data (excluding overhead) have we sent to this client during
 	 * this session. We should send 9.28mb to every client and then
@@ -256,18 +291,27 @@ public:
 	PartData* getReqPD() const { return m_reqPD; }
 
 	/**
-	 * Generate three chunk requests to be downloaded from this client. Call
-	 * this method AFTER selecting a part using selectPart() method.
+	 * Generate chunk requests to be downloaded from this client. Enough
+	 * chunks are kept requested to cover the data this client sends us
+	 * during one request round-trip (see getPipeline()), so the transfer
+	 * doesn't stall while the next request is underway.
 	 *
-	 * Note that in ed2k network, chunk requests are used in overlapping
-	 * manner, e.g. each next chunk request contains two previous ranges
-	 * plus one new range, and a new chunk request is sent after each chunk
-	 * is downloaded. This method takes care of these details, and returns
-	 * three chunk requests ready to be sent out to the uploader.
+	 * When no more chunks can be locked (usually near the end of the
+	 * download), chunks which slower sources have requested, but not
+	 * started receiving yet, are taken over.
 	 *
-	 * @return    Up to three requested chunks of size <= 180kb each
+	 * @param onlyNew   Only return chunks which weren't requested yet
+	 * @return          Requested chunks of size <= 180kb each
+	 * \throws         std::runtime_error if there is nothing to request
 	 */
-	std::list<Range32> getChunkReqs();
+	std::list<Range32> getChunkReqs(bool onlyNew = false);
+
+	/**
+	 * Number of chunks to keep requested from this client; the data
+	 * received during one round-trip (download speed * round-trip time),
+	 * plus the chunk being received, and one chunk as margin; at least 3.
+	 */
+	uint32_t getPipeline() const;
 
 	/**
 	 * Write data to the underlying temp file.
@@ -296,6 +340,21 @@ public:
 private:
 	typedef std::list< ::Detail::LockedRangePtr >::iterator Iter;
 
+	//! Lock next chunk within current part, selecting a new part if needed
+	::Detail::LockedRangePtr getNextLock();
+
+	/**
+	 * Release the last requested chunk of the slowest source downloading
+	 * the same file, which has more than one chunk requested and is less
+	 * than half as fast as this one, so it can be locked by this client.
+	 *
+	 * @return          True if a chunk was released
+	 */
+	bool stealChunk();
+
+	//! Update round-trip time estimate when data arrives at offset
+	void onData(uint64_t offset);
+
 	PartData         *m_reqPD;   //!< Requested file
 
 	//!< The chunks the remote party has of this file
@@ -303,7 +362,7 @@ private:
 
 	::Detail::UsedRangePtr m_curPart;   //!< Current active <=9500kb part
 
-	//! Currently locked up to 3 chunks
+	//! Currently locked and requested chunks, in the order requested
 	std::list< ::Detail::LockedRangePtr > m_reqChunks;
 
 	std::string m_packedBuffer; //!< Internal buffer for packed data
@@ -312,6 +371,16 @@ private:
 	//! How much data we have received during this download session
 	uint32_t m_received;
 
+	/**
+	 * Round-trip time is measured from requests sent when there was no
+	 * data coming in from the client, to the first data of those.
+	 */
+	//!@{
+	uint32_t m_rtt;           //!< Estimated round-trip time (ms)
+	Range64 m_probe;          //!< Chunk being measured
+	uint64_t m_probeTime;     //!< When it was requested; 0 if none
+	//!@}
+
 	//! Connection between socket's speedmeter and PartData getSpeed signal
 	boost::signals::connection m_speeder;
 };
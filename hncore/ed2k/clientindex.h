@@ -0,0 +1,151 @@
+/*
+ *  Copyright (C) 2004-2006 Alo Sarv <madcat_@users.sourceforge.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/**
+ * \file clientindex.h Lookup keys and dead source filter used by ClientList
+ */
+
+#ifndef __ED2K_CLIENTINDEX_H__
+#define __ED2K_CLIENTINDEX_H__
+
+#include <hnbase/osdep.h>
+#include <hnbase/cuckoofilter.h>
+#include <hnbase/hash.h>
+#include <boost/noncopyable.hpp>
+#include <cstring>
+
+namespace Donkey {
+namespace Detail {
+
+//! Lookup key of a client address: ID in the upper bits, port in lower 16
+inline uint64_t makeAddrKey(uint32_t id, uint16_t port) {
+	return (static_cast<uint64_t>(id) << 16) | port;
+}
+
+//! Extracts client address key, using the TCP port
+template<typename ClientType>
+struct TcpAddrKey {
+	typedef uint64_t result_type;
+	result_type operator()(const ClientType *c) const {
+		return makeAddrKey(c->getId(), c->getTcpPort());
+	}
+};
+
+//! Extracts client address key, using the UDP port
+template<typename ClientType>
+struct UdpAddrKey {
+	typedef uint64_t result_type;
+	result_type operator()(const ClientType *c) const {
+		return makeAddrKey(c->getId(), c->getUdpPort());
+	}
+};
+
+//! Userhashes are random, so the first bytes of it are as good as any hash
+struct UserHashHasher {
+	std::size_t operator()(const Hash<MD4Hash> &h) const {
+		if (!h) {
+			return 0;
+		}
+		uint32_t tmp;
+		memcpy(&tmp, h.getData().get(), sizeof(tmp));
+		return tmp;
+	}
+};
+
+/**
+ * DeadSources remembers address keys of sources that turned out to be dead.
+ * New keys go to the current filter; every lifetime / 2 (or when the current
+ * filter fills up) the older filter is dropped, and the current one takes
+ * its place, so keys expire lifetime / 2 .. lifetime after they were added.
+ *
+ * When more than burst keys are marked dead without a connection being
+ * established in between, our own connection is probably down rather than
+ * the sources, so no more keys are remembered until connectionEstablished().
+ */
+class DeadSources : public boost::noncopyable {
+public:
+	/**
+	 * @param lifetime   How long keys are remembered, in milliseconds
+	 * @param capacity   Keys remembered per lifetime / 2
+	 * @param burst      Failures in a row after which marking stops
+	 */
+	DeadSources(uint64_t lifetime, uint32_t capacity, uint32_t burst)
+	: m_cur(capacity), m_old(capacity), m_rotated(), m_lifetime(lifetime),
+	m_capacity(capacity), m_burst(burst), m_failedInRow() {}
+
+	/**
+	 * Remember a dead source.
+	 *
+	 * @param key     Address key of the source
+	 * @param now     Current tick
+	 * @return        False if the key wasn't remembered due to burst limit
+	 */
+	bool markDead(uint64_t key, uint64_t now) {
+		if (++m_failedInRow > m_burst) {
+			return false;
+		}
+		rotate(now);
+		m_cur.insert(key);
+		return true;
+	}
+
+	/**
+	 * Check whether a source was marked dead recently. Since only
+	 * fingerprints of the keys are stored, a small fraction (less than
+	 * 1/1000) of other keys match too.
+	 *
+	 * @param key     Address key of the source
+	 * @param now     Current tick
+	 */
+	bool isDead(uint64_t key, uint64_t now) {
+		rotate(now);
+		return m_cur.contains(key) || m_old.contains(key);
+	}
+
+	//! A connection was established, so our own connection works
+	void connectionEstablished() { m_failedInRow = 0; }
+
+	//! \returns Number of failures since last established connection
+	uint32_t getFailedInRow() const { return m_failedInRow; }
+
+	//! \returns Memory used by the filters, in bytes
+	uint32_t memory() const { return m_cur.memory() + m_old.memory(); }
+private:
+	//! Drop the older filter, if it's time to
+	void rotate(uint64_t now) {
+		bool full = m_cur.size() >= m_capacity;
+		if (full || now - m_rotated > m_lifetime / 2) {
+			m_old.swap(m_cur);
+			m_cur.clear();
+			m_rotated = now;
+		}
+	}
+
+	CuckooFilter m_cur;        //!< Keys added since m_rotated
+	CuckooFilter m_old;        //!< Keys of the previous generation
+	uint64_t m_rotated;        //!< When m_cur was started
+	uint64_t m_lifetime;       //!< Maximum time keys are remembered
+	uint32_t m_capacity;       //!< Keys per generation
+	uint32_t m_burst;          //!< Failures in a row before giving up
+	uint32_t m_failedInRow;    //!< Failures since last established conn
+};
+
+} // end namespace Detail
+} // end namespace Donkey
+
+#endif
@@ -30,9 +30,10 @@
 #include <hncore/sharedfile.h>
 #include <hnbase/prefs.h>
 #include <hnbase/ssocket.h>
+#include <hnbase/rankedset.h>
 #include <boost/lambda/bind.hpp>
 #include <boost/multi_index_container.hpp>
-#include <boost/multi_index/ordered_index.hpp>
+#include <boost/multi_index/hashed_index.hpp>
 #include <boost/multi_index/key_extractors.hpp>
 #include <boost/filesystem/operations.hpp>
 
@@ -47,9 +48,8 @@ enum Ed2k_Constants {
 
 	UDP_BUFSIZE = 1024,
 	/**
-	 * How often to recalculate the queue scores and resort the queue. Since
-	 * this is rather time-consuming operation if the queue is big, this is
-	 * done on regular intervals.
+	 * How often to drop expired clients from the queue, and re-key clients
+	 * whose score modifier has changed.
 	 */
 
 	QUEUE_UPDATE_TIME = 10000,
@@ -68,7 +68,25 @@ enum Ed2k_Constants {
 	/**
 	 * Specifies the TCP connection attempt timeout.
 	 */
-	CONNECT_TIMEOUT = 15000
+	CONNECT_TIMEOUT = 15000,
+
+	/**
+	 * How long to ignore sources that turned out to be dead; the entries
+	 * expire DEAD_TIME / 2 .. DEAD_TIME after they were added.
+	 */
+	DEAD_TIME = 2*60*60*1000,
+
+	/**
+	 * Number of connection failures in a row after which we assume our
+	 * own connection is down, and stop marking the sources dead.
+	 */
+	DEAD_BURST = 20,
+
+	/**
+	 * Number of dead sources remembered per DEAD_TIME / 2; the two
+	 * filters holding them take 128kb each with this value.
+	 */
+	DEAD_CAPACITY = 50000
 };
 
 IMPLEMENT_EVENT_TABLE(ClientList, ClientList*, ClientList::ClientListEvt);
@@ -80,40 +98,225 @@ const std::string TRACE_CLIST = "ed2k.clientlist";
 const std::string TRACE_SRCEXCH = "ed2k.sourceexchange";
 
 namespace Detail {
-//! ClientList indexes
+//! ClientList indexes; the key extractors are in clientindex.h
 struct ClientListIndices : boost::multi_index::indexed_by<
-	boost::multi_index::ordered_unique<
+	boost::multi_index::hashed_unique<
 		boost::multi_index::identity<Client*>
 	>,
-	boost::multi_index::ordered_non_unique<
+	boost::multi_index::hashed_non_unique<
 		boost::multi_index::const_mem_fun<
 			Client, uint32_t, &Client::getId
 		>
 	>,
-	boost::multi_index::ordered_non_unique<
+	boost::multi_index::hashed_non_unique<
 		boost::multi_index::const_mem_fun<
 			Client, Hash<MD4Hash>, &Client::getHash
-		>
-	>
+		>,
+		UserHashHasher
+	>,
+	boost::multi_index::hashed_non_unique<TcpAddrKey<Client> >,
+	boost::multi_index::hashed_non_unique<UdpAddrKey<Client> >
 > {};
 //! ClientList type
 struct CList : boost::multi_index_container<Client*, ClientListIndices> {};
 
 //! Different index ID's
-enum { ID_Client, ID_Id, ID_Hash };
+enum { ID_Client, ID_Id, ID_Hash, ID_Addr, ID_UdpAddr };
 typedef CList::nth_index<ID_Client>::type CMap;
 typedef CList::nth_index<ID_Id>::type IDMap;
 typedef CList::nth_index<ID_Hash>::type HashMap;
+typedef CList::nth_index<ID_Addr>::type AddrMap;
+typedef CList::nth_index<ID_UdpAddr>::type UdpAddrMap;
 typedef CMap::iterator CIter;
 typedef IDMap::iterator IIter;
 typedef HashMap::iterator HashIter;
+typedef AddrMap::iterator AddrIter;
+typedef UdpAddrMap::iterator UdpAddrIter;
+
+/**
+ * UploadQueue keeps the queued clients ordered by their score, so the next
+ * client to upload to can be found, and each client's position in the queue
+ * can be calculated, without sorting the entire queue.
+ *
+ * The score is the time waited in queue, multiplied by the credits modifier
+ * (see Client::getScore()), and the modifier is always a small integer (see
+ * Client::getScoreModifier()). Hence the clients are grouped by their
+ * modifier, and within each group ordered by the time they started waiting.
+ * That ordering doesn't change as time passes, so clients need re-keying
+ * only when their modifier or wait start time changes, and the client with
+ * the highest score is always at the head of one of the groups.
+ */
+class UploadQueue {
+	//! Wait start time and the client; ties are broken by the pointer
+	typedef std::pair<uint64_t, Client*> Key;
+	typedef RankedSet<Key> Group;
+	typedef std::map<uint32_t, boost::shared_ptr<Group> > Groups;
+
+	//! Modifier and wait start time the client was keyed with
+	typedef std::pair<uint32_t, uint64_t> Entry;
+	typedef std::map<Client*, Entry> Entries;
+public:
+	typedef Entries::const_iterator CIter;
+
+	/**
+	 * Add a client to the queue; if it's already in the queue, it's
+	 * re-keyed if needed.
+	 *
+	 * @param c      Client to add; must have queue info
+	 */
+	void push(Client *c) {
+		CHECK_THROW(c->getQueueInfo());
+		if (!contains(c)) {
+			Entry e(getEntry(c));
+			m_entries.insert(std::make_pair(c, e));
+			insert(c, e);
+		} else {
+			update(c);
+		}
+	}
+
+	//! Remove a client from the queue, if it's there
+	void erase(Client *c) {
+		Entries::iterator i = m_entries.find(c);
+		if (i != m_entries.end()) {
+			remove(c, (*i).second);
+			m_entries.erase(i);
+		}
+	}
+
+	/**
+	 * Move a client to the position matching its current score modifier
+	 * and wait start time, if they have changed since it was last keyed.
+	 * Clients which no longer have queue info are removed.
+	 *
+	 * @param c      Client to update
+	 * @return       True if the client was moved or removed
+	 */
+	bool update(Client *c) {
+		Entries::iterator i = m_entries.find(c);
+		if (i == m_entries.end()) {
+			return false;
+		} else if (!c->getQueueInfo()) {
+			erase(c);
+			return true;
+		}
+		Entry e(getEntry(c));
+		if (e == (*i).second) {
+			return false;
+		}
+		remove(c, (*i).second);
+		insert(c, e);
+		(*i).second = e;
+		return true;
+	}
+
+	/**
+	 * Update all clients in the queue.
+	 *
+	 * @return       Number of clients moved or removed
+	 */
+	uint32_t update() {
+		uint32_t cnt = 0;
+		Entries::iterator i = m_entries.begin();
+		while (i != m_entries.end()) {
+			cnt += update((*i++).first);
+		}
+		return cnt;
+	}
+
+	/**
+	 * @return       The client with the highest score, or 0 if the queue
+	 *               is empty
+	 */
+	Client* top() {
+		Client *best = 0;
+		uint64_t bestScore = 0;
+		Groups::iterator i = m_groups.begin();
+		while (i != m_groups.end()) {
+			Client *c = (*i++).second->front().second;
+			if (update(c)) {
+				// heads changed; start over
+				i = m_groups.begin();
+				best = 0;
+			} else if (!best || c->getScore() > bestScore) {
+				best = c;
+				bestScore = c->getScore();
+			}
+		}
+		return best;
+	}
+
+	/**
+	 * Calculate a client's position in the queue; clients with higher
+	 * scores come first.
+	 *
+	 * @param c      Client to look up
+	 * @return       Position in the queue, starting from 1, or 0 if the
+	 *               client isn't queued
+	 */
+	uint32_t getRank(Client *c) {
+		update(c);
+		if (!contains(c)) {
+			return 0;
+		}
+		// A client in group of modifier m has a higher score than s if
+		// it has waited at least (s / m + 1) seconds (score rounds the
+		// waiting time down to seconds).
+		uint64_t score = c->getScore();
+		uint64_t now = EventMain::instance().getTick();
+		uint32_t rank = 1;
+		Groups::iterator i = m_groups.begin();
+		for (; i != m_groups.end(); ++i) {
+			uint64_t waited = (score / (*i).first + 1) * 1000;
+			if (waited <= now) {
+				Key k(now - waited + 1, 0);
+				rank += (*i).second->countLess(k);
+			}
+		}
+		return rank;
+	}
+
+	bool     contains(Client *c) const { return m_entries.count(c); }
+	uint32_t size()              const { return m_entries.size();   }
+	bool     empty()             const { return m_entries.empty();  }
+	CIter    begin()             const { return m_entries.begin();  }
+	CIter    end()               const { return m_entries.end();    }
+private:
+	static Entry getEntry(Client *c) {
+		return Entry(
+			c->getScoreModifier(),
+			c->getQueueInfo()->getWaitStartTime()
+		);
+	}
+
+	void insert(Client *c, const Entry &e) {
+		boost::shared_ptr<Group> &g = m_groups[e.first];
+		if (!g) {
+			g.reset(new Group);
+		}
+		g->insert(Key(e.second, c));
+	}
+
+	void remove(Client *c, const Entry &e) {
+		Groups::iterator i = m_groups.find(e.first);
+		CHECK_RET(i != m_groups.end());
+		(*i).second->erase(Key(e.second, c));
+		if ((*i).second->empty()) {
+			m_groups.erase(i);
+		}
+	}
+
+	Groups  m_groups;     //!< Clients, grouped by score modifier
+	Entries m_entries;    //!< How each client is currently keyed
+};
 
 } // namespace Detail
 using namespace Detail;
 
 // dummy constructors/destructors. Don't do anything fancy here - do in init()!
-ClientList::ClientList() : m_clients(new CList), m_listener(),
-m_udpBuffer(new char[UDP_BUFSIZE]) {
+ClientList::ClientList() : m_clients(new CList),
+m_queue(new UploadQueue), m_listener(), m_udpBuffer(new char[UDP_BUFSIZE]),
+m_dead(DEAD_TIME, DEAD_CAPACITY, DEAD_BURST) {
 	// regen queue every 10 seconds
 	getEventTable().postEvent(this, EVT_REGEN_QUEUE, QUEUE_UPDATE_TIME);
 	getEventTable().addHandler(this, this, &ClientList::onClientListEvent);
@@ -272,8 +475,7 @@ void ClientList::onServerEvent(ED2KServerSocket *s, SocketEvent evt) {
 }
 
 //! handles Client::changeId signal
-//! \todo Also compare hashes; doesn't work correctly now
-//! because hash-index isn't correctly updated right now.
+//! \todo Also compare hashes
 void ClientList::onIdChange(Client *c, uint32_t newId) {
 	using boost::lambda::bind;
 
@@ -282,28 +484,27 @@ void ClientList::onIdChange(Client *c, uint32_t newId) {
 		% c->getIpPort() % c % newId
 	);
 
-	IDMap &idList = m_clients->get<ID_Id>();
-
 	CIter i = m_clients->get<ID_Client>().find(c);
 	CHECK_THROW(i != m_clients->get<ID_Client>().end());
 
-	IIter idIt = m_clients->project<ID_Id>(i);
-	idList.modify(idIt, bind(&Client::m_id, __1(__1)) = newId);
+	m_clients->modify(i, bind(&Client::m_id, __1(__1)) = newId);
 
-	std::pair<IIter, IIter> r = idList.equal_range(c->m_id);
+	AddrMap &addrList = m_clients->get<ID_Addr>();
+	std::pair<AddrIter, AddrIter> r = addrList.equal_range(
+		makeAddrKey(c->getId(), c->getTcpPort())
+	);
 	logTrace(TRACE_CLIST,
 		boost::format("[%s] Found %d candidates")
 		% c->getIpPort() % std::distance(r.first, r.second)
 	);
-	for (IIter j = r.first; j != r.second; ++j) {
+	for (AddrIter j = r.first; j != r.second; ++j) {
 		CHECK_FAIL((*j)->getId() == c->getId());
+		CHECK_FAIL((*j)->getTcpPort() == c->getTcpPort());
 		boost::format fmt("[%s] Candidate: %s %s ... %s");
 		fmt % c->getIpPort() % (*j)->getIpPort() % *j;
 		if (*j == c) {
 			logTrace(TRACE_CLIST, fmt % "Is myself ...");
 			continue;
-		} else if ((*j)->getTcpPort() != c->getTcpPort()) {
-			logTrace(TRACE_CLIST, fmt % "Wrong TCPPort");
 		} else {
 			logTrace(TRACE_CLIST, fmt % "Merging...");
 			(*j)->merge(c);
@@ -329,7 +530,7 @@ void ClientList::removeClient(Client *c) {
 	CHECK_RET(m_clients->find(c) != m_clients->end());
 	m_clients->erase(c);
 	m_uploading.erase(c);
-	m_queued.erase(c);
+	m_queue->erase(c);
 	delete c;
 	if (m_uploading.size() < getSlotCount()) {
 		startNextUpload();
@@ -347,16 +548,14 @@ void ClientList::onClientEvent(Client *c, ClientEvent evt) {
 
 			// no uploading/queued clients -> start one
 			if (m_uploading.size() < getSlotCount()) {
-				if (!m_queued.size()) {
+				if (m_queue->empty()) {
 					c->startUpload();
 					m_uploading.insert(c);
 				}
-			} else if (m_queued.find(c) == m_queued.end()) {
-				// wasn't found already in queue - push back
-				m_queued.insert(c);
-				m_queue.push_back(c);
+			} else if (!m_queue->contains(c)) {
+				// wasn't found already in queue - add it
 				CHECK_THROW(c->m_queueInfo);
-				c->m_queueInfo->setQR(m_queued.size());
+				m_queue->push(c);
 				if (c->isConnected()) {
 					c->sendQR();
 				}
@@ -377,7 +576,7 @@ void ClientList::onClientEvent(Client *c, ClientEvent evt) {
 		}
 		case EVT_CANCEL_UPLOADREQ:
 			m_uploading.erase(c);
-			m_queued.erase(c);
+			m_queue->erase(c);
 			if (m_uploading.size() < getSlotCount()) {
 				startNextUpload();
 			}
@@ -453,41 +652,29 @@ void ClientList::onClientEvent(Client *c, ClientEvent evt) {
 void ClientList::startNextUpload() {
 	logTrace(TRACE_CLIST, "Starting next upload.");
 
-	while (m_queue.size()) {
-		// remove obsolete entries
-		while (m_queue.size()) {
-			if (m_queued.find(m_queue.front()) == m_queued.end()) {
-				m_queue.erase(m_queue.begin());
-			} else {
-				break;
-			}
+	while (!m_queue->empty()) try {
+		// clients without queue info are dropped by top()
+		Client *c = m_queue->top();
+		if (!c) {
+			break;
 		}
-		if (m_queue.size()) try {
-			Client *c = m_queue.front();
-			if (!c->m_queueInfo) {
-				m_queue.pop_front();
-				m_queued.erase(c);
-				continue;
-			}
-			m_queued.erase(m_queue.front());
-			m_queue.pop_front();
-			logTrace(TRACE_CLIST,
-				 boost::format(
-					"[%s] Starting upload to client with "
-					"highest score (%d)"
-				) % c->getIpPort() % c->getScore()
-			);
-			c->startUpload();
-			m_uploading.insert(c);
-			if (m_uploading.size() >= getSlotCount()) {
-				break;
-			}
-		} catch (std::exception &er) {
-			logDebug(
-				boost::format("Error starting upload: %s")
-				% er.what()
-			);
+		m_queue->erase(c);
+		logTrace(TRACE_CLIST,
+			 boost::format(
+				"[%s] Starting upload to client with "
+				"highest score (%d)"
+			) % c->getIpPort() % c->getScore()
+		);
+		c->startUpload();
+		m_uploading.insert(c);
+		if (m_uploading.size() >= getSlotCount()) {
+			break;
 		}
+	} catch (std::exception &er) {
+		logDebug(
+			boost::format("Error starting upload: %s")
+			% er.what()
+		);
 	}
 }
 
@@ -497,70 +684,71 @@ void ClientList::onClientListEvent(ClientList *, ClientListEvt evt) {
 	}
 }
 
-bool scoreComp(const Client *const x, const Client *const y) {
-	return x->getScore() > y->getScore();
+// Clients that expired from the queue while being our sources keep their queue
+// info (see updateQueue()), and are put back when they reask, which may also
+// happen over UDP.
+void ClientList::updateQR(Client *c) {
+	if (c->m_queueInfo && !m_queue->contains(c) && !m_uploading.count(c)) {
+		m_queue->push(c);
+	}
+	uint32_t qr = m_queue->getRank(c);
+	if (qr) {
+		c->m_queueInfo->setQR(qr);
+	}
 }
 
-
 /**
- * Regenerate the upload queue, sorting and setting queue ranks as neccesery.
- * This method is called from event table every QUEUE_UPDATE_TIME interval.
- * The delayed event is also posted from this method.
+ * Maintains the upload queue. This method is called from event table every
+ * QUEUE_UPDATE_TIME interval. The delayed event is also posted from this
+ * method.
  *
- * Three operations need to be performed within this function:
- * - Build up m_queue list from items in m_queued. Only use clients which have
- *   m_queueInfo member, since we need that member's presence later on. Note
- *   that the existing contents of m_queue list must be discarded prior to this
- *   operation.
- * - Sort the newly generate queue, based on the client's queue scores. The
- * - Now that we have a sorted queue, we must iterate over the entire queue once
- *   more, and set each client's queue ranking to reflect it's position in the
- *   sorted queue. The queue ranking is needed later on by the client itself
- *   to send the queue ranking to the remote client on request.
+ * Two operations need to be performed within this function:
+ * - Drop clients that haven't reasked for QUEUE_DROPTIME. Clients that are
+ *   also our sources are only taken out of the queue index, keeping their
+ *   queue info; when they reask again, they are put back into the queue
+ *   with their original waiting time.
+ * - Re-key clients whose score modifier has changed (e.g. because we have
+ *   downloaded from them meanwhile). Scores growing with waiting time don't
+ *   need any updating, see Detail::UploadQueue.
+ *
+ * Queue ranks are calculated on demand, when they are sent to clients.
  */
 void ClientList::updateQueue() {
-	typedef std::set<Client*>::iterator QIter;
-	typedef std::list<Client*>::iterator QLIter;
-
 	Utils::StopWatch s;
 	uint64_t curTick = Utils::getTick();   // cache current tick count
-	uint32_t dropped = 0;                  // num dropped entries
-	m_queue.clear();
+	std::vector<Client*> expired;
 
-	for (QIter i = m_queued.begin(); i != m_queued.end(); ++i) {
-		Detail::QueueInfoPtr q = (*i)->m_queueInfo;
-		if (q && q->getLastQueueReask() + QUEUE_DROPTIME > curTick) {
-			m_queue.push_back(*i);
-		} else if (q && !(*i)->m_sourceInfo) {
+	typedef UploadQueue::CIter QIter;
+	for (QIter i = m_queue->begin(); i != m_queue->end(); ++i) {
+		Detail::QueueInfoPtr q = (*i).first->m_queueInfo;
+		if (q && q->getLastQueueReask() + QUEUE_DROPTIME <= curTick) {
+			expired.push_back((*i).first);
+		}
+	}
+	uint32_t dropped = 0;                  // num dropped entries
+	for (uint32_t i = 0; i < expired.size(); ++i) {
+		m_queue->erase(expired[i]);
+		if (!expired[i]->m_sourceInfo) {
 			// only drop clients here when they aren't sources
-			(*i)->removeFromQueue();
+			expired[i]->removeFromQueue();
 			++dropped;
 		}
 	}
-	m_queue.sort(&scoreComp);
+	uint32_t moved = m_queue->update();
 
 	logTrace(TRACE_CLIST,
 		boost::format(
-			"Queue update: %d clients queued, %d dropped, took %dms"
-		) % m_queue.size() % dropped % s
+			"Queue update: %d clients queued, %d dropped, "
+			"%d re-keyed, took %dms"
+		) % m_queue->size() % dropped % moved % s
 	);
-	if (m_queue.size()) {
+	if (Client *c = m_queue->top()) {
 		logTrace(TRACE_CLIST,
-			boost::format(
-				"Highest score is %d (%s), "
-				"lowest score is %d (%s)"
-			) % m_queue.front()->getScore()
-			% m_queue.front()->getIpPort()
-			% m_queue.back()->getScore()
-			% m_queue.back()->getIpPort()
+			boost::format("Highest score is %d (%s)")
+			% c->getScore() % c->getIpPort()
 		);
 	}
 
-	uint32_t cnt = 1;
-	for (QLIter i = m_queue.begin(); i != m_queue.end(); ++i, ++cnt) {
-		(*i)->m_queueInfo->setQR(cnt);
-	}
-
 	getEventTable().postEvent(this, EVT_REGEN_QUEUE, QUEUE_UPDATE_TIME);
 
 	// See if we need more slots
@@ -620,7 +808,7 @@ void ClientList::checkOpenMoreSlots() {
 		" | Down: "   COL_BGREEN "%9s/s"  COL_NONE
 	);
 
-	fmt % SourceInfo::count() % m_queue.size();
+	fmt % SourceInfo::count() % m_queue->size();
 	fmt % bytesToString(avgu) % bytesToString(avgd);
 
 	logMsg(fmt);
@@ -639,7 +827,7 @@ void ClientList::checkOpenMoreSlots() {
 	p /= "../statistics.log";
 	std::ofstream ofs(p.native_file_string().c_str(), std::ios::app);
 	ofs << curTick << " [ED2KStatistics] ";
-	ofs << SourceInfo::count() << ":" << m_queue.size() << ":";
+	ofs << SourceInfo::count() << ":" << m_queue->size() << ":";
 	ofs << (avgu - overheadUp) << ":" << (avgd - overheadDn) << ":";
 	ofs << conns << ":" << overheadUp << ":" << overheadDn << ":";
 	ClientManager::UploadingClients uc(
@@ -653,7 +841,7 @@ void ClientList::checkOpenMoreSlots() {
 
 	// conditions for opening new slots
 	uint32_t curUpSpeed = SchedBase::instance().getUpSpeed();
-	bool openSlot = m_queue.size();
+	bool openSlot = !m_queue->empty();
 	openSlot &= curUpSpeed < SchedBase::instance().getUpLimit() * .9;
 	openSlot &= avgu < SchedBase::instance().getUpLimit() * .85;
 
@@ -687,6 +875,15 @@ bool ClientList::addSource(
 		c->setServerAddr(saddr);
 		return false;
 	} else if (d) {
+		if (isHighId(caddr.getIp()) && isDead(caddr)) {
+			logTrace(TRACE_DEADSRC,
+				boost::format(
+					"[%s] Ignoring source: known to be "
+					"dead."
+				) % caddr
+			);
+			return false;
+		}
 		c = new Client(caddr, d);
 		c->setServerAddr(saddr);
 		m_clients->insert(c);
@@ -709,29 +906,55 @@ bool ClientList::addSource(
 MSVC_ONLY(;)
 
 Client* ClientList::findClient(IPV4Address addr) {
-	uint32_t id = addr.getIp();
-	IDMap &list = m_clients->get<ID_Id>();
-	std::pair<IIter, IIter> ret = list.equal_range(id);
-	for (IIter i = ret.first; i != ret.second; ++i) {
-		CHECK_FAIL((*i)->getId() == addr.getIp());
-		if ((*i)->getTcpPort() == addr.getPort()) {
-			return *i;
-		}
-	}
-	return 0;
+	AddrMap &list = m_clients->get<ID_Addr>();
+	AddrIter i = list.find(makeAddrKey(addr.getIp(), addr.getPort()));
+	return i == list.end() ? 0 : *i;
 }
 
 Client* ClientList::findClientByUdp(IPV4Address addr) {
-	uint32_t id = addr.getIp();
-	IDMap &list = m_clients->get<ID_Id>();
-	std::pair<IIter, IIter> ret = list.equal_range(id);
-	for (IIter i = ret.first; i != ret.second; ++i) {
-		CHECK_FAIL((*i)->getId() == addr.getIp());
-		if ((*i)->getUdpPort() == addr.getPort()) {
-			return *i;
-		}
+	UdpAddrMap &list = m_clients->get<ID_UdpAddr>();
+	UdpAddrIter i = list.find(makeAddrKey(addr.getIp(), addr.getPort()));
+	return i == list.end() ? 0 : *i;
+}
+
+void ClientList::updateKeys(
+	Client *c, uint16_t tcpPort, uint16_t udpPort,
+	const Hash<MD4Hash> &hash
+) {
+	using boost::lambda::bind;
+
+	CIter i = m_clients->get<ID_Client>().find(c);
+	if (i == m_clients->get<ID_Client>().end()) {
+		c->m_tcpPort = tcpPort;
+		c->m_udpPort = udpPort;
+		c->m_hash = hash;
+		return;
+	}
+	m_clients->modify(i, (
+		bind(&Client::m_tcpPort, __1(__1)) = tcpPort,
+		bind(&Client::m_udpPort, __1(__1)) = udpPort,
+		bind(&Client::m_hash, __1(__1)) = hash
+	));
+}
+
+void ClientList::markDead(IPV4Address addr) {
+	if (!isHighId(addr.getIp())) {
+		return;
 	}
-	return 0;
+	uint64_t key = makeAddrKey(addr.getIp(), addr.getPort());
+	if (!m_dead.markDead(key, EventMain::instance().getTick())) {
+		logTrace(TRACE_DEADSRC,
+			boost::format(
+				"[%s] Not marking source dead: %d connections "
+				"failed in a row."
+			) % addr % m_dead.getFailedInRow()
+		);
+	}
+}
+
+bool ClientList::isDead(IPV4Address addr) {
+	uint64_t key = makeAddrKey(addr.getIp(), addr.getPort());
+	return m_dead.isDead(key, EventMain::instance().getTick());
 }
 
 void ClientList::addClient(IPV4Address addr) {
@@ -26,10 +26,12 @@
 #include <hncore/ed2k/fwd.h>
 #include <hncore/ed2k/clients.h>
 #include <hncore/fwd.h>
+#include <hncore/ed2k/clientindex.h>
 
 namespace Donkey {
 namespace Detail {
 	struct CList;
+	class UploadQueue;
 }
 
 /**
@@ -40,7 +42,16 @@ namespace Detail {
  *
  * Clients can be found in this list by searching with the Client IP. Multiple
  * clients from same IP are allowed, in which case the differenciating can be
- * made based on the client's ports.
+ * made based on the client's ports. The lookups are done in hash tables keyed
+ * by ID and TCP or UDP port, so the ports and userhash of a client may only be
+ * changed via updateKeys().
+ *
+ * Addresses of HighID sources that turned out to be dead are remembered for
+ * a while (DEAD_TIME), so when servers or other clients keep on sending them
+ * to us, they can be ignored without creating a Client object and trying to
+ * connect to them again. Sources we already have a Client for are never
+ * ignored. When many connection attempts fail in a row, our own connection
+ * is probably down, so the sources aren't remembered then.
  */
 class ClientList {
 	enum ClientListEvt {
@@ -108,6 +119,48 @@ public:
 	 */
 	void startNextUpload();
 
+	/**
+	 * Sets the client's queue ranking to its current position in the
+	 * upload queue. Clients having queue info which aren't queued (since
+	 * they expired from the queue) are put back into it first. This should
+	 * be called before sending the queue ranking to the remote client.
+	 *
+	 * @param c      Client whose queue ranking to update
+	 */
+	void updateQR(Client *c);
+
+	/**
+	 * Changes the ports and userhash of a client. These are lookup keys
+	 * in the client list, so Client must use this instead of assigning
+	 * the members directly.
+	 *
+	 * @param c         Client to update
+	 * @param tcpPort   New TCP port
+	 * @param udpPort   New UDP port
+	 * @param hash      New userhash
+	 */
+	void updateKeys(
+		Client *c, uint16_t tcpPort, uint16_t udpPort,
+		const Hash<MD4Hash> &hash
+	);
+
+	/**
+	 * Remembers that a HighID source at the address is dead, so it won't
+	 * be added again by addSource() for the next DEAD_TIME / 2 .. DEAD_TIME
+	 * milliseconds. LowID addresses are ignored, as are all addresses
+	 * after DEAD_BURST failures without a successful connection in
+	 * between.
+	 *
+	 * @param addr      Address (ID and TCP port) of the dead source
+	 */
+	void markDead(IPV4Address addr);
+
+	/**
+	 * Called when an outgoing connection has been established, meaning
+	 * our own connection works, and failures are the sources' fault.
+	 */
+	void connectionEstablished() { m_dead.connectionEstablished(); }
+
 	/**
 	 * Prints the number of potentially zombie clients, as well as top
 	 * clients that have been zombie the longest. This is meant to aid in
@@ -154,16 +207,12 @@ private:
 	void onClientListEvent(ClientList *, ClientListEvt evt);
 
 	/**
-	 * Re-generates m_queue vector (from m_queued set), ordered by the
-	 * client's scores. Sets each client's m_uploadClient member's queue
-	 * ranking based on their position in the resulting m_queue vector.
+	 * Drops clients from m_queue that haven't reasked in a long time,
+	 * and re-keys the clients whose score modifier has changed, so the
+	 * queue remains ordered by the clients' current scores.
 	 *
 	 * This function is called once per every X seconds, where X is the
-	 * queue update interval. The purpose of this is to be able to send
-	 * queue rankings to remote clients (thus each client's member m_qr
-	 * value will indicate it's current position in the queue), as well as
-	 * for picking up highest-ranking clients from the queue when we want
-	 * to start sending data to them.
+	 * queue update interval.
 	 */
 	void updateQueue();
 
@@ -190,6 +239,16 @@ private:
 	 */
 	Client* findClientByUdp(IPV4Address addr);
 
+	/**
+	 * Checks whether the address was passed to markDead() recently.
+	 * Since only fingerprints of the addresses are stored, a small
+	 * fraction (less than 1/1000) of other addresses match too.
+	 *
+	 * @param addr     ClientID and TCP port to check
+	 * @return         True if the source should be ignored
+	 */
+	bool isDead(IPV4Address addr);
+
 	/**
 	 * Event handler for ClientUDP socket events.
 	 */
@@ -226,34 +285,13 @@ private:
 	boost::scoped_ptr<Detail::CList> m_clients;
 
 	/**
-	 * This is the queued clients list. The contents of this list are
-	 * ordered by the clients score, generated every X seconds. Note that
-	 * every X seconds, this container is cleared and re-filled from
-	 * m_queuedClients set. Also note that there may be dangling pointers
-	 * existing in this list, in worst-case scenario for up to X seconds
-	 * (e.g. until after next full regen). As such, if you access this
-	 * container, you need to make sure the pointer you just got is still
-	 * valid by looking it up from m_queuedClients set. If it is not found
-	 * there, the pointer is invalid and should be discarded.
+	 * This is the upload queue. It contains all clients which have
+	 * m_queueInfo member and are not currently uploading, ordered by
+	 * their scores. Picking the highest-scoring client, as well as finding
+	 * a client's position in the queue, are O(log n) operations, so the
+	 * queue never needs to be sorted as a whole.
 	 */
-	std::list<Client*> m_queue;
-
-	/**
-	 * This set contains all clients which have m_uploadClient member
-	 * pointer and are not currently uploading. This set is used as base for
-	 * building up the actual upload queue into m_queue list every X
-	 * seconds. The purpose of this set is to have a reference container in
-	 * which we can actually erase elements using fast integer-based lookups
-	 * (which we couldn't do in m_queue list since that one is ordered by
-	 * score).
-	 *
-	 * Note that we could achive the same purpose by using m_clients
-	 * container, however, m_clients also contains downloadclients, so
-	 * it would cause many more loops in there to find the queued clients
-	 * than it is to find them here. Also, this set is a more static entity
-	 * than m_queue member (which is completely regenerated often).
-	 */
-	std::set<Client*> m_queued;
+	boost::scoped_ptr<Detail::UploadQueue> m_queue;
 
 	/**
 	 * This set contains all clients that are currently in uploading state,
@@ -281,6 +319,11 @@ private:
 	 * Inter-client messages that should be filtered.
 	 */
 	std::vector<std::string> m_msgFilter;
+
+	/**
+	 * Addresses of dead sources, remembered for DEAD_TIME / 2 .. DEAD_TIME
+	 */
+	Detail::DeadSources m_dead;
 };
 
 } // end namespace Donkey
@@ -21,6 +21,7 @@
  */
 
 #include <hncore/ed2k/clients.h>
+#include <hncore/ed2k/clientlist.h>
 #include <hncore/ed2k/ed2k.h>
 #include <hncore/ed2k/serverlist.h>
 #include <hncore/ed2k/creditsdb.h>
@@ -169,7 +170,7 @@ m_reqChallenge(), m_upReqInProgress(), m_dnReqInProgress() {
 
 	setConnected(true);
 	c->setHandler(this, &Client::onSocketEvent);
-	m_parser->parse(c->getData());
+	m_parser->parse(c->getInput());
 }
 
 Client::Client(IPV4Address addr, Download *file):BaseClient(&ED2K::instance()),
@@ -384,12 +385,10 @@ void Client::merge(Client *c) {
 		m_downloadInfo = c->m_downloadInfo;
 		m_downloadInfo->setParent(this);
 	}
-	if (c->m_hash && !m_hash) {
-		m_hash = c->m_hash;
-	}
-	if (c->m_udpPort && !m_udpPort) {
-		m_udpPort = c->m_udpPort;
-	}
+	ClientList::instance().updateKeys(
+		this, m_tcpPort, m_udpPort ? m_udpPort : c->m_udpPort,
+		m_hash ? m_hash : c->m_hash
+	);
 	if (c->m_pubKey && !m_pubKey) {
 		m_pubKey = c->m_pubKey;
 	}
@@ -446,7 +445,7 @@ void Client::onSocketEvent(ED2KClientSocket *c, SocketEvent evt) {
 	}
 
 	if (evt == SOCK_READ) try {
-		m_parser->parse(c->getData());
+		m_parser->parse(c->getInput());
 	} catch (std::exception &er) {
 		logTrace(TRACE_DEADSRC,
 			boost::format(
@@ -463,6 +462,7 @@ void Client::onSocketEvent(ED2KClientSocket *c, SocketEvent evt) {
 				"[%s] Connection established, sending Hello"
 			) % getIpPort()
 		);
+		ClientList::instance().connectionEstablished();
 		*m_socket << ED2KPacket::Hello();
 		m_failedUdpReasks = 0;
 		m_upReqInProgress = false;
@@ -476,6 +476,7 @@ void Client::onSocketEvent(ED2KClientSocket *c, SocketEvent evt) {
 				"[%s] Dropping client (unable to connect)"
 			) % getIpPort()
 		);
+		ClientList::instance().markDead(IPV4Address(m_id, m_tcpPort));
 		destroy();
 	} else if (evt == SOCK_TIMEOUT) {
 		logTrace(TRACE_CLIENT,
@@ -516,6 +517,7 @@ void Client::onLostConnection() {
 				"never connected."
 			) % getIpPort()
 		);
+		ClientList::instance().markDead(IPV4Address(m_id, m_tcpPort));
 		destroy();
 	} else if (!m_sourceInfo && !m_queueInfo) {
 		logTrace(TRACE_DEADSRC,
@@ -533,6 +535,7 @@ void Client::onLostConnection() {
 				"failed, and TCP Reask also failed."
 			) % getIpPort()
 		);
+		ClientList::instance().markDead(IPV4Address(m_id, m_tcpPort));
 		destroy();
 	} else if (m_downloadInfo || (m_sourceInfo && m_dnReqInProgress)) {
 		// handles two cases: when socket timeouts while downloading,
@@ -592,10 +595,10 @@ void Client::onLostConnection() {
 // Stores client info found in packet internally. This is used as helper
 // method by Hello/HelloAnswer packet handler
 void Client::storeInfo(const ED2KPacket::Hello &p) {
-	m_tcpPort    = p.getClientAddr().getPort();
-	m_udpPort    = p.getUdpPort();
+	ClientList::instance().updateKeys(
+		this, p.getClientAddr().getPort(), p.getUdpPort(), p.getHash()
+	);
 	m_features   = p.getFeatures();
-	m_hash       = p.getHash();
 	m_serverAddr = p.getServerAddr();
 	m_nick       = p.getNick();
 
@@ -1044,6 +1047,7 @@ void Client::startUpload() {
 void Client::sendQR() {
 	CHECK_THROW(isConnected());
 	CHECK_THROW(m_queueInfo);
+	ClientList::instance().updateQR(this);
 	CHECK_THROW(m_queueInfo->getQR());
 	CHECK_THROW(!m_uploadInfo);
 	logTrace(TRACE_CLIENT,
@@ -1125,11 +1129,15 @@ void Client::sendNextChunk() try {
 		) % Utils::bytesToString(m_uploadInfo->getSent())
 	);
 
+	if (m_uploadInfo->isCompressing()) {
+		return; // resumed by UploadInfo when done
+	}
+
 	if (!m_uploadInfo->hasBuffered()) try {
-		m_uploadInfo->bufferData();
-//		if (getComprVer()) {
-//			m_uploadInfo->compress();
-//		}
+		m_uploadInfo->bufferData(getComprVer());
+		if (m_uploadInfo->isCompressing()) {
+			return;
+		}
 	} catch (SharedFile::ReadError &e) {
 		if (e.reason() == SharedFile::ETRY_AGAIN_LATER) {
 			Utils::timedCallback(
@@ -1141,20 +1149,36 @@ void Client::sendNextChunk() try {
 		}
 	}
 
+	if (m_uploadInfo->isFromFile()) {
+		uint32_t begin = 0, end = 0;
+		FileHandlePtr file = m_uploadInfo->getNextRegion(
+			10240, &begin, &end
+		);
+		*m_socket << ED2KPacket::DataChunkHeader(
+			m_uploadInfo->getReqHash(), begin, end
+		);
+		m_socket->writeFile(file, begin, end - begin);
+		if (m_credits) {
+			m_credits->addUploaded(end - begin);
+		}
+		m_uploadInfo->getReqFile()->addUploaded(end - begin);
+		return;
+	}
+
 	boost::tuple<uint32_t, uint32_t, std::string> nextChunk;
 	nextChunk = m_uploadInfo->getNext(10240);
 
-//	if (getComprVer() && m_uploadInfo->isCompressed()) {
-//		*m_socket << ED2KPacket::PackedChunk(
-//			m_uploadInfo->getReqHash(), nextChunk.get<0>(),
-//			nextChunk.get<1>(), nextChunk.get<2>()
-//		);
-//	} else {
+	if (m_uploadInfo->isCompressed()) {
+		*m_socket << ED2KPacket::PackedChunk(
+			m_uploadInfo->getReqHash(), nextChunk.get<0>(),
+			nextChunk.get<1>(), nextChunk.get<2>()
+		);
+	} else {
 		*m_socket << ED2KPacket::DataChunk(
 			m_uploadInfo->getReqHash(), nextChunk.get<0>(),
 			nextChunk.get<1>(), nextChunk.get<2>()
 		);
-//	}
+	}
 
 	if (m_credits) {
 		m_credits->addUploaded(nextChunk.get<2>().size());
@@ -1590,13 +1614,14 @@ MSVC_ONLY(;)
 
 // Little helper method - we send chunk requests from several locations, so
 // localize this in this helper function.
-// If onlyNew is set true, we only send the back-most chunk request in the list.
+// If onlyNew is set true, we only send the chunks that weren't requested yet.
 // While mules and edonkeys request chunk in a rotational way, (e.g.
 // [c1, c2, c3], [c2, c3, c4], [c3, c4, c5], it seems even they get confused
 // sometimes with this thing, and start sending chunks twice. Or it could be
 // we fail to do it exactly the way they expect it. Whatever the reason, it
 // seems way too error-prone and un-neccesery, so we'r just going to fall back
-// to requesting exactly the chunks we need, nothing more.
+// to requesting exactly the chunks we need, nothing more. ReqChunks packet
+// holds up to three chunks, so more chunks are requested in several packets.
 void Client::sendChunkReqs(bool onlyNew) try {
 	using ED2KPacket::ReqChunks;
 	typedef std::list<Range32>::iterator Iter;
@@ -1604,23 +1629,22 @@ void Client::sendChunkReqs(bool onlyNew) try {
 	CHECK_THROW(isConnected());
 	CHECK_THROW(m_downloadInfo);
 
-	std::list<Range32> creqs = m_downloadInfo->getChunkReqs();
+	std::list<Range32> creqs = m_downloadInfo->getChunkReqs(onlyNew);
 
-	if (creqs.size()) {
- 		if (onlyNew) {
-			while (creqs.size() > 1) {
-				creqs.pop_front();
-			}
-		}
+	for (Iter i = creqs.begin(); i != creqs.end(); ++i) {
+		boost::format fmt("[%s] Requesting chunk %d..%d");
+		fmt % getIpPort();
+		logTrace(TRACE_CLIENT, fmt % (*i).begin() % (*i).end());
+	}
 
-		for (Iter i = creqs.begin(); i != creqs.end(); ++i) {
-			boost::format fmt("[%s] Requesting chunk %d..%d");
-			fmt % getIpPort();
-			logTrace(TRACE_CLIENT, fmt % (*i).begin() % (*i).end());
+	while (creqs.size()) {
+		std::list<Range32> tmp;
+		while (creqs.size() && tmp.size() < 3) {
+			tmp.push_back(creqs.front());
+			creqs.pop_front();
 		}
-
 		*m_socket << ReqChunks(
-			m_sourceInfo->getReqFile()->getHash(), creqs
+			m_sourceInfo->getReqFile()->getHash(), tmp
 		);
 	}
 } catch (std::exception &e) {
@@ -2172,6 +2196,7 @@ void Client::onPacket(const ED2KPacket::ReaskFilePing &p) {
 	}
 
 	const PartData *pd = m_queueInfo->getReqFile()->getPartData();
+	ClientList::instance().updateQR(this);
 	uint16_t queueRank = m_queueInfo->getQR();
 
 	try {
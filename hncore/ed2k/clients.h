@@ -254,11 +254,19 @@ public:
 		}
 		tmp = (tmp - m_queueInfo->getWaitStartTime()) / 1000;
 
-		// Modify it (if possible) with credit score
+		// Modify it with credit score
+		return tmp * getScoreModifier();
+	}
+
+	/**
+	 * @returns Factor the waiting time is multiplied with in getScore();
+	 *          the client's credits modifier, or 1 without credits
+	 */
+	uint32_t getScoreModifier() const {
 		if (m_credits) {
-			tmp *= static_cast<uint64_t>(m_credits->getScore());
+			return static_cast<uint32_t>(m_credits->getScore());
 		}
-		return tmp;
+		return 1;
 	}
 
 	/**
@@ -343,6 +351,7 @@ public:
 	static ED2KUDPSocket* getUdpSocket();
 private:
 	friend class ClientList;
+	friend class Detail::UploadInfo;
 	Client();                                    //!< Forbidden
 	~Client();                                   //!< Allowed by ClientList
 	Client(const Client&);                       //!< Copying forbidden
@@ -0,0 +1,207 @@
+/*
+ *  Copyright (C) 2004-2006 Alo Sarv <madcat_@users.sourceforge.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/**
+ * \file compressor.cpp Implementation of Compressor class
+ */
+
+#include <hncore/ed2k/compressor.h>
+#include <hncore/ed2k/zutils.h>
+#include <hnbase/prefs.h>
+#include <cmath>
+
+namespace Donkey {
+
+namespace {
+	const std::string TRACE_COMPRESS = "ed2k.compress";
+
+	enum {
+		SAMPLE_COUNT = 8,     //!< Number of samples to check
+		SAMPLE_SIZE  = 512    //!< Size of each sample
+	};
+
+	/**
+	 * Entropy (bits per byte) above which data is considered random; zlib
+	 * only gains a few percent on such data, if anything at all.
+	 */
+	const double MAX_ENTROPY = 7.5;
+}
+
+// CompressJob class
+// -----------------
+IMPLEMENT_EVENT_TABLE(CompressJob, CompressJobPtr, bool);
+
+CompressJob::CompressJob(
+	const Hash<ED2KHash> &file, Range32 range, const std::string &data
+) : m_file(file), m_range(range), m_data(data) {}
+
+bool CompressJob::process() try {
+	std::string tmp(Zlib::compress(m_data));
+	if (tmp.size() && tmp.size() < m_data.size()) {
+		m_result.swap(tmp);
+	}
+	std::string().swap(m_data);
+	getEventTable().postEvent(CompressJobPtr(this), !m_result.empty());
+	setComplete();
+	return true;
+} catch (std::exception &e) {
+	logDebug(boost::format("Compressing upload data: %s") % e.what());
+	getEventTable().postEvent(CompressJobPtr(this), false);
+	setComplete();
+	return true;
+}
+
+// Compressor class
+// ----------------
+Compressor::Compressor() : m_size(), m_next(), m_hits(), m_misses(),
+m_skipped(), m_saved() {
+	CompressJob::getEventTable().addAllHandler(
+		this, &Compressor::onCompressed
+	);
+}
+
+Compressor::~Compressor() {}
+
+Compressor& Compressor::instance() {
+	static Compressor c;
+	return c;
+}
+
+bool Compressor::find(
+	const Hash<ED2KHash> &file, Range32 range, std::string *data
+) {
+	std::map<Key, Block>::iterator i = m_blocks.find(makeKey(file, range));
+	if (i == m_blocks.end()) {
+		return false;
+	}
+	m_lru.splice(m_lru.end(), m_lru, (*i).second.m_lru);
+	*data = (*i).second.m_data;
+	++m_hits;
+	return true;
+}
+
+CompressJobPtr Compressor::compress(
+	const Hash<ED2KHash> &file, Range32 range, const std::string &data
+) {
+	Key key(makeKey(file, range));
+	std::map<Key, CompressJobPtr>::iterator i = m_pending.find(key);
+	if (i != m_pending.end()) {
+		return (*i).second;
+	}
+	if (!isCompressible(data)) {
+		logTrace(TRACE_COMPRESS,
+			boost::format("Skipping incompressible block %s of %s")
+			% range % file.decode()
+		);
+		store(file, range, std::string());
+		++m_skipped;
+		return CompressJobPtr();
+	}
+
+	if (m_threads.empty()) {
+		uint32_t cnt = Prefs::instance().read<uint32_t>(
+			"/ed2k/CompressThreads", 2
+		);
+		for (uint32_t j = 0; j < std::max(cnt, 1u); ++j) {
+			m_threads.push_back(WorkThreadPtr(new WorkThread));
+		}
+	}
+
+	CompressJobPtr job(new CompressJob(file, range, data));
+	m_pending[key] = job;
+	m_threads[m_next++ % m_threads.size()]->postWork(job);
+	++m_misses;
+	return job;
+}
+
+// Called after the handlers of the job itself, so they can now be dropped
+void Compressor::onCompressed(CompressJobPtr job, bool ok) {
+	CompressJob::getEventTable().delHandlers(job);
+	m_pending.erase(makeKey(job->getFile(), job->getRange()));
+	store(job->getFile(), job->getRange(), job->getResult());
+	if (ok) {
+		m_saved += job->getRange().length() - job->getResult().size();
+	}
+	logTrace(TRACE_COMPRESS,
+		boost::format("Compressed block %s of %s: %d -> %d bytes")
+		% job->getRange() % job->getFile().decode()
+		% job->getRange().length() % job->getResult().size()
+	);
+}
+
+void Compressor::store(
+	const Hash<ED2KHash> &file, Range32 range, const std::string &data
+) {
+	Key key(makeKey(file, range));
+	if (m_blocks.find(key) != m_blocks.end()) {
+		return;
+	}
+	Block &b = m_blocks[key];
+	b.m_data = data;
+	b.m_lru = m_lru.insert(m_lru.end(), key);
+	m_size += data.size() + sizeof(Block);
+	shrink();
+}
+
+void Compressor::shrink() {
+	uint64_t limit = Prefs::instance().read<uint32_t>(
+		"/ed2k/CompressCacheSize", 16 * 1024 * 1024
+	);
+	while (m_size > limit && m_lru.size()) {
+		std::map<Key, Block>::iterator i = m_blocks.find(m_lru.front());
+		m_size -= (*i).second.m_data.size() + sizeof(Block);
+		m_blocks.erase(i);
+		m_lru.pop_front();
+	}
+}
+
+// Shannon entropy of the byte values in the samples
+bool Compressor::isCompressible(const std::string &data) {
+	uint32_t freq[256] = {};
+	uint32_t step = data.size() / SAMPLE_COUNT;
+	uint32_t len = std::min<uint32_t>(step, SAMPLE_SIZE);
+	uint32_t total = 0;
+	for (uint32_t i = 0; i < SAMPLE_COUNT; ++i) {
+		const char *p = data.data() + i * step;
+		for (uint32_t j = 0; j < len; ++j) {
+			++freq[static_cast<uint8_t>(p[j])];
+		}
+		total += len;
+	}
+	if (!total) {
+		return false;
+	}
+	double entropy = 0.0;
+	for (uint32_t i = 0; i < 256; ++i) {
+		if (freq[i]) {
+			double p = static_cast<double>(freq[i]) / total;
+			entropy -= p * std::log(p) / std::log(2.0);
+		}
+	}
+	return entropy < MAX_ENTROPY;
+}
+
+void Compressor::exit() {
+	m_threads.clear();      // joins the threads
+	m_pending.clear();
+	m_blocks.clear();
+	m_lru.clear();
+	m_size = 0;
+}
+
+} // end namespace Donkey
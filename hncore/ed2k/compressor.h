@@ -0,0 +1,185 @@
+/*
+ *  Copyright (C) 2004-2006 Alo Sarv <madcat_@users.sourceforge.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/**
+ * \file compressor.h Interface for Compressor class
+ */
+
+#ifndef __ED2K_COMPRESSOR_H__
+#define __ED2K_COMPRESSOR_H__
+
+#include <hnbase/osdep.h>
+#include <hnbase/workthread.h>
+#include <hnbase/event.h>
+#include <hnbase/hash.h>
+#include <hnbase/range.h>
+#include <boost/shared_ptr.hpp>
+#include <list>
+#include <map>
+#include <vector>
+
+namespace Donkey {
+
+class CompressJob;
+typedef boost::intrusive_ptr<CompressJob> CompressJobPtr;
+
+/**
+ * CompressJob compresses a block of upload data in a worker thread. When
+ * done, the job emits event 'true' if the data was compressed, or 'false'
+ * if it didn't get any smaller (or compression failed), in which case it
+ * should be sent uncompressed.
+ *
+ * The handlers of a job are dropped by Compressor once the event has been
+ * handled; the handlers should only disconnect their own connections.
+ */
+class CompressJob : public ThreadWork {
+public:
+	DECLARE_EVENT_TABLE(CompressJobPtr, bool);
+
+	CompressJob(
+		const Hash<ED2KHash> &file, Range32 range,
+		const std::string &data
+	);
+	virtual bool process();
+
+	Hash<ED2KHash> getFile()  const { return m_file;  }
+	Range32        getRange() const { return m_range; }
+
+	//! \returns Compressed data; empty until the job is complete
+	const std::string& getResult() const { return m_result; }
+private:
+	Hash<ED2KHash> m_file;    //!< File the data belongs to
+	Range32 m_range;          //!< Location of the data in file
+	std::string m_data;       //!< Data to be compressed
+	std::string m_result;     //!< Compressed data, if smaller than m_data
+};
+
+/**
+ * Compressor compresses upload data for clients supporting compression, in
+ * a set of worker threads (/ed2k/CompressThreads preference, default 2), so
+ * the main loop isn't stalled by zlib.
+ *
+ * Data that won't compress - e.g. archives, videos - is detected up front
+ * from a few samples of the data (see isCompressible()), and isn't passed to
+ * zlib at all.
+ *
+ * Compressed blocks are kept in a cache (/ed2k/CompressCacheSize preference
+ * in bytes, default 16MB), in least-recently-used order, so blocks of popular
+ * files requested by many clients are only compressed once. Blocks which
+ * didn't compress are remembered as well, so they aren't tried again.
+ */
+class Compressor : public boost::noncopyable {
+public:
+	static Compressor& instance();
+
+	/**
+	 * Look up a compressed block from the cache.
+	 *
+	 * @param file      File the block belongs to
+	 * @param range     Location of the block in file
+	 * @param data      Receives the compressed data, or is cleared if the
+	 *                  block is known not to compress
+	 * @return          True if the block was found
+	 */
+	bool find(const Hash<ED2KHash> &file, Range32 range, std::string *data);
+
+	/**
+	 * Compress a block in worker thread. If the same block is already
+	 * being compressed, that job is returned instead. The result is
+	 * stored in the cache when the job completes.
+	 *
+	 * @param file      File the block belongs to
+	 * @param range     Location of the block in file
+	 * @param data      The data to compress
+	 * @return          The job, or null if the data isn't worth
+	 *                  compressing
+	 */
+	CompressJobPtr compress(
+		const Hash<ED2KHash> &file, Range32 range,
+		const std::string &data
+	);
+
+	/**
+	 * Estimate whether data will compress, by calculating the entropy
+	 * of a few samples of it.
+	 *
+	 * @param data      Data to check
+	 * @return          False if the data looks random
+	 */
+	static bool isCompressible(const std::string &data);
+
+	//! Stop worker threads and drop cache; called on module exit
+	void exit();
+
+	/**
+	 * \name Statistics
+	 */
+	//!@{
+	uint64_t getHits()    const { return m_hits;    }
+	uint64_t getMisses()  const { return m_misses;  }
+	uint64_t getSkipped() const { return m_skipped; }
+	uint64_t getSaved()   const { return m_saved;   }
+	//!@}
+private:
+	Compressor();
+	~Compressor();
+
+	//! Event handler for finished jobs; stores the result in cache
+	void onCompressed(CompressJobPtr job, bool ok);
+
+	//! Add block to cache; empty data marks block as incompressible
+	void store(
+		const Hash<ED2KHash> &file, Range32 range,
+		const std::string &data
+	);
+
+	//! Drop least recently used blocks to keep within budget
+	void shrink();
+
+	typedef std::pair<uint32_t, uint32_t> Location;
+	typedef std::pair<Hash<ED2KHash>, Location> Key;
+	typedef std::list<Key> BlockList;
+
+	//! Cached block
+	struct Block {
+		std::string m_data;           //!< Empty if incompressible
+		BlockList::iterator m_lru;
+	};
+
+	static Key makeKey(const Hash<ED2KHash> &file, Range32 range) {
+		return Key(file, Location(range.begin(), range.end()));
+	}
+
+	std::map<Key, Block> m_blocks;          //!< Cached blocks
+	BlockList m_lru;                        //!< Least recently used first
+	uint64_t m_size;                        //!< Bytes in m_blocks
+	std::map<Key, CompressJobPtr> m_pending;//!< Jobs not finished yet
+
+	typedef boost::shared_ptr<WorkThread> WorkThreadPtr;
+	std::vector<WorkThreadPtr> m_threads;   //!< Started on demand
+	uint32_t m_next;                        //!< Thread for next job
+
+	uint64_t m_hits;       //!< Blocks found in cache
+	uint64_t m_misses;     //!< Blocks compressed
+	uint64_t m_skipped;    //!< Blocks not passed to zlib
+	uint64_t m_saved;      //!< Bytes saved by compression
+};
+
+} // end namespace Donkey
+
+#endif
@@ -28,6 +28,7 @@
 #include <hncore/ed2k/clientlist.h>
 #include <hncore/ed2k/creditsdb.h>
 #include <hncore/ed2k/downloadlist.h>
+#include <hncore/ed2k/compressor.h>
 #include <hncore/hydranode.h>
 #include <hncore/metadb.h>
 #include <hncore/fileslist.h>
@@ -150,6 +151,7 @@ int ED2K::onExit() {
 	ClientList::instance().exit();
 	DownloadList::instance().exit();
 	ServerList::instance().exit();
+	Compressor::instance().exit();
 
 	return 0;
 }
@@ -38,6 +38,7 @@
 #include <hncore/partdata.h>
 #include <boost/tuple/tuple.hpp>
 #include <bitset>
+#include <iterator>
 
 namespace Donkey {
 
@@ -114,6 +115,17 @@ void readPartMap(std::istream &i, std::vector<bool> *partMap) {
 	}
 }
 
+// Total length of packet data in stream. Packets are parsed from streams
+// bounded to a single packet, so this is the packet length; works with any
+// seekable stream.
+uint32_t streamLength(std::istream &i) {
+	std::streampos pos = i.tellg();
+	i.seekg(0, std::ios::end);
+	uint32_t len = i.tellg();
+	i.seekg(pos);
+	return len;
+}
+
 // Exception class
 // ---------------
 InvalidPacket::InvalidPacket(const std::string &what) :
@@ -621,11 +633,10 @@ GlobSearchRes::GlobSearchRes(std::istream &i) : SearchResult() {
 	if (!i.eof()) {
 		logDebug(boost::format(
 			"Extra bytes at the end of GlobSearchRes packet: %s"
-		) % Utils::hexDump(
-			dynamic_cast<std::istringstream&>(i).str().substr(
-				i.tellg()
-			)
-		));
+		) % Utils::hexDump(std::string(
+			std::istreambuf_iterator<char>(i),
+			std::istreambuf_iterator<char>()
+		)));
 	}
 }
 
@@ -1145,6 +1156,28 @@ DataChunk::operator std::string() {
 	return makePacket(tmp.str());
 }
 
+// DataChunkHeader class
+// ---------------------
+DataChunkHeader::DataChunkHeader(
+	Hash<ED2KHash> hash, uint32_t begin, uint32_t end
+) : m_hash(hash), m_begin(begin), m_end(end) {
+	CHECK_THROW(m_end > m_begin);
+	CHECK_THROW(!hash.isEmpty());
+}
+// Can't use makePacket() here, since the length must include the data which
+// isn't part of this packet.
+DataChunkHeader::operator std::string() {
+	std::ostringstream tmp;
+	Utils::putVal<uint8_t>(tmp, PR_ED2K);
+	// opcode, hash and offsets take 25 bytes
+	Utils::putVal<uint32_t>(tmp, 25 + m_end - m_begin);
+	Utils::putVal<uint8_t>(tmp, OP_SENDINGCHUNK);
+	Utils::putVal<std::string>(tmp, m_hash.getData(), 16);
+	Utils::putVal<uint32_t>(tmp, m_begin);
+	Utils::putVal<uint32_t>(tmp, m_end);
+	return tmp.str();
+}
+
 // PackedChunk class
 // -----------------
 PackedChunk::PackedChunk(
@@ -1163,8 +1196,7 @@ PackedChunk::PackedChunk(std::istream &i) : Packet(PR_EMULE) {
 	m_hash  = Utils::getVal<std::string>(i, 16).value();
 	m_begin = Utils::getVal<uint32_t>(i);
 	m_size  = Utils::getVal<uint32_t>(i);
-	std::istringstream &is = dynamic_cast<std::istringstream&>(i);
-	m_data  = is.str().substr(24);
+	m_data  = Utils::getVal<std::string>(i, streamLength(i) - 24).value();
 }
 PackedChunk::operator std::string() {
 	std::ostringstream tmp;
@@ -1208,10 +1240,10 @@ AnswerSources::AnswerSources(const Hash<ED2KHash> &hash, const SourceList &srcs)
 : Packet(PR_EMULE), m_hash(hash), m_srcList(srcs), m_swapIds() {
 	CHECK_THROW(m_hash);
 }
-AnswerSources::AnswerSources(std::istringstream &i) {
+AnswerSources::AnswerSources(std::istream &i) {
 	m_hash = Utils::getVal<std::string>(i, 16).value();
 	uint16_t cnt = Utils::getVal<uint16_t>(i);
-	uint16_t itemLength = (i.str().size() - 18u) / cnt;
+	uint16_t itemLength = (streamLength(i) - 18u) / cnt;
 	CHECK_THROW(itemLength);
 
 	while (i && cnt--) {
@@ -1355,8 +1387,7 @@ ReaskFilePing::ReaskFilePing(
 m_udpVersion(udpVersion) {}
 ReaskFilePing::ReaskFilePing(std::istream &i) {
 	m_hash = Utils::getVal<std::string>(i, 16).value();
-	std::istringstream &tmp = dynamic_cast<std::istringstream&>(i);
-	if (tmp.str().size() >= 20) { // UDPv4
+	if (streamLength(i) >= 20) { // UDPv4
 		readPartMap(i, &m_partMap);
 	}
 	try { // UDPv3
@@ -1394,9 +1425,8 @@ ReaskAck::ReaskAck(const PartData *pd, uint16_t qr, uint8_t udpVersion)
 : Packet(PR_EMULE), m_partMap(makePartMap(pd)), m_qr(qr),
 m_udpVersion(udpVersion) {}
 ReaskAck::ReaskAck(std::istream &i) {
-	std::istringstream &tmp = dynamic_cast<std::istringstream&>(i);
-	if (tmp.str().size() > 4) {
-		readPartMap(tmp, &m_partMap);
+	if (streamLength(i) > 4) {
+		readPartMap(i, &m_partMap);
 	}
 	m_qr = Utils::getVal<uint16_t>(i);
 }
@@ -845,6 +845,21 @@ private:
 	std::string    m_data;     //!< The data
 };
 
+/**
+ * DataChunkHeader is the DataChunk packet without the data. It's used when
+ * the data is sent directly from file (see SSocket::writeFile()) right after
+ * the header; the packet length in the header includes the data.
+ */
+class DataChunkHeader : public Packet {
+public:
+	DataChunkHeader(Hash<ED2KHash> hash, uint32_t begin, uint32_t end);
+	operator std::string();
+private:
+	Hash<ED2KHash> m_hash;     //!< File hash where the data belongs to
+	uint32_t       m_begin;    //!< Begin offset (inclusive)
+	uint32_t       m_end;      //!< End offset (exclusive)
+};
+
 /**
  * Emule extended packet, this contains packed data chunk.
  *
@@ -911,7 +926,7 @@ public:
 	typedef SourceList::const_iterator CIter;
 
 	AnswerSources(const Hash<ED2KHash> &hash, const SourceList &srcs);
-	AnswerSources(std::istringstream &i);
+	AnswerSources(std::istream &i);
 	operator std::string();
 
 	Hash<ED2KHash> getHash() const    { return m_hash;            }
@@ -33,6 +33,8 @@
 #include <hncore/ed2k/zutils.h>          // for decompress
 #include <hnbase/log.h>                  // For debug/trace logging
 #include <hnbase/utils.h>                // for Utils::getVal
+#include <hnbase/recvbuffer.h>           // for RecvBuffer
+#include <hnbase/memstream.h>            // for MemStream
 
 namespace Donkey {
 
@@ -42,20 +44,27 @@ namespace Donkey {
  */
 struct ED2KNetProtocolTCP {
 	enum {
-		HEADER_LENGTH = 5 // PROTO, LEN
+		HEADER_LENGTH = 5, // PROTO, LEN
+		MAX_LENGTH = 16*1024*1024 //!< Larger packets break the stream
 	};
 
-	//! Parse header of a TCP Packet from a stream
-	template<class Stream>
+	/**
+	 * Parse header of a TCP Packet from memory buffer.
+	 *
+	 * @param data     Buffer, must contain at least HEADER_LENGTH bytes
+	 * @param size     Number of bytes in buffer
+	 * @param proto    Receives the protocol
+	 * @param length   Receives the packet length (opcode + data)
+	 */
 	static void parseHeader(
-		Stream&   i,
-		uint8_t&  proto,
-		uint32_t& length,
-		uint8_t&  opcode
+		const char* data,
+		uint32_t,
+		uint8_t&    proto,
+		uint32_t&   length
 	) {
-		proto = Utils::getVal<uint8_t>(i);
-		length = Utils::getVal<uint32_t>(i);
-		opcode = Utils::getVal<uint8_t>(i);
+		proto = data[0];
+		memcpy(&length, data + 1, 4);
+		length = SWAP32_ON_BE(length);
 	}
 
 private:
@@ -68,22 +77,27 @@ private:
  */
 struct ED2KNetProtocolUDP {
 	enum {
-		HEADER_LENGTH = 1 // PROTO
+		HEADER_LENGTH = 1, // PROTO
+		MAX_LENGTH = 64*1024 //!< Datagrams can't be larger anyway
 	};
 
 	/**
-	 * Parse header of an UDP Packet from a stream
+	 * Parse header of an UDP Packet from memory buffer. UDP packets have
+	 * no length field; each datagram is a single packet.
+	 *
+	 * @param data     Datagram, must contain at least HEADER_LENGTH bytes
+	 * @param size     Length of the datagram
+	 * @param proto    Receives the protocol
+	 * @param length   Receives the packet length (opcode + data)
 	 */
-	template<class Stream>
 	static void parseHeader(
-		Stream&   i,
-		uint8_t&  proto,
-		uint32_t& length,
-		uint8_t&  opcode
+		const char* data,
+		uint32_t    size,
+		uint8_t&    proto,
+		uint32_t&   length
 	) {
-		proto = Utils::getVal<uint8_t>(i);
-		opcode = Utils::getVal<uint8_t>(i);
-		length = i.str().size() - HEADER_LENGTH;
+		proto = data[0];
+		length = size - HEADER_LENGTH;
 	}
 
 private:
@@ -122,7 +136,7 @@ public:
 	 * @param parent   Pointer to object to which notifications should be
 	 *                 sent. Must not be null.
 	 */
-	ED2KParser(Parent *parent) : m_parent(parent), m_need() {
+	ED2KParser(Parent *parent) : m_parent(parent) {
 		CHECK_THROW(parent);
 	}
 
@@ -132,64 +146,65 @@ public:
 	//@{
 	void    setParent(Parent *p) { CHECK_THROW(p); m_parent = p; }
 	Parent* getParent()    const { return m_parent;              }
-	bool    hasBuffered()  const { return m_buffer.size();       }
+	bool    hasBuffered()  const { return !m_buffer.empty();     }
 	void    clearBuffer()        { m_buffer.clear();             }
 	//@}
 
 	/**
-	 * Continue stream parsing, passing additional data. The data is
-	 * buffered internally, so @param data may be freed after passing
-	 * to this method. Note that this function triggers a chain-reaction
-	 * of events when a new packet is detected, which leads back to
-	 * client code, into the relevant packet handler function. When this
-	 * function returns, all found packets in stream have been parsed, and
-	 * all remaining data has been buffered for next parsing sequence.
+	 * Continue stream parsing, passing additional data. Complete packets
+	 * are parsed directly from @param data; only a trailing incomplete
+	 * packet is buffered internally, so @param data may be freed after
+	 * passing to this method. Note that this function triggers a
+	 * chain-reaction of events when a new packet is detected, which leads
+	 * back to client code, into the relevant packet handler function. When
+	 * this function returns, all found packets in stream have been parsed,
+	 * and all remaining data has been buffered for next parsing sequence.
 	 *
 	 * @param data     Data buffer to be parsed.
+	 * @param len      Length of data
 	 */
-	void parse(const std::string &data) {
-		m_buffer += data;
-		if(
-			m_buffer.size() < NetProtocolType::HEADER_LENGTH ||
-			m_buffer.size() < m_need
-		) {
-			return; // not enough data yet
+	void parse(const char *data, uint32_t len) {
+		if (!m_buffer.empty()) {
+			m_buffer.append(data, len);
+			parseBuffer(m_buffer);
+			return;
 		}
-		uint32_t lastPacket = 0;
-		std::istringstream i(m_buffer);
-		while (i.good()) {
-			lastPacket = i.tellg();
-			try {
-				if (!readPacket(i, m_packet)) {
-					break;
-				}
-			} catch (Utils::ReadError&) {
-				break;
+		uint32_t used = 0;
+		while (len - used >= NetProtocolType::HEADER_LENGTH) {
+			uint32_t ret = parsePacket(data + used, len - used);
+			if (!ret) {
+				break; // not enough data yet
 			}
+			used += ret;
+		}
+		m_buffer.append(data + used, len - used);
+	}
 
-			// Locate the right factory for this packet.
-			Iter iter = factories()[m_packet.m_proto].find(
-				m_packet.m_opcode
-			);
-			if (iter == factories()[m_packet.m_proto].end()) {
-				logTrace("ed2k.parser",
-					boost::format(
-						COL_GREEN "Received unknown "
-						"packet: %s" COL_NONE
-					) % m_packet
-				);
-				continue;
-			}
-			uint32_t curPos = i.tellg();
-			if (curPos == m_buffer.size()) {
-				m_buffer.clear();
-			}
+	//! Convenience overload, see above
+	void parse(const std::string &data) {
+		parse(data.data(), data.size());
+	}
 
-			// found the handler
-			std::istringstream packet(m_packet.m_data);
-			(*iter).second->create(m_parent, packet);
+	/**
+	 * Continue stream parsing, reading the data directly from a socket's
+	 * input buffer. Complete packets are consumed from the buffer as they
+	 * are parsed; a trailing incomplete packet is left in the buffer, to
+	 * be completed by subsequent reads. This avoids copying the stream
+	 * data into the parser.
+	 *
+	 * @param in       Input buffer to be parsed
+	 */
+	void parse(boost::shared_ptr<RecvBuffer> in) {
+		// Data buffered by the other parse() overload must come first
+		if (!m_buffer.empty()) {
+			m_buffer.append(in->data(), in->size());
+			in->clear();
+			parseBuffer(m_buffer);
+			return;
 		}
-		m_buffer = i.str().substr(lastPacket);
+		// Note: `in` is held by value, since the socket that owns the
+		// buffer may be destroyed by the packet handlers.
+		parseBuffer(*in);
 	}
 
 	/**
@@ -210,10 +225,9 @@ public:
 		 * Creates a packet and calls back to packet handler.
 		 *
 		 * @param parent        Pointer to packet handler object
-		 * @param i             Stream containing packet data
-		 * @param proto         Protocol used for this packet
+		 * @param i             Stream over the packet data
 		 */
-		virtual void create(Parent *parent, std::istringstream &i) = 0;
+		virtual void create(Parent *parent, MemStream &i) = 0;
 	protected:
 		/**
 		 * Base class constructor registers the factory with ED2KParser
@@ -266,14 +280,16 @@ private:
 	}
 
 	/**
-	 * InternalPacket structure is a temporary storage for a single packet
-	 * data.
+	 * InternalPacket structure describes the packet currently being parsed.
+	 * The data isn't copied; it points into the parsed stream, or into the
+	 * inflate buffer for compressed packets.
 	 */
 	struct InternalPacket {
 		uint8_t     m_proto;       //!< protocol
 		uint32_t    m_len;         //!< data + opcode length
 		uint8_t     m_opcode;      //!< opcode
-		std::string m_data;        //!< data
+		const char *m_data;        //!< data
+		uint32_t    m_size;        //!< data length
 
 		//! Output operator into streams
 		friend std::ostream& operator<<(
@@ -282,8 +298,10 @@ private:
 			o << "protocol=" << Utils::hexDump(i.m_proto)  << " ";
 			o << "length="   << i.m_len    << " ";
 			o << "opcode="   << Utils::hexDump(i.m_opcode) << " ";
-			if (i.m_data.size() < 1024) {
-				o << Utils::hexDump(i.m_data);
+			if (i.m_size < 1024) {
+				o << Utils::hexDump(
+					std::string(i.m_data, i.m_size)
+				);
 			} else {
 				o << "\nData omitted (length >= 1024)";
 			}
@@ -292,57 +310,116 @@ private:
 	};
 
 	/**
-	 * readPacket() method attempts to read a single packet from the
-	 * designated stream.
+	 * Parse complete packets from the start of a buffer, consuming them
+	 * from the buffer; a trailing incomplete packet is left in the buffer.
+	 *
+	 * @param in      Buffer to parse
+	 */
+	void parseBuffer(RecvBuffer &in) {
+		while (in.size() >= NetProtocolType::HEADER_LENGTH) {
+			uint32_t ret = parsePacket(in.data(), in.size());
+			if (!ret || ret > in.size()) {
+				break; // not enough data, or cleared by handler
+			}
+			in.consume(ret);
+		}
+	}
+
+	/**
+	 * Frame the packet at the start of a buffer, and pass it to the
+	 * relevant factory. The packet data is read in place, so the buffer
+	 * must not be modified until this returns.
 	 *
-	 * @param i       Stream to read the packet from
-	 * @param p       Packet object to store the packet data in
-	 * @return        True if packet was found and read; false otherwise
+	 * @param data    Buffer, must contain at least HEADER_LENGTH bytes
+	 * @param size    Number of bytes in buffer
+	 * @return        Length of the packet, including header, or 0 if the
+	 *                buffer doesn't contain the entire packet yet
 	 *
-	 * \throws std::out_of_range if only part of the packet could be read.
-	 *         This generally indicates you should try again later when more
-	 *         data is available.
 	 * \throws std::runtime_error on fatal errors. If this is thrown, the
 	 *         stream should be marked unusable, and exception propagated
 	 *         up to client code.
 	 */
-	bool readPacket(std::istringstream &i, InternalPacket &p) {
-		NetProtocol::parseHeader(i, p.m_proto, p.m_len, p.m_opcode);
+	uint32_t parsePacket(const char *data, uint32_t size) {
+		InternalPacket &p = m_packet;
+		NetProtocolType::parseHeader(data, size, p.m_proto, p.m_len);
+		checkProtocol(p.m_proto);
+		// compare before adding HEADER_LENGTH, which could overflow
+		if (p.m_len > NetProtocolType::MAX_LENGTH) {
+			throw std::runtime_error(
+				(boost::format("Packet too large (%d bytes)")
+				% p.m_len).str()
+			);
+		}
+		if (p.m_len > size - NetProtocolType::HEADER_LENGTH) {
+			return 0;
+		}
+		uint32_t total = NetProtocolType::HEADER_LENGTH + p.m_len;
+		if (p.m_len == 0) {
+			return total;
+		}
+		data += NetProtocolType::HEADER_LENGTH;
+		p.m_opcode = *data;
+		p.m_data = data + 1;
+		p.m_size = p.m_len - 1;
+
+		unpackPacket(p);
+
+		Iter iter = factories()[p.m_proto].find(p.m_opcode);
+		if (iter == factories()[p.m_proto].end()) {
+			logTrace("ed2k.parser",
+				boost::format(
+					COL_GREEN "Received unknown "
+					"packet: %s" COL_NONE
+				) % p
+			);
+			return total;
+		}
+		m_stream.reset(p.m_data, p.m_size);
+		(*iter).second->create(m_parent, m_stream);
+		return total;
+	}
 
-		switch (p.m_proto) {
+	/**
+	 * Verify the protocol byte from a packet header.
+	 *
+	 * \throws std::runtime_error if the protocol is not supported
+	 */
+	static void checkProtocol(uint8_t proto) {
+		switch (proto) {
 			case PR_EMULE: case PR_ED2K: 
 			case PR_KADEMLIA: case PR_ZLIB:
-				if (p.m_len == 0) { return true; }
 				break;
 			default:
 				throw std::runtime_error(
 					"Invalid protocol %s" 
-					+ Utils::hexDump(p.m_proto)
+					+ Utils::hexDump(proto)
 				);
 		}
+	}
 
-		if (i.str().size() < p.m_len + NetProtocol::HEADER_LENGTH) {
-			m_need = p.m_len +
-				NetProtocol::HEADER_LENGTH - i.str().size();
-
-			return false;
-		}
-
-		CHECK_THROW(p.m_len > 0);
-		p.m_data = Utils::getVal<std::string>(i, p.m_len - 1);
-		if (p.m_data.size() != p.m_len - 1) {
-			throw Utils::ReadError(
-				(boost::format(
-					"Internal parser error error: "
-					"%s != %s; packet: %s"
-				) % p.m_data.size() % p.m_len % p).str()
-			);
-		}
-		m_need = 0;
+	/**
+	 * Buffer for unpacking compressed packets. Packet objects copy the
+	 * data they need during construction, so a single buffer is shared by
+	 * all parsers (parsing is only done in the main thread); it keeps its
+	 * capacity, so unpacking normally needs no allocations.
+	 */
+	static std::vector<char>& inflateBuffer() {
+		static std::vector<char> s_buffer;
+		return s_buffer;
+	}
 
+	/**
+	 * Decompress a fully read packet if needed, and update statistics.
+	 *
+	 * @param p       Packet which has been read from stream
+	 * \throws std::runtime_error on fatal errors
+	 */
+	void unpackPacket(InternalPacket &p) {
 		if (p.m_proto == PR_ZLIB || p.m_proto == PR_KADEMLIA_ZLIB) {
-			p.m_data = Zlib::decompress(p.m_data);
-			CHECK_THROW_MSG(p.m_data.size(), "unpacking failed");
+			std::vector<char> &buf = inflateBuffer();
+			p.m_size = Zlib::decompress(p.m_data, p.m_size, buf);
+			CHECK_THROW_MSG(p.m_size, "unpacking failed");
+			p.m_data = &buf[0];
 
 			if (p.m_proto == PR_ZLIB) {
 				p.m_proto = PR_ED2K;
@@ -364,25 +441,17 @@ private:
 		) {
 			ED2KPacket::addOverheadDn(6 + 24);
 		} else {
-			ED2KPacket::addOverheadDn(6 + p.m_data.size());
+			ED2KPacket::addOverheadDn(6 + p.m_size);
 		}
 #ifdef HEXDUMPS
 		logDebug(boost::format("Received packet: %s") % p);
 #endif
-		return true;
 	}
 
-	std::string m_buffer;       //!< Internal data buffer
+	RecvBuffer m_buffer;        //!< Incomplete packet from parse(data)
 	Parent *m_parent;           //!< Pointer to packets handler class
 	InternalPacket m_packet;    //!< Packet currently being parsed
-
-	/**
-	 * When parsing long packets (e.g. data packets - 10k long), this
-	 * indicates how much more data is needed before completing the packet.
-	 * This is used for optimizing, on order to reduce the amount of
-	 * "failed" packet parse attempts.
-	 */
-	uint32_t m_need;
+	MemStream m_stream;         //!< Reader passed to packet factories
 };
 
 } // end namespace Donkey
@@ -456,7 +525,7 @@ public:                                                                       \
 	Factory_##PacketType()                                                \
 	: ED2KParser<Parent, NetProtocol>::PacketFactory(Proto, Opcode)       \
 	{ }                                                                   \
-	virtual void create(Parent *parent, std::istringstream &i) {          \
+	virtual void create(Parent *parent, MemStream &i) {                   \
 		parent->onPacket(ED2KPacket::PacketType(i));                  \
 	}                                                                     \
 }
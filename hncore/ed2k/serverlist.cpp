@@ -48,7 +48,9 @@ namespace Donkey {
 enum ED2K_ServerCommConstants {
 	SOURCEREASKTIME = 20*60*1000, //!< UDP queries time, 20 minutes
 	SERVERPINGTIME  = 20*60*1000, //!< Server ping time, 20 minutes
-	SERVERTIMEOUT   = 20000       //!< Server connection timeout
+	SERVERTIMEOUT   = 20000,      //!< Server connection timeout
+	PUBLISHBATCH    = 200,        //!< Files per OfferFiles packet
+	PUBLISHDELAY    = 10*1000     //!< Time between OfferFiles packets
 };
 
 const std::string TRACE = "ed2k.serverlist";
@@ -110,6 +112,82 @@ struct QTIter : MIServerList::nth_index<3>::type::iterator {
 };
 typedef MIServerList::nth_index<4>::type::iterator UAddrIter;
 
+/**
+ * Query times of a file; when the file was last queried from any server,
+ * and when from each server (by IP) within last SOURCEREASKTIME.
+ */
+struct FileQuery {
+	FileQuery(const Hash<ED2KHash> &h) : m_hash(h), m_lastQuery() {}
+
+	Hash<ED2KHash> m_hash;
+	uint64_t m_lastQuery;
+	mutable std::map<uint32_t, uint64_t> m_servers;
+};
+
+/**
+ * List of files to query sources for via UDP, sorted by hash and by last
+ * query time, longest-waiting files first.
+ */
+struct FileQueryIndices : boost::multi_index::indexed_by<
+	boost::multi_index::ordered_unique<
+		boost::multi_index::member<
+			FileQuery, Hash<ED2KHash>, &FileQuery::m_hash
+		>
+	>,
+	boost::multi_index::ordered_non_unique<
+		boost::multi_index::member<
+			FileQuery, uint64_t, &FileQuery::m_lastQuery
+		>
+	>
+> {};
+struct FileQueryList : boost::multi_index_container<
+	FileQuery, FileQueryIndices
+> {};
+typedef FileQueryList::nth_index<0>::type::iterator FQHashIter;
+typedef FileQueryList::nth_index<1>::type::iterator FQTimeIter;
+
+/**
+ * Finds the ED2K hashset of a file which can be published to servers.
+ *
+ * @param sf       File to be published
+ * @return         The hashset, or 0 if the file can't be published
+ */
+HashSetBase* getPublishHashSet(SharedFile *sf) {
+	// Only a partial solution, but avoids publishing files which
+	// have less than 9500kb downloaded. To be 100% correct, we
+	// should check here if the file has at least one complete chunk
+	if (sf->isPartial()) {
+		if (sf->getPartData()->getCompleted() < ED2K_PARTSIZE) {
+			return 0;
+		}
+	}
+
+	MetaData *md = sf->getMetaData();
+	if (md == 0) {
+		return 0; // No metadata - can't do anything
+	}
+	if (sf->getSize() > std::numeric_limits<uint32_t>::max()) {
+		// It's larger than we can support on
+		// ed2k (32-bit integer - 4gb) :(
+		return 0;
+	}
+
+	for (uint32_t j = 0; j < md->getHashSetCount(); ++j) {
+		HashSetBase* hs = md->getHashSet(j);
+		if (hs->getFileHashTypeId() == CGComm::OP_HT_ED2K) {
+			return hs;
+		}
+	}
+	return 0;
+}
+
+//! Sets last query time of a file
+struct SetLastQuery {
+	SetLastQuery(uint64_t t) : m_time(t) {}
+	void operator()(FileQuery &f) const { f.m_lastQuery = m_time; }
+	uint64_t m_time;
+};
+
 } // namespace Detail
 
 using namespace Detail;
@@ -129,7 +207,8 @@ DECLARE_PACKET_HANDLER(ServerList, FoundSources );
 ServerList::ServerList() : Object(&ED2K::instance(), "serverlist")
 , m_serverSocket(), m_currentServer(),
 m_parser(new ED2KParser<ServerList>(this)), m_status(),
-m_list(new MIServerList) {
+m_list(new MIServerList), m_queries(new FileQueryList), m_publishPos(),
+m_publishLeft(), m_publishScheduled() {
 	// Annouce we are capable of performing searches too
 	Search::addQueryHandler(
 		boost::bind(&ServerList::performSearch, this, _1)
@@ -160,6 +239,16 @@ void ServerList::init() {
 	DownloadList::instance().onAdded.connect(
 		boost::bind(&ServerList::reqSources, this, _1)
 	);
+	DownloadList::instance().onAdded.connect(
+		boost::bind(&ServerList::onDownloadAdded, this, _1)
+	);
+	DownloadList::instance().onRemoved.connect(
+		boost::bind(&ServerList::onDownloadRemoved, this, _1)
+	);
+	DownloadList &list = DownloadList::instance();
+	for (DownloadList::Iter i = list.begin(); i != list.end(); ++i) {
+		onDownloadAdded(*i);
+	}
 	Prefs::instance().valueChanged.connect(
 		boost::bind(&ServerList::configChanged, this, _1, _2)
 	);
@@ -174,6 +263,7 @@ void ServerList::exit() {
 	for (ServIter i = m_list->begin(); i != m_list->end(); ++i) {
 		delete *i;
 	}
+	m_queries->clear();
 }
 
 ServerList::~ServerList() {}
@@ -349,7 +439,7 @@ void ServerList::onServerSocketEvent(ED2KClientSocket *c, SocketEvent evt) {
 			break;
 		case SOCK_READ: {
 			try {
-				m_parser->parse(c->getData());
+				m_parser->parse(c->getInput());
 			} catch (std::exception &er) {
 				logDebug(
 					boost::format(
@@ -429,51 +519,98 @@ void ServerList::sendLoginRequest() {
 	);
 }
 
-void ServerList::publishFiles(bool useZlib) {
+void ServerList::publishFiles() {
 	CHECK_THROW(m_serverSocket);
 	CHECK_THROW(m_serverSocket->isConnected());
+	CHECK_THROW(m_currentServer);
 
+	bool useZlib = m_currentServer->getTcpFlags() & FL_ZLIB;
 	ED2KPacket::OfferFiles packet(useZlib ? PR_ZLIB : PR_ED2K);
 
-	uint32_t cnt = 0;         // Don't publish over 300 files
-	FilesList::CSFIter i = FilesList::instance().begin();
-	for (; i != FilesList::instance().end() && cnt <= 300; ++i, ++cnt) {
-		SharedFile *sf = *i;
+	FilesList &list = FilesList::instance();
+	uint32_t limit = getPublishLimit();
+	uint32_t cnt = 0;
+	if (m_publishPos >= list.size()) {
+		m_publishPos = 0;
+	}
+	m_publishLeft = std::min<uint32_t>(m_publishLeft, list.size());
 
-		// Only a partial solution, but avoids publishing files which
-		// have less than 9500kb downloaded. To be 100% correct, we
-		// should check here if the file has at least one complete chunk
-		if (sf->isPartial()) {
-			if (sf->getPartData()->getCompleted() < ED2K_PARTSIZE) {
-				continue;
-			}
+	// files shared after login first, then continue walking FilesList
+	while (m_publishQueue.size() && cnt < PUBLISHBATCH) {
+		if (m_published.size() >= limit) {
+			break;
 		}
+		Hash<ED2KHash> hash(m_publishQueue.front());
+		m_publishQueue.pop_front();
+		SharedFile *sf = MetaDb::instance().findSharedFile(hash);
+		HashSetBase *hs = sf ? getPublishHashSet(sf) : 0;
+		if (!hs || !m_published.insert(hash).second) {
+			continue; // gone meanwhile, or already offered
+		}
+		logTrace(TRACE,
+			boost::format("Publishing file %s") % sf->getName()
+		);
+		packet.push(makeED2KFile(sf, sf->getMetaData(), hs, useZlib));
+		++cnt;
+	}
 
-		MetaData *md = sf->getMetaData();
-		if (md == 0) {
-			continue; // No metadata - can't do anything
+	FilesList::CSFIter i = list.begin();
+	std::advance(i, m_publishPos);
+	while (m_publishLeft && cnt < PUBLISHBATCH) {
+		if (m_published.size() >= limit) {
+			break;
 		}
-		if (sf->getSize() > std::numeric_limits<uint32_t>::max()) {
-			// It's larger than we can support on
-			// ed2k (32-bit integer - 4gb) :(
-			continue;
+		if (i == list.end()) {
+			i = list.begin();
+			m_publishPos = 0;
 		}
+		SharedFile *sf = *i++;
+		++m_publishPos;
+		--m_publishLeft;
 
-		for (uint32_t j = 0; j < md->getHashSetCount(); ++j) {
-			HashSetBase* hs = md->getHashSet(j);
-			if (hs->getFileHashTypeId() == CGComm::OP_HT_ED2K) {
-				logTrace(TRACE, 
-					boost::format("Publishing file %s") 
-					% sf->getName()
-				);
-				packet.push(makeED2KFile(sf, md, hs, useZlib));
-			}
+		HashSetBase *hs = getPublishHashSet(sf);
+		if (!hs) {
+			continue;
 		}
+		Hash<ED2KHash> hash(hs->getFileHash().toString());
+		if (!m_published.insert(hash).second) {
+			continue; // already offered
+		}
+		logTrace(TRACE,
+			boost::format("Publishing file %s") % sf->getName()
+		);
+		packet.push(makeED2KFile(sf, sf->getMetaData(), hs, useZlib));
+		++cnt;
 	}
 
 	if (cnt) { // only send if we have smth to offer
 		*m_serverSocket << packet;
 	}
+	logTrace(TRACE,
+		boost::format("Published %d files (%d of max %d offered)")
+		% cnt % m_published.size() % limit
+	);
+
+	bool more = m_publishLeft || m_publishQueue.size();
+	if (more && m_published.size() < limit) {
+		if (!m_publishScheduled) {
+			getEventTable().postEvent(
+				this, EVT_PUBLISH, PUBLISHDELAY
+			);
+			m_publishScheduled = true;
+		}
+	}
+}
+
+uint32_t ServerList::getPublishLimit() const {
+	CHECK_THROW(m_currentServer);
+
+	if (m_currentServer->getSoftLimit()) {
+		return m_currentServer->getSoftLimit();
+	} else if (m_currentServer->getHardLimit()) {
+		return m_currentServer->getHardLimit();
+	}
+	return Prefs::instance().read<uint32_t>("/ed2k/MaxPublishFiles", 300);
 }
 
 void ServerList::performSearch(SearchPtr search) {
@@ -552,8 +689,14 @@ void ServerList::onPacket(const ED2KPacket::IdChange &p) {
 			% m_currentServer->getName()
 			% m_currentServer->getAddr()
 		);
-		// Publish our shared files
-		publishFiles(m_currentServer->getTcpFlags() & FL_ZLIB);
+		// Publish our shared files; the server doesn't know any
+		// of them yet
+		m_published.clear();
+		m_publishQueue.clear();
+		m_publishLeft = FilesList::instance().size();
+		if (!m_publishScheduled) {
+			publishFiles();
+		}
 		m_lastSourceRequest = 0;
 		reqSources();
 		getEventTable().postEvent(
@@ -685,23 +828,6 @@ void ServerList::onSharedFileEvent(SharedFile *sf, int evt) {
 	}
 
 	if (evt == SF_METADATA_ADDED) {
-		if (!sf->getMetaData()) {
-			return; // can't publish w/o metadata
-		}
-
-		if (!sf->getMetaData()->getHashSetCount()) {
-			return; // can't publish w/o hashes
-		}
-
-		// Only a partial solution, but avoids publishing files which
-		// have less than 9500kb downloaded. To be 100% correct, we
-		// should check here if the file has at least one complete chunk
-		if (sf->isPartial()) {
-			if (sf->getPartData()->getCompleted() < ED2K_PARTSIZE) {
-				return;
-			}
-		}
-
 		publishFile(sf);
 	}
 }
@@ -709,22 +835,23 @@ void ServerList::onSharedFileEvent(SharedFile *sf, int evt) {
 void ServerList::publishFile(SharedFile *sf) {
 	CHECK_THROW(m_serverSocket);
 	CHECK_THROW(m_serverSocket->isConnected());
-	CHECK_THROW(sf->getMetaData());
-	CHECK_THROW(sf->getMetaData()->getHashSetCount());
+	CHECK_THROW(m_currentServer);
 
-	logTrace(TRACE, boost::format("Publishing file %s") % sf->getName());
+	HashSetBase *hs = getPublishHashSet(sf);
+	if (!hs) {
+		return;
+	}
+	Hash<ED2KHash> hash(hs->getFileHash().toString());
+	if (m_published.find(hash) != m_published.end()) {
+		return; // already offered
+	} else if (m_published.size() >= getPublishLimit()) {
+		return; // server doesn't accept more files
+	}
+	m_publishQueue.push_back(hash);
 
-	MetaData *md = sf->getMetaData();
-	for (uint32_t i = 0; i < md->getHashSetCount(); ++i) {
-		HashSetBase *hs = md->getHashSet(i);
-		if (hs->getFileHashTypeId() == CGComm::OP_HT_ED2K) {
-			bool useZlib = m_currentServer->getTcpFlags() & FL_ZLIB;
-			*m_serverSocket << ED2KPacket::OfferFiles(
-				makeED2KFile(sf, md, hs, useZlib),
-				useZlib ? PR_ZLIB : PR_ED2K
-			);
-			break;
-		}
+	if (!m_publishScheduled) {
+		getEventTable().postEvent(this, EVT_PUBLISH, PUBLISHDELAY);
+		m_publishScheduled = true;
 	}
 }
 
@@ -837,6 +964,11 @@ void ServerList::onServerListEvent(ServerList *sl, ServerListEvent evt) {
 		}
 	} else if (evt == EVT_QUERYSERVER) {
 		queryNextServer();
+	} else if (evt == EVT_PUBLISH) {
+		m_publishScheduled = false;
+		if (m_serverSocket && m_status == ST_CONNECTED) {
+			publishFiles();
+		}
 	} else {
 		logDebug("Unknown ServerList event.");
 	}
@@ -1037,7 +1169,21 @@ void ServerList::queryNextServer() {
 		it, bind(&Server::setLastUdpQuery, __1, curTick)
 	);
 
-	// schedule next query
+	// Schedule next query. Each query covers up to 25 files, so all
+	// files can be queried within the query period only if there are
+	// enough servers, since none is queried more often than once per
+	// SOURCEREASKTIME.
+	uint64_t period = getQueryPeriod();
+	uint64_t queries = (m_queries->size() + 24) / 25;
+	if (queries * SOURCEREASKTIME > period * m_list->size()) {
+		logTrace(TRACE_GLOBSRC,
+			boost::format(
+				"%d servers are not enough for querying %d "
+				"files within %d minutes."
+			) % m_list->size() % m_queries->size()
+			% (period / 60000)
+		);
+	}
 	it = list.lower_bound(0);
 	uint64_t nextQuery = (*it)->getLastUdpQuery() + SOURCEREASKTIME;
 	if (nextQuery < curTick) {
@@ -1050,6 +1196,23 @@ void ServerList::queryNextServer() {
 	);
 }
 
+uint64_t ServerList::getQueryPeriod() const {
+	uint32_t period = Prefs::instance().read<uint32_t>(
+		"/ed2k/UdpQueryPeriod", 60
+	);
+	return std::max(period, 1u) * 60 * 1000;
+}
+
+void ServerList::onDownloadAdded(Download &d) {
+	if (m_queries->find(d.getHash()) == m_queries->end()) {
+		m_queries->insert(FileQuery(d.getHash()));
+	}
+}
+
+void ServerList::onDownloadRemoved(Download &d) {
+	m_queries->erase(d.getHash());
+}
+
 void ServerList::pingServer(QTIter &it) try {
 	CHECK_THROW(it != m_list->get<3>().end());
 
@@ -1086,38 +1249,52 @@ void ServerList::udpGetSources(QTIter &it) try {
 		limit = sendSize ? 25 : 31;
 	}
 
-	std::vector<Download*> downloads;
-	DownloadList& list = DownloadList::instance();
-	// can't use std::copy since Iter isn't fully standard-conformant
-	for (DownloadList::Iter i = list.begin(); i != list.end(); ++i) {
-		downloads.push_back(&*i);
+	// Candidates are the files that have waited longest for a query,
+	// skipping the ones asked from this server recently. Up to twice the
+	// packet's capacity is considered, and of those, the overdue files go
+	// first, and then the ones with least sources.
+	uint32_t ip = (*it)->getAddr().getIp();
+	uint64_t curTick = Utils::getTick();
+	uint64_t period = getQueryPeriod();
+	DownloadList &list = DownloadList::instance();
+	std::vector<std::pair<std::pair<bool, uint32_t>, Download*> > files;
+	FileQueryList::nth_index<1>::type &queue = m_queries->get<1>();
+	FQTimeIter i = queue.begin();
+	for (; i != queue.end() && files.size() < limit * 2; ++i) {
+		Download *d = list.find((*i).m_hash);
+		if (!d || !d->getPartData()->isRunning()) {
+			continue;
+		}
+		std::map<uint32_t, uint64_t>::iterator j;
+		j = (*i).m_servers.find(ip);
+		if (j != (*i).m_servers.end()) {
+			if ((*j).second + SOURCEREASKTIME > curTick) {
+				continue;
+			}
+		}
+		bool overdue = (*i).m_lastQuery + period <= curTick;
+		files.push_back(std::make_pair(
+			std::make_pair(!overdue, d->getSourceCount()), d
+		));
+	}
+	if (files.size() > limit) {
+		std::partial_sort(
+			files.begin(), files.begin() + limit, files.end()
+		);
+		files.resize(limit);
 	}
-	std::sort(
-		downloads.begin(), downloads.end(),
-		boost::bind(&Download::getSourceCount, _1) <
-		boost::bind(&Download::getSourceCount, _2)
-	);
 
-	uint32_t cnt = 0;
+	uint32_t cnt = files.size();
 	ED2KPacket::GlobGetSources packet(sendSize);
-	if (downloads.size() < limit) {
-		limit = downloads.size();
-	}
-	for (size_t i = 0; i < limit; ++i) {
-		Download *d = downloads[i];
-		if (d->getPartData()->isRunning()) {
-			packet.addHash(d->getHash(), d->getSize());
-			++cnt;
-		} else if (limit < downloads.size()) {
-			++limit;
-		}
+	for (size_t k = 0; k < files.size(); ++k) {
+		Download *d = files[k].second;
+		packet.addHash(d->getHash(), d->getSize());
 	}
-
 	if (!cnt) {
 		return; // no files queried ...
 	}
 
-	boost::format fmt("[%s] Sending GlobGetSources %s");
+	boost::format fmt("[%s] Sending GlobGetSources %s (%d files)");
 	fmt % to;
 	if ((*it)->getUdpFlags() & Server::FL_GETSOURCES2) {
 		fmt % "(NewFormat)";
@@ -1126,9 +1303,25 @@ void ServerList::udpGetSources(QTIter &it) try {
 	} else {
 		fmt % "";
 	}
-	logTrace(TRACE_GLOBSRC, fmt);
+	logTrace(TRACE_GLOBSRC, fmt % cnt);
 
 	Client::getUdpSocket()->send(packet, to);
+
+	// move the queried files to the back of the queue
+	for (size_t k = 0; k < files.size(); ++k) {
+		FQHashIter f = m_queries->find(files[k].second->getHash());
+		std::map<uint32_t, uint64_t> &times = (*f).m_servers;
+		std::map<uint32_t, uint64_t>::iterator j = times.begin();
+		while (j != times.end()) {
+			if ((*j).second + SOURCEREASKTIME <= curTick) {
+				times.erase(j++);
+			} else {
+				++j;
+			}
+		}
+		times[ip] = curTick;
+		m_queries->modify(f, SetLastQuery(curTick));
+	}
 } catch (SocketError &) {
 	logTrace(TRACE,
 		boost::format("[%s] Fatal error sending UDPGetSources: %s")
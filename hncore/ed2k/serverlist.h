@@ -28,6 +28,9 @@
 #include <hnbase/object.h>                 // object api
 #include <hncore/fwd.h>                    // forward declrs
 #include <hncore/search.h>                 // Search API
+#include <hnbase/hash.h>                   // Hash
+#include <deque>
+#include <set>
 
 namespace Donkey {
 
@@ -146,9 +149,27 @@ private:
 	//! List of servers, sorted by IP and Name
 	boost::scoped_ptr<Detail::MIServerList> m_list;
 
+	//! Files to query sources for via UDP, and when they were queried
+	boost::scoped_ptr<Detail::FileQueryList> m_queries;
+
 	//! Keeps the time when last connection attempt was done
 	uint32_t m_lastConnAttempt;
 
+	//! Files offered to current server during this connection
+	std::set<Hash<ED2KHash> > m_published;
+
+	//! Position in FilesList where publishing continues from
+	uint32_t m_publishPos;
+
+	//! Files in FilesList not yet considered for current server
+	uint32_t m_publishLeft;
+
+	//! Files shared after login, to be offered with the next batch
+	std::deque<Hash<ED2KHash> > m_publishQueue;
+
+	//! Whether EVT_PUBLISH is pending
+	bool m_publishScheduled;
+
 	//! Connected to Detail::foundServer signal
 	boost::signals::scoped_connection m_foundServerConn;
 
@@ -157,7 +178,8 @@ private:
 		EVT_PINGSERVER,    //!< Ping server with empty OfferFiles packet
 		EVT_REQSOURCES,    //!< Request sources from server
 		EVT_QUERYSERVER,   //!< UDP GetSources and Ping request time
-		EVT_CONNECT        //!< Attempt to connect to next server
+		EVT_CONNECT,       //!< Attempt to connect to next server
+		EVT_PUBLISH        //!< Publish next batch of shared files
 	};
 
 	//! Events emitted from Server class (used internally only)
@@ -189,15 +211,28 @@ private:
 	void sendLoginRequest();
 
 	/**
-	 * Sends our current shared files list to server (all of them)
+	 * Sends next batch of shared files to server, starting with files
+	 * queued by publishFile(); files already offered during this
+	 * connection are skipped. If there are more files left, and the
+	 * server's file limit isn't reached yet, the next batch is scheduled
+	 * after PUBLISHDELAY.
 	 *
-	 * @param useZlib        Whether to use Zlib compression (and the
-	 *                       related 'special' id's during sending.
+	 * Publishing continues from where it stopped with the previous server,
+	 * so if more files are shared than servers accept, different servers
+	 * get different files.
+	 */
+	void publishFiles();
+
+	/**
+	 * \returns Max number of files to offer to current server; the soft
+	 *          limit of the server if known, then the hard limit, and
+	 *          /ed2k/MaxPublishFiles preference (default 300) otherwise
 	 */
-	void publishFiles(bool useZlib);
+	uint32_t getPublishLimit() const;
 
 	/**
-	 * Publish a single file to server.
+	 * Queue a single file, which became shared after login, to be offered
+	 * to server with the next batch; schedules the batch if needed.
 	 *
 	 * @param sf             File to publish
 	 */
@@ -254,9 +289,28 @@ private:
 
 	//! Ping the server pointed to by iterator
 	void pingServer(Detail::QTIter &it);
-	//! Get sources via UDP from server pointed to by iterator
+
+	/**
+	 * Get sources via UDP from server pointed to by iterator. Files are
+	 * queried in turns, the ones waiting longest first, so all running
+	 * downloads get queried within the query period (if there are enough
+	 * servers); files are not queried from the same server again within
+	 * SOURCEREASKTIME. The packet is filled up to server's limit.
+	 */
 	void udpGetSources(Detail::QTIter &it);
 
+	/**
+	 * \returns Time within which each running download should be queried
+	 *          from some server via UDP (/ed2k/UdpQueryPeriod preference,
+	 *          in minutes, default 60)
+	 */
+	uint64_t getQueryPeriod() const;
+
+	//! Adds download to UDP queries list
+	void onDownloadAdded(Download &d);
+	//! Removes download from UDP queries list
+	void onDownloadRemoved(Download &d);
+
 	/**
 	 * Event handler for server udp listener
 	 */
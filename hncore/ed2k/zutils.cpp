@@ -67,54 +67,56 @@ std::string compress(const std::string &input) {
 
 // unpack data using zlib
 std::string decompress(const std::string &input, uint32_t bufsize /* = 0 */) {
-	uLongf destLen = bufsize;
-	if (destLen == 0) {
-		destLen = input.size() * 10 + 300;
+	std::vector<char> buf(bufsize);
+	uint32_t len = decompress(input.data(), input.size(), buf);
+	return std::string(len ? &buf[0] : "", len);
+}
+
+// Inflating in steps allows growing the buffer when it fills up, instead of
+// starting over with a larger buffer.
+uint32_t decompress(const char *input, uint32_t len, std::vector<char> &buf) {
+	uint32_t maxSize = std::max<uint32_t>(buf.size(), MAX_UNPACKED);
+	if (buf.size() < len * 4 + 300) {
+		buf.resize(std::min<uint32_t>(len * 4 + 300, maxSize));
 	}
-	boost::scoped_array<Bytef> dest(new Bytef[destLen]);
-	memset(dest.get(), 0, destLen);
-	int ret = uncompress(
-		dest.get(), &destLen,
-		reinterpret_cast<const Bytef*>(input.data()), input.size()
-	);
-	std::string tmp(reinterpret_cast<const char*>(dest.get()), destLen);
-	if (ret == Z_OK) {
-		return tmp;
+	z_stream zs;
+	memset(&zs, 0, sizeof(zs));
+	zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(input));
+	zs.avail_in = len;
+	int ret = inflateInit(&zs);
+	while (ret == Z_OK) {
+		if (zs.total_out == buf.size()) {
+			if (buf.size() >= maxSize) {
+				break;
+			}
+			buf.resize(std::min<uint32_t>(buf.size() * 2, maxSize));
+		}
+		zs.next_out = reinterpret_cast<Bytef*>(&buf[zs.total_out]);
+		zs.avail_out = buf.size() - zs.total_out;
+		ret = inflate(&zs, Z_NO_FLUSH);
+	}
+	uint32_t outLen = zs.total_out;
+	inflateEnd(&zs);
+	if (ret == Z_STREAM_END) {
+		return outLen;
 	}
-	// Else
+
 	boost::format fmt(
 		"Unpacking packet: inputSize=%s buffersize=%s: Error: `%s' %s"
 	);
-	fmt % Utils::hexDump(input.size()) % Utils::hexDump(destLen);
+	fmt % Utils::hexDump(len) % Utils::hexDump(buf.size());
 	switch (ret) {
+		case Z_OK:
+			fmt % "Unpacked data too large.";
+			break;
 		case Z_MEM_ERROR:
 			fmt % "Not enough memory to decompress packet.";
 			break;
-		case Z_BUF_ERROR: {
-			fmt % "Not enough buffer to decompress packet.";
-			// call ourself again, increase buffer 10x
-			bool ok = false;
-			while (!ok) {
-				try {
-					tmp = decompress(input, destLen*10);
-					ok = true;
-				} catch (std::runtime_error&) {
-					if (destLen > 1024*1024) {
-						// don't go over 1 MB bufsize
-						break;
-					}
-				}
-			}
-			if (ok) {
-				return tmp;
-			} // else falls through and throws exception
+		case Z_BUF_ERROR:
+			fmt % "Input incomplete.";
 			break;
-		}
 		case Z_DATA_ERROR:
-			fmt % "Input corrupt or incomplete.";
-			break;
-		case Z_ERRNO:
-			fmt % "Z_ERRNO";
+			fmt % "Input corrupt.";
 			break;
 		case Z_VERSION_ERROR:
 			fmt % "Z_VERSION_ERROR";
@@ -126,7 +128,7 @@ std::string decompress(const std::string &input, uint32_t bufsize /* = 0 */) {
 			fmt % "Unknown error.";
 			break;
 	}
-	fmt % Utils::hexDump(input);
+	fmt % Utils::hexDump(std::string(input, len));
 	throw std::runtime_error(fmt.str());
 }
 
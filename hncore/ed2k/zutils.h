@@ -25,6 +25,8 @@
 #define __ED2K_ZUTILS_H__
 
 #include <hnbase/osdep.h>
+#include <string>
+#include <vector>
 
 //! @name ZLIB compression/decompression methods
 namespace Zlib {
@@ -44,19 +46,35 @@ extern std::string compress(const std::string &input);
  * @param bufsize       Suggested buffer size. If left at default value, the
  *                      method attempts to guess the internal buffer size for
  *                      unpacking itself.
- * @return              Unpacked data, or empty string if something goes wrong
+ * @return              Unpacked data
  *
  * \throws std::runtime_error if decompression fails
  *
- * \note This function may call itself recursivly if the destination buffer size
- *       was not big enough to unpack the data (thus the second parameter also).
- *       The recursion ends either when the unpacking succeeds, or when
- *       destination buffer size exceeds 1MB. If you want to decompress data
- *       resulting in larger amount of unpacket data than 1MB, explicitly
- *       specify the buffer size as parameter.
+ * \note The unpacked data may be up to MAX_UNPACKED bytes, or bufsize, if it
+ *       is larger.
  */
 extern std::string decompress(const std::string &input, uint32_t bufsize = 0);
 
+/**
+ * Decompresses passed data into a reusable buffer. The buffer is grown as
+ * needed, but never shrunk, so once it has grown large enough for the typical
+ * input, decompressing needs no memory allocations at all.
+ *
+ * @param input         Data to be uncompressed
+ * @param len           Length of input
+ * @param buf           Receives the unpacked data at its start
+ * @return              Length of unpacked data
+ *
+ * \throws std::runtime_error if decompression fails, or the data unpacks to
+ *         more than MAX_UNPACKED bytes (or buf.size(), if it is larger)
+ */
+extern uint32_t decompress(
+	const char *input, uint32_t len, std::vector<char> &buf
+);
+
+//! Maximum size of unpacked data, unless a larger buffer is given
+const uint32_t MAX_UNPACKED = 10 * 1024 * 1024;
+
 }
 
 #endif
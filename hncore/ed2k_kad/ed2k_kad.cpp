@@ -319,11 +319,12 @@ void Listener::onSocketEvent(UDPSocket *socket, SocketEvent evt) {
 			) % ret % from
 		);
 
-		std::stringstream ss;
-		ss.write(buf, ret);
+		if (ret <= 0) {
+			return;
+		}
 
 		try {
-			m_parser->parse(ss.str());
+			m_parser->parse(buf, ret);
 		} catch(std::runtime_error &err) {
 			logMsg(boost::format(
 				"Listener::onSocketEvent: error: %s"
@@ -27,6 +27,7 @@
 #include <hncore/metadb.h>
 #include <hncore/sharedfile.h>
 #include <hncore/partdata.h>
+#include <hncore/dirscanner.h>
 #include <hnbase/event.h>
 #include <hnbase/prefs.h>
 #include <boost/filesystem/operations.hpp>
@@ -45,12 +46,17 @@ FilesList::FilesList() : Object(&Hydranode::instance(), "files") {
 	SharedFile::getEventTable().addAllHandler(
 		this, &FilesList::onSharedFileEvent
 	);
+	DirScanner::getEventTable().addHandler(
+		&DirScanner::instance(), this, &FilesList::onScanEvent
+	);
 }
 
 // Destructor (private)
 FilesList::~FilesList() {}
 
 void FilesList::exit() {
+	DirScanner::instance().exit();
+
 	for (SFIter i = m_list.begin(); i != m_list.end(); ++i) {
 		delete *i;
 	}
@@ -97,11 +103,7 @@ void FilesList::addSharedDir(const std::string &_path, bool recurse) try {
 		return; // already known
 	}
 
-	IOThread::Pauser pauser(IOThread::instance());
-
 	scanSharedDir(path, recurse);
-	m_sharedDirs[path] = recurse;
-	saveSettings();
 
 } catch (std::exception &e) {
 	logError(boost::format("Error scanning shared directory: %s")%e.what());
@@ -144,6 +146,10 @@ void FilesList::remSharedDir(const std::string &path, bool /* recurse */) {
 		return;
 	}
 	m_sharedDirs.erase(ret);
+	DirScanner::instance().remove(path);
+	if (m_scanning.erase(path) && m_scanning.empty()) {
+		onScanDone();
+	}
 
 	// Scan through main map and locate entries which were in this
 	// directory, and destroy them.
@@ -200,75 +206,102 @@ void FilesList::verifyPath(const std::string &path) {
 	}
 }
 
-//! This variable keeps track of recursion count in scanSharedDir (which calls
-//! itself during recursive directories scanning) in order to write preferences
-//! only during first entrance of the function during recursive scan, but not
-//! during any subsequent recursive entrances. The variable is initialized to
-//! zero, increased by one during every entrance of scanSharedDir() method, and
-//! reduced by one during every exit of scanSharedDir() method. Thus, if this
-//! variable is set to 1, we are dealing with first entrance of the function.
-//! Once the recursion ends, the variable should be back at zero.
-static int recursion = 0;
-
-//! Directories scanning, optionally recursing.
+// Directories are enumerated by DirScanner, which also keeps watching them for
+// changes afterwards; the files found are added in onScanEvent().
 void FilesList::scanSharedDir(const std::string &dir, bool recurse) try {
 	verifyPath(dir);
-	recursion++;
-	using namespace boost::filesystem;
 
-	if (recursion == 1) {
-		logMsg(
-			boost::format("Scanning shared directory %s %s")
-			% dir % (recurse ? "recursivly" : "")
-		);
-		SDIter i = m_sharedDirs.find(dir);
-		if (i == m_sharedDirs.end()) {
-			m_sharedDirs.insert(std::make_pair(dir, recurse));
-		} else {
-			// We already have this dir - update it
-			if ((*i).second != recurse) {
-				(*i).second = recurse;
-			}
+	logMsg(
+		boost::format("Scanning shared directory %s %s")
+		% dir % (recurse ? "recursivly" : "")
+	);
+	m_sharedDirs[dir] = recurse;
+	saveSettings();
+
+	ScanState &state = m_scanning[dir];
+	state.m_found = 0;
+	state.m_timer.reset();
+	DirScanner::instance().scan(dir, recurse);
+} catch (std::exception &er) {
+	logError(boost::format("Scanning shared directories: %s") % er.what());
+}
+MSVC_ONLY(;)
+
+// Files being moved to incoming dir when download completes are still listed
+// under their temp file path, so they are recognized by their destination.
+void FilesList::onScanEvent(DirScanner*, DirScanner::DeltaPtr delta) {
+	using boost::filesystem::path;
+	if (m_sharedDirs.find(delta->m_root) == m_sharedDirs.end()) {
+		return; // un-shared meanwhile
+	}
+	NIter notFound = m_list.get<1>().end();
+	std::set<path> moving;
+	if (delta->m_added.size()) {
+		std::pair<PDIter, PDIter> tmp = getTempFiles();
+		for (PDIter i = tmp.first; i != tmp.second; ++i) {
+			moving.insert((*i)->getPartData()->getDestination());
 		}
-		saveSettings();
 	}
 
-	// Scan it
-	directory_iterator end_itr; // Default constructor -> end iterator
-	for (directory_iterator i(path(dir, no_check)); i != end_itr; ++i) {
-		if (is_directory(*i)) {
-			if (recurse) {
-				scanSharedDir((*i).string(), recurse);
-			}
-			continue;
+	uint32_t found = 0;
+	for (uint32_t i = 0; i < delta->m_added.size(); ++i) try {
+		const path &p = delta->m_added[i];
+		NIter j = m_list.get<1>().find(p);
+		if (j != notFound) {
+			// Let the file re-verify its integrity
+			(*j)->verify();
+		} else if (!moving.count(p)) {
+			SharedFile *f = new SharedFile(p);
+			m_list.insert(f);
+			++found;
 		}
-		std::string fName = (*i).leaf();
-		boost::algorithm::to_lower(fName);
-		if (boost::algorithm::starts_with(fName, "albumart")) {
-			continue;
-		} else if (fName == "folder.jpg") {
-			continue;
-		} else if (fName == "thumbs.db") {
-			continue;
-		} else if (fName == "desktop.ini") {
-			continue;
+	} catch (std::exception &e) {
+		logDebug(boost::format("Sharing file: %s") % e.what());
+	}
+
+	for (uint32_t i = 0; i < delta->m_removed.size(); ++i) {
+		NIter j = m_list.get<1>().find(delta->m_removed[i]);
+		if (j != notFound && !(*j)->isPartial()) {
+			logTrace(TRACE_FILESLIST,
+				boost::format("File %s was removed.")
+				% delta->m_removed[i].native_file_string()
+			);
+			(*j)->destroy();
 		}
+	}
 
-		NIter j = m_list.get<1>().find((*i).string());
-		if (j == m_list.get<1>().end()) {
-			SharedFile *f = new SharedFile(*i);
-			m_list.insert(f);
-		} else {
-			// Let the file re-verify its integrity
-			(*j)->verify();
+	for (uint32_t i = 0; i < delta->m_removedDirs.size(); ++i) {
+		std::string dir(delta->m_removedDirs[i].string() + "/");
+		for (SFIter j = m_list.begin(); j != m_list.end(); ++j) {
+			if ((*j)->isPartial()) {
+				continue;
+			}
+			if (boost::algorithm::starts_with(
+				(*j)->getPath().string(), dir
+			)) {
+				(*j)->destroy();
+			}
+		}
+	}
+
+	std::map<std::string, ScanState>::iterator it;
+	it = m_scanning.find(delta->m_root);
+	if (it == m_scanning.end()) {
+		return;
+	}
+	(*it).second.m_found += found;
+	if (delta->m_done) {
+		logMsg(
+			boost::format("Shared directory %s scanned in %dms: "
+			"%d new files found.") % delta->m_root
+			% (*it).second.m_timer % (*it).second.m_found
+		);
+		m_scanning.erase(it);
+		if (m_scanning.empty()) {
+			onScanDone();
 		}
 	}
-	recursion--;
-} catch (std::exception &er) {
-	logError(boost::format("Scanning shared directories: %s") % er.what());
-	recursion--;
 }
-MSVC_ONLY(;)
 
 /**
  * Scan directory for part files.
@@ -355,6 +388,10 @@ bool FilesList::loadTempFile(const boost::filesystem::path &file) {
 		if (exists(tmp) && !is_directory(tmp)) {
 			remove(tmp);
 		}
+		tmp = path(partName + ".dat.log", native);
+		if (exists(tmp) && !is_directory(tmp)) {
+			remove(tmp);
+		}
 	}
 	return false;
 }
@@ -97,6 +97,7 @@
 #include <hnbase/object.h>
 #include <hncore/fwd.h>
 #include <hncore/sharedfile.h>
+#include <hncore/dirscanner.h>
 #include <boost/shared_ptr.hpp>
 #include <boost/filesystem/path.hpp>
 #include <boost/multi_index_container.hpp>
@@ -160,6 +161,10 @@ public:
 	 *
 	 * @param path     Path to folder to be scanned
 	 * @param recurse  If true, the path will be scanned recursivly
+	 *
+	 * The folder is scanned in the background, and the files are added
+	 * as they are found; afterwards, changes in the folder are picked up
+	 * as they happen, where the platform supports it.
 	 */
 	void addSharedDir(const std::string &path, bool recurse = false);
 
@@ -257,6 +262,15 @@ public:
 	//! Attempt to import files from a location
 	boost::signal<void (boost::filesystem::path)> import;
 
+	//! Whether shared directories are being scanned
+	bool isScanning() const { return m_scanning.size(); }
+
+	/**
+	 * This signal is emitted when all shared directory scans have been
+	 * finished, so all files in shared directories are in the list.
+	 */
+	boost::signal<void ()> onScanDone;
+
 	//! Saves known shared/temp dirs to settings
 	void saveSettings() const;
 private:
@@ -285,6 +299,15 @@ private:
 	std::set<std::string> m_tempDirs;
 	typedef std::set<std::string>::iterator TDIter;
 
+	//! Progress of a shared directory scan
+	struct ScanState {
+		ScanState() : m_found() {}
+		Utils::StopWatch m_timer;   //!< Started with the scan
+		uint32_t m_found;           //!< Number of files added so far
+	};
+	//! Shared directories being scanned
+	std::map<std::string, ScanState> m_scanning;
+
 	//! Output operator to streams
 	friend std::ostream& operator<<(std::ostream &o, const FilesList &fl);
 
@@ -305,6 +328,14 @@ private:
 	 */
 	void onSharedFileEvent(SharedFile *sf, int evt);
 
+	/**
+	 * Event handler for DirScanner events; adds and removes SharedFiles
+	 * according to the changes found in shared directories.
+	 *
+	 * @param delta   Changes found
+	 */
+	void onScanEvent(DirScanner*, DirScanner::DeltaPtr delta);
+
 	/**
 	 * Attempts to load a temp file from designated path.
 	 *
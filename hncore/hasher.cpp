@@ -27,6 +27,7 @@
 #include <hnbase/sha1transform.h>
 
 #include <hncore/hasher.h>
+#include <hncore/hashpool.h>
 #include <hncore/hashsetmaker.h>
 #include <hncore/metadata.h>
 
@@ -43,7 +44,7 @@ using namespace CGComm;
 
 uint64_t HashWork::s_dataCnt = 0;
 double   HashWork::s_timeCnt = 0.0;
-uint32_t HashWork::s_bufSize = 32*1024;
+uint32_t HashWork::s_bufSize = 256*1024;
 boost::mutex HashWork::s_statsLock;
 IMPLEMENT_EVENT_TABLE(HashWork, HashWorkPtr, HashEvent);
 
@@ -71,6 +72,24 @@ uint64_t HashWork::getHashed() { return s_dataCnt; }
 double HashWork::getTime() { return s_timeCnt; }
 uint32_t HashWork::getBufSize() { return s_bufSize; }
 
+// ed2k hash of less than a part is the md4 hash of the data
+bool HashWork::canBatch() {
+	boost::mutex::scoped_lock l(m_lock);
+	if (m_full) {
+		return false;
+	}
+	switch (m_ref->getTypeId()) {
+		case OP_HT_MD4:
+		case OP_HT_MD5:
+		case OP_HT_SHA1:
+			return true;
+		case OP_HT_ED2K:
+			return m_end - m_begin + 1 < ED2K_PARTSIZE;
+		default:
+			return false;
+	}
+}
+
 bool HashWork::process() try {
 	if (!m_inProgress) {
 		initState();
@@ -79,6 +98,7 @@ bool HashWork::process() try {
 
 	Utils::StopWatch s1;
 	doProcess();
+	boost::mutex::scoped_lock l(s_statsLock);
 	s_timeCnt += s1.elapsed() / 1000.0;
 
 	return isComplete();
@@ -130,25 +150,10 @@ void HashWork::initState() {
 		m_begin = 0;
 		m_end = Utils::getFileSize(m_fileName.native_file_string());
 	} else {
-		switch (getType()) {
-			case OP_HT_MD4:
-				t.reset(new MD4HashMaker);
-				break;
-			case OP_HT_MD5:
-				t.reset(new MD5HashMaker);
-				break;
-			case OP_HT_ED2K:
-				t.reset(new ED2KHashMaker);
-				break;
-			case OP_HT_SHA1:
-				t.reset(new SHA1HashMaker);
-				break;
-			default:
-				boost::format fmt(
-					"Requested unknown hash of type %s"
-				);
-				logError(fmt % m_ref->getType());
-				break;
+		t.reset(createMaker(getType()));
+		if (!t) {
+			boost::format fmt("Requested unknown hash of type %s");
+			logError(fmt % m_ref->getType());
 		}
 		m_makers.push_back(t);
 		uint64_t ret = lseek64(m_file, m_begin, SEEK_SET);
@@ -171,12 +176,12 @@ void HashWork::doProcess() {
 	uint64_t curPos = lseek64(m_file, 0L, SEEK_CUR);
 	uint64_t ret = readNext(curPos);
 
-	for (uint32_t i = 0; i < m_makers.size(); ++i) {
-		m_makers[i]->sumUp(m_buf.get(), ret);
-	}
+	HashPool::instance().sumUp(m_makers, m_buf.get(), ret);
 
-	boost::mutex::scoped_lock l(s_statsLock);
-	s_dataCnt += ret;
+	{
+		boost::mutex::scoped_lock l(s_statsLock);
+		s_dataCnt += ret;
+	}
 	curPos = lseek64(m_file, 0L, SEEK_CUR);
 
 	if (!ret || m_end + 1 == curPos) {
@@ -213,30 +218,50 @@ void HashWork::finish() {
 		getEventTable().postEvent(HashWorkPtr(this), HASH_COMPLETE);
 	} else {
 		CHECK_THROW(m_makers.size() == 1);
-		const HashBase &h = m_makers[0]->getHashSet()->getFileHash();
-		HashEvent evt(h == *m_ref ? HASH_VERIFIED : HASH_FAILED);
-#ifndef NDEBUG
-		boost::format fmt(
-			"Chunk verification (%s, %d..%d): %s [%s (%s)]"
-		);
-		fmt % m_fileName.leaf() % m_begin % m_end;
-		if (evt == HASH_VERIFIED) {
-			fmt % "succeeded";
-			fmt % m_ref->decode() % m_ref->getType();
-			logTrace(TRACE_HASHER, fmt);
-		} else {
-			fmt % "failed";
-			fmt % m_ref->decode() % m_ref->getType();
-			logTrace(TRACE_HASHER,
-				boost::format("%s != [%s (%s)]")
-				% fmt.str() % h.decode() % h.getType()
-			);
-		}
-#endif
-		getEventTable().postEvent(HashWorkPtr(this), evt);
+		verify(m_makers[0]->getHashSet()->getFileHash());
 	}
 	setComplete();
 	close(m_file);
 	m_file = 0;
 	m_buf.reset();
 }
+
+HashSetMaker* HashWork::createMaker(CGComm::HashTypeId type) {
+	switch (type) {
+		case OP_HT_MD4:  return new MD4HashMaker;
+		case OP_HT_MD5:  return new MD5HashMaker;
+		case OP_HT_ED2K: return new ED2KHashMaker;
+		case OP_HT_SHA1: return new SHA1HashMaker;
+		default:         return 0;
+	}
+}
+
+void HashWork::setHash(const HashBase &h) {
+	CHECK_THROW(!isFull());
+	CHECK_THROW(!m_inProgress);
+	verify(h);
+	setComplete();
+}
+
+void HashWork::verify(const HashBase &h) {
+	HashEvent evt(h == *m_ref ? HASH_VERIFIED : HASH_FAILED);
+#ifndef NDEBUG
+	boost::format fmt(
+		"Chunk verification (%s, %d..%d): %s [%s (%s)]"
+	);
+	fmt % m_fileName.leaf() % m_begin % m_end;
+	if (evt == HASH_VERIFIED) {
+		fmt % "succeeded";
+		fmt % m_ref->decode() % m_ref->getType();
+		logTrace(TRACE_HASHER, fmt);
+	} else {
+		fmt % "failed";
+		fmt % m_ref->decode() % m_ref->getType();
+		logTrace(TRACE_HASHER,
+			boost::format("%s != [%s (%s)]")
+			% fmt.str() % h.decode() % h.getType()
+		);
+	}
+#endif
+	getEventTable().postEvent(HashWorkPtr(this), evt);
+}
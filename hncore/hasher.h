@@ -33,6 +33,10 @@
 #include <boost/enable_shared_from_this.hpp>
 #include <boost/filesystem/path.hpp>
 
+namespace Detail {
+	class HashBatchWork;
+}
+
 /**
  * Represents a job entry to be performed by WorkThread. Always wrap this class
  * into boost::shared_ptr<>, because it is a 'loose' object - it is not
@@ -41,8 +45,9 @@
  * to this class - it will need to be cleaned up once nobody really needs
  * it anymore. The path through which this object goes is generally this:
  *
- * - Client code creates an object, and submits it to WorkThread.
- * - WorkThread inserts it into its local queue of pending jobs.
+ * - Client code creates an object, and submits it to HashPool.
+ * - HashPool inserts it into the queue of pending jobs of the device the file
+ *   resides on.
  * - When time comes, hashing thread takes it out from the queue and performs
  *   the work.
  * - When the work is completed, an event is emitted from the work.
@@ -155,6 +160,31 @@ public:
 	//! Process this job
 	virtual bool process();
 
+	/**
+	 * Whether this job may be processed together with other jobs of the
+	 * same hash type, reading its data with the default openFile() and
+	 * readNext() implementations; true for range jobs of MD4, MD5 and
+	 * SHA1 hashes (see HashPool).
+	 */
+	virtual bool canBatch();
+
+	/**
+	 * Complete range job with a hash computed elsewhere, e.g. from the data
+	 * as it was downloaded, without reading the file. Emits HASH_VERIFIED
+	 * or HASH_FAILED event, as if the job had been processed.
+	 *
+	 * @param h        Hash of the range
+	 */
+	void setHash(const HashBase &h);
+
+	/**
+	 * Create hashset maker used for range jobs of given hash type.
+	 *
+	 * @param type     Type of reference hash
+	 * @return         New maker, or 0 if type isn't supported
+	 */
+	static HashSetMaker* createMaker(CGComm::HashTypeId type);
+
 protected:
 	/**
 	 * Open file for hashing
@@ -176,6 +206,15 @@ protected:
 	 */
 	virtual void finish();
 
+	/**
+	 * Called when range job is done, from finish() or by HashPool when
+	 * the job was processed in a batch. Emits HASH_VERIFIED or
+	 * HASH_FAILED event, depending on whether h matches reference hash.
+	 *
+	 * @param h        Hash of the range
+	 */
+	virtual void verify(const HashBase &h);
+
 	//! File to be hashed. Must include full path to the file.
 	boost::filesystem::path m_fileName;
 
@@ -214,6 +253,8 @@ private:
 	void initState();
 	void doProcess();
 
+	friend class Detail::HashBatchWork;
+
 	int m_file;
 	boost::scoped_array<char> m_buf;
 	std::vector<boost::shared_ptr<HashSetMaker> > m_makers;
@@ -0,0 +1,392 @@
+/*
+ *  Copyright (C) 2004-2006 Alo Sarv <madcat_@users.sourceforge.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/**
+ * \file hashpool.cpp Implementation of HashPool class
+ */
+
+#include <hncore/pch.h>
+#include <hncore/hashpool.h>
+#include <hncore/hasher.h>
+#include <hncore/hashsetmaker.h>
+#include <hncore/iothread.h>
+#include <hnbase/multihash.h>
+#include <hnbase/prefs.h>
+#include <boost/bind.hpp>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+namespace Detail {
+
+/**
+ * HashRelay passes a hash job through IOThread queue to HashPool, so the job
+ * is started only after the I/O posted before it has been done.
+ */
+class HashRelay : public ThreadWork {
+public:
+	HashRelay(HashWorkPtr work) : m_work(work) {}
+
+	virtual bool process() {
+		HashPool::instance().dispatch(m_work);
+		m_work = HashWorkPtr();
+		setComplete();
+		return true;
+	}
+private:
+	HashWorkPtr m_work;
+};
+
+/**
+ * HashBatch tracks the hash computations started by one HashPool::sumUp()
+ * call; it lives on the stack of the calling thread until all are done.
+ */
+class HashBatch : public boost::noncopyable {
+public:
+	HashBatch(uint32_t count) : m_pending(count) {}
+
+	void run(HashSetMaker *maker, const char *data, uint32_t len) {
+		std::string error;
+		try {
+			maker->sumUp(data, len);
+		} catch (std::exception &e) {
+			error = e.what();
+		}
+		boost::mutex::scoped_lock l(m_lock);
+		if (!error.empty()) {
+			m_error = error;
+		}
+		if (!--m_pending) {
+			m_done.notify_all();
+		}
+	}
+
+	//! Wait until all computations are done; rethrows any errors
+	void wait() {
+		boost::mutex::scoped_lock l(m_lock);
+		while (m_pending) {
+			m_done.wait(l);
+		}
+		if (!m_error.empty()) {
+			throw std::runtime_error(m_error);
+		}
+	}
+private:
+	uint32_t m_pending;        //!< Computations not done yet
+	std::string m_error;       //!< Error from any of the computations
+	boost::mutex m_lock;       //!< Protects m_pending and m_error
+	boost::condition m_done;   //!< Signalled when m_pending reaches 0
+};
+
+//! MultiHash algorithm for range job; HashWork::canBatch() must be true
+static MultiHash::Algorithm getAlgorithm(HashWorkPtr work) {
+	switch (work->getType()) {
+		case CGComm::OP_HT_MD5:  return MultiHash::MD5;
+		case CGComm::OP_HT_SHA1: return MultiHash::SHA1;
+		default:                 return MultiHash::MD4;
+	}
+}
+
+/**
+ * HashBatchWork verifies the batched range jobs of a device, taking them from
+ * HashPool one batch at a time. Jobs of a batch are read in turns, one buffer
+ * at a time, using their own openFile() and readNext() methods, and all the
+ * data read in a turn is passed to MultiHash at once. The work is completed
+ * when there are no more jobs left for the device.
+ */
+class HashBatchWork : public ThreadWork {
+public:
+	HashBatchWork(uint64_t dev) : m_device(dev) {}
+
+	virtual bool process() {
+		if (m_jobs.empty() && !start()) {
+			setComplete();
+			return true;
+		}
+		Utils::StopWatch s1;
+		uint64_t cnt = next();
+		boost::mutex::scoped_lock l(HashWork::s_statsLock);
+		HashWork::s_dataCnt += cnt;
+		HashWork::s_timeCnt += s1.elapsed() / 1000.0;
+		return false;
+	}
+private:
+	//! Take the next batch and open the files; false if none left
+	bool start() {
+		if (!HashPool::instance().takeBatch(m_device, &m_jobs)) {
+			return false;
+		}
+		m_hash.reset(
+			new MultiHash(getAlgorithm(m_jobs[0]), m_jobs.size())
+		);
+		m_pos.assign(m_jobs.size(), 0);
+		for (uint32_t i = 0; i < m_jobs.size(); ++i) try {
+			HashWork &w = *m_jobs[i];
+			w.openFile();
+			uint64_t ret = lseek64(w.m_file, w.m_begin, SEEK_SET);
+			CHECK_THROW(ret == w.m_begin);
+			w.m_buf.reset(new char[HashWork::getBufSize()]);
+			m_pos[i] = w.m_begin;
+		} catch (std::exception &e) {
+			logError(e.what());
+			HashWork::getEventTable().postEvent(
+				m_jobs[i], HASH_FATAL_ERROR
+			);
+			done(i);
+		}
+		return true;
+	}
+
+	//! Read and hash next buffer of each job; returns amount of data
+	uint64_t next() {
+		std::vector<const char*> data(m_jobs.size());
+		std::vector<uint32_t> len(m_jobs.size());
+		uint64_t total = 0;
+		for (uint32_t i = 0; i < m_jobs.size(); ++i) {
+			HashWork &w = *m_jobs[i];
+			if (w.isComplete()) {
+				continue;
+			} else if (!w.isValid()) {
+				done(i);
+				continue;
+			}
+			int64_t ret = w.readNext(m_pos[i]);
+			len[i] = ret > 0 ? ret : 0;
+			data[i] = w.m_buf.get();
+			m_pos[i] += len[i];
+			total += len[i];
+		}
+		m_hash->sumUp(&data[0], &len[0]);
+
+		// as in HashWork::doProcess(), short reads end the job too
+		bool finished = true;
+		for (uint32_t i = 0; i < m_jobs.size(); ++i) {
+			HashWork &w = *m_jobs[i];
+			if (w.isComplete()) {
+				continue;
+			} else if (!len[i] || m_pos[i] == w.m_end + 1) {
+				verify(i);
+			} else {
+				finished = false;
+			}
+		}
+		if (finished) {
+			m_jobs.clear();
+			m_hash.reset();
+		}
+		return total;
+	}
+
+	//! Post the result of job i
+	void verify(uint32_t i) {
+		std::string h = m_hash->getHash(i);
+		switch (m_jobs[i]->getType()) {
+			case CGComm::OP_HT_MD4:
+				m_jobs[i]->verify(Hash<MD4Hash>(h));
+				break;
+			case CGComm::OP_HT_ED2K:
+				m_jobs[i]->verify(Hash<ED2KHash>(h));
+				break;
+			case CGComm::OP_HT_MD5:
+				m_jobs[i]->verify(Hash<MD5Hash>(h));
+				break;
+			default:
+				m_jobs[i]->verify(Hash<SHA1Hash>(h));
+				break;
+		}
+		done(i);
+	}
+
+	//! Complete job i and release its resources
+	void done(uint32_t i) {
+		HashWork &w = *m_jobs[i];
+		w.setComplete();
+		if (w.m_file > 0) {
+			close(w.m_file);
+		}
+		w.m_file = 0;
+		w.m_buf.reset();
+	}
+
+	uint64_t m_device;                 //!< Device of the jobs
+	std::vector<HashWorkPtr> m_jobs;   //!< Current batch
+	std::vector<uint64_t> m_pos;       //!< Read positions of the jobs
+	boost::scoped_ptr<MultiHash> m_hash; //!< Hashes the current batch
+};
+
+} // end namespace Detail
+
+HashPool::HashPool() : m_exiting(), m_workerCount() {
+	m_workerCount = Prefs::instance().read<uint32_t>("/HashThreads", 4);
+	for (uint32_t i = 0; i < m_workerCount; ++i) {
+		m_workers.create_thread(
+			boost::bind(&HashPool::workerLoop, this)
+		);
+	}
+	logTrace(TRACE_HASHER,
+		boost::format("Verifying chunks with %s hash kernel.")
+		% MultiHash::getKernelName(MultiHash::getKernel())
+	);
+}
+
+// device threads go first, since they may be waiting for the workers; they
+// are stopped without holding the lock, which batch jobs need
+HashPool::~HashPool() {
+	std::map<uint64_t, Device> devices;
+	{
+		boost::mutex::scoped_lock l(m_devicesLock);
+		devices.swap(m_devices);
+	}
+	devices.clear();
+	{
+		boost::mutex::scoped_lock l(m_tasksLock);
+		m_exiting = true;
+		m_tasksNotify.notify_all();
+	}
+	m_workers.join_all();
+}
+
+HashPool& HashPool::instance() {
+	static HashPool hp;
+	return hp;
+}
+
+void HashPool::postWork(HashWorkPtr work) {
+	IOThread::instance().postWork(
+		ThreadWorkPtr(new Detail::HashRelay(work))
+	);
+}
+
+// without SIMD kernel, batching gains nothing, so the jobs are run as before
+void HashPool::dispatch(HashWorkPtr work) {
+	uint64_t dev = getDevice(work->getFileName());
+	bool batch = MultiHash::getLanes() > 1 && work->canBatch();
+	boost::mutex::scoped_lock l(m_devicesLock);
+	Device &d = m_devices[dev];
+	if (!d.m_thread) {
+		logTrace(TRACE_HASHER,
+			boost::format("Starting hash queue for device %d.")
+			% dev
+		);
+		d.m_thread.reset(new WorkThread);
+	}
+	if (!batch) {
+		d.m_thread->postWork(work);
+		return;
+	}
+	d.m_batch.push_back(work);
+	if (!d.m_batchPosted) {
+		d.m_thread->postWork(
+			ThreadWorkPtr(new Detail::HashBatchWork(dev))
+		);
+		d.m_batchPosted = true;
+	}
+}
+
+// Takes the jobs of the same hash type as the first valid job in the queue;
+// others are left for the next batch.
+bool HashPool::takeBatch(uint64_t dev, std::vector<HashWorkPtr> *jobs) {
+	boost::mutex::scoped_lock l(m_devicesLock);
+	std::map<uint64_t, Device>::iterator d = m_devices.find(dev);
+	if (d == m_devices.end()) {
+		return false;
+	}
+	std::deque<HashWorkPtr> &queue = d->second.m_batch;
+	std::deque<HashWorkPtr>::iterator i = queue.begin();
+	MultiHash::Algorithm algo = MultiHash::MD4;
+	while (i != queue.end() && jobs->size() < MultiHash::getLanes()) {
+		if (!(*i)->isValid()) {
+			i = queue.erase(i);
+		} else if (jobs->empty() || Detail::getAlgorithm(*i) == algo) {
+			algo = Detail::getAlgorithm(*i);
+			jobs->push_back(*i);
+			i = queue.erase(i);
+		} else {
+			++i;
+		}
+	}
+	if (jobs->empty()) {
+		d->second.m_batchPosted = false;
+	}
+	return !jobs->empty();
+}
+
+uint64_t HashPool::getDevice(const boost::filesystem::path &file) {
+	std::string name(file.native_file_string());
+#ifdef _MSC_VER
+	struct ::__stat64 results;
+	int ret = ::_stat64(name.c_str(), &results);
+#elif defined(WIN32) // other compilers, e.g. mingw
+	struct ::_stati64 results;
+	int ret = ::_stati64(name.c_str(), &results);
+#else
+	struct stat results;
+	int ret = stat(name.c_str(), &results);
+#endif
+	return ret ? 0 : results.st_dev;
+}
+
+size_t HashPool::getDeviceCount() {
+	boost::mutex::scoped_lock l(m_devicesLock);
+	return m_devices.size();
+}
+
+// The first generator is run by the calling thread, the others are queued for
+// the workers.
+void HashPool::sumUp(
+	const std::vector<boost::shared_ptr<HashSetMaker> > &makers,
+	const char *data, uint32_t len
+) {
+	if (makers.size() < 2 || !m_workerCount) {
+		for (uint32_t i = 0; i < makers.size(); ++i) {
+			makers[i]->sumUp(data, len);
+		}
+		return;
+	}
+	Detail::HashBatch batch(makers.size());
+	{
+		boost::mutex::scoped_lock l(m_tasksLock);
+		for (uint32_t i = 1; i < makers.size(); ++i) {
+			m_tasks.push_back(boost::bind(
+				&Detail::HashBatch::run, &batch,
+				makers[i].get(), data, len
+			));
+		}
+		m_tasksNotify.notify_all();
+	}
+	batch.run(makers[0].get(), data, len);
+	batch.wait();
+}
+
+// tasks still queued at exit are run, since their callers are waiting
+void HashPool::workerLoop() {
+	while (true) {
+		Task task;
+		{
+			boost::mutex::scoped_lock l(m_tasksLock);
+			while (m_tasks.empty() && !m_exiting) {
+				m_tasksNotify.wait(l);
+			}
+			if (m_tasks.empty()) {
+				return;
+			}
+			task = m_tasks.front();
+			m_tasks.pop_front();
+		}
+		task();
+	}
+}
@@ -0,0 +1,134 @@
+/*
+ *  Copyright (C) 2004-2006 Alo Sarv <madcat_@users.sourceforge.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/**
+ * \file hashpool.h Interface for HashPool class
+ */
+
+#ifndef __HASHPOOL_H__
+#define __HASHPOOL_H__
+
+#include <hnbase/workthread.h>
+#include <hncore/fwd.h>
+#include <boost/filesystem/path.hpp>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <deque>
+#include <map>
+#include <vector>
+
+namespace Detail {
+	class HashRelay;
+	class HashBatchWork;
+}
+
+/**
+ * HashPool runs hash jobs concurrently. Jobs are grouped by the device their
+ * file resides on; each device has its own queue and thread, so jobs on
+ * different disks run in parallel, while jobs on the same disk run one after
+ * another, avoiding seeking back and forth between files.
+ *
+ * The CPU-bound part - feeding the data to the hash generators - is spread
+ * over a separate set of threads (/HashThreads preference, default 4): a full
+ * hash job generates several hashes from each block of data, which are then
+ * computed in parallel (see sumUp()).
+ *
+ * Range jobs that allow it (see HashWork::canBatch()) are verified in
+ * batches: up to MultiHash::getLanes() jobs of the same hash type queued for a
+ * device are read in turns, and their data is hashed with a single MultiHash,
+ * which processes them at the same time with SIMD instructions.
+ *
+ * Jobs are passed through IOThread on the way in, so they run only after all
+ * I/O posted before them (e.g. flushing the data being hashed) has been done.
+ * As before, the results are delivered through HashWork event table.
+ */
+class HNCORE_EXPORT HashPool : public boost::noncopyable {
+public:
+	static HashPool& instance();
+
+	/**
+	 * Post a hash job for processing.
+	 *
+	 * @param work      Job to be processed
+	 */
+	void postWork(HashWorkPtr work);
+
+	/**
+	 * Feed data to a number of hash generators in parallel. Returns once
+	 * all of them have processed the data.
+	 *
+	 * @param makers    Hash generators
+	 * @param data      Data to be hashed
+	 * @param len       Length of data
+	 */
+	void sumUp(
+		const std::vector<boost::shared_ptr<HashSetMaker> > &makers,
+		const char *data, uint32_t len
+	);
+
+	//! \returns Number of device queues created
+	size_t getDeviceCount();
+private:
+	HashPool();
+	~HashPool();
+
+	//! Called in IOThread; passes the job to the queue of its device
+	void dispatch(HashWorkPtr work);
+
+	//! Retrieve device identifier for file, 0 if unknown
+	static uint64_t getDevice(const boost::filesystem::path &file);
+
+	/**
+	 * Called from device thread; takes the next batch of range jobs queued
+	 * for the device.
+	 *
+	 * @param dev       Device identifier
+	 * @param jobs      Receives the jobs
+	 * @return          False if there are no jobs left
+	 */
+	bool takeBatch(uint64_t dev, std::vector<HashWorkPtr> *jobs);
+
+	//! Hash computing thread loop
+	void workerLoop();
+
+	friend class Detail::HashRelay;
+	friend class Detail::HashBatchWork;
+
+	typedef boost::shared_ptr<WorkThread> WorkThreadPtr;
+
+	//! Jobs of a single device
+	struct Device {
+		Device() : m_batchPosted() {}
+
+		WorkThreadPtr m_thread;           //!< Runs the jobs
+		std::deque<HashWorkPtr> m_batch;  //!< Jobs waiting for batching
+		bool m_batchPosted;               //!< HashBatchWork is in queue
+	};
+	std::map<uint64_t, Device> m_devices; //!< Device queues
+	boost::mutex m_devicesLock;           //!< Protects m_devices
+
+	typedef boost::function<void ()> Task;
+	std::deque<Task> m_tasks;          //!< Pending hash computations
+	boost::mutex m_tasksLock;          //!< Protects m_tasks and m_exiting
+	boost::condition m_tasksNotify;    //!< Signals new tasks
+	bool m_exiting;                    //!< Worker threads should exit
+	boost::thread_group m_workers;     //!< Hash computing threads
+	uint32_t m_workerCount;            //!< Number of threads in m_workers
+};
+
+#endif
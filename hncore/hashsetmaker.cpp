@@ -119,7 +119,7 @@ HashSetBase* ED2KHashMaker::getHashSet() {
 // Constructor
 BTHashMaker::BTHashMaker(uint32_t chunkSize)
 : m_completed(false), m_transformer(new Sha1Transform()),
-m_chunkSize(chunkSize) {
+m_chunkSize(chunkSize), m_dataCount() {
 }
 
 // Destructor
@@ -133,31 +133,25 @@ BTHashMaker::~BTHashMaker() {
 void BTHashMaker::sumUp(const char *data, uint32_t length) {
 	CHECK_THROW(!m_completed);                // Shouldn't have finished
 	CHECK_THROW(data);                        // Shouldn't be null
-	static uint32_t dataCount = 0;
 
-	if (dataCount + length >= m_chunkSize) {
+	// one call may cross several part boundaries with small parts
+	while (m_dataCount + length >= m_chunkSize) {
 		// Sum until end of part
 		m_transformer->sumUp(
-			data, m_chunkSize - dataCount
+			data, m_chunkSize - m_dataCount
 		);
-		data   += (m_chunkSize - dataCount);
-		length -= (m_chunkSize - dataCount);
+		data   += (m_chunkSize - m_dataCount);
+		length -= (m_chunkSize - m_dataCount);
 
 		m_partHashes.push_back(m_transformer->getHash());
 		// Reset transformer
 		delete m_transformer;
 		m_transformer = new Sha1Transform();
-
-		// Sum remainder of data with new transformer
-		if (length) {
-			m_transformer->sumUp(data, length);
-		}
-
-		// Reset the counter
-		dataCount = length;
-	} else {
+		m_dataCount = 0;
+	}
+	if (length) {
 		m_transformer->sumUp(data, length);
-		dataCount += length;
+		m_dataCount += length;
 	}
 }
 
@@ -144,6 +144,8 @@ private:
 	typedef std::vector< Hash<SHA1Hash> >::iterator Iter;
 	//! Size of one chunk
 	const uint32_t m_chunkSize;
+	//! Amount of data hashed in current chunk
+	uint32_t m_dataCount;
 };
 
 /**
@@ -111,6 +111,7 @@ m_curCmd(m_cmdHistory.end()) {
 	m_commands["clear"]   = bind(&ShellCommands::cmdClear, this, _1);
 	m_commands["uptime"]  = bind(&ShellCommands::cmdUptime, this, _1);
 	m_commands["share"]   = bind(&ShellCommands::cmdShare, this, _1);
+	m_commands["fs"]      = bind(&ShellCommands::cmdFindShared, this, _1);
 	m_commands["links"]   = bind(&ShellCommands::cmdLinkDownloads,this, _1);
 	m_commands["memstat"] = bind(&ShellCommands::cmdMemStats, this, _1);
 	m_commands["alloc"]   = bind(&ShellCommands::cmdAlloc, this, _1);
@@ -911,6 +912,7 @@ bool ShellCommands::cmdHelp(Tokenizer) {
 	*m_socket << "log [on/off]  Enable/Disable log printing."<<Socket::Endl;
 	*m_socket << "share [dir] -r Share folder, optionally recursivly.";
 	*m_socket << Socket::Endl;
+	*m_socket << "fs <words>    Find shared files by name." << Socket::Endl;
 #if !defined(NDEBUG) && !defined(NTRACE)
 	*m_socket << "trace         Enable/Disable/View Trace Masks.";
 	*m_socket << Socket::Endl;
@@ -1551,6 +1553,26 @@ bool ShellCommands::cmdShare(Tokenizer args) {
 	return true;
 }
 
+bool ShellCommands::cmdFindShared(Tokenizer args) {
+	if (++args.begin() == args.end()) {
+		*m_socket << "Usage: fs <keywords>" << Socket::Endl;
+		return true;
+	}
+	std::string words;
+	for (Tokenizer::iterator it = ++args.begin(); it != args.end(); ++it) {
+		words += *it + " ";
+	}
+	std::vector<SharedFile*> found(MetaDb::instance().search(words));
+	for (uint32_t i = 0; i < found.size(); ++i) {
+		boost::format fmt("%s %|10t|%s");
+		fmt % Utils::bytesToString(found[i]->getSize());
+		fmt % found[i]->getLocation();
+		*m_socket << fmt.str() << Socket::Endl;
+	}
+	*m_socket << found.size() << " shared files found." << Socket::Endl;
+	return true;
+}
+
 bool ShellCommands::cmdAlloc(Tokenizer args) {
 	if (++args.begin() == args.end()) {
 		*m_socket << "Usage: alloc <objects>" << Socket::Endl;
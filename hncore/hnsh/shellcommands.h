@@ -194,6 +194,9 @@ public:
 	//! Share a folder
 	bool cmdShare(Tokenizer);
 
+	//! Find shared files by keywords, using MetaDb keyword index
+	bool cmdFindShared(Tokenizer);
+
 	//! Displays file buffers amount and such
 	bool cmdMemStats(Tokenizer);
 
@@ -146,11 +146,7 @@ int Hydranode::cleanUp() {
 	FilesList::instance().exit();
 
 	logMsg("Saving MetaDb...");
-	std::ofstream metadb(
-		(getConfigDir()/"metadb.dat").string().c_str(),
-		std::ios::binary
-	);
-	metadb << MetaDb::instance();
+	MetaDb::instance().save(getConfigDir()/"metadb.dat");
 	MetaDb::instance().exit();
 
 	logMsg("Saving configuration...");
@@ -296,6 +292,22 @@ void Hydranode::initSockets() {
 	(void)SchedBase::instance().init();
 	(void)DNS::ResolverThread::instance();
 
+	// empty value selects the best polling backend for this platform
+	std::string poller = Prefs::instance().read<std::string>(
+		"/SocketPoller", ""
+	);
+	if (!SocketWatcher::instance().setPoller(poller)) {
+		logWarning(
+			boost::format("Socket poller '%s' is not available.")
+			% poller
+		);
+		SocketWatcher::instance().setPoller("");
+	}
+	logMsg(
+		boost::format("Using %s() for socket polling.")
+		% SocketWatcher::instance().getPoller()
+	);
+
 	std::string fName= Prefs::instance().read<std::string>("/IPFilter", "");
 
 	// don't attempt to load w/o filename
@@ -326,11 +338,7 @@ void Hydranode::initSockets() {
 void Hydranode::initFiles() {
 	(void)FilesList::instance();
 
-	std::ifstream metadb(
-		(getConfigDir()/"metadb.dat").string().c_str(),
-		std::ios::binary
-	);
-	MetaDb::instance().load(metadb);
+	MetaDb::instance().load(getConfigDir()/"metadb.dat");
 
 	// Get list of shared files dirs from prefs.
 	Prefs::instance().setPath("/SharedDirs");
@@ -357,7 +365,8 @@ void Hydranode::initFiles() {
 	std::string incDir = Prefs::instance().read<std::string>("Incoming","");
 	dirs.insert(std::make_pair(incDir, false));
 
-	Utils::StopWatch t;      // For performance testing/debugging
+	// the directories are scanned in background; FilesList logs the
+	// results once each of them is done
 	for (DirMap::iterator i = dirs.begin(); i != dirs.end(); ++i) try {
 		FilesList::instance().addSharedDir((*i).first, (*i).second);
 	} catch (std::exception &er) {
@@ -366,10 +375,6 @@ void Hydranode::initFiles() {
 			% er.what()
 		);
 	}
-	logMsg(
-		boost::format("%d shared files loaded in %dms")
-		% FilesList::instance().size() % t
-	);
 
 	// Temp files ...
 	// primary temp dir
@@ -478,11 +483,7 @@ void Hydranode::saveSettings() {
 	m_stats.save();
 
 	logMsg("Saving MetaDb...");
-	std::ofstream metadb(
-		(getConfigDir()/"metadb.dat").string().c_str(),
-		std::ios::binary
-	);
-	metadb << MetaDb::instance();
+	MetaDb::instance().save(getConfigDir()/"metadb.dat");
 
 	logMsg("Saving temp files...");
 	FilesList::instance().savePartFiles();
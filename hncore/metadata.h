@@ -510,6 +510,7 @@ public:
 	void setFileType(FileType type)   { m_fileType = type;       }
 	void setTypeGuessed(bool guessed) { m_typeGuessed = guessed; }
 	void addUploaded(uint32_t amount) { m_uploaded += amount;    }
+	void setUploaded(uint64_t amount) { m_uploaded = amount;     }
 
 	/**
 	 * \brief Adjust the size
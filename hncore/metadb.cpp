@@ -25,9 +25,324 @@
 #include <hncore/metadb.h>
 #include <hncore/sharedfile.h>
 #include <hncore/metadata.h>
+#include <hnbase/prefs.h>
+#include <hnbase/timed_callback.h>
+#include <boost/filesystem/operations.hpp>
+#include <cctype>
+#include <cstdio>
+
+#ifndef WIN32
+	#include <sys/types.h>
+	#include <sys/stat.h>
+	#include <sys/mman.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+#endif
+
+enum MetaDbOpCodes {
+	OP_MDB_VERSION = 0x01,   //!< version
+	OP_MDB_INDEXED = 0x02    //!< version with index
+};
+
+// MetaDb::Index class
+// -------------------
+// The indexed database file is laid out as follows:
+//
+// uint8   OP_MDB_INDEXED
+// <data>  MetaData objects, as written by operator<<(ostream&, MetaData&)
+// <data>  record table; uint64 offset and uint32 length of each object
+// <data>  hash index; uint8 hash type, uint8 hash length, 32 bytes of hash
+//         (zero-padded), uint32 object number; sorted by the first 34 bytes
+// <data>  file names; uint16 length, name
+// <data>  name index; uint64 offset of name, uint32 object number; sorted by
+//         the names
+// <data>  trailer; uint64 offset and uint32 size of record table, hash index
+//         and name index, followed by uint32 MDB_MAGIC
+//
+// Since the tables are sorted, lookups are binary searches directly in the
+// mapped file, and nothing needs to be parsed when the file is opened.
+
+static const uint32_t RECORD_ENTRY = 12;         //!< record table entry
+static const uint32_t HASH_KEY     = 34;         //!< compared hash entry part
+static const uint32_t HASH_ENTRY   = 38;         //!< hash index entry
+static const uint32_t NAME_ENTRY   = 12;         //!< name index entry
+static const uint32_t TRAILER      = 40;         //!< trailer size
+static const uint32_t MDB_MAGIC    = 0x3242444d; //!< "MDB2"
+
+//! Read little-endian value from memory
+template<typename T>
+static T peek(const char *p) {
+	T t;
+	memcpy(&t, p, sizeof(T));
+	return Utils::swapHostToStream<T, std::istream>(t);
+}
+
+//! Key of a hash in hash index; longer hashes are truncated
+static std::string hashKey(const HashBase &h) {
+	std::string ret(HASH_KEY, '\0');
+	ret[0] = static_cast<char>(h.getTypeId());
+	ret[1] = static_cast<char>(h.size());
+	if (h.getData()) {
+		memcpy(
+			&ret[2], h.getData().get(),
+			std::min<uint32_t>(h.size(), HASH_KEY - 2)
+		);
+	}
+	return ret;
+}
+
+//! Whether any hashset of md has file hash h
+static bool hasHash(const MetaData *md, const HashBase &h) {
+	for (uint32_t i = 0; i < md->getHashSetCount(); ++i) {
+		if (md->getHashSet(i)->getFileHash() == h) {
+			return true;
+		}
+	}
+	return false;
+}
+
+class MetaDb::Index : public boost::noncopyable {
+public:
+	/**
+	 * Map database file into memory.
+	 *
+	 * @param file      File to open
+	 * @return          New index, or 0 if file isn't in indexed format
+	 * @throws std::runtime_error if the file is damaged
+	 */
+	static Index* open(const boost::filesystem::path &file);
+
+	/**
+	 * Construct from data in memory, beginning with OP_MDB_INDEXED.
+	 *
+	 * @throws std::runtime_error if the data is damaged
+	 */
+	Index(const std::string &data);
+
+	~Index();
+
+	//! \returns Number of objects
+	uint32_t count() const { return m_records; }
+	//! \returns Number of hash index entries
+	uint32_t hashCount() const { return m_hashes; }
+	//! \returns Number of name index entries
+	uint32_t nameCount() const { return m_names; }
+
+	/**
+	 * Locate object in the file
+	 *
+	 * @param id       Object number
+	 * @param data     Receives pointer to object data
+	 * @param len      Receives object data length
+	 * @return         False if the record table entry is invalid
+	 */
+	bool getRecord(uint32_t id, const char **data, uint32_t *len) const;
+
+	//! \returns Numbers of objects containing hash
+	std::vector<uint32_t> find(const HashBase &h) const;
+	//! \returns Numbers of objects with file name
+	std::vector<uint32_t> find(const std::string &name) const;
+
+	//! \returns Key of hash index entry
+	std::string getHashKey(uint32_t i) const {
+		return std::string(hashEntry(i), HASH_KEY);
+	}
+	//! \returns Object number of hash index entry
+	uint32_t getHashRecord(uint32_t i) const {
+		return peek<uint32_t>(hashEntry(i) + HASH_KEY);
+	}
+	//! \returns File name of name index entry
+	std::string getName(uint32_t i) const;
+	//! \returns Object number of name index entry
+	uint32_t getNameRecord(uint32_t i) const {
+		return peek<uint32_t>(m_data + m_namePos + i * NAME_ENTRY + 8);
+	}
+private:
+	Index();
+	//! Locate and check the tables
+	void init();
+	const char* hashEntry(uint32_t i) const {
+		return m_data + m_hashPos + i * HASH_ENTRY;
+	}
+
+	const char *m_data;       //!< Database contents
+	uint64_t m_size;          //!< Size of m_data
+	std::string m_buffer;     //!< Contents, unless mapped
+	void *m_map;              //!< Mapped memory
+	uint64_t m_recordPos;     //!< Offset of record table
+	uint64_t m_hashPos;       //!< Offset of hash index
+	uint64_t m_namePos;       //!< Offset of name index
+	uint32_t m_records;       //!< Number of objects
+	uint32_t m_hashes;        //!< Number of hash index entries
+	uint32_t m_names;         //!< Number of name index entries
+};
+
+MetaDb::Index::Index() : m_data(), m_size(), m_map(), m_recordPos(),
+m_hashPos(), m_namePos(), m_records(), m_hashes(), m_names() {}
+
+MetaDb::Index::Index(const std::string &data) : m_data(), m_size(),
+m_buffer(data), m_map(), m_recordPos(), m_hashPos(), m_namePos(),
+m_records(), m_hashes(), m_names() {
+	m_data = m_buffer.data();
+	m_size = m_buffer.size();
+	init();
+}
+
+MetaDb::Index::~Index() {
+#ifndef WIN32
+	if (m_map) {
+		munmap(m_map, m_size);
+	}
+#endif
+}
+
+MetaDb::Index* MetaDb::Index::open(const boost::filesystem::path &file) {
+	std::auto_ptr<Index> index(new Index);
+#ifdef WIN32
+	std::ifstream ifs(file.string().c_str(), std::ios::binary);
+	if (!ifs || ifs.peek() != OP_MDB_INDEXED) {
+		return 0;
+	}
+	std::ostringstream tmp;
+	tmp << ifs.rdbuf();
+	index->m_buffer = tmp.str();
+	index->m_data = index->m_buffer.data();
+	index->m_size = index->m_buffer.size();
+#else
+	int fd = ::open(file.string().c_str(), O_RDONLY);
+	if (fd == -1) {
+		return 0;
+	}
+	struct stat st;
+	if (fstat(fd, &st) || !st.st_size) {
+		::close(fd);
+		return 0;
+	}
+	void *map = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
+	if (map == MAP_FAILED) {
+		throw std::runtime_error("Unable to map database file.");
+	}
+	index->m_map = map;
+	index->m_data = static_cast<const char*>(map);
+	index->m_size = st.st_size;
+	if (*index->m_data != OP_MDB_INDEXED) {
+		return 0;
+	}
+#endif
+	index->init();
+	return index.release();
+}
+
+void MetaDb::Index::init() {
+	if (m_size < 1 + TRAILER) {
+		throw std::runtime_error("Database file is truncated.");
+	}
+	const char *p = m_data + m_size - TRAILER;
+	if (peek<uint32_t>(p + TRAILER - 4) != MDB_MAGIC) {
+		throw std::runtime_error("Database file is truncated.");
+	}
+	m_recordPos = peek<uint64_t>(p);
+	m_records   = peek<uint32_t>(p + 8);
+	m_hashPos   = peek<uint64_t>(p + 12);
+	m_hashes    = peek<uint32_t>(p + 20);
+	m_namePos   = peek<uint64_t>(p + 24);
+	m_names     = peek<uint32_t>(p + 32);
+
+	// the tables must lie between the version byte and the trailer
+	uint64_t end = m_size - TRAILER;
+	CHECK_THROW_MSG(
+		m_recordPos >= 1 && m_recordPos <= end
+		&& m_records * uint64_t(RECORD_ENTRY) <= end - m_recordPos
+		&& m_hashPos >= 1 && m_hashPos <= end
+		&& m_hashes * uint64_t(HASH_ENTRY) <= end - m_hashPos
+		&& m_namePos >= 1 && m_namePos <= end
+		&& m_names * uint64_t(NAME_ENTRY) <= end - m_namePos,
+		"Invalid database file index."
+	);
+}
+
+bool MetaDb::Index::getRecord(
+	uint32_t id, const char **data, uint32_t *len
+) const {
+	CHECK_THROW(id < m_records);
+	const char *p = m_data + m_recordPos + id * RECORD_ENTRY;
+	uint64_t off = peek<uint64_t>(p);
+	*len = peek<uint32_t>(p + 8);
+	if (off < 1 || off > m_size || *len > m_size - off) {
+		return false;
+	}
+	*data = m_data + off;
+	return true;
+}
+
+std::vector<uint32_t> MetaDb::Index::find(const HashBase &h) const {
+	std::string key(hashKey(h));
+	uint32_t lo = 0, hi = m_hashes;
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (memcmp(hashEntry(mid), key.data(), HASH_KEY) < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	std::vector<uint32_t> ret;
+	while (lo < m_hashes && !memcmp(hashEntry(lo), key.data(), HASH_KEY)) {
+		ret.push_back(getHashRecord(lo++));
+	}
+	return ret;
+}
+
+std::string MetaDb::Index::getName(uint32_t i) const {
+	uint64_t off = peek<uint64_t>(m_data + m_namePos + i * NAME_ENTRY);
+	if (off < 1 || off > m_size || m_size - off < 2) {
+		return std::string();
+	}
+	uint16_t len = peek<uint16_t>(m_data + off);
+	if (m_size - off - 2 < len) {
+		return std::string();
+	}
+	return std::string(m_data + off + 2, len);
+}
+
+std::vector<uint32_t> MetaDb::Index::find(const std::string &name) const {
+	uint32_t lo = 0, hi = m_names;
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (getName(mid) < name) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	std::vector<uint32_t> ret;
+	while (lo < m_names && getName(lo) == name) {
+		ret.push_back(getNameRecord(lo++));
+	}
+	return ret;
+}
+
+// MetaDb class
+// ------------
+
+// Hashes are already uniformly distributed, so their leading bytes will do
+size_t MetaDb::HashPtrHash::operator()(const HashBase *h) const {
+	size_t ret = h->getTypeId();
+	boost::shared_array<char> data(h->getData());
+	if (data) {
+		size_t tmp = 0;
+		memcpy(
+			&tmp, data.get(),
+			std::min<size_t>(sizeof(tmp), h->size())
+		);
+		ret ^= tmp;
+	}
+	return ret;
+}
 
 // Default constructor
-MetaDb::MetaDb() {
+MetaDb::MetaDb() : m_unloaded(), m_unloadPending() {
 }
 
 MetaDb::~MetaDb() {
@@ -38,12 +353,53 @@ MetaDb& MetaDb::instance() {
 	return md;
 }
 
-enum MetaDbOpCodes {
-	OP_MDB_VERSION = 0x01    //!< version
-};
+// load from file, mapping it if it's in indexed format
+void MetaDb::load(const boost::filesystem::path &file) try {
+	Utils::StopWatch t;
+	logTrace(TRACE_MD, "Loading MetaDb from file.");
+	Index *index = Index::open(file);
+	if (index) {
+		setIndex(index);
+		logMsg(
+			boost::format(
+				"MetaDb loaded successfully. %d entries "
+				"indexed. (%dms)"
+			) % index->count() % t
+		);
+	} else {
+		std::ifstream ifs(file.string().c_str(), std::ios::binary);
+		load(ifs);
+	}
+} catch (std::exception &e) {
+	logError(boost::format("Unable to load MetaDb: %s") % e.what());
+}
+MSVC_ONLY(;)
 
 // load from stream
 void MetaDb::load(std::istream &i) try {
+	if (!i || i.peek() != OP_MDB_INDEXED) {
+		loadLegacy(i);
+		return;
+	}
+	Utils::StopWatch t;
+	logTrace(TRACE_MD, "Loading indexed MetaDb from stream.");
+	std::ostringstream tmp;
+	tmp << i.rdbuf();
+	setIndex(new Index(tmp.str()));
+	uint32_t added = m_unloaded;
+	loadAll();
+	logMsg(
+		boost::format(
+			"MetaDb loaded successfully. %d entries added. (%dms)"
+		) % added % t
+	);
+} catch (std::exception &e) {
+	logError(boost::format("Unable to load MetaDb: %s") % e.what());
+}
+MSVC_ONLY(;)
+
+// load old-format database from stream
+void MetaDb::loadLegacy(std::istream &i) try {
 	if (!i) {
 		return;
 	}
@@ -99,6 +455,29 @@ void MetaDb::save(std::ostream &os) const {
 	os << *this;
 }
 
+// The mapped file must not be modified, so the new file is written next to it
+// and renamed over it; POSIX rename() replaces the target atomically.
+void MetaDb::save(const boost::filesystem::path &file) const try {
+	std::string tmp(file.string() + "_");
+	std::ofstream ofs(tmp.c_str(), std::ios::binary);
+	ofs << *this;
+	ofs.close();
+	if (!ofs) {
+		boost::filesystem::remove(boost::filesystem::path(tmp));
+		throw std::runtime_error("Error writing " + tmp);
+	}
+	if (std::rename(tmp.c_str(), file.string().c_str())) {
+		boost::filesystem::remove(file);
+		CHECK_THROW_MSG(
+			!std::rename(tmp.c_str(), file.string().c_str()),
+			"Unable to rename " + tmp
+		);
+	}
+} catch (std::exception &e) {
+	logError(boost::format("Unable to save MetaDb: %s") % e.what());
+}
+MSVC_ONLY(;)
+
 // we do cleanup here instead of destructor since ~MetaData calls
 // EventTable::delHandlers, which can fail on shutdown, but we can't remove
 // that call from there, so ...
@@ -107,23 +486,231 @@ void MetaDb::exit() {
 		delete *i;
 	}
 	m_list.clear();
+	m_sfToMd.clear();
+	m_filenames.clear();
+	m_nameToSF.clear();
+	m_hashToSF.clear();
+	m_hashes.clear();
+	m_words.clear();
+	m_index.reset();
+	m_records.clear();
+	m_recordIds.clear();
+	m_keep.clear();
+	m_loaded.clear();
+	m_unloaded = 0;
 }
 
-// Write contents to designated output stream
+// Write contents to designated output stream. Entries which haven't been
+// loaded from the index are copied over as-is, along with their index entries.
 std::ostream& operator<<(std::ostream &o, const MetaDb &md) {
 	logTrace(TRACE_MD, "Writing MetaDb to stream.");
-	Utils::StopWatch s1;
-	Utils::putVal<uint8_t>(o, OP_MDB_VERSION);
-	Utils::putVal<uint32_t>(o, md.m_list.size());
-	uint16_t count = 0;
+	typedef std::vector<std::pair<std::string, uint32_t> > Keys;
+	std::vector<std::pair<uint64_t, uint32_t> > records;
+	Keys hashes, names;
+	uint64_t pos = 1;
+	Utils::putVal<uint8_t>(o, OP_MDB_INDEXED);
+
 	for (MetaDb::CLIter i = md.m_list.begin(); i != md.m_list.end(); ++i) {
-		o << *(*i);
-		++count;
+		std::ostringstream tmp;
+		tmp << *(*i);
+		uint32_t id = records.size();
+		records.push_back(std::make_pair(pos, tmp.str().size()));
+		Utils::putVal<std::string>(o, tmp.str(), tmp.str().size());
+		pos += tmp.str().size();
+		names.push_back(std::make_pair((*i)->getName(), id));
+		for (uint32_t j = 0; j < (*i)->getHashSetCount(); ++j) {
+			hashes.push_back(std::make_pair(
+				hashKey((*i)->getHashSet(j)->getFileHash()), id
+			));
+		}
+	}
+
+	if (md.m_index) {
+		const MetaDb::Index &index = *md.m_index;
+		std::vector<uint32_t> newIds(index.count(), ~0u);
+		for (uint32_t i = 0; i < index.count(); ++i) {
+			const char *data = 0;
+			uint32_t len = 0;
+			if (md.m_records[i]) {
+				continue;
+			} else if (!index.getRecord(i, &data, &len)) {
+				continue;
+			}
+			newIds[i] = records.size();
+			records.push_back(std::make_pair(pos, len));
+			o.write(data, len);
+			pos += len;
+		}
+		for (uint32_t i = 0; i < index.hashCount(); ++i) {
+			uint32_t id = index.getHashRecord(i);
+			if (id < newIds.size() && newIds[id] != ~0u) {
+				hashes.push_back(std::make_pair(
+					index.getHashKey(i), newIds[id]
+				));
+			}
+		}
+		for (uint32_t i = 0; i < index.nameCount(); ++i) {
+			uint32_t id = index.getNameRecord(i);
+			if (id < newIds.size() && newIds[id] != ~0u) {
+				names.push_back(std::make_pair(
+					index.getName(i), newIds[id]
+				));
+			}
+		}
+	}
+
+	uint64_t recordPos = pos;
+	for (uint32_t i = 0; i < records.size(); ++i) {
+		Utils::putVal<uint64_t>(o, records[i].first);
+		Utils::putVal<uint32_t>(o, records[i].second);
+	}
+	pos += records.size() * RECORD_ENTRY;
+
+	std::sort(hashes.begin(), hashes.end());
+	uint64_t hashPos = pos;
+	for (Keys::iterator i = hashes.begin(); i != hashes.end(); ++i) {
+		Utils::putVal<std::string>(o, (*i).first, HASH_KEY);
+		Utils::putVal<uint32_t>(o, (*i).second);
+	}
+	pos += hashes.size() * HASH_ENTRY;
+
+	std::sort(names.begin(), names.end());
+	std::vector<uint64_t> nameOffsets;
+	for (Keys::iterator i = names.begin(); i != names.end(); ++i) {
+		(*i).first = (*i).first.substr(0, 0xffff);
+		nameOffsets.push_back(pos);
+		Utils::putVal<std::string>(o, (*i).first);
+		pos += 2 + (*i).first.size();
 	}
-	CHECK_THROW(count == md.m_list.size());
+	uint64_t namePos = pos;
+	for (uint32_t i = 0; i < names.size(); ++i) {
+		Utils::putVal<uint64_t>(o, nameOffsets[i]);
+		Utils::putVal<uint32_t>(o, names[i].second);
+	}
+
+	Utils::putVal<uint64_t>(o, recordPos);
+	Utils::putVal<uint32_t>(o, records.size());
+	Utils::putVal<uint64_t>(o, hashPos);
+	Utils::putVal<uint32_t>(o, hashes.size());
+	Utils::putVal<uint64_t>(o, namePos);
+	Utils::putVal<uint32_t>(o, names.size());
+	Utils::putVal<uint32_t>(o, MDB_MAGIC);
 	return o;
 }
 
+// MetaDb - Indexed database file
+// ------------------------------
+
+void MetaDb::setIndex(Index *index) {
+	if (m_index) {
+		loadAll();
+	}
+	m_index.reset(index);
+	m_records.assign(index->count(), 0);
+	m_keep.assign(index->count(), false);
+	m_recordIds.clear();
+	m_loaded.clear();
+	m_unloaded = index->count();
+}
+
+// After this, loaded entries are regular entries which are never unloaded
+void MetaDb::loadAll() {
+	for (uint32_t i = 0; i < m_records.size(); ++i) {
+		if (!m_records[i]) {
+			loadRecord(i);
+		}
+	}
+	m_index.reset();
+	m_records.clear();
+	m_recordIds.clear();
+	m_keep.clear();
+	m_loaded.clear();
+	m_unloaded = 0;
+}
+
+MetaData* MetaDb::loadRecord(uint32_t id) try {
+	CHECK_THROW(id < m_records.size());
+	if (m_records[id]) {
+		return m_records[id];
+	}
+	logTrace(METADB, boost::format("Loading entry %d from index.") % id);
+	const char *data = 0;
+	uint32_t len = 0;
+	CHECK_THROW_MSG(
+		m_index->getRecord(id, &data, &len), "Invalid record table."
+	);
+	std::istringstream i(std::string(data, len));
+	uint8_t oc = Utils::getVal<uint8_t>(i);
+	(void)Utils::getVal<uint16_t>(i);
+	CHECK_THROW(oc == CGComm::OP_METADATA);
+	MetaData *md = new MetaData(i);
+	if (!md->getName().size()) {
+		delete md;
+		return 0;
+	}
+	push(md);
+	--m_unloaded;
+	m_records[id] = md;
+	m_recordIds[md] = id;
+	m_loaded.push_back(id);
+
+	// unloading is deferred, since callers hold on to returned pointers
+	uint32_t cache = Prefs::instance().read<uint32_t>("/MetaDbCache", 1000);
+	if (m_loaded.size() > cache && !m_unloadPending) {
+		Utils::timedCallback(this, &MetaDb::unload, 0);
+		m_unloadPending = true;
+	}
+	return md;
+} catch (std::exception &e) {
+	logError(
+		boost::format("Unable to load MetaDb entry %d: %s")
+		% id % e.what()
+	);
+	return 0;
+}
+MSVC_ONLY(;)
+
+void MetaDb::unload() {
+	m_unloadPending = false;
+	uint32_t cache = Prefs::instance().read<uint32_t>("/MetaDbCache", 1000);
+	uint32_t count = 0;
+	while (m_loaded.size() > cache) {
+		uint32_t id = m_loaded.front();
+		m_loaded.pop_front();
+		MetaData *md = m_records[id];
+		if (!md || m_keep[id]) {
+			continue;
+		}
+		remove(md);
+		m_recordIds.erase(md);
+		m_records[id] = 0;
+		++m_unloaded;
+		++count;
+		delete md;
+	}
+	logTrace(METADB, boost::format("Unloaded %d entries.") % count);
+}
+
+void MetaDb::remove(MetaData *md) {
+	m_list.erase(md);
+	std::pair<FNIter, FNIter> i = m_filenames.equal_range(md->getName());
+	while (i.first != i.second) {
+		if ((*i.first).second == md) {
+			m_filenames.erase(i.first++);
+		} else {
+			++i.first;
+		}
+	}
+	for (uint32_t i = 0; i < md->getHashSetCount(); ++i) {
+		const HashBase *h = &md->getHashSet(i)->getFileHash();
+		MetaData **j = m_hashes.find(h);
+		if (j && *j == md) {
+			m_hashes.erase(h);
+		}
+	}
+	MetaData::getEventTable().delHandlers(md);
+}
+
 // MetaDb - Adding entries
 // -----------------------
 
@@ -177,6 +764,7 @@ void MetaDb::tryAddFileName(SharedFile *sf, const std::string &name) {
 
 	logTrace(METADB, "-> Inserting.");
 	m_nameToSF.insert(std::make_pair(name, sf));
+	addWords(sf, name);
 
 	// We need to know of its destruction events
 	SharedFile::getEventTable().addHandler(
@@ -193,29 +781,7 @@ void MetaDb::tryAddHashSet(MetaData *source, const HashSetBase *hash) {
 		% hash->getFileHash().decode()
 	);
 
-	const HashBase &hashToAdd = hash->getFileHash();
-
-	HTMDIter i = m_hashes.find(hashToAdd.getTypeId());
-	if (i == m_hashes.end()) {
-		// Already outer map key doesn't exist - add the outer map
-		// entry, add inner map, and add the hash to inner map.
-		std::map<HashWrapper, MetaData*> maptoAdd;
-		maptoAdd.insert(
-			std::make_pair(HashWrapper(&hashToAdd), source)
-		);
-		m_hashes.insert(
-			std::make_pair(hashToAdd.getTypeId(), maptoAdd)
-		);
-	} else {
-		// Outer map key found - search in inner map
-		HWTMDIter j = (*i).second.find(HashWrapper(&hashToAdd));
-		if (j == (*i).second.end()) {
-			// Key not found in inner map - insert it.
-			(*i).second.insert(
-				std::make_pair(HashWrapper(&hashToAdd), source)
-			);
-		}
-	}
+	m_hashes.insert(&hash->getFileHash(), source);
 }
 
 // Try to add hashset to Hash <-> SharedFile reference map
@@ -223,28 +789,7 @@ void MetaDb::tryAddHashSet(SharedFile *sf, const HashSetBase *hash) {
 	CHECK_THROW(hash != 0);
 	CHECK_THROW(sf != 0);
 
-	const HashBase &hashToAdd = hash->getFileHash();
-
-	// Add to m_hashToSF map
-	HTSFIter i = m_hashToSF.find(hashToAdd.getTypeId());
-	if (i == m_hashToSF.end()) {
-		// Already outer map key doesn't exist - add the outer map
-		// entry, add inner map, and add the hash to inner map.
-		std::map<HashWrapper, SharedFile*> toAdd;
-		toAdd.insert(std::make_pair(HashWrapper(&hashToAdd), sf));
-		m_hashToSF.insert(
-			std::make_pair(hashToAdd.getTypeId(), toAdd)
-		);
-	} else {
-		// Outer map key found - search in inner map
-		HWTSFIter j = (*i).second.find(HashWrapper(&hashToAdd));
-		if (j == (*i).second.end()) {
-			// Key not found in inner map - insert it.
-			(*i).second.insert(
-				std::make_pair(HashWrapper(&hashToAdd), sf)
-			);
-		}
-	}
+	m_hashToSF.insert(&hash->getFileHash(), sf);
 
 	// We need to know of its destruction events
 	SharedFile::getEventTable().addHandler(
@@ -279,6 +824,11 @@ void MetaDb::push(MetaData *md, SharedFile *sf) {
 
 	push(md);
 
+	std::map<MetaData*, uint32_t>::iterator it = m_recordIds.find(md);
+	if (it != m_recordIds.end()) {
+		m_keep[(*it).second] = true;
+	}
+
 	bool added = m_sfToMd.insert(std::make_pair(sf, md)).second;
 
 	for (uint32_t i = 0; i < md->getHashSetCount(); ++i) {
@@ -304,21 +854,28 @@ MetaData* MetaDb::find(const HashBase &h) const {
 		% h.getType() % h.decode()
 	);
 
-	CHTMDIter i = m_hashes.find(h.getTypeId());
-
-	if (i == m_hashes.end()) {
-		// outer map key not found
-		return 0;
+	MetaData *const *i = m_hashes.find(&h);
+	if (i) {
+		logTrace(METADB, "Found.");
+		return *i;
 	}
 
-	CHWTMDIter j = (*i).second.find(HashWrapper(&h));
-	if (j == (*i).second.end()) {
-		// Inner map key not found
-		return 0;
+	// Not loaded yet? Index keys may be truncated, so verify the hash.
+	if (m_index) {
+		MetaDb *self = const_cast<MetaDb*>(this);
+		std::vector<uint32_t> ids = m_index->find(h);
+		for (uint32_t k = 0; k < ids.size(); ++k) {
+			if (ids[k] >= m_records.size() || m_records[ids[k]]) {
+				continue;
+			}
+			MetaData *md = self->loadRecord(ids[k]);
+			if (md && hasHash(md, h)) {
+				logTrace(METADB, "Found in index.");
+				return md;
+			}
+		}
 	}
-
-	logTrace(METADB, "Found.");
-	return (*j).second;
+	return 0;
 }
 
 // Locate MetaData(s) by searching with file name by looking at m_filenames map
@@ -326,10 +883,16 @@ std::vector<MetaData*> MetaDb::find(const std::string &filename) const {
 	logTrace(METADB, boost::format("Searching for filename %s") % filename);
 
 	std::vector<MetaData*> ret;
-	std::pair<CFNIter, CFNIter> i = m_filenames.equal_range(filename);
-	if (i.first == i.second) {
-		return ret;
+	if (m_index) {
+		MetaDb *self = const_cast<MetaDb*>(this);
+		std::vector<uint32_t> ids = m_index->find(filename);
+		for (uint32_t k = 0; k < ids.size(); ++k) {
+			if (ids[k] < m_records.size() && !m_records[ids[k]]) {
+				self->loadRecord(ids[k]);
+			}
+		}
 	}
+	std::pair<CFNIter, CFNIter> i = m_filenames.equal_range(filename);
 	for (CFNIter j = i.first; j != i.second; ++j) {
 		ret.push_back((*j).second);
 	}
@@ -348,16 +911,8 @@ MetaData* MetaDb::find(SharedFile *sf) const {
 
 // Locate SharedFile by searching with hash
 SharedFile* MetaDb::findSharedFile(const HashBase &h) const {
-	CHTSFIter i = m_hashToSF.find(h.getTypeId());
-	if (i == m_hashToSF.end()) {
-		return 0;
-	}
-	HashWrapper hw(&h);
-	CHWTSFIter j = (*i).second.find(hw);
-	if (j == (*i).second.end()) {
-		return 0;
-	}
-	return (*j).second;
+	SharedFile *const *i = m_hashToSF.find(&h);
+	return i ? *i : 0;
 }
 
 // Locate SharedFiless matching given file name
@@ -391,39 +946,112 @@ void MetaDb::remSharedFile(SharedFile *sf) {
 		return;
 	}
 
-	// Look up all file names found in metadata and erase them from
-	// m_nameToSF map
+	// Look up all file names found in metadata and erase this file's
+	// entries from m_nameToSF map and m_words index
 	MetaData::NameIter it = md->namesBegin();
-	while (it != md->namesEnd()) {
-		NTSFIter j = m_nameToSF.find((*it++).first);
-		if (j == m_nameToSF.end()) {
-			continue;
+	for (; it != md->namesEnd(); ++it) {
+		std::pair<NTSFIter, NTSFIter> j = m_nameToSF.equal_range(
+			(*it).first
+		);
+		while (j.first != j.second) {
+			if ((*j.first).second == sf) {
+				m_nameToSF.erase(j.first++);
+			} else {
+				++j.first;
+			}
 		}
-		m_nameToSF.erase(j);
+		delWords(sf, (*it).first);
 	}
 
-	// Look up all hash sets foudn in metadata and erase them from
+	// Look up all hash sets found in metadata and erase them from
 	// m_hashToSF map
 	for (uint32_t i = 0; i < md->getHashSetCount(); ++i) {
-		HTSFIter j = m_hashToSF.find(
-			md->getHashSet(i)->getFileHashTypeId()
-		);
-		if (j == m_hashToSF.end()) {
-			continue;
+		const HashBase *h = &md->getHashSet(i)->getFileHash();
+		SharedFile **j = m_hashToSF.find(h);
+		if (j && *j == sf) {
+			m_hashToSF.erase(h);
 		}
-		HWTSFIter k = (*j).second.find(
-			HashWrapper(&(md->getHashSet(i)->getFileHash()))
-		);
-		if (k == (*j).second.end()) {
-			continue;
+	}
+}
+
+// MetaDb - Keyword index
+// ----------------------
+
+// Split name into lowercase words at non-alphanumeric characters. Bytes
+// outside of ASCII are kept as parts of words, so UTF-8 names work too.
+static std::vector<std::string> tokenize(const std::string &name) {
+	std::vector<std::string> ret;
+	std::string word;
+	for (uint32_t i = 0; i <= name.size(); ++i) {
+		unsigned char c = i < name.size() ? name[i] : 0;
+		if (c >= 0x80 || isalnum(c)) {
+			word += static_cast<char>(tolower(c));
+		} else if (word.size()) {
+			ret.push_back(word);
+			word.clear();
 		}
-		(*j).second.erase(k);
-		if ((*j).second.size() == 0) {
-			m_hashToSF.erase(j);
+	}
+	std::sort(ret.begin(), ret.end());
+	ret.erase(std::unique(ret.begin(), ret.end()), ret.end());
+	return ret;
+}
+
+void MetaDb::addWords(SharedFile *sf, const std::string &name) {
+	std::vector<std::string> words = tokenize(name);
+	for (uint32_t i = 0; i < words.size(); ++i) {
+		m_words[words[i]].insert(sf);
+	}
+}
+
+// A file may be listed under the same word for another name too, however this
+// is only called when the file is removed altogether.
+void MetaDb::delWords(SharedFile *sf, const std::string &name) {
+	std::vector<std::string> words = tokenize(name);
+	for (uint32_t i = 0; i < words.size(); ++i) {
+		std::set<SharedFile*> *files = m_words.find(words[i]);
+		if (files) {
+			files->erase(sf);
+			if (files->empty()) {
+				m_words.erase(words[i]);
+			}
 		}
 	}
 }
 
+// Start with the rarest word, and check the candidates against the rest
+std::vector<SharedFile*> MetaDb::search(const std::string &keywords) const {
+	logTrace(METADB, boost::format("Searching for keywords %s") % keywords);
+
+	std::vector<SharedFile*> ret;
+	std::vector<std::string> words = tokenize(keywords);
+	std::vector<const std::set<SharedFile*>*> files;
+	for (uint32_t i = 0; i < words.size(); ++i) {
+		const std::set<SharedFile*> *f = m_words.find(words[i]);
+		if (!f) {
+			return ret;
+		}
+		files.push_back(f);
+		if (f->size() < files.front()->size()) {
+			std::swap(files.front(), files.back());
+		}
+	}
+	if (files.empty()) {
+		return ret;
+	}
+	std::set<SharedFile*>::const_iterator i = files.front()->begin();
+	for (; i != files.front()->end(); ++i) {
+		uint32_t j = 1;
+		while (j < files.size() && files[j]->count(*i)) {
+			++j;
+		}
+		if (j == files.size()) {
+			ret.push_back(*i);
+		}
+	}
+	logTrace(METADB, boost::format("%d match(es) found.") % ret.size());
+	return ret;
+}
+
 
 // MetaDb - Event Handling
 // -----------------------
@@ -431,6 +1059,12 @@ void MetaDb::remSharedFile(SharedFile *sf) {
 void MetaDb::onMetaDataEvent(MetaData *md, int evt) {
 	CHECK_THROW(md != 0);
 
+	// modified entries must be kept until saved
+	std::map<MetaData*, uint32_t>::iterator it = m_recordIds.find(md);
+	if (it != m_recordIds.end()) {
+		m_keep[(*it).second] = true;
+	}
+
 	// \todo Uh, yeah, boss, but how do we update SharedFile maps ?
 	switch (evt) {
 		case MD_ADDED_FILENAME:
@@ -464,6 +1098,13 @@ void MetaDb::clear() {
 	m_nameToSF.clear();
 	m_hashToSF.clear();
 	m_hashes.clear();
+	m_words.clear();
+	m_index.reset();
+	m_records.clear();
+	m_recordIds.clear();
+	m_keep.clear();
+	m_loaded.clear();
+	m_unloaded = 0;
 }
 
 // "From down here we can make the whole wall collapse!"
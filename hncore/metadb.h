@@ -25,7 +25,11 @@
 
 #include <hnbase/osdep.h>
 #include <hnbase/hash.h>
+#include <hnbase/openhash.h>
 #include <hncore/fwd.h>
+#include <boost/filesystem/path.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <deque>
 
 //! For trace logging
 #define METADB 1030
@@ -41,6 +45,18 @@
  * The purpose of this class is to provide a application-central database
  * through which it is possible to perform cross-referencing between FilesList
  * and this list.
+ *
+ * The database file is indexed by file hashes and names, and is mapped into
+ * memory on loading; entries are loaded from it only when looked up by find()
+ * methods. Loaded entries that aren't associated with a SharedFile nor were
+ * modified are unloaded again when there are more of them than /MetaDbCache
+ * preference allows (1000 by default).
+ *
+ * \note Entries associated with a SharedFile are never unloaded, hashsets
+ *       included, since SharedFile, PartData and the modules keep pointers to
+ *       them; so once shared directories have been scanned, the entries of
+ *       all shared files are resident. Only the entries of files which aren't
+ *       shared (anymore) are kept out of memory.
  */
 class HNCORE_EXPORT MetaDb {
 public:
@@ -58,19 +74,38 @@ public:
 
 	/**
 	 * Load the MetaDb contents from input stream, adding all found entries
-	 * in the stream to the database, merging duplicate entries.
+	 * in the stream to the database, merging duplicate entries. Both the
+	 * old and the indexed format are accepted; all entries are loaded.
 	 *
 	 * @param is       Input stream to read from.
 	 */
 	void load(std::istream &is);
 
 	/**
-	 * Write the contents of the database into output stream.
+	 * Load the MetaDb contents from file. Files in the indexed format are
+	 * mapped into memory; files in the old format are loaded entirely.
+	 *
+	 * @param file     File to read from.
+	 */
+	void load(const boost::filesystem::path &file);
+
+	/**
+	 * Write the contents of the database into output stream, in the
+	 * indexed format.
 	 *
 	 * @param os       Output stream to write to.
 	 */
 	void save(std::ostream &os) const;
 
+	/**
+	 * Write the contents of the database into file. The data is written
+	 * to a temporary file first, which then replaces the file, so the
+	 * currently mapped file remains intact.
+	 *
+	 * @param file     File to write to.
+	 */
+	void save(const boost::filesystem::path &file) const;
+
 	/**
 	 * This should be called on application shutdown; cleans up all internal
 	 * data.
@@ -139,6 +174,16 @@ public:
 		const std::string &filename
 	) const;
 
+	/**
+	 * Locate SharedFiles whose names contain all given keywords. Names and
+	 * keywords are split into words at non-alphanumeric characters, and
+	 * compared case-insensitively; keywords must match whole words.
+	 *
+	 * @param keywords   Keywords to search for
+	 * @return           Vector containing all found entries. May be empty.
+	 */
+	std::vector<SharedFile*> search(const std::string &keywords) const;
+
 	/**
 	 * Remove a SharedFile <-> MetaData association from the database
 	 *
@@ -147,19 +192,19 @@ public:
 	void remSharedFile(SharedFile *sf);
 
 	/**
-	 * @returns const_iterator to beginning of the database
+	 * @returns const_iterator to beginning of the loaded entries
 	 */
 	CIter begin() const { return m_list.begin(); }
 
 	/**
-	 * @returns const_iterator to the end of the database
+	 * @returns const_iterator to the end of the loaded entries
 	 */
 	CIter end() const { return m_list.end(); }
 
 	/**
-	 * @returns the size of the database
+	 * @returns the size of the database, including entries not loaded
 	 */
-	size_t size() const { return m_list.size(); }
+	size_t size() const { return m_list.size() + m_unloaded; }
 private:
 	/**
 	 * @name Singleton
@@ -172,34 +217,20 @@ private:
 	//@}
 
 	/**
-	 * HashWrapper structure acts as a container for HashBase pointers in
-	 * order to allow us to have a map of those keyed by the Hash.
+	 * Functors for keying OpenHashMap with HashBase pointers. Hashes are
+	 * compared by their contents, and hashes of different types never
+	 * compare equal.
 	 */
-	class HashWrapper {
-	public:
-		HashWrapper(const HashBase *obj) : m_object(obj) {}
-		const HashBase *const m_object;           //!< Contained object
-
-		//! Operator to work with std containers
-		friend bool operator<(
-			const HashWrapper &x, const HashWrapper &y
-		) {
-			return (*x.m_object) < (*y.m_object);
-		}
-		friend std::ostream& operator<<(
-			std::ostream &o, const HashWrapper &hw
-		) {
-			return o << (*hw.m_object);
-		}
-		bool operator==(const HashWrapper &h) const {
-			return *m_object == *h.m_object;
-		}
-		bool operator!=(const HashWrapper &h) const {
-			return *m_object != *h.m_object;
+	//!@{
+	struct HashPtrHash {
+		size_t operator()(const HashBase *h) const;
+	};
+	struct HashPtrEqual {
+		bool operator()(const HashBase *x, const HashBase *y) const {
+			return *x == *y;
 		}
-	private:
-		HashWrapper();
 	};
+	//!@}
 
 	/**
 	 * Primary List
@@ -264,64 +295,77 @@ private:
 	/**
 	 * Hash To SharedFile Map
 	 * ----------------------
-	 * A dual map which allows us to locate SharedFiles given a hash. The
-	 * outer map is keyed on HashTypeId, so there are generally only 5-6
-	 * entries there. For each of the outer maps, there's an inner map,
-	 * containing hashes of the given type. Lookups in the inner map return
-	 * the SharedFile of the searched entry.
-	 */
-	std::map<
-		CGComm::HashTypeId, std::map<HashWrapper, SharedFile*>
+	 * Allows us to locate SharedFiles given a hash, of any type. The keys
+	 * point to the hashes within MetaData objects, so entries must be
+	 * removed before the MetaData is destroyed.
+	 */
+	OpenHashMap<
+		const HashBase*, SharedFile*, HashPtrHash, HashPtrEqual
 	> m_hashToSF;
-	//! Hash To SharedFile Iterator
-	typedef std::map<
-		CGComm::HashTypeId, std::map<HashWrapper, SharedFile*>
-	>::iterator HTSFIter;
-	//! Constant Hash To SharedFile Iterator
-	typedef std::map<
-		CGComm::HashTypeId, std::map<HashWrapper, SharedFile*>
-	>::const_iterator CHTSFIter;
-	//! HashWrapper To SharedFile Iterator
-	typedef std::map<HashWrapper, SharedFile*>::iterator HWTSFIter;
-	//! Constant HashWrapper To SharedFile Iterator
-	typedef std::map<HashWrapper, SharedFile*>::const_iterator CHWTSFIter;
 
 	/**
 	 * Hash To Meta Data Map
 	 * ---------------------
-	 * Last, but not least, a recursive map which allows us to look up
-	 * MetaData objects given we know one hash. The outer map is keyed
-	 * on hash types, so there are generally only 5-6 entries in the
-	 * outer map. For each of the outer map, there is an inner map, which
-	 * is keyed on the actual Hash, and returns MetaData pointer. Note
-	 * that we use HashWrapper wrapper class around HashBase pointer,
-	 * doing virtual function calls on lookups. While it is known that
-	 * virtual function calls come with some performance tradeoff, I
-	 * really don't see other way of doing it. Also keep in mind that
-	 * when HashSet object (contained in MetaData object) is destroyed,
-	 * it would invalidate the HashWrapper pointer - make sure to not
-	 * have any HashWrappers containing the HashBase objects around
-	 * anymore when deleting MetaData.
-	 */
-	std::map<
-		CGComm::HashTypeId, std::map<HashWrapper, MetaData*>
+	 * Last, but not least, a map which allows us to look up MetaData
+	 * objects given we know one hash. Hashes of all types are kept in the
+	 * same table; as with m_hashToSF, the keys point to hashes within the
+	 * MetaData objects, so make sure to remove the entries when deleting
+	 * MetaData.
+	 */
+	OpenHashMap<
+		const HashBase*, MetaData*, HashPtrHash, HashPtrEqual
 	> m_hashes;
-	//! Hash To Meta Data Iterator
-	typedef std::map<
-		CGComm::HashTypeId, std::map<HashWrapper, MetaData*>
-	>::iterator HTMDIter;
-	//! Constant Hash To Meta Data Iterator
-	typedef std::map<
-		CGComm::HashTypeId, std::map<HashWrapper, MetaData*>
-	>::const_iterator CHTMDIter;
-	//! Hash Wrapper To Meta Data Iterator
-	typedef std::map<HashWrapper, MetaData*>::iterator HWTMDIter;
-	//! Constant Hash Wrapper To Meta Data Iterator
-	typedef std::map<HashWrapper, MetaData*>::const_iterator CHWTMDIter;
+
+	/**
+	 * Keyword To SharedFile Map
+	 * -------------------------
+	 * Inverted index of the words found in SharedFile names, used by
+	 * search(). Words are lowercased; see tokenize() in metadb.cpp.
+	 */
+	OpenHashMap<std::string, std::set<SharedFile*>, StringHash> m_words;
+
+	//! Add SharedFile to m_words under the words of the name
+	void addWords(SharedFile *sf, const std::string &name);
+	//! Remove SharedFile from m_words under the words of the name
+	void delWords(SharedFile *sf, const std::string &name);
 
 	//! Output operator for streams
 	friend std::ostream& operator<<(std::ostream &o, const MetaDb &md);
 
+	/**
+	 * \name Indexed database file
+	 */
+	//!@{
+	//! Read-only access to database file, defined in metadb.cpp
+	class Index;
+	boost::scoped_ptr<Index> m_index;
+	//! Entries of m_index which have been loaded, by entry number
+	std::vector<MetaData*> m_records;
+	//! Entry numbers of loaded entries
+	std::map<MetaData*, uint32_t> m_recordIds;
+	//! Entries which may not be unloaded
+	std::vector<bool> m_keep;
+	//! Loaded entries, in loading order
+	std::deque<uint32_t> m_loaded;
+	//! Number of entries of m_index not loaded
+	uint32_t m_unloaded;
+	//! Whether unload() call has been scheduled
+	bool m_unloadPending;
+
+	//! Load legacy-format database, which contains no index
+	void loadLegacy(std::istream &is);
+	//! Start using indexed database file
+	void setIndex(Index *index);
+	//! Load all entries of m_index and stop using it
+	void loadAll();
+	//! Load entry from m_index; returns 0 on failure
+	MetaData* loadRecord(uint32_t id);
+	//! Unload least recently loaded entries, which are not needed
+	void unload();
+	//! Remove entry from lookup maps
+	void remove(MetaData *md);
+	//!@}
+
 	/**
 	 * Event handler for MetaData events, called from event table.
 	 *
@@ -25,6 +25,7 @@
 #include <hnbase/log.h>
 #include <hnbase/lambda_placeholders.h>
 #include <hnbase/hash.h>
+#include <hnbase/md4transform.h>
 #include <hnbase/prefs.h>
 #include <hnbase/timed_callback.h>
 
@@ -32,7 +33,10 @@
 #include <hncore/partdata_impl.h>
 #include <hncore/metadata.h>
 #include <hncore/hasher.h>
+#include <hncore/hashpool.h>
+#include <hncore/hashsetmaker.h>
 #include <hncore/hydranode.h>
+#include <hncore/readcache.h>
 
 #include <boost/lambda/lambda.hpp>
 #include <boost/lambda/if.hpp>
@@ -41,14 +45,20 @@
 #include <boost/algorithm/string/replace.hpp>
 
 #include <fstream>
+#include <cerrno>
 #include <fcntl.h>
 
+#ifdef __linux__
+	#define HAVE_FALLOCATE
+	#ifndef FALLOC_FL_KEEP_SIZE
+		#define FALLOC_FL_KEEP_SIZE 0x01
+	#endif
+#endif
+
 using namespace boost::lambda;
 using namespace boost::multi_index;
 using namespace CGComm;
 
-static const uint32_t BUF_SIZE_LIMIT = 512*1024; //!< 512k buffer
-
 namespace Detail {
 
 // UsedRange class
@@ -315,40 +325,258 @@ void Chunk::onHashEvent(HashWorkPtr c, HashEvent evt){
 }
 
 /**
- * AllocJob allocates disk space for temp file. Emits event 'true' when
- * allocation succeeds, false otherwise.
+ * AllocJob allocates disk space for temp file. Where the filesystem supports
+ * it, the space is reserved with fallocate(), which doesn't change the file
+ * size; otherwise the file is extended with zeros, ALLOC_STEP bytes at a time.
+ * Each step is a separate IOThread job, so flushes submitted meanwhile aren't
+ * delayed until the allocation completes. Zeros are only written past the end
+ * of file, so data flushed meanwhile is never overwritten.
+ *
+ * Emits ALLOC_PROGRESS after each step, and ALLOC_DONE or ALLOC_FAILED when
+ * finished. Once cancel() returns, the file is no longer written to.
  */
-class AllocJob : public ThreadWork {
+class AllocJob {
 public:
-	DECLARE_EVENT_TABLE(AllocJobPtr, bool);
+	DECLARE_EVENT_TABLE(AllocJobPtr, AllocEvent);
 	AllocJob(const boost::filesystem::path &file, uint64_t size);
-	virtual bool process();
+
+	//! Submit the first step to IOThread
+	void start();
+	//! Stop allocating; waits for the current step to finish
+	void cancel();
+	//! \returns Number of bytes allocated so far
+	uint64_t getProgress();
 private:
+	class Step;
+
+	//! Amount of zeros written per step
+	static const uint32_t ALLOC_STEP = 4 * 1024 * 1024;
+
+	//! Perform one step of the allocation; called from IOThread
+	void step();
+
 	boost::filesystem::path m_file;
 	uint64_t m_size;
+	uint64_t m_done;         //!< Bytes allocated so far
+	bool m_reserveTried;     //!< Whether fallocate() has been tried
+	bool m_canceled;         //!< Set by cancel(), or when finished
+	boost::mutex m_lock;     //!< Protects all of the above
+};
+IMPLEMENT_EVENT_TABLE(AllocJob, AllocJobPtr, AllocEvent);
+
+//! Performs single step of AllocJob in IOThread
+class AllocJob::Step : public ThreadWork {
+public:
+	Step(AllocJobPtr job) : m_job(job) {}
+	virtual bool process() {
+		m_job->step();
+		setComplete();
+		return true;
+	}
+private:
+	AllocJobPtr m_job;
 };
-IMPLEMENT_EVENT_TABLE(AllocJob, AllocJobPtr, bool);
 
 AllocJob::AllocJob(const boost::filesystem::path &file, uint64_t size)
-: m_file(file), m_size(size) {}
+: m_file(file), m_size(size), m_done(), m_reserveTried(), m_canceled() {}
+
+void AllocJob::start() {
+	ThreadWorkPtr s(new Step(AllocJobPtr(this)));
+	IOThread::instance().postWork(s);
+}
+
+void AllocJob::cancel() {
+	boost::mutex::scoped_lock l(m_lock);
+	m_canceled = true;
+}
+
+uint64_t AllocJob::getProgress() {
+	boost::mutex::scoped_lock l(m_lock);
+	return m_done;
+}
+
+void AllocJob::step() {
+	boost::mutex::scoped_lock l(m_lock);
+	if (m_canceled) {
+		return;
+	}
+	int fd = open(
+		m_file.native_file_string().c_str(),
+		O_RDWR|O_LARGEFILE|O_BINARY
+	);
+	if (fd == -1) {
+		m_canceled = true;
+		getEventTable().postEvent(AllocJobPtr(this), ALLOC_FAILED);
+		return;
+	}
+
+	bool failed = false;
+#ifdef HAVE_FALLOCATE
+	if (!m_reserveTried) {
+		m_reserveTried = true;
+		if (!::fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, m_size)) {
+			m_done = m_size;
+		} else if (errno == ENOSPC) {
+			failed = true;
+		} // otherwise not supported by the filesystem
+	}
+#endif
+	if (!failed && m_done < m_size) {
+		uint64_t eof = ::lseek64(fd, 0, SEEK_END);
+		if (eof < m_size) {
+			uint32_t len = std::min<uint64_t>(
+				ALLOC_STEP, m_size - eof
+			);
+			std::vector<char> zeros(len);
+			failed = ::write(fd, &zeros[0], len) != int(len);
+			eof += len;
+		}
+		m_done = std::min(eof, m_size);
+	}
+	::close(fd);
+
+	if (failed) {
+		m_canceled = true;
+		getEventTable().postEvent(AllocJobPtr(this), ALLOC_FAILED);
+	} else if (m_done == m_size) {
+		m_canceled = true;
+		getEventTable().postEvent(AllocJobPtr(this), ALLOC_DONE);
+	} else {
+		getEventTable().postEvent(AllocJobPtr(this), ALLOC_PROGRESS);
+		ThreadWorkPtr s(new Step(AllocJobPtr(this)));
+		IOThread::instance().postWork(s);
+	}
+}
 
-// allocates disk space in 10mb increments
-bool AllocJob::process() {
-	int fd = open(m_file.native_file_string().c_str(), O_RDWR|O_BINARY);
-	if (!fd) {
-		getEventTable().postEvent(AllocJobPtr(this), false);
+/**
+ * FlushJob writes buffered data to temp file. Emits event 'true' when all data
+ * has been written, false otherwise. The job may also be run directly from
+ * main thread (e.g. during shutdown); it's only performed once.
+ */
+class FlushJob : public ThreadWork {
+public:
+	DECLARE_EVENT_TABLE(FlushJobPtr, bool);
+	typedef WriteBuffer::Extents Buffers;
+
+	FlushJob(const boost::filesystem::path &file, bool sync);
+	virtual bool process();
+
+	//! Data to be written, keyed by offset
+	Buffers& getData() { return m_data; }
+	//! \returns Error message if the job failed
+	std::string getError() const { return m_error; }
+private:
+	boost::filesystem::path m_file;
+	Buffers m_data;
+	bool m_sync;             //!< Whether to fsync() after writing
+	bool m_done;             //!< Set when the job has been performed
+	std::string m_error;
+	boost::mutex m_lock;     //!< Protects all of the above
+};
+IMPLEMENT_EVENT_TABLE(FlushJob, FlushJobPtr, bool);
+
+FlushJob::FlushJob(const boost::filesystem::path &file, bool sync)
+: m_file(file), m_sync(sync), m_done() {}
+
+bool FlushJob::process() {
+	boost::mutex::scoped_lock l(m_lock);
+	if (m_done) {
+		setComplete();
+		return true;
+	}
+	m_done = true;
+
+	int fd = open(
+		m_file.native_file_string().c_str(),
+		O_RDWR|O_LARGEFILE|O_BINARY
+	);
+	if (fd == -1) {
+		m_error = "unable to open file " + m_file.native_file_string()
+			+ " for writing.";
 	} else {
-		::lseek64(fd, m_size - 1, SEEK_SET);
-		::write(fd, "1", 1);
-		::fsync(fd);
-		::close(fd);
-		assert(Utils::getFileSize(m_file) <= m_size);
-		bool ret = Utils::getFileSize(m_file) == m_size;
-		getEventTable().postEvent(AllocJobPtr(this), ret);
+		for (Buffers::iterator i = m_data.begin(); i != m_data.end(); ++i) {
+			if (!(*i).second->writeTo(fd)) {
+				m_error = "no space left on drive";
+				break;
+			}
+		}
+		if (m_error.empty() && m_sync) {
+			fsync(fd);
+		}
+		close(fd);
 	}
+	getEventTable().postEvent(FlushJobPtr(this), m_error.empty());
 	setComplete();
 	return true;
 }
+
+/**
+ * ArrivalHash computes checksum of a chunk from the data written to it, so the
+ * chunk can be verified without reading it back from disk once it completes.
+ * The data must arrive in order, starting at chunk beginning.
+ */
+struct ArrivalHash {
+	ArrivalHash(const HashBase *ref, uint64_t begin)
+	: m_ref(ref), m_next(begin), m_maker(HashWork::createMaker(
+		ref->getTypeId()
+	)) {}
+
+	const HashBase *m_ref;                   //!< Chunk hash
+	uint64_t m_next;                         //!< Next expected offset
+	boost::scoped_ptr<HashSetMaker> m_maker; //!< May be null
+};
+
+/**
+ * Journal records; each record is opcode and two uint64 values, followed by
+ * uint32 checksum of the record and journal identifier, which detects records
+ * torn by a crash, and records belonging to an older .dat file.
+ */
+enum JournalOpCodes {
+	JR_COMPLETE   = 0x01, //!< Range completed
+	JR_INCOMPLETE = 0x02, //!< Range no longer complete (corrupt)
+	JR_VERIFIED   = 0x03, //!< Range verified
+	JR_UNVERIFIED = 0x04, //!< Range no longer verified
+	JR_MODDATE    = 0x05, //!< Temp file modification date
+	JR_UPLOADED   = 0x06  //!< Amount uploaded
+};
+//! Size of journal record
+const uint32_t JOURNAL_RECORD = 21;
+//! Journal is merged into .dat file when larger than this, and the .dat file
+const uint64_t JOURNAL_MIN = 64 * 1024;
+
+//! FNV-1a checksum of journal record
+uint32_t journalCheck(uint32_t id, const std::string &rec) {
+	uint32_t h = 2166136261u ^ id;
+	for (uint32_t i = 0; i < rec.size(); ++i) {
+		h = (h ^ static_cast<uint8_t>(rec[i])) * 16777619u;
+	}
+	return h;
+}
+
+void putRecord(
+	std::ostream &o, uint32_t id, uint8_t op, uint64_t a, uint64_t b
+) {
+	std::ostringstream rec;
+	Utils::putVal<uint8_t>(rec, op);
+	Utils::putVal<uint64_t>(rec, a);
+	Utils::putVal<uint64_t>(rec, b);
+	Utils::putVal<std::string>(o, rec.str(), rec.str().size());
+	Utils::putVal<uint32_t>(o, journalCheck(id, rec.str()));
+}
+
+//! Records the ranges in x but not in y
+void putDiff(
+	std::ostream &o, uint32_t id, uint8_t op,
+	const FlatRangeList64 &x, const FlatRangeList64 &y
+) {
+	FlatRangeList64 tmp(x);
+	for (FlatRangeList64::CIter i = y.begin(); i != y.end(); ++i) {
+		tmp.erase(*i);
+	}
+	for (FlatRangeList64::CIter i = tmp.begin(); i != tmp.end(); ++i) {
+		putRecord(o, id, op, (*i).begin(), (*i).end());
+	}
+}
 } // namespace Detail
 
 using namespace Detail;
@@ -367,8 +595,11 @@ PartData::PartData(
 	const boost::filesystem::path &loc,
 	const boost::filesystem::path &dest
 ) : Object(0), m_size(size), m_loc(loc), m_dest(dest), m_chunks(new ChunkMap),
-m_toFlush(), m_md(), m_pendingHashes(), m_sourceCnt(), m_fullSourceCnt(),
-m_paused(), m_stopped(), m_autoPaused() {
+m_buffer(boost::bind(&PartData::save, this)), m_md(), m_pendingHashes(),
+m_sourceCnt(), m_fullSourceCnt(), m_paused(), m_stopped(), m_autoPaused(),
+m_allocStarted(), m_saveAfterFlush(), m_lastSync(), m_unsynced(),
+m_syncPending(), m_journalId(), m_journalSize(), m_snapshotSize(),
+m_savedModDate(), m_savedUploaded() {
 	initSignals();
 
 	std::ofstream o(loc.string().c_str(), std::ios::binary);
@@ -379,8 +610,11 @@ m_paused(), m_stopped(), m_autoPaused() {
 
 
 PartData::PartData(const boost::filesystem::path &p) try : Object(0),
-m_size(), m_chunks(new ChunkMap), m_toFlush(), m_md(), m_pendingHashes(),
-m_sourceCnt(), m_fullSourceCnt(), m_paused(), m_stopped(), m_autoPaused() {
+m_size(), m_chunks(new ChunkMap), m_buffer(boost::bind(&PartData::save, this)),
+m_md(), m_pendingHashes(), m_sourceCnt(), m_fullSourceCnt(), m_paused(),
+m_stopped(), m_autoPaused(), m_allocStarted(), m_saveAfterFlush(),
+m_lastSync(), m_unsynced(), m_syncPending(), m_journalId(), m_journalSize(),
+m_snapshotSize(), m_savedModDate(), m_savedUploaded() {
 	initSignals();
 
 	logTrace(TRACE_PARTDATA,
@@ -420,7 +654,7 @@ m_sourceCnt(), m_fullSourceCnt(), m_paused(), m_stopped(), m_autoPaused() {
 					ifs.seekg(len, std::ios::cur);
 				} else {
 					(void)Utils::getVal<uint16_t>(ifs);
-					m_complete = RangeList64(ifs);
+					m_complete = FlatRangeList64(ifs);
 				}
 				break;
 			case OP_PD_VERIFIED:
@@ -429,9 +663,12 @@ m_sourceCnt(), m_fullSourceCnt(), m_paused(), m_stopped(), m_autoPaused() {
 					ifs.seekg(len, std::ios::cur);
 				} else {
 					(void)Utils::getVal<uint16_t>(ifs);
-					m_verified = RangeList64(ifs);
+					m_verified = FlatRangeList64(ifs);
 				}
 				break;
+			case OP_PD_JOURNAL:
+				m_journalId = Utils::getVal<uint32_t>(ifs);
+				break;
 			case OP_PD_STATE: {
 				uint8_t state = Utils::getVal<uint8_t>(ifs);
 				if (state == STATE_STOPPED) {
@@ -452,6 +689,7 @@ m_sourceCnt(), m_fullSourceCnt(), m_paused(), m_stopped(), m_autoPaused() {
 		(void)Utils::getVal<uint16_t>(ifs);
 		m_md = new MetaData(ifs);
 	}
+	loadJournal();
 
 	cleanupName();
 //	printCompleted();
@@ -464,8 +702,11 @@ MSVC_ONLY(;)
 PartData::PartData(
 	const boost::filesystem::path &path, MetaData *md
 ) : Object(0), m_size(md->getSize()), m_loc(path), m_chunks(new ChunkMap),
-m_toFlush(), m_md(md), m_pendingHashes(), m_sourceCnt(), m_fullSourceCnt(),
-m_paused(), m_stopped(), m_autoPaused() {
+m_buffer(boost::bind(&PartData::save, this)), m_md(md), m_pendingHashes(),
+m_sourceCnt(), m_fullSourceCnt(), m_paused(), m_stopped(), m_autoPaused(),
+m_allocStarted(), m_saveAfterFlush(), m_lastSync(), m_unsynced(),
+m_syncPending(), m_journalId(), m_journalSize(), m_snapshotSize(),
+m_savedModDate(), m_savedUploaded() {
 	initSignals();
 
 	for (uint32_t i = 0; i < md->getHashSetCount(); ++i) {
@@ -487,14 +728,21 @@ m_paused(), m_stopped(), m_autoPaused() {
 }
 
 // protected default constructor
-PartData::PartData() : Object(0), m_size(), m_chunks(new ChunkMap), m_toFlush(),
-m_md(), m_pendingHashes(), m_sourceCnt(), m_fullSourceCnt(), m_paused(),
-m_stopped(), m_autoPaused() {
+PartData::PartData() : Object(0), m_size(), m_chunks(new ChunkMap),
+m_buffer(boost::bind(&PartData::save, this)), m_md(), m_pendingHashes(),
+m_sourceCnt(), m_fullSourceCnt(), m_paused(), m_stopped(), m_autoPaused(),
+m_allocStarted(), m_saveAfterFlush(), m_lastSync(), m_unsynced(),
+m_syncPending(), m_journalId(), m_journalSize(), m_snapshotSize(),
+m_savedModDate(), m_savedUploaded() {
 	initSignals();
 }
 
 PartData::~PartData() {
+	cancelAlloc();
 	getEventTable().delHandlers(this);
+	for (uint32_t i = 0; i < m_flushJobs.size(); ++i) {
+		FlushJob::getEventTable().delHandlers(m_flushJobs[i]);
+	}
 }
 
 // boost::signals breaks when the first time the signal is invoced it's done
@@ -870,7 +1118,7 @@ void PartData::addHashSet(const HashSetBase *hs) {
 
 bool PartData::canLock(const Range64 &r, uint32_t size) const {
 	Range64 cand(r.begin(), r.begin());
-	typedef RangeList64::CIter CIter;
+	typedef FlatRangeList64::CIter CIter;
 	CIter i = m_complete.getContains(cand);
 	CIter j = m_locked.getContains(cand);
 	CIter k = m_dontDownload.getContains(cand);
@@ -893,7 +1141,7 @@ bool PartData::canLock(const Range64 &r, uint32_t size) const {
 
 LockedRangePtr PartData::getLock(UsedRangePtr used, uint32_t size) {
 	Range64 cand(used->begin(), used->begin());
-	typedef RangeList64::CIter CIter;
+	typedef FlatRangeList64::CIter CIter;
 	CIter i = m_complete.getContains(cand);
 	CIter j = m_locked.getContains(cand);
 	CIter k = m_dontDownload.getContains(cand);
@@ -975,6 +1223,14 @@ void PartData::setComplete(Range64 range) {
 }
 
 void PartData::setCorrupt(Range64 range) {
+	typedef std::map<ArrivalKey, ArrivalHashPtr>::iterator AIter;
+	for (AIter i = m_arrival.begin(); i != m_arrival.end();) {
+		if (range.contains((*i).first.first, (*i).first.second)) {
+			m_arrival.erase(i++);
+		} else {
+			++i;
+		}
+	}
 	m_complete.erase(range);
 	m_corrupt.merge(range);
 	m_verified.erase(range);
@@ -1009,56 +1265,222 @@ void PartData::doWrite(uint64_t begin, const std::string &data) {
 
 	CHECK_THROW(!m_complete.contains(begin, begin + data.size() - 1));
 
-	m_buffer[begin] = data;
+	m_buffer.write(begin, data);
+	hashArrived(begin, data);
 	setComplete(Range64(begin, begin + data.size() - 1));
-	m_toFlush += data.size();
 	getEventTable().postEvent(this, PD_DATA_ADDED);
-	if (m_toFlush >= BUF_SIZE_LIMIT) {
-		save();
-	}
+	WriteCache::instance().evict();
 	dataAdded(this, begin, data.size());
 }
 
-void PartData::flushBuffer() {
+// Feeds written data to checksums of the chunks it belongs to. Chunk checksum
+// is started when data is written at the beginning of a chunk with a hash, and
+// dropped when the next write doesn't continue where the previous one ended;
+// such chunks are read back from disk for verification, as before. Chunks of
+// all sizes are fed, since each size may come with its own hashes.
+void PartData::hashArrived(uint64_t begin, const std::string &data) {
+	typedef std::map<uint32_t, std::vector<bool> >::iterator SIter;
+
+	uint64_t end = begin + data.size() - 1;
+	for (SIter i = m_partStatus.begin(); i != m_partStatus.end(); ++i) {
+		uint64_t cs = (*i).first;
+		for (uint64_t c = begin / cs; c <= end / cs; ++c) {
+			uint64_t last = std::min((c + 1) * cs, m_size) - 1;
+			hashArrived(Range64(c * cs, last), begin, data);
+		}
+	}
+}
+
+void PartData::hashArrived(
+	Range64 chunk, uint64_t begin, const std::string &data
+) {
+	ArrivalKey key(chunk.begin(), chunk.end());
+	uint64_t from = std::max(begin, chunk.begin());
+	uint64_t to = std::min(begin + data.size() - 1, chunk.end());
+
+	std::map<ArrivalKey, ArrivalHashPtr>::iterator i = m_arrival.find(key);
+	if (i != m_arrival.end() && (*i).second->m_next != from) {
+		m_arrival.erase(i);
+		i = m_arrival.end();
+	}
+	if (i == m_arrival.end()) {
+		if (from != chunk.begin()) {
+			return;
+		}
+		CMPosIndex::iterator it = m_chunks->find(Chunk(this, chunk, 0));
+		if (it == m_chunks->end() || !(*it).getHash()) {
+			return;
+		} else if ((*it).length() != chunk.length()) {
+			return; // found chunk of other size with same midpoint
+		}
+		ArrivalHashPtr a(new ArrivalHash((*it).getHash(), from));
+		if (!a->m_maker) {
+			return;
+		}
+		i = m_arrival.insert(std::make_pair(key, a)).first;
+	}
+	(*i).second->m_maker->sumUp(data.data() + from - begin, to - from + 1);
+	(*i).second->m_next = to + 1;
+}
+
+// Buffered data is handed over to IOThread for writing, so slow disks don't
+// stall the main loop; adjacent blocks were already merged by WriteBuffer. Since
+// IOThread performs jobs in order, hash jobs submitted after a flush always
+// see the flushed data.
+//
+// Durability is controlled by /DiskSync preference:
+// "flush"    - fsync() after each flush (default)
+// "interval" - fsync() at most once per /DiskSyncInterval seconds; data
+//              flushed without fsync() is synced when the interval expires
+// "complete" - fsync() only when the download is completed
+void PartData::flushBuffer(bool forceSync) {
 	logTrace(TRACE_PARTDATA,
 		boost::format("Flushing buffers: %s") % m_dest.leaf()
 	);
 
-	// don't attempt to alloc if we'r shutting down
-	if (m_allocJob || (m_toFlush && !Hydranode::instance().isRunning())) {
-		return;
-	} else if (m_toFlush && Utils::getFileSize(m_loc) < m_size) {
-		allocDiskSpace();
+	if (m_buffer.empty()) {
 		return;
 	}
 
-	int fd = open(m_loc.native_file_string().c_str(), O_RDWR|O_BINARY);
-	if (fd < 1) {
-		throw std::runtime_error(
-			"unable to open file " + m_loc.native_file_string()
-			+ " for writing."
+	// disk space is allocated in background, the data is written meanwhile;
+	// don't attempt to alloc if we'r shutting down
+	if (!m_allocStarted && Hydranode::instance().isRunning()) {
+		m_allocStarted = true;
+		std::string mode = Prefs::instance().read<std::string>(
+			"/Preallocate", "full"
 		);
+		if (mode != "sparse") {
+			allocDiskSpace();
+		}
 	}
 
-	for (BIter i = m_buffer.begin(); i != m_buffer.end(); ++i) try {
-		uint64_t ret = lseek64(fd, (*i).first, SEEK_SET);
-		CHECK_THROW(ret == static_cast<uint64_t>((*i).first));
-		int c = ::write(fd, (*i).second.data(), (*i).second.size());
-		CHECK_THROW(c == static_cast<int>((*i).second.size()));
-	} catch (...) {
-		close(fd);
-		throw std::runtime_error("no space left on drive");
+	FlushJobPtr job(new FlushJob(m_loc, syncNeeded(forceSync)));
+	job->getData() = m_buffer.take();
+	logTrace(TRACE_PARTDATA,
+		boost::format("Writing %d blocks.") % job->getData().size()
+	);
+
+	FlushJob::getEventTable().addHandler(job, this, &PartData::onFlushed);
+	m_flushJobs.push_back(job);
+	IOThread::instance().postWork(job);
+}
+
+bool PartData::syncNeeded(bool forceSync) {
+	std::string mode = Prefs::instance().read<std::string>(
+		"/DiskSync", "flush"
+	);
+	uint64_t now = Utils::getTick();
+	if (!forceSync && mode == "complete") {
+		return false;
+	} else if (!forceSync && mode == "interval") {
+		uint32_t interval = Prefs::instance().read<uint32_t>(
+			"/DiskSyncInterval", 30
+		);
+		if (now - m_lastSync < interval * 1000ull) {
+			m_unsynced = true;
+			if (!m_syncPending) {
+				m_syncPending = true;
+				uint64_t due = m_lastSync + interval * 1000ull;
+				Utils::timedCallback(
+					boost::bind(
+						&PartData::syncTimeout, this
+					), due - now
+				);
+			}
+			return false;
+		}
+	}
+	m_lastSync = now;
+	m_unsynced = false;
+	return true;
+}
+
+// fsync() the data flushed since last sync; the job is queued after the
+// flushes, so it runs after they have written their data
+void PartData::syncTimeout() {
+	m_syncPending = false;
+	if (!m_unsynced) {
+		return;
+	}
+	m_unsynced = false;
+	m_lastSync = Utils::getTick();
+
+	FlushJobPtr job(new FlushJob(m_loc, true));
+	FlushJob::getEventTable().addHandler(job, this, &PartData::onFlushed);
+	m_flushJobs.push_back(job);
+	IOThread::instance().postWork(job);
+}
+
+// the jobs' data isn't modified once they are queued, so it's safe to look at
+// while the I/O thread is writing it
+bool PartData::isFlushing(uint64_t begin, uint64_t end) const {
+	for (uint32_t i = 0; i < m_flushJobs.size(); ++i) {
+		FlushJob::Buffers &data = m_flushJobs[i]->getData();
+		FlushJob::Buffers::iterator j = data.upper_bound(end);
+		if (j != data.begin() && (*--j).second->end() > begin) {
+			return true;
+		}
 	}
-	fsync(fd);
-	close(fd);
+	return false;
+}
 
-	m_buffer.clear();
-	m_toFlush = 0;
+void PartData::onFlushed(FlushJobPtr job, bool ok) {
+	FlushJob::getEventTable().delHandlers(job);
+	std::deque<FlushJobPtr>::iterator it = std::find(
+		m_flushJobs.begin(), m_flushJobs.end(), job
+	);
+	if (it != m_flushJobs.end()) { // otherwise handled by finishFlushes()
+		m_flushJobs.erase(it);
+		flushDone(job, ok);
+	}
+}
+
+void PartData::flushDone(FlushJobPtr job, bool ok) {
+	if (!ok) {
+		// keep the data around, it's written during next flush
+		m_buffer.restore(job->getData());
+		job->getData().clear();
+		m_saveAfterFlush = false;
+		logError(
+			boost::format("Error saving temp file: %s")
+			% job->getError()
+		);
+		if (isRunning()) {
+			logMsg(
+				boost::format(
+					"Info: Auto-pausing file '%s' due "
+					"to the above error."
+				) % getName()
+			);
+			autoPause();
+		}
+		return;
+	}
+
+	job->getData().clear(); // written; release it from the write cache
+	ReadCache::instance().invalidate(m_loc);
 	if (m_md) {
 		m_md->setModDate(Utils::getModDate(m_loc));
 	}
 	getEventTable().postEvent(this, PD_DATA_FLUSHED);
-//	printCompleted();
+	if (m_saveAfterFlush && m_flushJobs.empty()) {
+		m_saveAfterFlush = false;
+		save();
+	}
+}
+
+// performs all pending flushes in calling thread
+void PartData::finishFlushes() {
+	// flushes are performed in this thread now, so stop allocating
+	cancelAlloc();
+	m_saveAfterFlush = false;
+	while (m_flushJobs.size()) {
+		FlushJobPtr job = m_flushJobs.front();
+		m_flushJobs.pop_front();
+		job->process();
+		FlushJob::getEventTable().delHandlers(job);
+		flushDone(job, job->getError().empty());
+	}
 }
 
 //! Sorts container of HashSetBase* objects based on chunkhashcount
@@ -1234,11 +1656,28 @@ HashWorkPtr PartData::verifyRange(
 	HashWorkPtr c(
 		new HashWork(m_loc.string(), range.begin(), range.end(), ref)
 	);
-	if (m_allocJob) {
-		m_chunkChecks.push_back(c);
-	} else {
-		IOThread::instance().postWork(c);
+
+	// chunk downloaded in order has been hashed already in doWrite()
+	std::map<ArrivalKey, ArrivalHashPtr>::iterator i = m_arrival.find(
+		ArrivalKey(range.begin(), range.end())
+	);
+	if (i != m_arrival.end()) {
+		ArrivalHashPtr a((*i).second);
+		m_arrival.erase(i);
+		if (a->m_ref == ref && a->m_next == range.end() + 1) {
+			boost::scoped_ptr<HashSetBase> hs(
+				a->m_maker->getHashSet()
+			);
+			logTrace(TRACE_PARTDATA, boost::format(
+				"%s: Chunk %d..%d hashed in memory"
+			) % m_dest.leaf() % range.begin() % range.end());
+			c->setHash(hs->getFileHash());
+			++m_pendingHashes;
+			return c;
+		}
 	}
+
+	HashPool::instance().postWork(c);
 	++m_pendingHashes;
 	return c;
 }
@@ -1255,25 +1694,72 @@ void PartData::doComplete() {
 	CHECK_THROW(isComplete());
 	CHECK_RET(!m_fullJob);
 
+	cancelAlloc();
+	flushBuffer(true);
 	save();
 	HashWorkPtr p(new HashWork(m_loc.string()));
 	HashWork::getEventTable().addHandler(p, this, &PartData::onHashEvent);
-	IOThread::instance().postWork(p);
+	HashPool::instance().postWork(p);
 	getEventTable().postEvent(this, PD_VERIFYING);
 	m_fullJob = p;
 }
 
+void PartData::save() try {
+	// flush all temporary buffers; the .dat file is written once the data
+	// is on disk, except when shutting down, where we wait for it here.
+	flushBuffer();
+	if (!Hydranode::instance().isRunning()) {
+		finishFlushes();
+	} else if (m_flushJobs.size()) {
+		m_saveAfterFlush = true;
+		return;
+	}
+
+	if (!appendJournal()) {
+		saveSnapshot();
+	}
+
+	// buffer flush and dat file save successful - check if we need to
+	// auto-resume the download
+	if (isAutoPaused()) {
+		logMsg(
+			boost::format("Info: Auto-resuming file '%s'.")
+			% getName()
+		);
+		resume();
+	}
+} catch (std::exception &e) {
+	logError(
+		boost::format("Error saving temp file: %s") % e.what()
+	);
+	if (isRunning()) {
+		logMsg(
+			boost::format(
+				"Info: Auto-pausing file '%s' due "
+				"to the above error."
+			) % getName()
+		);
+		autoPause();
+	}
+}
+MSVC_ONLY(;)
+
+// Writes the complete state to .dat file, and starts a new journal for it.
+//
 // this is a bit tricky, since we must ensure that when disk is full, we don't
 // corrupt anything, not even backup files; thus, we do all operations first on
 // temporary files ("_" suffix), and if they were written successfully, rename
 // them to the real files.
 // care must also be taken to remove all our temporary files ("_" suffix ones)
 // when throwing exceptions - we don't want to leave our mess behind
-void PartData::save() try {
+void PartData::saveSnapshot() {
 	using Utils::getFileSize;
 
-	// flush all temporary buffers; this can throw out_of_disk_space as well
-	flushBuffer();
+	// if anything below fails, journal can't be used until next snapshot
+	m_savedDigest.clear();
+	do {
+		m_journalId = Utils::getRandom();
+	} while (!m_journalId);
 
 	// write into a temporary buffer at first
 	std::ostringstream tmp;
@@ -1323,28 +1809,158 @@ void PartData::save() try {
 	boost::filesystem::remove(p);
 	boost::filesystem::rename((p.string() + "_"), p);
 
-	// buffer flush and dat file save successful - check if we need to
-	// auto-resume the download
-	if (isAutoPaused()) {
-		logMsg(
-			boost::format("Info: Auto-resuming file '%s'.")
-			% getName()
-		);
-		resume();
+	// start new journal; until this succeeds, the old journal is ignored
+	// on loading due to differing identifier
+	std::ofstream jfs(
+		(m_loc.string() + ".dat.log").c_str(),
+		std::ios::binary | std::ios::trunc
+	);
+	Utils::putVal<uint8_t>(jfs, OP_PD_JOURNAL);
+	Utils::putVal<uint32_t>(jfs, m_journalId);
+	jfs.flush();
+	if (!jfs.good()) {
+		throw std::runtime_error("no space left on drive");
 	}
-} catch (std::exception &e) {
-	logError(
-		boost::format("Error saving temp file: %s") % e.what()
+	m_journalSize = 5;
+	m_snapshotSize = tmp.str().size();
+	m_savedComplete = m_complete;
+	m_savedVerified = m_verified;
+	m_savedModDate = m_md ? m_md->getModDate() : 0;
+	m_savedUploaded = m_md ? m_md->getUploaded() : 0;
+	m_savedDigest = stateDigest();
+}
+
+// Appends the changes since last save() to the journal; returns false if the
+// .dat file needs to be rewritten instead.
+bool PartData::appendJournal() {
+	if (m_savedDigest.empty() || m_savedDigest != stateDigest()) {
+		return false;
+	}
+
+	std::ostringstream tmp;
+	uint32_t id = m_journalId;
+	putDiff(tmp, id, JR_COMPLETE, m_complete, m_savedComplete);
+	putDiff(tmp, id, JR_INCOMPLETE, m_savedComplete, m_complete);
+	putDiff(tmp, id, JR_VERIFIED, m_verified, m_savedVerified);
+	putDiff(tmp, id, JR_UNVERIFIED, m_savedVerified, m_verified);
+	if (m_md && m_md->getModDate() != m_savedModDate) {
+		putRecord(tmp, id, JR_MODDATE, m_md->getModDate(), 0);
+	}
+	if (m_md && m_md->getUploaded() != m_savedUploaded) {
+		putRecord(tmp, id, JR_UPLOADED, m_md->getUploaded(), 0);
+	}
+	if (tmp.str().empty()) {
+		return true;
+	}
+	uint64_t size = m_journalSize + tmp.str().size();
+	if (size > std::max(m_snapshotSize, JOURNAL_MIN)) {
+		return false;
+	}
+
+	std::ofstream ofs(
+		(m_loc.string() + ".dat.log").c_str(),
+		std::ios::binary | std::ios::app
 	);
-	if (isRunning()) {
-		logMsg(
-			boost::format(
-				"Info: Auto-pausing file '%s' due "
-				"to the above error."
-			) % getName()
+	Utils::putVal<std::string>(ofs, tmp.str(), tmp.str().size());
+	ofs.flush();
+	if (!ofs.good()) {
+		// partially written record would hide any records after it
+		m_savedDigest.clear();
+		throw std::runtime_error("no space left on drive");
+	}
+	m_journalSize = size;
+	m_savedComplete = m_complete;
+	m_savedVerified = m_verified;
+	m_savedModDate = m_md ? m_md->getModDate() : 0;
+	m_savedUploaded = m_md ? m_md->getUploaded() : 0;
+	return true;
+}
+
+// Digest of everything in .dat file, except what is recorded in journal
+std::string PartData::stateDigest() {
+	std::ostringstream tmp;
+	Utils::putVal<uint64_t>(tmp, m_size);
+	Utils::putVal<std::string>(tmp, m_dest.string());
+	Utils::putVal<uint8_t>(tmp, isPaused());
+	Utils::putVal<uint8_t>(tmp, isStopped());
+	if (m_md) {
+		uint32_t modDate = m_md->getModDate();
+		uint64_t uploaded = m_md->getUploaded();
+		m_md->setModDate(0);
+		m_md->setUploaded(0);
+		tmp << *m_md;
+		m_md->setModDate(modDate);
+		m_md->setUploaded(uploaded);
+	}
+	Md4Transform t;
+	t.sumUp(tmp.str().data(), tmp.str().size());
+	return t.getHash().toString();
+}
+
+// Applies journal records written after the loaded .dat file, up to the first
+// damaged one. The next save() writes a new .dat file in any case.
+void PartData::loadJournal() try {
+	std::ifstream ifs(
+		(m_loc.string() + ".dat.log").c_str(), std::ios::binary
+	);
+	if (!ifs || !m_journalId) {
+		return;
+	}
+	if (Utils::getVal<uint8_t>(ifs) != OP_PD_JOURNAL) {
+		return;
+	} else if (Utils::getVal<uint32_t>(ifs) != m_journalId) {
+		logDebug(
+			boost::format("%s: Ignoring old journal")
+			% m_loc.string()
 		);
-		autoPause();
+		return;
 	}
+
+	uint32_t cnt = 0;
+	char buf[JOURNAL_RECORD];
+	while (ifs.read(buf, JOURNAL_RECORD)) {
+		std::string rec(buf, JOURNAL_RECORD - 4);
+		std::istringstream i(std::string(buf, JOURNAL_RECORD));
+		uint8_t op = Utils::getVal<uint8_t>(i);
+		uint64_t x = Utils::getVal<uint64_t>(i);
+		uint64_t y = Utils::getVal<uint64_t>(i);
+		uint32_t check = Utils::getVal<uint32_t>(i);
+		if (check != journalCheck(m_journalId, rec)) {
+			logWarning(
+				boost::format("%s: Damaged journal record #%d")
+				% m_loc.string() % cnt
+			);
+			break;
+		} else if (op < JR_MODDATE && (x > y || y >= m_size)) {
+			break;
+		}
+		switch (op) {
+			case JR_COMPLETE:   m_complete.merge(x, y);  break;
+			case JR_INCOMPLETE: m_complete.erase(x, y);  break;
+			case JR_VERIFIED:   m_verified.merge(x, y);  break;
+			case JR_UNVERIFIED: m_verified.erase(x, y);  break;
+			case JR_MODDATE:
+				if (m_md) {
+					m_md->setModDate(x);
+				}
+				break;
+			case JR_UPLOADED:
+				if (m_md) {
+					m_md->setUploaded(x);
+				}
+				break;
+			default:
+				logWarning("Unhandled journal record.");
+				break;
+		}
+		++cnt;
+	}
+	logTrace(TRACE_PARTDATA,
+		boost::format("%s: Applied %d journal records")
+		% m_loc.string() % cnt
+	);
+} catch (Utils::ReadError &) {
+	// truncated header; nothing to apply
 }
 MSVC_ONLY(;)
 
@@ -1354,7 +1970,7 @@ std::ostream& operator<<(std::ostream &o, const PartData &p) {
 	Utils::putVal<uint8_t>(tmp, OP_PD_VER);
 	Utils::putVal<uint64_t>(tmp, p.m_size);
 
-	Utils::putVal<uint16_t>(tmp, 4); // tagcount
+	Utils::putVal<uint16_t>(tmp, 5); // tagcount
 
 	Utils::putVal<uint8_t>(tmp, OP_PD_DESTINATION);
 	Utils::putVal<uint16_t>(tmp, p.m_dest.string().size() + 2);
@@ -1370,6 +1986,10 @@ std::ostream& operator<<(std::ostream &o, const PartData &p) {
 	tmp3 << p.m_verified;
 	Utils::putVal<std::string>(tmp, tmp3.str());
 
+	Utils::putVal<uint8_t>(tmp, OP_PD_JOURNAL);
+	Utils::putVal<uint16_t>(tmp, 4);
+	Utils::putVal<uint32_t>(tmp, p.m_journalId);
+
 	Utils::putVal<uint8_t>(tmp, OP_PD_STATE);
 	Utils::putVal<uint16_t>(tmp, 1);
 	if (p.isPaused()) {
@@ -1438,7 +2058,8 @@ void PartData::printCompleted() {
 	boost::format fmt("| Complete: %s %5.2f%% Size: %s / %d bytes%|73t||");
 	fmt % buf % perc % Utils::bytesToString(getSize()) % getSize();
 	logTrace(TRACE_PARTDATA, fmt);
-	for (RangeList64::CIter i = m_complete.begin();i!=m_complete.end();++i){
+	FlatRangeList64::CIter i = m_complete.begin();
+	for (; i != m_complete.end(); ++i) {
 		boost::format fmt("| Complete range: %d -> %d %|73t||");
 		logTrace(TRACE_PARTDATA, fmt % (*i).begin() % (*i).end());
 	}
@@ -1491,6 +2112,7 @@ void PartData::cancel() {
 void PartData::deleteFiles() {
 	using namespace boost::filesystem;
 
+	cancelAlloc();
 	if (!m_loc.empty()) {
 		if (exists(m_loc)) try {
 			remove(m_loc);
@@ -1520,6 +2142,16 @@ void PartData::deleteFiles() {
 				% tmp.native_file_string() % e.what()
 			);
 		}
+
+		tmp = path(m_loc.string() + ".dat.log", native);
+		if (exists(tmp)) try {
+			remove(tmp);
+		} catch (std::exception &e) {
+			logDebug(
+				boost::format("Deleting file %s: %s") 
+				% tmp.native_file_string() % e.what()
+			);
+		}
 	}
 }
 
@@ -1582,10 +2214,22 @@ void PartData::resume() {
 	}
 }
 
-void PartData::allocDone(AllocJobPtr job, bool evt) {
-	assert(m_allocJob);
-	assert(job == m_allocJob);
-	if (!evt) {
+// Progress events are only traced; since data is written during allocation,
+// failure only pauses the download, instead of losing the buffered data.
+void PartData::allocDone(AllocJobPtr job, AllocEvent evt) {
+	if (job != m_allocJob) {
+		return; // canceled
+	} else if (evt == ALLOC_PROGRESS) {
+		logTrace(TRACE_PARTDATA,
+			boost::format("%s: Allocated %s of %s")
+			% getName() % Utils::bytesToString(job->getProgress())
+			% Utils::bytesToString(m_size)
+		);
+		return;
+	}
+	AllocJob::getEventTable().delHandlers(job);
+	m_allocJob = AllocJobPtr();
+	if (evt == ALLOC_FAILED) {
 		logError(
 			boost::format(
 				"Allocating %s space for file %s failed "
@@ -1599,18 +2243,21 @@ void PartData::allocDone(AllocJobPtr job, bool evt) {
 		// resume it now
 		resume();
 	}
-	m_allocJob = AllocJobPtr();
-	if (evt) {
-		// flush buffers after finishing allocation
-		save();
-		for (uint32_t i = 0; i < m_chunkChecks.size(); ++i) {
-			IOThread::instance().postWork(m_chunkChecks[i]);
-		}
-		m_chunkChecks.clear();
-		onAllocDone(this);
+	onAllocDone(this);
+}
+
+void PartData::cancelAlloc() {
+	if (m_allocJob) {
+		m_allocJob->cancel();
+		AllocJob::getEventTable().delHandlers(m_allocJob);
+		m_allocJob = AllocJobPtr();
 	}
 }
 
+uint64_t PartData::getAllocProgress() const {
+	return m_allocJob ? m_allocJob->getProgress() : 0;
+}
+
 void PartData::dontDownload(Range64 range) {
 	m_dontDownload.merge(range);
 }
@@ -1637,12 +2284,7 @@ void PartData::setDestination(const boost::filesystem::path &p) {
 }
 
 uint32_t PartData::amountBuffered() const {
-	typedef std::map<uint64_t, std::string>::const_iterator CBIter;
-	uint32_t ret = 0;
-	for (CBIter i = m_buffer.begin(); i != m_buffer.end(); ++i) {
-		ret += (*i).second.size();
-	}
-	return ret;
+	return m_buffer.size();
 }
 
 void PartData::cleanupName() {
@@ -1663,7 +2305,7 @@ void PartData::cleanupName() {
 }
 
 void PartData::allocDiskSpace() {
-	if (Utils::getFileSize(m_loc) == m_size) {
+	if (m_allocJob || Utils::getFileSize(m_loc) == m_size) {
 		return;
 	}
 	logMsg(
@@ -1674,5 +2316,5 @@ void PartData::allocDiskSpace() {
 	AllocJob::getEventTable().addHandler(
 		m_allocJob, this, &PartData::allocDone
 	);
-	IOThread::instance().postWork(m_allocJob);
+	m_allocJob->start();
 }
@@ -29,6 +29,7 @@
 #include <hnbase/object.h>
 
 #include <hncore/fwd.h>
+#include <hncore/writecache.h>
 
 #include <boost/filesystem/path.hpp>
 #include <boost/shared_ptr.hpp>
@@ -37,6 +38,7 @@
 
 #include <map>
 #include <list>
+#include <deque>
 
 /**
  * Events emitted from PartData object
@@ -67,7 +69,8 @@ namespace CGComm {
 		OP_PD_COMPLETED   = 0x93,  //!< RangeList64 completed ranges
 		OP_PD_HASHSET     = 0x94,  //!< RangeList<HashBase*> hashset
 		OP_PD_STATE       = 0x95,  //!< Download state
-		OP_PD_VERIFIED    = 0x96   //!< RangeList64 verified ranges
+		OP_PD_VERIFIED    = 0x96,  //!< RangeList64 verified ranges
+		OP_PD_JOURNAL     = 0x97   //!< uint32 Journal identifier
 	};
 	//! State of a download
 	enum DownloadState {
@@ -83,6 +86,16 @@ namespace Detail {
 	class Chunk;
 	class AllocJob;
 	typedef boost::intrusive_ptr<AllocJob> AllocJobPtr;
+	//! Events emitted by AllocJob
+	enum AllocEvent {
+		ALLOC_PROGRESS,   //!< Part of the space has been allocated
+		ALLOC_DONE,       //!< All of the space has been allocated
+		ALLOC_FAILED      //!< Allocation failed, e.g. out of disk space
+	};
+	class FlushJob;
+	typedef boost::intrusive_ptr<FlushJob> FlushJobPtr;
+	struct ArrivalHash;
+	typedef boost::shared_ptr<ArrivalHash> ArrivalHashPtr;
 }
 
 /**
@@ -123,9 +136,9 @@ private:
 	 * @param dest      Destination where to write the complete file
 	 *
 	 * \note The disk space indicated by @param size is not allocated on
-	 *       actual disk right away. Instead, the size is allocated
-	 *       dynamically as the file grows. This can be changed from global
-	 *       application preferences though.
+	 *       actual disk right away. Instead, it is allocated in background
+	 *       during the first buffer flush, unless /Preallocate preference
+	 *       is "sparse", in which case the file grows as data is written.
 	 */
 	PartData(
 		uint64_t size,
@@ -274,14 +287,25 @@ public:
 		CHECK_THROW(m_partStatus.find(chunkSize) != m_partStatus.end());
 		return (*m_partStatus.find(chunkSize)).second;
 	}
-	RangeList64 getCompletedRanges() const { return m_complete; }
-	RangeList64 getVerifiedRanges()  const { return m_verified; }
+	FlatRangeList64 getCompletedRanges() const { return m_complete; }
+	FlatRangeList64 getVerifiedRanges()  const { return m_verified; }
 	bool allocInProgress() const { return m_allocJob; }
+	uint64_t getAllocProgress() const;
+	bool isFlushing()      const { return m_flushJobs.size(); }
+	//! \returns Whether data in begin..end is being written to disk
+	bool isFlushing(uint64_t begin, uint64_t end) const;
 	Detail::ChunkMap& getChunks() const { return *m_chunks; }
 	//!@}
 
 	/**
-	 * Saves the current state of this file to m_loc.dat file.
+	 * Saves the current state of this file to m_loc.dat file. Buffered
+	 * data is written to disk asynchronously, and the .dat file is
+	 * written once all the data has reached the disk.
+	 *
+	 * When only the completed and verified ranges have changed since the
+	 * .dat file was written, the changes are appended to m_loc.dat.log
+	 * journal instead; the journal is merged into the .dat file once it
+	 * grows larger than the .dat file itself.
 	 */
 	virtual void save();
 
@@ -546,7 +570,7 @@ public:
 	 *
 	 * @returns true if there is anything buffered.
 	 */
-	bool hasBuffered() const { return m_buffer.size(); }
+	bool hasBuffered() const { return !m_buffer.empty(); }
 
 	/**
 	 * @returns Amount of data currently in this file's buffers
@@ -557,8 +581,14 @@ public:
 	 * Allocates all neccesery disk space for this file. If the file already
 	 * has all it's space allocated, this function doesn't do anything.
 	 *
+	 * Space is reserved with fallocate() where the filesystem supports it,
+	 * and by extending the file with zeros otherwise. The allocation runs
+	 * in the background, and data is written to the file meanwhile;
+	 * progress is reported by getAllocProgress(), and onAllocDone is
+	 * emitted when it finishes.
+	 *
 	 * Note that PartData automatically allocates disk space for itself during
-	 * first buffer flush.
+	 * first buffer flush, unless /Preallocate preference is "sparse".
 	 */
 	virtual void allocDiskSpace();
 
@@ -668,11 +698,11 @@ private:
 	 * overlapping ranges.
 	 */
 	//! @{
-	RangeList64 m_complete;     //!< Complete ranges
-	RangeList64 m_locked;       //!< Locked ranges
-	RangeList64 m_corrupt;      //!< Corrupt ranges
-	RangeList64 m_verified;     //!< Verified ranges
-	RangeList64 m_dontDownload; //!< Ranges that should never be downloaded
+	FlatRangeList64 m_complete;     //!< Complete ranges
+	FlatRangeList64 m_locked;       //!< Locked ranges
+	FlatRangeList64 m_corrupt;      //!< Corrupt ranges
+	FlatRangeList64 m_verified;     //!< Verified ranges
+	FlatRangeList64 m_dontDownload; //!< Ranges never to be downloaded
 	//! @}
 
 	/**
@@ -684,12 +714,24 @@ private:
 	Detail::UsedRangePtr getNextChunk(uint64_t size, Predicate &pred);
 	template<typename Predicate>
 	Detail::UsedRangePtr doGetRange(uint64_t size, Predicate &pred);
-	void flushBuffer();
+	void flushBuffer(bool forceSync = false);
+	bool syncNeeded(bool forceSync);
+	void syncTimeout();
+	void onFlushed(Detail::FlushJobPtr job, bool ok);
+	void flushDone(Detail::FlushJobPtr job, bool ok);
+	void finishFlushes();
 	boost::logic::tribool verifyHashSet(const HashSetBase *hs);
 	void deleteFiles(); // delete physical files refering to this temp file
+	std::string stateDigest();
+	bool appendJournal();
+	void saveSnapshot();
+	void loadJournal();
 	void onMetaDataEvent(MetaData *src, int evt);
-	void allocDone(Detail::AllocJobPtr job, bool evt);
+	void allocDone(Detail::AllocJobPtr job, Detail::AllocEvent evt);
+	void cancelAlloc();
 	void updateChunks(Range64 range);
+	void hashArrived(uint64_t begin, const std::string &data);
+	void hashArrived(Range64 chunk, uint64_t begin, const std::string &d);
 	void cleanupName();
 
 	/**
@@ -705,9 +747,8 @@ private:
 	 */
 	//!@{
 	boost::scoped_ptr<Detail::ChunkMap> m_chunks;
-	std::map<uint64_t, std::string> m_buffer;
-	typedef std::map<uint64_t, std::string>::iterator BIter;
-	uint32_t m_toFlush;
+	//! Data not yet written to disk
+	WriteBuffer m_buffer;
 	MetaData *m_md;
 	uint16_t m_pendingHashes;
 	//! Pointer to full rehash job (if any) in progress, used for canceling
@@ -721,10 +762,33 @@ private:
 	std::map<uint32_t, std::vector<bool> > m_partStatus;
 	//! Paused/stopped status
 	bool m_paused, m_stopped, m_autoPaused;
-	//! When file allocation is in progress, new completed chunk hash
-	//! jobs are buffered here, and submitted to Hasher after allocation
-	//! succeeds.
-	std::vector<HashWorkPtr> m_chunkChecks;
+	//! Disk space allocation has been started during this session
+	bool m_allocStarted;
+	//! Checksums of chunks being downloaded in order, keyed by chunk
+	//! begin and end offsets; see hashArrived()
+	typedef std::pair<uint64_t, uint64_t> ArrivalKey;
+	std::map<ArrivalKey, Detail::ArrivalHashPtr> m_arrival;
+	//! Buffer flushes submitted to IOThread, in submission order
+	std::deque<Detail::FlushJobPtr> m_flushJobs;
+	//! Write the .dat file once all flushes have completed
+	bool m_saveAfterFlush;
+	//! Time of last flush which was fsync()'ed
+	uint64_t m_lastSync;
+	//! Data has been flushed without fsync() since m_lastSync
+	bool m_unsynced;
+	//! syncTimeout() has been scheduled
+	bool m_syncPending;
+	//! Identifies the journal belonging to the current .dat file
+	uint32_t m_journalId;
+	//! Size of journal file, and of .dat file
+	uint64_t m_journalSize, m_snapshotSize;
+	//! Digest of state other than ranges, when .dat file was written;
+	//! empty when the journal can't be used
+	std::string m_savedDigest;
+	//! State as of last save(), in .dat file and journal
+	FlatRangeList64 m_savedComplete, m_savedVerified;
+	uint32_t m_savedModDate;
+	uint64_t m_savedUploaded;
 	//!}
 public:
 	//! For testing purposes only
@@ -0,0 +1,280 @@
+/*
+ *  Copyright (C) 2004-2006 Alo Sarv <madcat_@users.sourceforge.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/**
+ * \file readcache.cpp Implementation of ReadCache class
+ */
+
+#include <hncore/pch.h>
+#include <hncore/readcache.h>
+#include <hnbase/prefs.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdexcept>
+
+ReadCache::ReadCache() : m_size(), m_fdCount(), m_hits(), m_misses(),
+m_fdHits(), m_fdMisses() {}
+
+ReadCache::~ReadCache() {
+	for (Files::iterator i = m_files.begin(); i != m_files.end(); ++i) {
+		closeFd(*(*i).second);
+	}
+}
+
+ReadCache& ReadCache::instance() {
+	static ReadCache rc;
+	return rc;
+}
+
+ReadCache::File& ReadCache::getFile(const boost::filesystem::path &file) {
+	boost::shared_ptr<File> &f = m_files[file.string()];
+	if (!f) {
+		f.reset(new File);
+		f->m_path = file.string();
+	}
+	return *f;
+}
+
+bool ReadCache::find(
+	const boost::filesystem::path &file, uint64_t begin, uint64_t end,
+	std::string *data
+) {
+	CHECK_THROW(begin <= end);
+	Files::iterator it = m_files.find(file.string());
+	if (it == m_files.end()) {
+		return false;
+	}
+	File &f = *(*it).second;
+	uint64_t first = begin / BLOCK_SIZE;
+	uint64_t last = end / BLOCK_SIZE;
+
+	// blocks may be shorter than BLOCK_SIZE (near end of file or limit)
+	std::map<uint64_t, Block>::iterator i = f.m_blocks.find(first);
+	for (uint64_t idx = first; idx <= last; ++idx, ++i) {
+		if (i == f.m_blocks.end() || (*i).first != idx) {
+			return false;
+		}
+		uint64_t need = std::min(end + 1, (idx + 1) * BLOCK_SIZE);
+		if (idx * BLOCK_SIZE + (*i).second.m_data.size() < need) {
+			return false;
+		}
+	}
+
+	data->clear();
+	data->reserve(end - begin + 1);
+	i = f.m_blocks.find(first);
+	for (uint64_t idx = first; idx <= last; ++idx, ++i) {
+		Block &b = (*i).second;
+		uint64_t from = std::max(begin, idx * BLOCK_SIZE);
+		uint64_t to = std::min(end + 1, (idx + 1) * BLOCK_SIZE);
+		data->append(b.m_data, from - idx * BLOCK_SIZE, to - from);
+		touch(b);
+	}
+	m_hits += last - first + 1;
+	f.m_next = end + 1;
+	return true;
+}
+
+// Blocks already in cache are used as-is, but only if they are long enough,
+// since blocks loaded with a lower limit may be truncated. If the read
+// continues where the last one ended, up to READAHEAD blocks past the end are
+// loaded as well, up to the limit.
+std::string ReadCache::read(
+	const boost::filesystem::path &file, uint64_t begin, uint64_t end,
+	uint64_t limit
+) {
+	CHECK_THROW(begin <= end && end <= limit);
+	File &f = getFile(file);
+	uint64_t first = begin / BLOCK_SIZE;
+	uint64_t last = end / BLOCK_SIZE;
+	uint64_t raLast = last;
+	if (f.m_next && f.m_next == begin) {
+		raLast = std::min<uint64_t>(
+			last + READAHEAD, limit / BLOCK_SIZE
+		);
+	}
+
+	std::string ret;
+	ret.reserve(end - begin + 1);
+	for (uint64_t idx = first; idx <= raLast; ++idx) try {
+		uint64_t from = std::max(begin, idx * BLOCK_SIZE);
+		uint64_t to = std::min(end + 1, (idx + 1) * BLOCK_SIZE);
+		std::map<uint64_t, Block>::iterator i = f.m_blocks.find(idx);
+		Block *b = 0;
+		if (i != f.m_blocks.end()) {
+			b = &(*i).second;
+			if (idx * BLOCK_SIZE + b->m_data.size() < to) {
+				b = 0;
+			}
+		}
+		if (b) {
+			touch(*b);
+			if (idx <= last) {
+				++m_hits;
+			}
+		} else if (idx <= last) {
+			b = &load(f, idx, limit);
+			++m_misses;
+		} else {
+			// readahead; don't replace what we already have
+			if (i == f.m_blocks.end()) {
+				load(f, idx, limit);
+			}
+			continue;
+		}
+		if (idx > last) {
+			continue;
+		} else if (idx * BLOCK_SIZE + b->m_data.size() < to) {
+			throw std::runtime_error("Short read from " + f.m_path);
+		}
+		ret.append(b->m_data, from - idx * BLOCK_SIZE, to - from);
+	} catch (...) {
+		cleanup(f);
+		throw;
+	}
+	f.m_next = end + 1;
+	shrink();
+	return ret;
+}
+
+ReadCache::Block& ReadCache::load(File &f, uint64_t idx, uint64_t limit) {
+	int fd = getFd(f);
+	if (fd == -1) {
+		throw std::runtime_error("Unable to open " + f.m_path);
+	}
+	uint64_t pos = idx * BLOCK_SIZE;
+	uint32_t len = std::min<uint64_t>(BLOCK_SIZE, limit + 1 - pos);
+	std::string data(len, '\0');
+	uint32_t done = 0;
+	while (done < len) {
+#ifdef WIN32
+		if (lseek64(fd, pos + done, SEEK_SET) != pos + done) {
+			throw std::runtime_error("Seek failed in " + f.m_path);
+		}
+		int c = ::read(fd, &data[done], len - done);
+#else
+		ssize_t c = ::pread64(fd, &data[done], len - done, pos + done);
+		if (c == -1 && errno == EINTR) {
+			continue;
+		}
+#endif
+		if (c == -1) {
+			throw std::runtime_error("Error reading " + f.m_path);
+		} else if (c == 0) {
+			break; // end of file
+		}
+		done += c;
+	}
+	data.resize(done);
+
+	std::pair<std::map<uint64_t, Block>::iterator, bool> ret;
+	ret = f.m_blocks.insert(std::make_pair(idx, Block()));
+	Block &b = (*ret.first).second;
+	if (!ret.second) {
+		m_size -= b.m_data.size();
+		m_blockLru.erase(b.m_lru);
+	}
+	b.m_data.swap(data);
+	b.m_lru = m_blockLru.insert(m_blockLru.end(), BlockKey(&f, idx));
+	m_size += b.m_data.size();
+	return b;
+}
+
+void ReadCache::touch(Block &b) {
+	m_blockLru.splice(m_blockLru.end(), m_blockLru, b.m_lru);
+}
+
+int ReadCache::getDescriptor(const boost::filesystem::path &file) {
+	File &f = getFile(file);
+	int fd = getFd(f);
+	if (fd == -1) {
+		cleanup(f);
+	}
+	return fd;
+}
+
+int ReadCache::getFd(File &f) {
+	if (f.m_fd != -1) {
+		++m_fdHits;
+		m_fdLru.splice(m_fdLru.end(), m_fdLru, f.m_fdLru);
+		return f.m_fd;
+	}
+	f.m_fd = open(f.m_path.c_str(), O_RDONLY|O_LARGEFILE|O_BINARY);
+	if (f.m_fd == -1) {
+		return -1;
+	}
+	++m_fdMisses;
+	++m_fdCount;
+	f.m_fdLru = m_fdLru.insert(m_fdLru.end(), &f);
+
+	uint32_t maxFds = Prefs::instance().read<uint32_t>(
+		"/ReadCacheFiles", 32
+	);
+	while (m_fdCount > maxFds && m_fdLru.front() != &f) {
+		File *old = m_fdLru.front();
+		closeFd(*old);
+		cleanup(*old);
+	}
+	return f.m_fd;
+}
+
+void ReadCache::closeFd(File &f) {
+	if (f.m_fd != -1) {
+		close(f.m_fd);
+		f.m_fd = -1;
+		m_fdLru.erase(f.m_fdLru);
+		--m_fdCount;
+	}
+}
+
+void ReadCache::shrink() {
+	uint64_t budget = Prefs::instance().read<uint64_t>(
+		"/ReadCacheSize", 8 * 1024 * 1024
+	);
+	while (m_size > budget && m_blockLru.size()) {
+		File *f = m_blockLru.front().first;
+		std::map<uint64_t, Block>::iterator i;
+		i = f->m_blocks.find(m_blockLru.front().second);
+		m_size -= (*i).second.m_data.size();
+		f->m_blocks.erase(i);
+		m_blockLru.pop_front();
+		cleanup(*f);
+	}
+}
+
+void ReadCache::cleanup(File &f) {
+	if (f.m_fd == -1 && f.m_blocks.empty()) {
+		std::string path(f.m_path); // f is destroyed by erase()
+		m_files.erase(path);
+	}
+}
+
+void ReadCache::invalidate(const boost::filesystem::path &file) {
+	Files::iterator it = m_files.find(file.string());
+	if (it == m_files.end()) {
+		return;
+	}
+	File &f = *(*it).second;
+	closeFd(f);
+	std::map<uint64_t, Block>::iterator i = f.m_blocks.begin();
+	for (; i != f.m_blocks.end(); ++i) {
+		m_size -= (*i).second.m_data.size();
+		m_blockLru.erase((*i).second.m_lru);
+	}
+	m_files.erase(it);
+}
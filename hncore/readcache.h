@@ -0,0 +1,168 @@
+/*
+ *  Copyright (C) 2004-2006 Alo Sarv <madcat_@users.sourceforge.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/**
+ * \file readcache.h Interface for ReadCache class
+ */
+
+#ifndef __READCACHE_H__
+#define __READCACHE_H__
+
+#include <hnbase/osdep.h>
+#include <boost/filesystem/path.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <list>
+#include <map>
+#include <string>
+
+/**
+ * ReadCache speeds up reading shared files for uploading. It keeps a pool of
+ * open file descriptors (/ReadCacheFiles preference, default 32), so serving
+ * a file doesn't need an open() per request, and a cache of recently read
+ * file blocks (/ReadCacheSize preference in bytes, default 8MB), so popular
+ * data which is requested by many clients is read from disk only once. Both
+ * are managed in least-recently-used order.
+ *
+ * When a file is read sequentially, (e.g. an upload stream), the blocks
+ * following the requested range are read ahead, so the next request is
+ * served from memory.
+ *
+ * The cache doesn't check whether the files are modified - the owner must
+ * call invalidate() when a file is changed, moved or removed.
+ */
+class HNCORE_EXPORT ReadCache : public boost::noncopyable {
+public:
+	enum Constants {
+		BLOCK_SIZE = 64 * 1024,   //!< Size of cached blocks
+		READAHEAD  = 8            //!< Max blocks read ahead
+	};
+
+	static ReadCache& instance();
+
+	/**
+	 * Check whether a range of file is entirely in the cache.
+	 *
+	 * @param file      File to read
+	 * @param begin     Begin offset
+	 * @param end       End offset, inclusive
+	 * @param data      Receives the data if found
+	 * @return          True if the data was found
+	 */
+	bool find(
+		const boost::filesystem::path &file, uint64_t begin,
+		uint64_t end, std::string *data
+	);
+
+	/**
+	 * Read a range of file, filling the cache with the blocks read.
+	 *
+	 * @param file      File to read
+	 * @param begin     Begin offset
+	 * @param end       End offset, inclusive
+	 * @param limit     Last offset which may be read ahead; the data past
+	 *                  end up to limit must be valid for caching
+	 * @return          The data
+	 * @throws std::runtime_error if the data couldn't be read
+	 */
+	std::string read(
+		const boost::filesystem::path &file, uint64_t begin,
+		uint64_t end, uint64_t limit
+	);
+
+	/**
+	 * Get an open descriptor for file from the pool, opening it if needed.
+	 * The descriptor is owned by the pool, and stays valid until the next
+	 * call to any of the ReadCache methods.
+	 *
+	 * @param file      File to open
+	 * @return          Read-only descriptor, or -1 on failure
+	 */
+	int getDescriptor(const boost::filesystem::path &file);
+
+	//! Drop cached blocks and descriptor of file
+	void invalidate(const boost::filesystem::path &file);
+
+	/**
+	 * \name Statistics
+	 */
+	//!@{
+	uint64_t getHits() const { return m_hits; }
+	uint64_t getMisses() const { return m_misses; }
+	uint64_t getFdHits() const { return m_fdHits; }
+	uint64_t getFdMisses() const { return m_fdMisses; }
+	uint64_t getSize() const { return m_size; }
+	uint32_t getFdCount() const { return m_fdCount; }
+	//! \returns Percentage of blocks found in cache
+	uint32_t getHitRate() const {
+		uint64_t total = m_hits + m_misses;
+		return total ? m_hits * 100 / total : 0;
+	}
+	//!@}
+private:
+	ReadCache();
+	~ReadCache();
+
+	struct File;
+	typedef std::map<std::string, boost::shared_ptr<File> > Files;
+	typedef std::pair<File*, uint64_t> BlockKey;
+	typedef std::list<BlockKey> BlockList;
+	typedef std::list<File*> FileList;
+
+	//! Cached block
+	struct Block {
+		std::string m_data;
+		BlockList::iterator m_lru;
+	};
+	//! Per-file state
+	struct File {
+		File() : m_fd(-1), m_next() {}
+		std::string m_path;
+		int m_fd;                          //!< -1 if not open
+		FileList::iterator m_fdLru;        //!< Valid if m_fd != -1
+		std::map<uint64_t, Block> m_blocks;//!< Keyed by block number
+		uint64_t m_next;                   //!< Where last read ended
+	};
+
+	//! \returns State for file, creating it if needed
+	File& getFile(const boost::filesystem::path &file);
+	//! Open descriptor for file, if not open yet; -1 on failure
+	int getFd(File &f);
+	//! Read block of file from disk into cache, up to limit offset
+	Block& load(File &f, uint64_t idx, uint64_t limit);
+	//! Mark block as recently used
+	void touch(Block &b);
+	//! Close descriptor of file
+	void closeFd(File &f);
+	//! Drop least recently used blocks to keep within budget
+	void shrink();
+	//! Drop file state if nothing is cached for it
+	void cleanup(File &f);
+
+	Files     m_files;      //!< Known files
+	BlockList m_blockLru;   //!< Blocks, least recently used first
+	FileList  m_fdLru;      //!< Open files, least recently used first
+	uint64_t  m_size;       //!< Bytes in cached blocks
+	uint32_t  m_fdCount;    //!< Open descriptors
+	uint64_t  m_hits;       //!< Blocks found in cache
+	uint64_t  m_misses;     //!< Blocks read from disk
+	uint64_t  m_fdHits;     //!< Descriptors found in pool
+	uint64_t  m_fdMisses;   //!< Descriptors opened
+};
+
+#endif
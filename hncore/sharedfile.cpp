@@ -26,7 +26,9 @@
 #include <hncore/partdata.h>
 #include <hncore/metadata.h>
 #include <hncore/metadb.h>
+#include <hncore/hashpool.h>
 #include <hncore/fileslist.h>             // Needed for Object() constructor
+#include <hncore/readcache.h>
 #include <boost/filesystem/operations.hpp>
 #include <boost/filesystem/exception.hpp>
 #include <fcntl.h>
@@ -320,6 +322,7 @@ void SharedFile::onPartEvent(PartData *pd, int evt) {
 void SharedFile::finishDownload() {
 	CHECK_RET(m_partData);
 
+	ReadCache::instance().invalidate(m_partData->getLocation());
 	m_moveWork = MoveWorkPtr(
 		new MoveWork(
 			m_partData->getLocation(), m_partData->getDestination()
@@ -397,6 +400,7 @@ void SharedFile::setPartData(PartData *pd) {
 // event table, but since we are also heading for destruction, that would be
 // really bad karma ...
 void SharedFile::destroy() {
+	ReadCache::instance().invalidate(m_location);
 	getEventTable().postEvent(this, SF_DESTROY);
 	if (m_partData) {
 		m_pdSigHandler.disconnect();
@@ -429,7 +433,7 @@ void SharedFile::verify() {
 
 		// Keep a weak reference to the job in case we want to abort it
 		m_pendingJob = hw;
-		IOThread::instance().postWork(hw);
+		HashPool::instance().postWork(hw);
 	} else if (m_metaData) {
 		CHECK_THROW(m_metaData->getSize() == getSize());
 
@@ -534,31 +538,44 @@ bool SharedFile::isDuplicate() {
 // recurse into this function again, until we either run out of alternative
 // locations, or find a location where the file has correct modification date
 // and is readable.
-std::string SharedFile::read(uint64_t begin, uint64_t end) {
+//
+// Data is read through ReadCache. Data found in the cache was checked against
+// the modification date when it was read from disk (and the cache is
+// invalidated whenever we change the file), so it is sent out as-is.
+void SharedFile::checkReadable(uint64_t begin, uint64_t end) {
 	if (m_moveWork) {
 		throw ReadError(
 			"Moving in progress; try again later", ETRY_AGAIN_LATER
 		);
 	}
 
+	// data being written may be only partially on disk yet
+	if (m_partData && m_partData->isFlushing(begin, end)) {
+		throw ReadError(
+			"Flushing in progress; try again later",
+			ETRY_AGAIN_LATER
+		);
+	}
+
 	if (m_partData && !m_partData->isComplete(begin, end)) {
 		boost::format fmt("%s: Requested incomplete range %d..%d");
 		fmt % getName() % begin % end;
 		throw ReadError(fmt.str(), EINVALID_RANGE);
 	}
+}
+
+int SharedFile::openVerified() {
+	ReadCache &cache = ReadCache::instance();
 
 	// first try to open, 'cos if the file doesn't exist, there's no point
 	// in the below modification date checks either
-	int fd = open(
-		getPath().native_file_string().c_str(),
-		O_RDONLY|O_LARGEFILE|O_BINARY
-	);
+	int fd = cache.getDescriptor(getPath());
 
 	if (fd == -1) {
 		if (m_locations.size()) {
 			setLocation(m_locations.back().second);
 			m_locations.pop_back();
-			return read(begin, end);
+			return openVerified();
 		}
 		boost::format fmt(
 			"Unable to open shared file %s%s (reason: %s)"
@@ -580,8 +597,9 @@ std::string SharedFile::read(uint64_t begin, uint64_t end) {
 
 	// check if modification date matches what we have on record
 	// if not, and we'r partial file, just rehash completed parts;
-	// otherwise, drop current metadata and rehash the file
-	if (m_metaData) try {
+	// otherwise, drop current metadata and rehash the file. While our own
+	// flushes are in progress, the date is updated once they finish.
+	if (m_metaData && !(m_partData && m_partData->isFlushing())) {
 		uint32_t actual = Utils::getModDate(m_location);
 		uint32_t stored = m_metaData->getModDate();
 
@@ -597,6 +615,7 @@ std::string SharedFile::read(uint64_t begin, uint64_t end) {
 				"modification date %d != %d"
 			);
 			fmt % getName() % actual % stored;
+			cache.invalidate(getPath());
 			if (isPartial()) {
 				m_partData->rehashCompleted();
 			} else {
@@ -606,29 +625,53 @@ std::string SharedFile::read(uint64_t begin, uint64_t end) {
 			}
 			throw ReadError(fmt.str(), ETRY_AGAIN_LATER);
 		}
-	} catch (...) {
-		close(fd);
-		throw;
+	}
+	return fd;
+}
+
+std::string SharedFile::read(uint64_t begin, uint64_t end) {
+	checkReadable(begin, end);
+
+	ReadCache &cache = ReadCache::instance();
+	std::string ret;
+	if (cache.find(getPath(), begin, end, &ret)) {
+		return ret;
 	}
 
-	boost::scoped_array<char> buf(new char[end - begin + 1]);
+	openVerified();
 
+	// partial files may have incomplete data after the requested range,
+	// so read ahead only in complete files
+	uint64_t limit = end;
+	if (!m_partData && getSize() > end) {
+		limit = getSize() - 1;
+	}
 	try {
-		uint64_t ret = lseek64(fd, begin, SEEK_SET);
-		CHECK_THROW(ret == begin);
-		int check = ::read(fd, buf.get(), end - begin + 1);
-		CHECK_THROW(check == static_cast<int>(end - begin + 1));
+		ret = cache.read(getPath(), begin, end, limit);
 	} catch (std::exception &e) {
-		close(fd);
 		throw ReadError(e.what(), E_OTHER);
 	}
-	close(fd);
-
-	std::string ret(buf.get(), end - begin + 1);
 
 	return ret;
 }
 
+// The descriptor from ReadCache pool is duplicated, since the pool may close
+// its own while the data is still queued for sending.
+FileHandlePtr SharedFile::openRegion(uint64_t begin, uint64_t end) {
+	checkReadable(begin, end);
+	if (end >= getSize()) {
+		boost::format fmt("%s: Requested range %d..%d past the end");
+		fmt % getName() % begin % end;
+		throw ReadError(fmt.str(), EINVALID_RANGE);
+	}
+
+	int fd = dup(openVerified());
+	if (fd == -1) {
+		throw ReadError("Unable to duplicate file descriptor", E_OTHER);
+	}
+	return FileHandlePtr(new FileHandle(fd));
+}
+
 std::string SharedFile::getName() const {
 	if (m_partData) {
 		return m_partData->getDestination().leaf();
@@ -662,6 +705,7 @@ void SharedFile::addLocation(const boost::filesystem::path &loc) {
 }
 
 void SharedFile::setLocation(const boost::filesystem::path &loc) {
+	ReadCache::instance().invalidate(m_location);
 	m_location = loc;
 	if (m_metaData) {
 		m_metaData->setModDate(Utils::getModDate(loc));
@@ -23,6 +23,7 @@
 #ifndef __SHAREDFILE_H__
 #define __SHAREDFILE_H__
 
+#include <hnbase/bufferchain.h>
 #include <hnbase/event.h>
 #include <hnbase/object.h>
 
@@ -137,6 +138,19 @@ public:
 	 */
 	virtual std::string read(uint64_t begin, uint64_t end);
 
+	/**
+	 * Open the file for sending a range of it directly from disk (see
+	 * SSocket::writeFile()). Performs the same checks as read(), but
+	 * doesn't read any data.
+	 *
+	 * @param begin   Begin offset of the range
+	 * @param end     End offset of the range (included)
+	 * @return        Open file, which stays valid while referenced
+	 *
+	 * \throws ReadError on failure
+	 */
+	FileHandlePtr openRegion(uint64_t begin, uint64_t end);
+
 	/**
 	 * @returns The current upload speed of this file.
 	 *
@@ -234,6 +248,22 @@ private:
 	 */
 	void addLocation(const boost::filesystem::path &loc);
 
+	/**
+	 * Check whether a range may be read at this time.
+	 *
+	 * \throws ReadError if not
+	 */
+	void checkReadable(uint64_t begin, uint64_t end);
+
+	/**
+	 * Open the file through ReadCache, falling back to alternative
+	 * locations, and verify its modification date.
+	 *
+	 * @return        Descriptor owned by ReadCache
+	 * \throws ReadError on failure
+	 */
+	int openVerified();
+
 	MetaData   *m_metaData;     //!< May be null
 	PartData   *m_partData;     //!< May be null
 	HashWorkPtr m_pendingJob;   //!< Pending job (if any)
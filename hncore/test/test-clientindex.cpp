@@ -0,0 +1,309 @@
+/*
+ *  Copyright (C) 2004-2006 Alo Sarv <madcat_@users.sourceforge.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/**
+ * \file test-clientindex.cpp Benchmark for ed2k ClientList indexes
+ *
+ * Simulates the client churn of a busy ed2k node: 100k clients are kept in
+ * the list, while clients are looked up by ID and TCP port (incoming
+ * connections, callbacks, sources from servers and source exchange) and by
+ * ID and UDP port (UDP reasks), have their ports and userhash set (Hello),
+ * and are destroyed and replaced by new ones.
+ *
+ * This is run with the ordered indexes ClientList used to have (lookup by ID,
+ * then scanning the clients with that ID for the port), and with the hashed
+ * indexes it has now. Finally, sources are offered to the list, half of them
+ * known dead, with and without the dead source filter.
+ *
+ * The key extractors and the dead source filter are the ones ClientList uses
+ * (see clientindex.h); the filter's expiry and burst cutoff are checked first.
+ */
+
+#ifndef DOXYGEN_SHOULD_SKIP_THIS
+
+#include <hncore/ed2k/clientindex.h>
+#include <hnbase/utils.h>
+#include <boost/multi_index_container.hpp>
+#include <boost/multi_index/ordered_index.hpp>
+#include <boost/multi_index/hashed_index.hpp>
+#include <boost/multi_index/key_extractors.hpp>
+#include <boost/format.hpp>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+using namespace boost::multi_index;
+using namespace Donkey::Detail;
+
+static const uint32_t CLIENTS = 100000;
+static const uint32_t ROUNDS  = 1000000;
+
+//! The parts of ed2k Client that are used as keys
+struct Client {
+	uint32_t getId()      const { return m_id;      }
+	uint16_t getTcpPort() const { return m_tcpPort; }
+	uint16_t getUdpPort() const { return m_udpPort; }
+	Hash<MD4Hash> getHash() const { return m_hash; }
+
+	uint32_t m_id;
+	uint16_t m_tcpPort;
+	uint16_t m_udpPort;
+	Hash<MD4Hash> m_hash;
+};
+
+//! Indexes ClientList used to have
+struct Ordered : multi_index_container<Client*, indexed_by<
+	ordered_unique<identity<Client*> >,
+	ordered_non_unique<const_mem_fun<Client, uint32_t, &Client::getId> >,
+	ordered_non_unique<
+		const_mem_fun<Client, Hash<MD4Hash>, &Client::getHash>
+	>
+> > {
+	Client* lookup(uint32_t id, uint16_t port, bool udp) {
+		typedef nth_index<1>::type::iterator Iter;
+		std::pair<Iter, Iter> r = get<1>().equal_range(id);
+		for (Iter i = r.first; i != r.second; ++i) {
+			uint16_t p = (*i)->getTcpPort();
+			if (udp) {
+				p = (*i)->getUdpPort();
+			}
+			if (p == port) {
+				return *i;
+			}
+		}
+		return 0;
+	}
+};
+
+//! Indexes ClientList has now
+struct Hashed : multi_index_container<Client*, indexed_by<
+	hashed_unique<identity<Client*> >,
+	hashed_non_unique<const_mem_fun<Client, uint32_t, &Client::getId> >,
+	hashed_non_unique<
+		const_mem_fun<Client, Hash<MD4Hash>, &Client::getHash>,
+		UserHashHasher
+	>,
+	hashed_non_unique<TcpAddrKey<Client> >,
+	hashed_non_unique<UdpAddrKey<Client> >
+> > {
+	Client* lookup(uint32_t id, uint16_t port, bool udp) {
+		uint64_t key = makeAddrKey(id, port);
+		if (udp) {
+			nth_index<4>::type::iterator i = get<4>().find(key);
+			return i == get<4>().end() ? 0 : *i;
+		} else {
+			nth_index<3>::type::iterator i = get<3>().find(key);
+			return i == get<3>().end() ? 0 : *i;
+		}
+	}
+};
+
+struct SetKeys {
+	SetKeys(uint16_t tcp, uint16_t udp, const Hash<MD4Hash> &h)
+	: m_tcp(tcp), m_udp(udp), m_hash(h) {}
+	void operator()(Client *c) const {
+		c->m_tcpPort = m_tcp;
+		c->m_udpPort = m_udp;
+		c->m_hash = m_hash;
+	}
+	uint16_t m_tcp, m_udp;
+	Hash<MD4Hash> m_hash;
+};
+
+uint32_t random32() {
+	return (static_cast<uint32_t>(rand()) << 16) ^ rand();
+}
+
+// HighID clients on a few common ports, so IDs and ports repeat
+Client* newClient() {
+	Client *c = new Client;
+	c->m_id = 0x01000000 + random32() % 0xfe000000;
+	c->m_tcpPort = rand() % 2 ? 4662 : 1024 + rand() % 60000;
+	c->m_udpPort = 0;
+	return c;
+}
+
+Hash<MD4Hash> newHash() {
+	std::string tmp(16, '\0');
+	for (uint32_t i = 0; i < 16; ++i) {
+		tmp[i] = rand();
+	}
+	return Hash<MD4Hash>(tmp);
+}
+
+template<typename List>
+void benchmark(const char *name) {
+	srand(1);
+	List list;
+	std::vector<Client*> clients;
+	Utils::StopWatch t;
+	for (uint32_t i = 0; i < CLIENTS; ++i) {
+		clients.push_back(newClient());
+		list.insert(clients.back());
+	}
+	uint64_t insertTime = t.elapsed();
+
+	t = Utils::StopWatch();
+	uint32_t found = 0;
+	for (uint32_t i = 0; i < ROUNDS; ++i) {
+		uint32_t n = random32() % clients.size();
+		Client *c = clients[n];
+		switch (i % 8) {
+			case 0: {      // Hello: ports and userhash are set
+				typename List::iterator j = list.find(c);
+				list.modify(j, SetKeys(
+					c->m_tcpPort, 1024 + rand() % 60000,
+					newHash()
+				));
+				break;
+			}
+			case 1: {      // destroyed, and replaced by a new one
+				list.erase(c);
+				delete c;
+				c = newClient();
+				list.insert(c);
+				clients[n] = c;
+				break;
+			}
+			case 2:        // UDP reask
+				found += list.lookup(c->m_id, c->m_udpPort, true)
+					!= 0;
+				break;
+			case 3:        // source not known yet
+				found += list.lookup(random32(), 4662, false)
+					!= 0;
+				break;
+			default:       // connection, callback or known source
+				found += list.lookup(c->m_id, c->m_tcpPort, false)
+					!= 0;
+				break;
+		}
+	}
+	uint64_t churnTime = t.elapsed();
+	std::cerr << boost::format(
+		"%-8s insert %d clients: %4dms; %d lookups/rekeys/churn: "
+		"%5dms (%d found)"
+	) % name % CLIENTS % insertTime % ROUNDS % churnTime % found
+	<< std::endl;
+
+	for (typename List::iterator i = list.begin(); i != list.end(); ++i) {
+		delete *i;
+	}
+}
+
+#define EXPECT(cond) \
+	if (!(cond)) { \
+		std::cerr << "Check failed: " #cond << std::endl; \
+		return false; \
+	}
+
+// expiry by time and by filling up, and the burst cutoff
+bool checkDeadSources() {
+	DeadSources d(1000, 100, 5);
+	uint64_t key = makeAddrKey(0x01020304, 4662);
+	EXPECT(d.markDead(key, 1) && d.isDead(key, 1));
+	EXPECT(!d.isDead(makeAddrKey(0x01020304, 4663), 1));
+	EXPECT(d.isDead(key, 400));
+	EXPECT(d.isDead(key, 600));   // rotated, still in the older filter
+	EXPECT(!d.isDead(key, 1200)); // rotated again, expired
+
+	// five failures in a row are remembered, the sixth is not
+	d.connectionEstablished();
+	for (uint32_t i = 0; i < 5; ++i) {
+		EXPECT(d.markDead(makeAddrKey(0x02000000 + i, 4662), 1300));
+	}
+	uint64_t late = makeAddrKey(0x03000000, 4662);
+	EXPECT(!d.markDead(late, 1300) && !d.isDead(late, 1300));
+	EXPECT(d.getFailedInRow() == 6);
+	d.connectionEstablished();
+	EXPECT(d.markDead(late, 1300) && d.isDead(late, 1300));
+
+	// filling up the filter twice drops the first generation
+	DeadSources f(1000, 100, 1000);
+	for (uint32_t i = 0; i < 200; ++i) {
+		f.markDead(makeAddrKey(0x04000000 + i, 4662), 1);
+	}
+	EXPECT(f.isDead(makeAddrKey(0x04000000 + 100, 4662), 1));
+	for (uint32_t i = 200; i < 300; ++i) {
+		f.markDead(makeAddrKey(0x04000000 + i, 4662), 1);
+	}
+	EXPECT(!f.isDead(makeAddrKey(0x04000000, 4662), 1));
+	EXPECT(f.isDead(makeAddrKey(0x04000000 + 299, 4662), 1));
+	return true;
+}
+
+// Offers sources, half of which are dead; as in ClientList::addSource(),
+// sources already in the list are looked up first. Without filter, a Client
+// is created for each new one and added to list, which is what the
+// connection attempt will then find out.
+void benchmarkDead(bool useFilter) {
+	srand(2);
+	std::vector<uint32_t> dead;
+	DeadSources filter(2*60*60*1000, 50000, 50000);
+	for (uint32_t i = 0; i < 50000; ++i) {
+		dead.push_back(random32() | 0x01000000);
+		filter.markDead(makeAddrKey(dead.back(), 4662), 1);
+	}
+	Hashed list;
+	Utils::StopWatch t;
+	uint32_t created = 0, rejected = 0;
+	for (uint32_t i = 0; i < ROUNDS; ++i) {
+		uint32_t id = random32() | 0x01000000;
+		uint16_t port = 4662;
+		if (i % 2) {
+			id = dead[rand() % dead.size()];
+		}
+		uint64_t key = makeAddrKey(id, port);
+		if (list.lookup(id, port, false)) {
+			continue;
+		}
+		if (useFilter && filter.isDead(key, 1)) {
+			++rejected;
+		} else {
+			Client *c = new Client;
+			c->m_id = id;
+			c->m_tcpPort = port;
+			c->m_udpPort = 0;
+			list.insert(c);
+			++created;
+		}
+	}
+	std::cerr << boost::format(
+		"%-8s %d sources offered: %4dms, %d clients created, "
+		"%d rejected (filter: %d bytes)"
+	) % (useFilter ? "filter" : "nofilter") % ROUNDS % t.elapsed()
+	% created % rejected % (useFilter ? filter.memory() : 0)
+	<< std::endl;
+	for (Hashed::iterator i = list.begin(); i != list.end(); ++i) {
+		delete *i;
+	}
+}
+
+int main() {
+	if (!checkDeadSources()) {
+		return 1;
+	}
+	benchmark<Ordered>("ordered");
+	benchmark<Hashed>("hashed");
+	benchmarkDead(false);
+	benchmarkDead(true);
+	return 0;
+}
+
+#endif
@@ -0,0 +1,161 @@
+/*
+ *  Copyright (C) 2004-2006 Alo Sarv <madcat_@users.sourceforge.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/**
+ * \file test-dirscanner.cpp Regress-test for DirScanner background scanning
+ */
+
+#ifndef DOXYGEN_SHOULD_SKIP_THIS
+
+#include <hncore/dirscanner.h>
+#include <boost/filesystem/operations.hpp>
+#include <boost/test/unit_test.hpp>
+#include <fstream>
+#include <iostream>
+#include <set>
+
+using namespace boost::filesystem;
+
+static const std::string s_root("dirscanner.tmp");
+
+struct Collector {
+	Collector() : m_done() {
+		m_conn = DirScanner::getEventTable().addHandler(
+			&DirScanner::instance(), this, &Collector::onEvent
+		);
+	}
+	~Collector() {
+		DirScanner::getEventTable().delHandler(
+			&DirScanner::instance(), m_conn
+		);
+	}
+	void onEvent(DirScanner*, DirScanner::DeltaPtr d) {
+		BOOST_CHECK(d->m_root == s_root);
+		BOOST_CHECK(d->m_added.size() <= DirScanner::BATCH_SIZE);
+		for (uint32_t i = 0; i < d->m_added.size(); ++i) {
+			m_added.insert(d->m_added[i].string());
+		}
+		for (uint32_t i = 0; i < d->m_removed.size(); ++i) {
+			m_removed.insert(d->m_removed[i].string());
+		}
+		for (uint32_t i = 0; i < d->m_removedDirs.size(); ++i) {
+			m_removed.insert(d->m_removedDirs[i].string());
+		}
+		m_done |= d->m_done;
+	}
+	// process events until cond is true, for up to 5 seconds
+	template<typename Cond>
+	bool waitFor(Cond cond) {
+		Utils::StopWatch t;
+		while (!cond(*this) && t.elapsed() < 5000) {
+			EventMain::instance().process();
+		}
+		return cond(*this);
+	}
+	std::set<std::string> m_added;
+	std::set<std::string> m_removed;
+	bool m_done;
+	boost::signals::connection m_conn;
+};
+
+struct IsDone {
+	bool operator()(const Collector &c) const { return c.m_done; }
+};
+
+struct HasFile {
+	HasFile(const std::string &f, bool removed) : m_f(f), m_rem(removed) {}
+	bool operator()(const Collector &c) const {
+		return (m_rem ? c.m_removed : c.m_added).count(m_f) > 0;
+	}
+	std::string m_f;
+	bool m_rem;
+};
+
+void makeFile(const path &p) {
+	std::ofstream o(p.string().c_str());
+	o << "data";
+}
+
+// 3 directories with 1500 files each, plus an ignored file
+void test_scan() {
+	remove_all(path(s_root));
+	create_directory(path(s_root));
+	for (uint32_t i = 0; i < 3; ++i) {
+		path dir(path(s_root) / (boost::format("dir%d") % i).str());
+		create_directory(dir);
+		for (uint32_t j = 0; j < 1500; ++j) {
+			makeFile(dir / (boost::format("file%d") % j).str());
+		}
+	}
+	makeFile(path(s_root) / "Thumbs.db");
+
+	Collector c;
+	DirScanner::instance().scan(s_root, true);
+	BOOST_REQUIRE(c.waitFor(IsDone()));
+	BOOST_CHECK(c.m_added.size() == 4500);
+	BOOST_CHECK(c.m_added.count(s_root + "/dir2/file1499"));
+	BOOST_CHECK(!c.m_added.count(s_root + "/Thumbs.db"));
+}
+
+void test_watch() {
+	if (!DirScanner::instance().canWatch()) {
+		return;
+	}
+	Collector c;
+	makeFile(path(s_root) / "new");
+	BOOST_CHECK(c.waitFor(HasFile(s_root + "/new", false)));
+
+	remove(path(s_root) / "dir0" / "file1");
+	BOOST_CHECK(c.waitFor(HasFile(s_root + "/dir0/file1", true)));
+
+	rename(path(s_root) / "new", path(s_root) / "renamed");
+	BOOST_CHECK(c.waitFor(HasFile(s_root + "/new", true)));
+	BOOST_CHECK(c.waitFor(HasFile(s_root + "/renamed", false)));
+
+	// new subdirectories are scanned and watched too
+	create_directory(path(s_root) / "sub");
+	BOOST_CHECK(c.waitFor(IsDone()));
+	makeFile(path(s_root) / "sub" / "x");
+	BOOST_CHECK(c.waitFor(HasFile(s_root + "/sub/x", false)));
+
+	rename(path(s_root) / "dir1", path("dirscanner-moved.tmp"));
+	BOOST_CHECK(c.waitFor(HasFile(s_root + "/dir1", true)));
+	remove_all(path("dirscanner-moved.tmp"));
+}
+
+void test_remove() {
+	Collector c;
+	DirScanner::instance().remove(s_root);
+	makeFile(path(s_root) / "ignored");
+	c.waitFor(HasFile(s_root + "/ignored", false));
+	BOOST_CHECK(c.m_added.empty());
+	remove_all(path(s_root));
+	DirScanner::instance().exit();
+}
+
+boost::unit_test::test_suite* init_unit_test_suite(int, char*[]) {
+	std::cerr << "DirScanner: ";
+	boost::unit_test::test_suite *test = 0;
+	test = BOOST_TEST_SUITE("DirScanner");
+	test->add(BOOST_TEST_CASE(&test_scan));
+	test->add(BOOST_TEST_CASE(&test_watch));
+	test->add(BOOST_TEST_CASE(&test_remove));
+	return test;
+}
+
+#endif
@@ -0,0 +1,229 @@
+/*
+ *  Copyright (C) 2004-2006 Alo Sarv <madcat_@users.sourceforge.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/**
+ * \file test-ed2kparser.cpp Benchmark for ED2KParser stream framing
+ *
+ * Replays a captured eDonkey2000 TCP stream (the data received from a single
+ * connection), given as the first argument, through ED2KParser. Without
+ * arguments, a 64MB download session is generated instead: 10KB data chunks,
+ * 180KB blocks sent as packed chunks, zlib-compressed packets, and small
+ * control packets in between.
+ *
+ * The stream is fed to the parser in segments of random size, like they
+ * are received from a socket, both through parse(data, len) and through a
+ * socket input buffer; reports the throughput and the number of packets
+ * parsed.
+ */
+
+#ifndef DOXYGEN_SHOULD_SKIP_THIS
+
+#include <hncore/ed2k/parser.h>
+#include <hncore/ed2k/zutils.h>
+#include <hnbase/utils.h>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+
+namespace Donkey {
+
+struct Bench {
+	Bench() : m_packets(), m_data() {}
+	void onPacket(const ED2KPacket::DataChunk &p) {
+		++m_packets;
+		m_data += p.getData().size();
+	}
+	void onPacket(const ED2KPacket::PackedChunk &p) {
+		++m_packets;
+		m_data += p.getData().size();
+	}
+	void onPacket(const ED2KPacket::QueueRanking &) { ++m_packets; }
+	void onPacket(const ED2KPacket::AcceptUploadReq &) { ++m_packets; }
+	uint32_t m_packets;
+	uint64_t m_data;
+};
+
+DECLARE_PACKET_HANDLER(Bench, DataChunk);
+DECLARE_PACKET_HANDLER(Bench, PackedChunk);
+DECLARE_PACKET_HANDLER(Bench, QueueRanking);
+DECLARE_PACKET_HANDLER(Bench, AcceptUploadReq);
+
+}
+
+using namespace Donkey;
+
+static const uint32_t SESSION_SIZE = 64 * 1024 * 1024;
+static const uint32_t BLOCK_SIZE   = 180 * 1024;
+static const uint32_t CHUNK_SIZE   = 10240;
+
+// Compress the data of a packet, as senders do with PR_ZLIB
+std::string zip(const std::string &packet) {
+	std::string ret(Zlib::compress(packet.substr(6)));
+	std::ostringstream tmp;
+	Utils::putVal<uint8_t>(tmp, PR_ZLIB);
+	Utils::putVal<uint32_t>(tmp, ret.size() + 1);
+	Utils::putVal<uint8_t>(tmp, packet.at(5));
+	Utils::putVal<std::string>(tmp, ret, ret.size());
+	return tmp.str();
+}
+
+// Somewhat compressible data, like most downloaded files
+std::string blockData(uint32_t len) {
+	std::string ret(len, '\0');
+	for (uint32_t i = 0; i < len; ++i) {
+		ret[i] = rand() % 4 ? 'a' + i % 16 : rand();
+	}
+	return ret;
+}
+
+// block sent as data chunks, optionally compressed
+uint32_t addChunks(
+	std::string &s, const Hash<ED2KHash> &hash, uint32_t begin,
+	const std::string &data, bool compress
+) {
+	uint32_t cnt = 0;
+	for (uint32_t i = 0; i < data.size(); i += CHUNK_SIZE, ++cnt) {
+		std::string p = ED2KPacket::DataChunk(
+			hash, begin + i, begin + i + CHUNK_SIZE,
+			data.substr(i, CHUNK_SIZE)
+		);
+		s += compress ? zip(p) : p;
+	}
+	return cnt;
+}
+
+// block compressed as a whole, and sent in chunks
+uint32_t addPacked(
+	std::string &s, const Hash<ED2KHash> &hash, uint32_t begin,
+	const std::string &data
+) {
+	std::string packed(Zlib::compress(data));
+	uint32_t cnt = 0;
+	for (uint32_t i = 0; i < packed.size(); i += CHUNK_SIZE, ++cnt) {
+		s += ED2KPacket::PackedChunk(
+			hash, begin, packed.size(), packed.substr(i, CHUNK_SIZE)
+		);
+	}
+	return cnt;
+}
+
+std::string makeSession(uint32_t *packets) {
+	Hash<ED2KHash> hash(std::string(16, '\x5a'));
+	std::string ret;
+	srand(1);
+	*packets = 0;
+	for (uint32_t begin = 0; begin < SESSION_SIZE; begin += BLOCK_SIZE) {
+		std::string data(blockData(BLOCK_SIZE));
+		uint32_t type = rand() % 3;
+		bool packed = type == 1;
+		if (type == 0) {
+			*packets += addPacked(ret, hash, begin, data);
+		} else {
+			*packets += addChunks(ret, hash, begin, data, packed);
+		}
+		ret += ED2KPacket::QueueRanking(rand());
+		ret += ED2KPacket::AcceptUploadReq();
+		*packets += 2;
+	}
+	return ret;
+}
+
+// feeds the stream in segments of up to maxSegment bytes
+void benchmark(const std::string &stream, uint32_t maxSegment, bool socket) {
+	Bench b;
+	ED2KParser<Bench> parser(&b);
+	boost::shared_ptr<RecvBuffer> in(new RecvBuffer);
+	srand(2);
+	Utils::StopWatch t;
+	for (uint32_t pos = 0; pos < stream.size();) {
+		uint32_t len = std::min<uint32_t>(
+			stream.size() - pos, 1 + rand() % maxSegment
+		);
+		if (socket) {
+			in->append(stream.data() + pos, len);
+			parser.parse(in);
+		} else {
+			parser.parse(stream.data() + pos, len);
+		}
+		pos += len;
+	}
+	uint64_t elapsed = std::max<uint64_t>(t.elapsed(), 1);
+	std::cerr << boost::format(
+		"%-6s segments <= %5d bytes: %4dms, %6.1f MB/s, "
+		"%d packets, %d bytes of data"
+	) % (socket ? "socket" : "data") % maxSegment % elapsed
+	% (stream.size() / 1024.0 / 1024.0 / (elapsed / 1000.0))
+	% b.m_packets % b.m_data << std::endl;
+}
+
+// a header announcing 4GB must be rejected, not wait for the data
+bool checkOversize(bool socket) {
+	Bench b;
+	ED2KParser<Bench> parser(&b);
+	std::ostringstream tmp;
+	Utils::putVal<uint8_t>(tmp, PR_ED2K);
+	Utils::putVal<uint32_t>(tmp, 0xffffffff);
+	Utils::putVal<uint8_t>(tmp, 0x46);
+	std::string header(tmp.str());
+	bool rejected = false;
+	try {
+		if (socket) {
+			boost::shared_ptr<RecvBuffer> in(new RecvBuffer);
+			in->append(header.data(), header.size());
+			parser.parse(in);
+		} else {
+			parser.parse(header);
+		}
+	} catch (std::runtime_error&) {
+		rejected = true;
+	}
+	std::cerr << boost::format("%-6s oversized packet header: %s")
+		% (socket ? "socket" : "data")
+		% (rejected ? "rejected" : "NOT REJECTED") << std::endl;
+	return rejected;
+}
+
+int main(int argc, char *argv[]) {
+	bool ok = checkOversize(false);
+	ok = checkOversize(true) && ok;
+	if (!ok) {
+		return 1;
+	}
+	std::string stream;
+	if (argc > 1) {
+		std::ifstream f(argv[1], std::ios::binary);
+		std::ostringstream tmp;
+		tmp << f.rdbuf();
+		stream = tmp.str();
+		std::cerr << boost::format("Replaying %s (%d bytes)")
+			% argv[1] % stream.size() << std::endl;
+	} else {
+		uint32_t packets = 0;
+		stream = makeSession(&packets);
+		std::cerr << boost::format(
+			"Replaying generated session (%d bytes, %d packets)"
+		) % stream.size() % packets << std::endl;
+	}
+	benchmark(stream, 1460, false);
+	benchmark(stream, 1460, true);
+	benchmark(stream, 65536, false);
+	benchmark(stream, 65536, true);
+	return 0;
+}
+
+#endif
@@ -0,0 +1,194 @@
+/*
+ *  Copyright (C) 2004-2006 Alo Sarv <madcat_@users.sourceforge.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/**
+ * \file test-hashpool.cpp Regress-test for HashPool parallel hashing
+ */
+
+#ifndef DOXYGEN_SHOULD_SKIP_THIS
+
+#include <hncore/hashpool.h>
+#include <hncore/hasher.h>
+#include <hncore/hashsetmaker.h>
+#include <hnbase/multihash.h>
+#include <boost/filesystem/operations.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/test/unit_test.hpp>
+#include <fstream>
+#include <iostream>
+
+typedef boost::shared_ptr<HashSetMaker> MakerPtr;
+
+std::vector<MakerPtr> makeMakers() {
+	std::vector<MakerPtr> ret;
+	ret.push_back(MakerPtr(new ED2KHashMaker));
+	ret.push_back(MakerPtr(new SHA1HashMaker));
+	ret.push_back(MakerPtr(new MD4HashMaker));
+	ret.push_back(MakerPtr(new MD5HashMaker));
+	ret.push_back(MakerPtr(new BTHashMaker(32 * 1024)));
+	return ret;
+}
+
+// file and chunk hashes of all generated hashsets
+std::vector<std::string> results(const std::vector<MakerPtr> &makers) {
+	std::vector<std::string> ret;
+	for (uint32_t i = 0; i < makers.size(); ++i) {
+		boost::scoped_ptr<HashSetBase> hs(makers[i]->getHashSet());
+		ret.push_back(hs->getFileHash().decode());
+		for (uint32_t j = 0; j < hs->getChunkCnt(); ++j) {
+			ret.push_back(hs->getChunkHash(j).decode());
+		}
+	}
+	return ret;
+}
+
+std::string makeData(uint32_t len) {
+	std::string data(len, '\0');
+	for (uint32_t i = 0; i < data.size(); ++i) {
+		data[i] = static_cast<char>(i * 7 + i / 251);
+	}
+	return data;
+}
+
+// parallel hashing must produce the same results as serial
+void test_sumup() {
+	std::string data = makeData(10 * 1024 * 1024 + 1000);
+	std::vector<MakerPtr> serial = makeMakers();
+	std::vector<MakerPtr> parallel = makeMakers();
+	const uint32_t block = 256 * 1024;
+	for (uint32_t pos = 0; pos < data.size(); pos += block) {
+		uint32_t len = std::min<uint32_t>(block, data.size() - pos);
+		for (uint32_t i = 0; i < serial.size(); ++i) {
+			serial[i]->sumUp(data.data() + pos, len);
+		}
+		HashPool::instance().sumUp(parallel, data.data() + pos, len);
+	}
+	std::vector<std::string> res = results(serial);
+	BOOST_CHECK(res == results(parallel));
+	// ed2k (2 parts + file hash) and bt (321 pieces + file hash)
+	BOOST_CHECK(res.size() == 3 + 1 + 1 + 1 + 322);
+}
+
+struct FailingMaker : public HashSetMaker {
+	virtual void sumUp(const char*, uint32_t) {
+		throw std::runtime_error("failed");
+	}
+	virtual HashSetBase* getHashSet() { return 0; }
+};
+
+// errors in worker threads are passed to the caller
+void test_error() {
+	std::vector<MakerPtr> makers;
+	makers.push_back(MakerPtr(new MD5HashMaker));
+	makers.push_back(MakerPtr(new FailingMaker));
+	std::string data(1000, 'x');
+	BOOST_CHECK_THROW(
+		HashPool::instance().sumUp(makers, data.data(), data.size()),
+		std::runtime_error
+	);
+}
+
+struct BatchTester {
+	void onHashEvent(HashWorkPtr hw, HashEvent evt) {
+		m_results[hw] = evt;
+	}
+	std::map<HashWorkPtr, HashEvent> m_results;
+};
+
+// range jobs verified in batches (or one by one, with scalar kernel), with
+// one corrupt reference hash
+void checkRanges(const std::string &data, const std::string &file) {
+	std::vector<boost::shared_ptr<HashBase> > refs;
+	std::vector<HashWorkPtr> jobs;
+	BatchTester tester;
+	const uint32_t range = 100000;
+	for (uint32_t pos = 0; pos < data.size(); pos += range) {
+		uint32_t len = std::min<uint32_t>(range, data.size() - pos);
+		const char *ptr = data.data() + pos;
+		boost::shared_ptr<HashBase> ref;
+		switch (refs.size() % 4) {
+			case 0: {
+				Md4Transform t;
+				t.sumUp(ptr, len);
+				ref.reset(new Hash<MD4Hash>(t.getHash()));
+				break;
+			}
+			case 1: {
+				Md4Transform t;
+				t.sumUp(ptr, len);
+				Hash<MD4Hash> h(t.getHash());
+				ref.reset(new Hash<ED2KHash>(h.getData()));
+				break;
+			}
+			case 2: {
+				Md5Transform t;
+				t.sumUp(ptr, len);
+				ref.reset(new Hash<MD5Hash>(t.getHash()));
+				break;
+			}
+			default: {
+				Sha1Transform t;
+				t.sumUp(ptr, refs.size() == 7 ? len - 1 : len);
+				ref.reset(new Hash<SHA1Hash>(t.getHash()));
+				break;
+			}
+		}
+		refs.push_back(ref);
+		jobs.push_back(HashWorkPtr(
+			new HashWork(file, pos, pos + len - 1, ref.get())
+		));
+		HashWork::getEventTable().addHandler(
+			jobs.back(), &tester, &BatchTester::onHashEvent
+		);
+		HashPool::instance().postWork(jobs.back());
+	}
+	while (tester.m_results.size() < jobs.size()) {
+		EventMain::instance().process();
+	}
+	for (uint32_t i = 0; i < jobs.size(); ++i) {
+		HashEvent expected = i == 7 ? HASH_FAILED : HASH_VERIFIED;
+		BOOST_CHECK(tester.m_results[jobs[i]] == expected);
+	}
+}
+
+void test_batch() {
+	std::string data = makeData(3 * 1024 * 1024 + 1000);
+	boost::filesystem::path file("hashpool.tmp");
+	{
+		std::ofstream o(file.string().c_str(), std::ios::binary);
+		o.write(data.data(), data.size());
+	}
+	MultiHash::Kernel kernel = MultiHash::getKernel();
+	checkRanges(data, file.string());
+	MultiHash::setKernel(MultiHash::SCALAR);
+	checkRanges(data, file.string());
+	MultiHash::setKernel(kernel);
+	boost::filesystem::remove(file);
+}
+
+boost::unit_test::test_suite* init_unit_test_suite(int, char*[]) {
+	std::cerr << "HashPool: ";
+	boost::unit_test::test_suite *test = 0;
+	test = BOOST_TEST_SUITE("HashPool");
+	test->add(BOOST_TEST_CASE(&test_sumup));
+	test->add(BOOST_TEST_CASE(&test_error));
+	test->add(BOOST_TEST_CASE(&test_batch));
+	return test;
+}
+
+#endif
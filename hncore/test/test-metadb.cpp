@@ -0,0 +1,156 @@
+/*
+ *  Copyright (C) 2004-2006 Alo Sarv <madcat_@users.sourceforge.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/**
+ * \file test-metadb.cpp Test and benchmark for MetaDb database file formats
+ *
+ * Generates databases of 10k, 100k and 500k entries, writes them both in the
+ * old and in the indexed format, and reports the time and memory (resident
+ * set size growth) it takes to load each. Then checks that entries can be
+ * looked up by hash and name after loading either file.
+ */
+
+#ifndef DOXYGEN_SHOULD_SKIP_THIS
+
+#include <hncore/metadb.h>
+#include <hncore/metadata.h>
+#include <hnbase/md4transform.h>
+#include <hnbase/utils.h>
+#include <boost/filesystem/operations.hpp>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#ifndef WIN32
+	#include <unistd.h>
+#endif
+
+static const boost::filesystem::path s_legacy("metadb-legacy.tmp");
+static const boost::filesystem::path s_indexed("metadb-indexed.tmp");
+static const uint32_t LOOKUPS = 1000;
+
+// resident set size, in kilobytes
+uint64_t getRss() {
+#ifdef WIN32
+	return 0;
+#else
+	std::ifstream ifs("/proc/self/statm");
+	uint64_t size = 0, rss = 0;
+	ifs >> size >> rss;
+	return rss * sysconf(_SC_PAGESIZE) / 1024;
+#endif
+}
+
+Hash<MD4Hash> makeHash(uint32_t num, uint32_t chunk) {
+	Md4Transform t;
+	t.sumUp(reinterpret_cast<const char*>(&num), sizeof(num));
+	t.sumUp(reinterpret_cast<const char*>(&chunk), sizeof(chunk));
+	return t.getHash();
+}
+
+std::string makeName(uint32_t num) {
+	return (boost::format("Some file number %d.avi") % num).str();
+}
+
+// ~700MB file, with ed2k hashset
+MetaData* makeEntry(uint32_t num) {
+	MetaData *md = new MetaData(734003200ull + num);
+	md->addFileName(makeName(num));
+	HashSet<MD4Hash, ED2KHash, 9728000> *hs;
+	hs = new HashSet<MD4Hash, ED2KHash, 9728000>(
+		Hash<ED2KHash>(makeHash(num, ~0u).getData())
+	);
+	for (uint32_t i = 0; i < 76; ++i) {
+		hs->addChunkHash(makeHash(num, i).getData());
+	}
+	md->addHashSet(hs);
+	return md;
+}
+
+// write both formats
+void generate(uint32_t count) {
+	std::ofstream ofs(s_legacy.string().c_str(), std::ios::binary);
+	Utils::putVal<uint8_t>(ofs, 0x01);
+	Utils::putVal<uint32_t>(ofs, count);
+	for (uint32_t i = 0; i < count; ++i) {
+		MetaData *md = makeEntry(i);
+		ofs << *md;
+		MetaDb::instance().push(md);
+	}
+	MetaDb::instance().save(s_indexed);
+	MetaDb::instance().exit();
+}
+
+void checkLookups(uint32_t count) {
+	for (uint32_t i = 0; i < LOOKUPS; ++i) {
+		uint32_t num = Utils::getRandom() % count;
+		MetaData *md = MetaDb::instance().find(
+			Hash<ED2KHash>(makeHash(num, ~0u).getData())
+		);
+		CHECK_THROW_MSG(md, "Entry not found by hash");
+		CHECK_THROW_MSG(md->getName() == makeName(num), "Wrong entry");
+		CHECK_THROW(md->getHashSet(0)->getChunkCnt() == 76);
+		std::vector<MetaData*> ret = MetaDb::instance().find(
+			makeName(num)
+		);
+		CHECK_THROW_MSG(ret.size() == 1, "Entry not found by name");
+		CHECK_THROW_MSG(ret[0] == md, "Wrong entry");
+	}
+	CHECK_THROW(!MetaDb::instance().find(
+		Hash<ED2KHash>(makeHash(count, ~0u).getData())
+	));
+	CHECK_THROW(MetaDb::instance().find(makeName(count)).empty());
+	CHECK_THROW(MetaDb::instance().size() == count);
+}
+
+void benchmark(const boost::filesystem::path &file, const std::string &name) {
+	uint64_t rss = getRss();
+	Utils::StopWatch elapsed;
+	MetaDb::instance().load(file);
+	uint64_t loadTime = elapsed.elapsed();
+	uint64_t loadRss = getRss() - rss;
+	uint32_t count = MetaDb::instance().size();
+	elapsed.reset();
+	checkLookups(count);
+	uint64_t lookupTime = elapsed.elapsed();
+	std::cerr << boost::format(
+		"%-8s %7d entries: load %6dms, %8dkB; %d lookups %5dms"
+	) % name % count % loadTime % loadRss % LOOKUPS % lookupTime
+	<< std::endl;
+	MetaDb::instance().exit();
+}
+
+int main() try {
+	uint32_t counts[] = { 10000, 100000, 500000 };
+	for (uint32_t i = 0; i < 3; ++i) {
+		generate(counts[i]);
+		std::cerr << boost::format("File sizes: %dkB old, %dkB indexed")
+			% (boost::filesystem::file_size(s_legacy) / 1024)
+			% (boost::filesystem::file_size(s_indexed) / 1024)
+			<< std::endl;
+		benchmark(s_indexed, "Indexed");
+		benchmark(s_legacy, "Old");
+	}
+	boost::filesystem::remove(s_legacy);
+	boost::filesystem::remove(s_indexed);
+	return 0;
+} catch (std::exception &e) {
+	std::cerr << "Error: " << e.what() << std::endl;
+	return 1;
+}
+
+#endif
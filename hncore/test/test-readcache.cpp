@@ -0,0 +1,122 @@
+/*
+ *  Copyright (C) 2004-2006 Alo Sarv <madcat_@users.sourceforge.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/**
+ * \file test-readcache.cpp Regress-test for ReadCache
+ */
+
+#ifndef DOXYGEN_SHOULD_SKIP_THIS
+
+#include <hncore/readcache.h>
+#include <hnbase/prefs.h>
+#include <boost/filesystem/operations.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/test/unit_test.hpp>
+#include <fstream>
+#include <iostream>
+
+static const uint32_t BLOCK = ReadCache::BLOCK_SIZE;
+static const uint32_t FILE_SIZE = 1024 * 1024 + 1000;
+static std::string s_data;
+
+std::string makeFile(const std::string &name) {
+	if (s_data.empty()) {
+		for (uint32_t i = 0; i < FILE_SIZE; ++i) {
+			s_data += static_cast<char>(i * 7 + i / 251);
+		}
+	}
+	std::ofstream o(name.c_str(), std::ios::binary);
+	o.write(s_data.data(), s_data.size());
+	return name;
+}
+
+void test_read() {
+	ReadCache &rc = ReadCache::instance();
+	boost::filesystem::path p(makeFile("readcache.tmp"));
+	std::string tmp;
+
+	BOOST_CHECK(!rc.find(p, 0, 99, &tmp));
+	BOOST_CHECK(rc.read(p, 0, 99, FILE_SIZE - 1) == s_data.substr(0, 100));
+	BOOST_CHECK(rc.getMisses() == 1 && rc.getHits() == 0);
+	BOOST_CHECK(rc.find(p, 50, 149, &tmp));
+	BOOST_CHECK(tmp == s_data.substr(50, 100));
+	BOOST_CHECK(rc.getHits() == 1);
+	BOOST_CHECK(!rc.find(p, BLOCK - 10, BLOCK + 10, &tmp));
+
+	// sequential read - the blocks after it are read ahead
+	uint64_t misses = rc.getMisses();
+	tmp = rc.read(p, 150, 3 * BLOCK - 1, FILE_SIZE - 1);
+	BOOST_CHECK(tmp == s_data.substr(150, 3 * BLOCK - 150));
+	BOOST_CHECK(rc.getMisses() == misses + 2);
+	uint64_t end = (3 + ReadCache::READAHEAD) * BLOCK - 1;
+	BOOST_CHECK(rc.find(p, 3 * BLOCK, end, &tmp));
+	BOOST_CHECK(tmp == s_data.substr(3 * BLOCK, end - 3 * BLOCK + 1));
+	BOOST_CHECK(!rc.find(p, end + 1, end + 1, &tmp));
+
+	// read ahead doesn't go past limit, nor the end of file
+	tmp = rc.read(p, end + 1, end + 1, end + 100);
+	BOOST_CHECK(rc.find(p, end + 1, end + 100, &tmp));
+	BOOST_CHECK(!rc.find(p, end + 1, end + 101, &tmp));
+	tmp = rc.read(p, end + 1, FILE_SIZE - 1, FILE_SIZE - 1);
+	BOOST_CHECK(tmp == s_data.substr(end + 1));
+	BOOST_CHECK(rc.getFdCount() == 1);
+	BOOST_CHECK(rc.getFdMisses() == 1);
+
+	rc.invalidate(p);
+	BOOST_CHECK(rc.getSize() == 0 && rc.getFdCount() == 0);
+	BOOST_CHECK(!rc.find(p, 0, 99, &tmp));
+	boost::filesystem::remove(p);
+	BOOST_CHECK_THROW(rc.read(p, 0, 99, 99), std::runtime_error);
+}
+
+void test_limits() {
+	ReadCache &rc = ReadCache::instance();
+	Prefs::instance().write<uint32_t>("/ReadCacheFiles", 2);
+	Prefs::instance().write<uint64_t>("/ReadCacheSize", 4 * BLOCK);
+	std::vector<boost::filesystem::path> files;
+	for (uint32_t i = 0; i < 3; ++i) {
+		std::string name = boost::lexical_cast<std::string>(i);
+		files.push_back(makeFile("readcache" + name + ".tmp"));
+		rc.read(files.back(), 0, 2 * BLOCK - 1, 2 * BLOCK - 1);
+	}
+	BOOST_CHECK(rc.getFdCount() == 2);
+	BOOST_CHECK(rc.getSize() == 4 * BLOCK);
+
+	std::string tmp;
+	BOOST_CHECK(!rc.find(files[0], 0, 0, &tmp));
+	BOOST_CHECK(rc.find(files[1], 0, 2 * BLOCK - 1, &tmp));
+	BOOST_CHECK(rc.find(files[2], 0, 2 * BLOCK - 1, &tmp));
+	BOOST_CHECK(tmp == s_data.substr(0, 2 * BLOCK));
+	for (uint32_t i = 0; i < files.size(); ++i) {
+		rc.invalidate(files[i]);
+		boost::filesystem::remove(files[i]);
+	}
+	BOOST_CHECK(rc.getSize() == 0 && rc.getFdCount() == 0);
+	std::cerr << "hit rate " << rc.getHitRate() << "% ";
+}
+
+boost::unit_test::test_suite* init_unit_test_suite(int, char*[]) {
+	std::cerr << "ReadCache: ";
+	boost::unit_test::test_suite *test = 0;
+	test = BOOST_TEST_SUITE("ReadCache");
+	test->add(BOOST_TEST_CASE(&test_read));
+	test->add(BOOST_TEST_CASE(&test_limits));
+	return test;
+}
+
+#endif
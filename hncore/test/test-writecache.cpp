@@ -0,0 +1,229 @@
+/*
+ *  Copyright (C) 2004-2006 Alo Sarv <madcat_@users.sourceforge.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/**
+ * \file test-writecache.cpp Regress-test for WriteCache and WriteBuffer
+ */
+
+#ifndef DOXYGEN_SHOULD_SKIP_THIS
+
+#include <hncore/writecache.h>
+#include <hnbase/prefs.h>
+#include <hnbase/utils.h>
+#include <boost/bind.hpp>
+#include <boost/test/unit_test.hpp>
+#include <iostream>
+
+static const uint32_t SLAB = WriteCache::SLAB_SIZE;
+
+void nothing() {}
+
+// builds data of given length, with bytes depending on the file offset, so
+// misplaced data is detected
+std::string makeData(uint64_t begin, uint32_t len, char salt = 0) {
+	std::string ret(len, '\0');
+	for (uint32_t i = 0; i < len; ++i) {
+		ret[i] = static_cast<char>((begin + i) * 7 + salt);
+	}
+	return ret;
+}
+
+// compares buffer contents against a plain byte-map reference
+bool compare(const WriteBuffer &b, const std::map<uint64_t, char> &ref) {
+	std::map<uint64_t, char> tmp;
+	typedef WriteBuffer::Extents::const_iterator Iter;
+	const WriteBuffer::Extents &e = b.getExtents();
+	Iter prev = e.end();
+	for (Iter i = e.begin(); i != e.end(); ++i) {
+		// extents must not overlap, nor touch
+		if (prev != e.end() && (*prev).second->end() >= (*i).first) {
+			return false;
+		}
+		std::string data = (*i).second->getData();
+		for (uint32_t j = 0; j < data.size(); ++j) {
+			tmp[(*i).first + j] = data[j];
+		}
+		prev = i;
+	}
+	return tmp == ref && b.size() == ref.size();
+}
+
+void test_merge() {
+	WriteBuffer b(&nothing);
+	b.write(0, makeData(0, 10000));
+	b.write(10000, makeData(10000, 10000));
+	b.write(20000, makeData(20000, 30000));
+	BOOST_CHECK(b.getExtents().size() == 1);
+	BOOST_CHECK(b.size() == 50000);
+	BOOST_CHECK(b.getLargest() == 50000);
+	std::string tmp = (*b.getExtents().begin()).second->getData();
+	BOOST_CHECK(tmp == makeData(0, 50000));
+
+	// gap, then filling the gap joins everything
+	b.write(60000, makeData(60000, 100));
+	BOOST_CHECK(b.getExtents().size() == 2);
+	b.write(50000, makeData(50000, 10000));
+	BOOST_CHECK(b.getExtents().size() == 1);
+	BOOST_CHECK(b.size() == 60100);
+
+	// overlapping write replaces the old data
+	b.write(SLAB - 10, makeData(SLAB - 10, 20, 1));
+	tmp = (*b.getExtents().begin()).second->getData();
+	BOOST_CHECK(tmp.substr(SLAB - 10, 20) == makeData(SLAB - 10, 20, 1));
+	BOOST_CHECK(tmp.substr(0, SLAB - 10) == makeData(0, SLAB - 10));
+	BOOST_CHECK(b.size() == 60100);
+
+	WriteBuffer::Extents e = b.take();
+	BOOST_CHECK(b.empty() && b.size() == 0);
+	BOOST_CHECK(e.size() == 1);
+	b.restore(e);
+	BOOST_CHECK(b.size() == 60100);
+}
+
+// random writes, compared against a reference
+void test_random() {
+	WriteBuffer b(&nothing);
+	std::map<uint64_t, char> ref;
+	srand(0);
+	for (uint32_t i = 0; i < 500; ++i) {
+		uint64_t begin = rand() % 200000;
+		uint32_t len = rand() % 20000 + 1;
+		std::string data = makeData(begin, len, i);
+		b.write(begin, data);
+		for (uint32_t j = 0; j < len; ++j) {
+			ref[begin + j] = data[j];
+		}
+	}
+	BOOST_CHECK(compare(b, ref));
+}
+
+// data written while the taken extents were away wins over restored data
+void test_restore() {
+	WriteBuffer b(&nothing);
+	std::map<uint64_t, char> ref;
+	b.write(10000, makeData(10000, 30000));
+	b.write(50000, makeData(50000, 10000));
+	WriteBuffer::Extents e = b.take();
+	b.write(5000, makeData(5000, 10000, 1));
+	b.write(20000, makeData(20000, 100, 1));
+	b.write(39000, makeData(39000, 11000, 1));
+	b.write(70000, makeData(70000, 100, 1));
+	b.restore(e);
+	for (uint32_t i = 10000; i < 40000; ++i) {
+		ref[i] = makeData(i, 1)[0];
+	}
+	for (uint32_t i = 50000; i < 60000; ++i) {
+		ref[i] = makeData(i, 1)[0];
+	}
+	for (uint32_t i = 5000; i < 15000; ++i) {
+		ref[i] = makeData(i, 1, 1)[0];
+	}
+	for (uint32_t i = 20000; i < 20100; ++i) {
+		ref[i] = makeData(i, 1, 1)[0];
+	}
+	for (uint32_t i = 39000; i < 50000; ++i) {
+		ref[i] = makeData(i, 1, 1)[0];
+	}
+	for (uint32_t i = 70000; i < 70100; ++i) {
+		ref[i] = makeData(i, 1, 1)[0];
+	}
+	BOOST_CHECK(compare(b, ref));
+	BOOST_CHECK(b.getExtents().size() == 2);
+}
+
+// waits until the clock moves, so extents get different ages
+void nextTick() {
+	uint64_t now = Utils::getTick();
+	while (Utils::getTick() == now);
+}
+
+void flush(WriteBuffer *b, std::vector<WriteBuffer*> *order) {
+	order->push_back(b);
+	b->take();
+}
+
+void test_evict() {
+	WriteCache &wc = WriteCache::instance();
+	Prefs::instance().write<uint64_t>("/WriteCacheSize", 100000);
+	std::vector<WriteBuffer*> order;
+	WriteBuffer b1(boost::bind(&flush, &b1, &order));
+	WriteBuffer b2(boost::bind(&flush, &b2, &order));
+	WriteBuffer b3(boost::bind(&flush, &b3, &order));
+
+	b1.write(0, makeData(0, 30000));
+	nextTick();
+	b2.write(0, makeData(0, 30000));
+	b3.write(0, makeData(0, 30000));
+	BOOST_CHECK(wc.getDirty() == 90000);
+	BOOST_CHECK(wc.getBufferCount() == 3);
+	wc.evict();
+	BOOST_CHECK(order.empty());
+
+	// nothing large enough - oldest goes first
+	b3.write(30000, makeData(30000, 20000));
+	wc.evict();
+	BOOST_CHECK(order.size() == 1 && order[0] == &b1);
+	BOOST_CHECK(wc.getDirty() == 80000);
+	BOOST_CHECK(wc.getBufferCount() == 2);
+
+	// large contiguous extents are preferred
+	Prefs::instance().write<uint64_t>("/WriteCacheSize", 500000);
+	b2.write(500000, makeData(500000, WriteCache::FLUSH_SIZE));
+	b3.write(100000, makeData(100000, 1000));
+	wc.evict();
+	BOOST_CHECK(order.size() == 2 && order[1] == &b2);
+	BOOST_CHECK(wc.getDirty() == 51000);
+	BOOST_CHECK(wc.getUsed() == 5 * SLAB);
+	b3.take();
+	BOOST_CHECK(wc.getDirty() == 0 && wc.getUsed() == 0);
+}
+
+// data being written still counts against the budget
+void test_inflight() {
+	WriteCache &wc = WriteCache::instance();
+	Prefs::instance().write<uint64_t>("/WriteCacheSize", 100000);
+	std::vector<WriteBuffer*> order;
+	WriteBuffer b1(boost::bind(&flush, &b1, &order));
+	WriteBuffer b2(boost::bind(&flush, &b2, &order));
+
+	b1.write(0, makeData(0, 60000));
+	WriteBuffer::Extents e = b1.take();
+	b2.write(0, makeData(0, 30000));
+	wc.evict();
+	BOOST_CHECK(wc.getDirty() == 30000 && order.empty());
+	b2.write(30000, makeData(30000, 20000));
+	wc.evict();
+	BOOST_CHECK(order.size() == 1 && order[0] == &b2);
+	BOOST_CHECK(wc.getDirty() == 0 && wc.getUsed() == 4 * SLAB);
+	e.clear();
+	BOOST_CHECK(wc.getUsed() == 0);
+}
+
+boost::unit_test::test_suite* init_unit_test_suite(int, char*[]) {
+	std::cerr << "WriteCache: ";
+	boost::unit_test::test_suite *test = 0;
+	test = BOOST_TEST_SUITE("WriteCache");
+	test->add(BOOST_TEST_CASE(&test_merge));
+	test->add(BOOST_TEST_CASE(&test_random));
+	test->add(BOOST_TEST_CASE(&test_restore));
+	test->add(BOOST_TEST_CASE(&test_evict));
+	test->add(BOOST_TEST_CASE(&test_inflight));
+	return test;
+}
+
+#endif
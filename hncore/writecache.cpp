@@ -0,0 +1,362 @@
+/*
+ *  Copyright (C) 2004-2006 Alo Sarv <madcat_@users.sourceforge.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/**
+ * \file writecache.cpp Implementation of write cache classes
+ */
+
+#include <hncore/pch.h>
+#include <hncore/writecache.h>
+#include <hnbase/log.h>
+#include <hnbase/prefs.h>
+#include <hnbase/utils.h>
+#include <cstring>
+#include <errno.h>
+
+// WriteExtent class
+// -----------------
+static const uint32_t SLAB_SIZE = WriteCache::SLAB_SIZE;
+
+WriteExtent::WriteExtent(uint64_t begin)
+: m_begin(begin), m_size(), m_created(Utils::getTick()) {}
+
+WriteExtent::~WriteExtent() {
+	for (uint32_t i = 0; i < m_slabs.size(); ++i) {
+		WriteCache::instance().freeSlab(m_slabs[i]);
+	}
+}
+
+void WriteExtent::append(const char *data, uint32_t len) {
+	while (len) {
+		if (m_size == m_slabs.size() * SLAB_SIZE) {
+			m_slabs.push_back(WriteCache::instance().allocSlab());
+		}
+		uint32_t off = m_size % SLAB_SIZE;
+		uint32_t cnt = std::min<uint32_t>(SLAB_SIZE - off, len);
+		memcpy(m_slabs.back() + off, data, cnt);
+		m_size += cnt;
+		data += cnt;
+		len -= cnt;
+	}
+}
+
+void WriteExtent::append(const WriteExtent &other, uint32_t offset) {
+	while (offset < other.m_size) {
+		uint32_t off = offset % SLAB_SIZE;
+		uint32_t cnt = std::min<uint32_t>(
+			SLAB_SIZE - off, other.m_size - offset
+		);
+		append(other.m_slabs[offset / SLAB_SIZE] + off, cnt);
+		offset += cnt;
+	}
+}
+
+void WriteExtent::overwrite(uint32_t offset, const char *data, uint32_t len) {
+	CHECK_THROW(offset + len <= m_size);
+	while (len) {
+		uint32_t off = offset % SLAB_SIZE;
+		uint32_t cnt = std::min<uint32_t>(SLAB_SIZE - off, len);
+		memcpy(m_slabs[offset / SLAB_SIZE] + off, data, cnt);
+		offset += cnt;
+		data += cnt;
+		len -= cnt;
+	}
+}
+
+// write all of data at offset, handling short writes
+static bool writeAt(int fd, const char *data, uint32_t len, uint64_t offset) {
+	while (len) {
+#ifdef WIN32
+		uint64_t ret = lseek64(fd, offset, SEEK_SET);
+		if (ret != offset) {
+			return false;
+		}
+		int c = ::write(fd, data, len);
+#else
+		ssize_t c = ::pwrite64(fd, data, len, offset);
+		if (c == -1 && errno == EINTR) {
+			continue;
+		}
+#endif
+		if (c <= 0) {
+			return false;
+		}
+		data += c;
+		len -= c;
+		offset += c;
+	}
+	return true;
+}
+
+bool WriteExtent::writeTo(int fd) const {
+	for (uint32_t i = 0; i < m_slabs.size(); ++i) {
+		uint32_t pos = i * SLAB_SIZE;
+		uint32_t len = std::min<uint32_t>(
+			SLAB_SIZE, m_size - pos
+		);
+		if (!writeAt(fd, m_slabs[i], len, m_begin + pos)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+std::string WriteExtent::getData() const {
+	std::string ret;
+	ret.reserve(m_size);
+	for (uint32_t i = 0; i < m_slabs.size(); ++i) {
+		uint32_t pos = i * SLAB_SIZE;
+		ret.append(
+			m_slabs[i],
+			std::min<uint32_t>(SLAB_SIZE, m_size - pos)
+		);
+	}
+	return ret;
+}
+
+// WriteBuffer class
+// -----------------
+WriteBuffer::WriteBuffer(const EvictHandler &onEvict)
+: m_size(), m_onEvict(onEvict), m_registered() {}
+
+WriteBuffer::~WriteBuffer() {
+	uint32_t oldSize = m_size;
+	m_extents.clear();
+	m_size = 0;
+	updateDirty(oldSize);
+}
+
+void WriteBuffer::write(uint64_t begin, const std::string &data) {
+	uint32_t oldSize = m_size;
+	store(begin, data.data(), data.size());
+	updateDirty(oldSize);
+}
+
+// The new data is first merged into the preceding extent, if that one overlaps
+// or ends right where the data begins, otherwise a new extent is started. Any
+// following extents the data now reaches are then folded into it as well,
+// keeping only their parts beyond the new data.
+void WriteBuffer::store(uint64_t begin, const char *ptr, uint32_t len) {
+	if (!len) {
+		return;
+	}
+
+	WriteExtentPtr cur;
+	Extents::iterator i = m_extents.upper_bound(begin);
+	if (i != m_extents.begin()) {
+		Extents::iterator prev = i;
+		--prev;
+		if ((*prev).second->end() >= begin) {
+			cur = (*prev).second;
+		}
+	}
+	if (cur) {
+		if (cur->end() > begin) {
+			uint32_t cnt = std::min<uint64_t>(
+				cur->end() - begin, len
+			);
+			cur->overwrite(begin - cur->begin(), ptr, cnt);
+			ptr += cnt;
+			len -= cnt;
+		}
+		cur->append(ptr, len);
+		m_size += len;
+	} else {
+		cur.reset(new WriteExtent(begin));
+		cur->append(ptr, len);
+		m_size += len;
+		i = m_extents.insert(i, std::make_pair(begin, cur));
+	}
+
+	i = m_extents.upper_bound(cur->begin());
+	while (i != m_extents.end() && (*i).first <= cur->end()) {
+		WriteExtentPtr next = (*i).second;
+		m_size -= next->size();
+		if (next->end() > cur->end()) {
+			uint32_t skip = cur->end() - next->begin();
+			m_size += next->size() - skip;
+			cur->append(*next, skip);
+		}
+		m_extents.erase(i++);
+	}
+}
+
+WriteBuffer::Extents WriteBuffer::take() {
+	uint32_t oldSize = m_size;
+	Extents ret;
+	ret.swap(m_extents);
+	m_size = 0;
+	updateDirty(oldSize);
+	return ret;
+}
+
+// Data written since take() is newer than the restored data, so where they
+// overlap (or touch), the newer extents are taken out, the restored extent is
+// put in their place, and the newer data is then stored over it again.
+void WriteBuffer::restore(const Extents &e) {
+	uint32_t oldSize = m_size;
+	for (Extents::const_iterator i = e.begin(); i != e.end(); ++i) {
+		WriteExtentPtr cur = (*i).second;
+		Extents::iterator j = m_extents.upper_bound(cur->begin());
+		if (j != m_extents.begin()) {
+			Extents::iterator prev = j;
+			if ((*--prev).second->end() >= cur->begin()) {
+				j = prev;
+			}
+		}
+		std::vector<WriteExtentPtr> newer;
+		while (j != m_extents.end() && (*j).first <= cur->end()) {
+			newer.push_back((*j).second);
+			m_size -= (*j).second->size();
+			m_extents.erase(j++);
+		}
+		m_extents.insert(std::make_pair(cur->begin(), cur));
+		m_size += cur->size();
+		for (uint32_t k = 0; k < newer.size(); ++k) {
+			std::string tmp = newer[k]->getData();
+			store(newer[k]->begin(), tmp.data(), tmp.size());
+		}
+	}
+	updateDirty(oldSize);
+}
+
+uint32_t WriteBuffer::getLargest() const {
+	uint32_t ret = 0;
+	Extents::const_iterator i = m_extents.begin();
+	for (; i != m_extents.end(); ++i) {
+		ret = std::max(ret, (*i).second->size());
+	}
+	return ret;
+}
+
+uint64_t WriteBuffer::getOldest() const {
+	uint64_t ret = 0;
+	Extents::const_iterator i = m_extents.begin();
+	for (; i != m_extents.end(); ++i) {
+		if (!ret || (*i).second->getAge() < ret) {
+			ret = (*i).second->getAge();
+		}
+	}
+	return ret;
+}
+
+void WriteBuffer::updateDirty(uint32_t oldSize) {
+	WriteCache &cache = WriteCache::instance();
+	cache.m_dirty -= oldSize;
+	cache.m_dirty += m_size;
+	if (!m_registered && !empty()) {
+		cache.m_buffers.insert(this);
+		m_registered = true;
+	} else if (m_registered && empty()) {
+		cache.m_buffers.erase(this);
+		m_registered = false;
+	}
+}
+
+// WriteCache class
+// ----------------
+WriteCache::WriteCache() : m_pool(SLAB_SIZE, FREE_SLABS), m_used(),
+m_dirty(), m_evicting() {}
+
+WriteCache& WriteCache::instance() {
+	static WriteCache wc;
+	return wc;
+}
+
+char* WriteCache::allocSlab() {
+	{
+		boost::mutex::scoped_lock l(m_usedLock);
+		m_used += SLAB_SIZE;
+	}
+	return static_cast<char*>(m_pool.alloc());
+}
+
+void WriteCache::freeSlab(char *slab) {
+	m_pool.free(slab);
+	boost::mutex::scoped_lock l(m_usedLock);
+	m_used -= SLAB_SIZE;
+}
+
+uint64_t WriteCache::getUsed() const {
+	boost::mutex::scoped_lock l(m_usedLock);
+	return m_used;
+}
+
+uint64_t WriteCache::getBudget() const {
+	return Prefs::instance().read<uint64_t>(
+		"/WriteCacheSize", 16 * 1024 * 1024
+	);
+}
+
+WriteBuffer* WriteCache::getVictim(const std::set<WriteBuffer*> &tried) const {
+	WriteBuffer *largest = 0, *oldest = 0;
+	uint32_t largestSize = 0;
+	uint64_t oldestAge = 0;
+	std::set<WriteBuffer*>::const_iterator i = m_buffers.begin();
+	for (; i != m_buffers.end(); ++i) {
+		if (tried.find(*i) != tried.end()) {
+			continue;
+		}
+		uint32_t size = (*i)->getLargest();
+		if (size > largestSize) {
+			largest = *i;
+			largestSize = size;
+		}
+		uint64_t age = (*i)->getOldest();
+		if (!oldest || age < oldestAge) {
+			oldest = *i;
+			oldestAge = age;
+		}
+	}
+	return largestSize >= FLUSH_SIZE ? largest : oldest;
+}
+
+// Flushed data stays allocated until it has been written, so the budget is
+// checked against all allocated memory; flushing can then only start the
+// writes, but doing so is all we can do.
+void WriteCache::evict() {
+	uint64_t budget = getBudget();
+	if (m_evicting || getUsed() <= budget) {
+		return;
+	}
+	m_evicting = true;
+	std::set<WriteBuffer*> tried;
+	while (getUsed() > budget) {
+		WriteBuffer *victim = getVictim(tried);
+		if (!victim) {
+			break;
+		}
+		tried.insert(victim);
+		logTrace("writecache",
+			boost::format("Over budget (%s); flushing %s.")
+			% Utils::bytesToString(getUsed())
+			% Utils::bytesToString(victim->size())
+		);
+		// the handler may destroy the buffer
+		WriteBuffer::EvictHandler handler(victim->m_onEvict);
+		try {
+			handler();
+		} catch (std::exception &e) {
+			logError(
+				boost::format("Flushing write cache: %s")
+				% e.what()
+			);
+		}
+	}
+	m_evicting = false;
+}
@@ -0,0 +1,214 @@
+/*
+ *  Copyright (C) 2004-2006 Alo Sarv <madcat_@users.sourceforge.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/**
+ * \file writecache.h Interface for WriteCache, WriteBuffer and WriteExtent
+ */
+
+#ifndef __WRITECACHE_H__
+#define __WRITECACHE_H__
+
+#include <hnbase/osdep.h>
+#include <hnbase/mpscqueue.h>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+/**
+ * WriteExtent is a contiguous range of not-yet-written file data, stored in
+ * fixed-size slabs allocated from WriteCache. Data appended to the end of the
+ * extent fills the free space of the last slab, so sequential blocks end up
+ * stored back-to-back without being copied around.
+ */
+class HNCORE_EXPORT WriteExtent : public boost::noncopyable {
+public:
+	/**
+	 * @param begin    Offset of the extent in the file
+	 */
+	explicit WriteExtent(uint64_t begin);
+	~WriteExtent();
+
+	//! Add data to the end of the extent
+	void append(const char *data, uint32_t len);
+
+	//! Add data of another extent, starting at offset, to the end
+	void append(const WriteExtent &other, uint32_t offset);
+
+	/**
+	 * Replace data inside the extent.
+	 *
+	 * @param offset   Offset relative to the beginning of the extent
+	 * @param data     Data to be written
+	 * @param len      Length of data; offset + len must not exceed size()
+	 */
+	void overwrite(uint32_t offset, const char *data, uint32_t len);
+
+	/**
+	 * Write the extent's data to a file, at the extent's offset.
+	 *
+	 * @param fd       Open file descriptor
+	 * @return         False if the data couldn't be fully written
+	 */
+	bool writeTo(int fd) const;
+
+	//! \returns Offset of the extent in the file
+	uint64_t begin() const { return m_begin; }
+	//! \returns Offset one past the end of the extent
+	uint64_t end() const { return m_begin + m_size; }
+	//! \returns Number of bytes in the extent
+	uint32_t size() const { return m_size; }
+	//! \returns Time (as in Utils::getTick()) when the extent was created
+	uint64_t getAge() const { return m_created; }
+	//! \returns Copy of the extent's data, mainly for testing
+	std::string getData() const;
+private:
+	std::vector<char*> m_slabs;  //!< Storage
+	uint64_t m_begin;            //!< Offset in file
+	uint32_t m_size;             //!< Bytes stored
+	uint64_t m_created;          //!< Creation time
+};
+typedef boost::shared_ptr<WriteExtent> WriteExtentPtr;
+
+/**
+ * WriteBuffer holds one file's dirty data as a set of non-overlapping extents,
+ * keyed by offset, so the data is written out in begin->end order. Incoming
+ * blocks which are adjacent to (or overlap) existing extents are merged into
+ * them; where data overlaps, the newer data wins.
+ *
+ * The buffer's memory is accounted against the WriteCache budget. When the
+ * cache needs to free memory and picks this buffer, the eviction handler is
+ * called, which is expected to take() the extents and write them to disk.
+ */
+class HNCORE_EXPORT WriteBuffer : public boost::noncopyable {
+public:
+	typedef std::map<uint64_t, WriteExtentPtr> Extents;
+	typedef boost::function<void ()> EvictHandler;
+
+	/**
+	 * @param onEvict  Called when the cache wants this buffer flushed
+	 */
+	explicit WriteBuffer(const EvictHandler &onEvict);
+	~WriteBuffer();
+
+	/**
+	 * Store data in the buffer.
+	 *
+	 * @param begin    Offset in file
+	 * @param data     Data to be stored
+	 */
+	void write(uint64_t begin, const std::string &data);
+
+	//! Remove and return all extents (e.g. for writing them to disk)
+	Extents take();
+
+	/**
+	 * Put back extents returned by take(), e.g. if writing them failed.
+	 * Where data written meanwhile overlaps them, the newer data is kept.
+	 */
+	void restore(const Extents &e);
+
+	//! \returns Number of bytes buffered
+	uint32_t size() const { return m_size; }
+	//! \returns True if nothing is buffered
+	bool empty() const { return m_extents.empty(); }
+	//! \returns The extents
+	const Extents& getExtents() const { return m_extents; }
+	//! \returns Size of the largest extent
+	uint32_t getLargest() const;
+	//! \returns Age of the oldest extent
+	uint64_t getOldest() const;
+private:
+	friend class WriteCache;
+	//! Update cache accounting after m_size changed from oldSize
+	void updateDirty(uint32_t oldSize);
+	//! Merge data into m_extents, without updating cache accounting
+	void store(uint64_t begin, const char *ptr, uint32_t len);
+
+	Extents      m_extents;      //!< Buffered data
+	uint32_t     m_size;         //!< Bytes in m_extents
+	EvictHandler m_onEvict;      //!< Eviction handler
+	bool         m_registered;   //!< Whether we'r in WriteCache list
+};
+
+/**
+ * WriteCache is the daemon-wide write-behind cache budget. Buffered download
+ * data of all files (PartData, as well as BitTorrent cross-file caches) is
+ * stored in fixed-size slabs allocated here, and once the allocated total
+ * exceeds the budget (/WriteCacheSize preference, in bytes), buffers are
+ * flushed until we'r back below it. Data handed over to a writer keeps
+ * counting against the budget until it has been written and released, so
+ * the budget is compared against all memory allocated for slabs.
+ *
+ * Eviction prefers the buffer holding the largest contiguous extent, if it's
+ * big enough to make for an efficient write (FLUSH_SIZE); otherwise the buffer
+ * holding the oldest dirty data is flushed.
+ *
+ * Slabs may be freed from any thread; everything else is main thread only.
+ */
+class HNCORE_EXPORT WriteCache : public boost::noncopyable {
+public:
+	enum Constants {
+		SLAB_SIZE  = 16 * 1024,   //!< Size of a slab
+		FLUSH_SIZE = 512 * 1024,  //!< Large extents are flushed first
+		FREE_SLABS = 64           //!< Free slabs kept for reuse
+	};
+
+	static WriteCache& instance();
+
+	/**
+	 * Flush buffers until allocated memory is below the budget, or there's
+	 * no buffered data left to flush. Each buffer is asked at most once
+	 * per call, so buffers which can't be flushed right now don't cause
+	 * endless looping.
+	 */
+	void evict();
+
+	//! \returns Memory budget, in bytes
+	uint64_t getBudget() const;
+	//! \returns Bytes buffered, not yet handed over for writing
+	uint64_t getDirty() const { return m_dirty; }
+	//! \returns Memory currently allocated for slabs, in bytes
+	uint64_t getUsed() const;
+	//! \returns Number of buffers holding dirty data
+	size_t getBufferCount() const { return m_buffers.size(); }
+private:
+	friend class WriteExtent;
+	friend class WriteBuffer;
+
+	WriteCache();
+
+	char* allocSlab();
+	void freeSlab(char *slab);
+
+	//! Select buffer to be flushed next, ignoring those in tried set
+	WriteBuffer* getVictim(const std::set<WriteBuffer*> &tried) const;
+
+	Detail::NodePool       m_pool;      //!< Slab allocator
+	uint64_t               m_used;      //!< Bytes in allocated slabs
+	mutable boost::mutex   m_usedLock;  //!< Protects m_used
+	std::set<WriteBuffer*> m_buffers;   //!< Buffers with dirty data
+	uint64_t               m_dirty;     //!< Bytes in m_buffers
+	bool                   m_evicting;  //!< Protects against recursion
+};
+
+#endif